@@ -4,12 +4,10 @@ Verified through a BLE Scanner app.
 
 BLE5 Implementation with Long Range adjustments (low data rate)
 You will need a BLE5 Capable Receiver for these messages.
-It's also possible to extend the packet size to 1650 bytes, although recommended to keep 
-below 255 bytes for compatibility with BLE scanners.
+The device is created with MAX_EXTENDED_ADVERTISEMENT_SIZE (255 bytes), the largest
+packet BLE 5 scanners reliably accept, so many more measurements fit in a single packet.
 
 Increasing the TX power past 9dB does nothing as it's capped.
-
-You can manually change MAX_ADVERTISEMENT_SIZE in the library if wanted.
 */
 
 
@@ -36,14 +34,14 @@ void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
 }
 
 RTC_DATA_ATTR uint8_t counter = 0;
-uint8_t advertisementData[MAX_ADVERTISEMENT_SIZE];
+uint8_t advertisementData[MAX_EXTENDED_ADVERTISEMENT_SIZE];
 
 void setup() {
   Serial.begin(115200);
   delay(500);
   Serial.println("\nWakeup. Starting BLE Long-Range Advertisement...");
 
-  BtHomeV2Device device("LONG_RNG", "A long range example using BLE 5", false);
+  BtHomeV2Device device("LONG_RNG", "A long range example using BLE 5", false, MAX_EXTENDED_ADVERTISEMENT_SIZE);
 
   device.addBatteryPercentage(77);
   device.addCount_0_4294967295(counter++);
@@ -0,0 +1,203 @@
+#include "bench.h"
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+static std::atomic<size_t> _allocationCount(0);
+static volatile uint8_t _sink = 0;
+
+static void countAllocation()
+{
+  _allocationCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+#if defined(__GLIBC__)
+// Interpose the C allocator too, so allocations inside mbedtls and the C library are counted as well.
+// Shared libraries resolve malloc to these definitions; glibc's own entry points do the work.
+extern "C"
+{
+  void *__libc_malloc(size_t size);
+  void *__libc_calloc(size_t count, size_t size);
+  void *__libc_realloc(void *ptr, size_t size);
+  void __libc_free(void *ptr);
+
+  void *malloc(size_t size)
+  {
+    countAllocation();
+    return __libc_malloc(size);
+  }
+
+  void *calloc(size_t count, size_t size)
+  {
+    countAllocation();
+    return __libc_calloc(count, size);
+  }
+
+  void *realloc(void *ptr, size_t size)
+  {
+    countAllocation();
+    return __libc_realloc(ptr, size);
+  }
+
+  void free(void *ptr)
+  {
+    __libc_free(ptr);
+  }
+}
+#endif
+
+void *operator new(size_t size)
+{
+#if !defined(__GLIBC__)
+  // counted by malloc otherwise
+  countAllocation();
+#endif
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr)
+  {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+size_t allocationCount()
+{
+  return _allocationCount;
+}
+
+void benchConsume(const uint8_t *data, size_t length)
+{
+  uint8_t acc = 0;
+  for (size_t i = 0; i < length; i++)
+  {
+    acc ^= data[i];
+  }
+  _sink ^= acc;
+}
+
+// Stack measurement: run the function once on a private stack filled with a
+// known pattern, then count how much of the pattern was overwritten.
+static const size_t STACK_PROBE_SIZE = 64 * 1024;
+static const uint8_t STACK_PAINT = 0xA5;
+
+static ucontext_t _callerContext;
+static ucontext_t _probeContext;
+static BenchFunction _probeFunction;
+static void *_probeArgument;
+
+static void stackProbeTrampoline()
+{
+  _probeFunction(_probeArgument);
+}
+
+static size_t measurePeakStack(BenchFunction fn, void *context)
+{
+  static uint8_t stack[STACK_PROBE_SIZE];
+  memset(stack, STACK_PAINT, sizeof(stack));
+
+  _probeFunction = fn;
+  _probeArgument = context;
+
+  getcontext(&_probeContext);
+  _probeContext.uc_stack.ss_sp = stack;
+  _probeContext.uc_stack.ss_size = sizeof(stack);
+  _probeContext.uc_link = &_callerContext;
+  makecontext(&_probeContext, stackProbeTrampoline, 0);
+  swapcontext(&_callerContext, &_probeContext);
+
+  // the stack grows down, so the untouched pattern is at the start of the buffer
+  size_t untouched = 0;
+  while (untouched < sizeof(stack) && stack[untouched] == STACK_PAINT)
+  {
+    untouched++;
+  }
+  return sizeof(stack) - untouched;
+}
+
+// Baseline usage of the trampoline itself, subtracted from every measurement.
+static void emptyBenchFunction(void *)
+{
+}
+
+BenchResult runBenchmark(BenchFunction fn, void *context, size_t iterations)
+{
+  BenchResult result;
+
+  // warm up caches and any lazily initialised state
+  for (size_t i = 0; i < iterations / 10 + 1; i++)
+  {
+    fn(context);
+  }
+
+  size_t allocationsBefore = _allocationCount;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++)
+  {
+    fn(context);
+  }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  size_t allocations = _allocationCount - allocationsBefore;
+
+  double elapsedNs = std::chrono::duration<double, std::nano>(end - start).count();
+  result.nsPerOp = elapsedNs / iterations;
+  result.allocationsPerOp = static_cast<double>(allocations) / iterations;
+
+  size_t baseline = measurePeakStack(emptyBenchFunction, 0);
+  size_t peak = measurePeakStack(fn, context);
+  result.peakStackBytes = peak > baseline ? peak - baseline : 0;
+  return result;
+}
+
+size_t benchIterations(int argc, char **argv, size_t defaultIterations)
+{
+  if (argc > 1)
+  {
+    long value = strtol(argv[1], 0, 10);
+    if (value > 0)
+    {
+      return static_cast<size_t>(value);
+    }
+  }
+  return defaultIterations;
+}
+
+void printBenchHeader(const char *suite)
+{
+  printf("\n%s\n", suite);
+  printf("%-40s %12s %14s %12s %8s\n", "case", "ns/op", "allocs/op", "stack B", "bytes");
+}
+
+void printBenchResult(const char *name, const BenchResult &result, size_t bytesPerOp)
+{
+  printf("%-40s %12.1f %14.2f %12zu %8zu\n", name, result.nsPerOp, result.allocationsPerOp, result.peakStackBytes, bytesPerOp);
+}
@@ -0,0 +1,34 @@
+#ifndef BTHOME_HOST_BENCH_H
+#define BTHOME_HOST_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief Result of a single benchmark case.
+struct BenchResult
+{
+  double nsPerOp;
+  double allocationsPerOp;
+  size_t peakStackBytes;
+};
+
+typedef void (*BenchFunction)(void *context);
+
+/// @brief Time `iterations` calls of fn and count heap allocations made by them.
+/// @details The peak stack usage is measured on a separate, pre-painted stack for one extra call.
+BenchResult runBenchmark(BenchFunction fn, void *context, size_t iterations);
+
+/// @brief Number of heap allocations since the program started: operator new, and on glibc also malloc,
+/// calloc and realloc from any library (mbedtls included).
+size_t allocationCount();
+
+/// @brief Parse the iteration count from the command line, or return the default.
+size_t benchIterations(int argc, char **argv, size_t defaultIterations);
+
+void printBenchHeader(const char *suite);
+void printBenchResult(const char *name, const BenchResult &result, size_t bytesPerOp);
+
+/// @brief Keeps the optimiser from discarding results that are never otherwise read.
+void benchConsume(const uint8_t *data, size_t length);
+
+#endif // BTHOME_HOST_BENCH_H
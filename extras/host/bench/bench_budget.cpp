@@ -0,0 +1,203 @@
+// Compile-time payload budget: checks that setMeasurements encodes the same packets as add<>, that the sizes
+// computed by BtHomePayloadBudget match the packets built, and the cost of filling a packet with and without
+// the per-measurement space checks.
+
+#include "bench.h"
+
+#include <BtHomeV2Device.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t BENCH_KEY[BIND_KEY_LEN] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1,
+                                                0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+static const uint8_t BENCH_MAC[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, 0x8F, 0x80, 0xA5};
+
+typedef BtHomeSensorSet<BtHomeSensors::temperature_int16_scale_0_01, BtHomeSensors::humidity_uint16,
+                        BtHomeSensors::battery_percentage>
+    ClimateSet;
+typedef BtHomeSensorSet<BtHomeSensors::power_uint24, BtHomeSensors::voltage_0_001, BtHomeSensors::current_uint16,
+                        BtHomeSensors::energy_uint24>
+    MeterSet;
+
+typedef BtHomePayloadBudget<ClimateSet> ClimatePlain;
+typedef BtHomePayloadBudget<ClimateSet, true> ClimateEncrypted;
+typedef BtHomePayloadBudget<ClimateSet, true, true> ClimateEncryptedWithId;
+typedef BtHomePayloadBudget<MeterSet> MeterPlain;
+typedef BtHomePayloadBudget<MeterSet, true, false, 64> MeterEncryptedExtended;
+
+static_assert(ClimateSet::count == 3 && ClimateSet::measurementBytes == 8, "climate set size");
+static_assert(ClimatePlain::packetBytes == 16 && ClimatePlain::maxCompleteNameLength == 13, "climate budget");
+static_assert(ClimateEncrypted::packetBytes == 24 && ClimateEncrypted::maxCompleteNameLength == 5, "encrypted climate budget");
+static_assert(MeterSet::measurementBytes == 14 && MeterPlain::nameSpace == 9, "meter budget");
+static_assert(MeterEncryptedExtended::nameSpace == 34 && MeterEncryptedExtended::maxCompleteNameLength == MAX_LENGTH_COMPLETE_NAME,
+              "extended meter budget");
+
+#if defined(BENCH_BUDGET_OVERSIZED)
+// 14 measurement bytes, an encrypted 31 byte packet takes 11: build with -DBENCH_BUDGET_OVERSIZED to see the static_assert
+typedef BtHomePayloadBudget<MeterSet, true> MeterEncrypted;
+static_assert(MeterEncrypted::nameSpace > 0, "not reached");
+#endif
+
+static const char NAME[] = "Climate sensor in the attic";
+// the service data AD follows the 3 byte flags AD, the names come after it
+static const size_t SERVICE_DATA_AD = 3;
+
+static bool hasCompleteName(const uint8_t *advertisement, size_t size)
+{
+  for (size_t i = 0; i + 1 < size; i += advertisement[i] + 1)
+  {
+    if (advertisement[i + 1] == COMPLETE_NAME)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename Budget>
+static int checkBudget(const char *name, bool encrypted, bool packetId, size_t maxAdvertisementSize)
+{
+  int failures = 0;
+  uint8_t checked[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+  uint8_t unchecked[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+
+  // one name that is just sent, one that is just too long
+  for (size_t length = Budget::maxCompleteNameLength; length <= Budget::maxCompleteNameLength + 1; length++)
+  {
+    char completeName[sizeof(NAME)];
+    memcpy(completeName, NAME, length);
+    completeName[length] = '\0';
+    BtHomeV2Device *a = encrypted ? new BtHomeV2Device("sensor", completeName, false, BENCH_KEY, BENCH_MAC, maxAdvertisementSize)
+                                  : new BtHomeV2Device("sensor", completeName, false, maxAdvertisementSize);
+    BtHomeV2Device *b = encrypted ? new BtHomeV2Device("sensor", completeName, false, BENCH_KEY, BENCH_MAC, maxAdvertisementSize)
+                                  : new BtHomeV2Device("sensor", completeName, false, maxAdvertisementSize);
+    if (packetId)
+    {
+      a->enablePacketId();
+      b->enablePacketId();
+    }
+
+    for (int i = 0; i < 50; i++)
+    {
+      a->clearMeasurementData();
+      a->add<BtHomeSensors::temperature_int16_scale_0_01>(-10.0f + i * 0.37f);
+      a->add<BtHomeSensors::humidity_uint16>(30.0f + i);
+      a->add<BtHomeSensors::battery_percentage>(100 - i);
+      size_t checkedSize = a->getAdvertisementData(checked);
+
+      b->addTemperature_neg44_to_44_Resolution_0_35(1.0f); // replaced by setMeasurements
+      if (!b->setMeasurements<Budget>(-10.0f + i * 0.37f, 30.0f + i, 100 - i))
+      {
+        failures++;
+      }
+      size_t uncheckedSize = b->getAdvertisementData(unchecked);
+
+      bool nameSent = length <= Budget::maxCompleteNameLength;
+      if (checkedSize != uncheckedSize || memcmp(checked, unchecked, checkedSize) != 0 ||
+          hasCompleteName(unchecked, uncheckedSize) != nameSent ||
+          SERVICE_DATA_AD + 1 + unchecked[SERVICE_DATA_AD] != Budget::packetBytes)
+      {
+        failures++;
+      }
+    }
+    delete a;
+    delete b;
+  }
+
+  printf("%-40s %3zu bytes, %2zu left for names, complete name up to %2zu: %s\n", name, Budget::packetBytes,
+         Budget::nameSpace, Budget::maxCompleteNameLength, failures ? "FAIL" : "OK");
+  return failures;
+}
+
+static int checkMismatch()
+{
+  int failures = 0;
+  uint8_t before[MAX_ADVERTISEMENT_SIZE];
+  uint8_t after[MAX_ADVERTISEMENT_SIZE];
+
+  // sized for a plain packet, used on an encrypted device: refused at runtime, the measurements are kept
+  BtHomeV2Device device("meter", "Meter", false, BENCH_KEY, BENCH_MAC);
+  device.add<BtHomeSensors::power_uint24>(230.5f);
+  BtHomeV2Device copy("meter", "Meter", false, BENCH_KEY, BENCH_MAC);
+  copy.add<BtHomeSensors::power_uint24>(230.5f);
+  if (device.setMeasurements<MeterPlain>(230.5f, 3.3f, 1.2f, 12.5f))
+  {
+    failures++;
+  }
+  size_t size = copy.getAdvertisementData(before);
+  if (device.getAdvertisementData(after) != size || memcmp(before, after, size) != 0)
+  {
+    failures++;
+  }
+
+  // the plain budget also fits a 31 byte device with a packet id
+  BtHomeV2Device withId("meter", "Meter", false);
+  withId.enablePacketId();
+  if (!withId.setMeasurements<MeterPlain>(230.5f, 3.3f, 1.2f, 12.5f))
+  {
+    failures++;
+  }
+
+  printf("%-40s %s\n", "device configured unlike the budget", failures ? "FAIL" : "OK");
+  return failures;
+}
+
+struct FillContext
+{
+  BtHomeV2Device *device;
+  uint32_t iteration;
+  uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+};
+
+static void fillChecked(void *context)
+{
+  FillContext *ctx = static_cast<FillContext *>(context);
+  uint32_t i = ctx->iteration++;
+  ctx->device->clearMeasurementData();
+  ctx->device->add<BtHomeSensors::power_uint24>(i & 0xFFFF);
+  ctx->device->add<BtHomeSensors::voltage_0_001>(3 + (i & 1));
+  ctx->device->add<BtHomeSensors::current_uint16>(i & 0xF);
+  ctx->device->add<BtHomeSensors::energy_uint24>(i);
+}
+
+static void fillUnchecked(void *context)
+{
+  FillContext *ctx = static_cast<FillContext *>(context);
+  uint32_t i = ctx->iteration++;
+  ctx->device->setMeasurements<MeterPlain>(i & 0xFFFF, 3 + (i & 1), i & 0xF, i);
+}
+
+static void packetChecked(void *context)
+{
+  FillContext *ctx = static_cast<FillContext *>(context);
+  fillChecked(context);
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+static void packetUnchecked(void *context)
+{
+  FillContext *ctx = static_cast<FillContext *>(context);
+  fillUnchecked(context);
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 1000000);
+
+  int failures = checkBudget<ClimatePlain>("climate, plain", false, false, MAX_ADVERTISEMENT_SIZE);
+  failures += checkBudget<ClimateEncrypted>("climate, encrypted", true, false, MAX_ADVERTISEMENT_SIZE);
+  failures += checkBudget<ClimateEncryptedWithId>("climate, encrypted + packet id", true, true, MAX_ADVERTISEMENT_SIZE);
+  failures += checkMismatch();
+
+  BtHomeV2Device device("meter", "Meter", false);
+  FillContext context = {&device, 0, {}};
+
+  printBenchHeader("meter set of 4 (per fill)");
+  printBenchResult("add<> x 4", runBenchmark(fillChecked, &context, iterations), 0);
+  printBenchResult("setMeasurements<Budget>", runBenchmark(fillUnchecked, &context, iterations), 0);
+  printBenchHeader("meter set of 4 (per packet)");
+  printBenchResult("add<> x 4", runBenchmark(packetChecked, &context, iterations), MeterPlain::packetBytes);
+  printBenchResult("setMeasurements<Budget>", runBenchmark(packetUnchecked, &context, iterations), MeterPlain::packetBytes);
+  return failures;
+}
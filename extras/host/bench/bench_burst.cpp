@@ -0,0 +1,308 @@
+// Packet id and burst retransmission: checks of the packet id and the scheduler, a simulation of button presses
+// reaching a scanning receiver (delivery, latency, advertising events per press), and the cost per packet.
+
+#include "bench.h"
+
+#include <BtHomeV2Device.h>
+#include <BtHomeV2KeyStore.h>
+#include <BtHomeV2Parser.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t BENCH_KEY[BIND_KEY_LEN] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1,
+                                                0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+static const uint8_t BENCH_MAC[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, 0x8F, 0x80, 0xA5};
+
+static bool packetIdOf(const uint8_t *advertisement, size_t size, uint8_t &packetId)
+{
+  return BtHomeV2Parser::fromAdvertisement(advertisement, size).packetId(packetId);
+}
+
+static int checkPacketId()
+{
+  int failures = 0;
+  uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+
+  // every packet built gets the next id, wrapping after 255
+  BtHomeV2Device button("btn", "Button", true);
+  button.enablePacketId();
+  for (int i = 1; i <= 600; i++)
+  {
+    button.clearMeasurementData();
+    button.setButtonEvent(Button_Event_Status_Press);
+    size_t size = button.getAdvertisementData(advertisement);
+    uint8_t packetId;
+    BtHomeV2Parser parser = BtHomeV2Parser::fromAdvertisement(advertisement, size);
+    BtHomeMeasurement first;
+    BtHomeMeasurement second;
+    if (!packetIdOf(advertisement, size, packetId) || packetId != static_cast<uint8_t>(i) || button.getPacketId() != packetId ||
+        !parser.next(first) || first.info.id != packet_id.id || !parser.next(second) || second.info.id != 0x3A)
+    {
+      failures++;
+    }
+  }
+
+  // encrypted: the id is inside the ciphertext, readable after decrypting
+  BtHomeV2Device encrypted("btn", "Button", true, BENCH_KEY, BENCH_MAC);
+  encrypted.enablePacketId();
+  BtHomeV2KeyStore keyStore(1);
+  keyStore.addKey(BENCH_MAC, BENCH_KEY);
+  for (int i = 1; i <= 3; i++)
+  {
+    encrypted.clearMeasurementData();
+    encrypted.setButtonEvent(Button_Event_Status_Press);
+    size_t size = encrypted.getAdvertisementData(advertisement);
+    const uint8_t *serviceData;
+    size_t serviceDataLength;
+    uint8_t measurements[MAX_ADVERTISEMENT_SIZE];
+    size_t measurementsLength;
+    uint8_t packetId;
+    if (!BtHomeV2Parser::findServiceData(advertisement, size, &serviceData, &serviceDataLength) ||
+        keyStore.decrypt(BENCH_MAC, serviceData, serviceDataLength, measurements, &measurementsLength) != BTHOME_DECRYPT_OK ||
+        !BtHomeV2Parser::fromMeasurements(serviceData[0], measurements, measurementsLength).packetId(packetId) ||
+        packetId != i)
+    {
+      failures++;
+    }
+  }
+
+  // overflow: every packet of a sequence has its own id
+  BtHomeV2Device probe("probe", "Probe", false);
+  probe.enablePacketId();
+  probe.enableOverflow(64);
+  for (int i = 0; i < 12; i++)
+  {
+    probe.add<BtHomeSensors::temperature_int16_scale_0_01>(20.0f + i);
+  }
+  uint8_t lastId = 0;
+  size_t packets = 0;
+  while (size_t size = probe.nextAdvertisement(advertisement))
+  {
+    uint8_t packetId;
+    if (!packetIdOf(advertisement, size, packetId) || (packets && packetId != static_cast<uint8_t>(lastId + 1)))
+    {
+      failures++;
+    }
+    lastId = packetId;
+    packets++;
+  }
+  if (packets < 2)
+  {
+    failures++;
+  }
+
+  // deep sleep: the device is built again on every wake and continues from the id kept in RTC memory
+  uint8_t lastPacketId = 250;
+  for (int wake = 0; wake < 10; wake++)
+  {
+    BtHomeV2Device sleeper("btn", "Button", true);
+    sleeper.enablePacketId();
+    sleeper.setPacketId(lastPacketId);
+    sleeper.setButtonEvent(Button_Event_Status_Press);
+    size_t size = sleeper.getAdvertisementData(advertisement);
+    uint8_t packetId;
+    if (!packetIdOf(advertisement, size, packetId) || packetId != static_cast<uint8_t>(lastPacketId + 1))
+    {
+      failures++;
+    }
+    lastPacketId = sleeper.getPacketId();
+  }
+
+  printf("packet id: 600 plain packets (wrapping), 3 encrypted, %zu overflow packets, 10 wakes: %s\n", packets,
+         failures ? "FAIL" : "OK");
+  return failures;
+}
+
+static int checkScheduler()
+{
+  int failures = 0;
+  uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+  BtHomeV2Device button("btn", "Button", true);
+  button.enablePacketId();
+  button.setButtonEvent(Button_Event_Status_Press);
+  size_t size = button.getAdvertisementData(advertisement);
+
+  // starts just before millis() wraps around
+  BtHomeV2BurstScheduler burst(5, 40);
+  uint32_t start = 0xFFFFFF00u;
+  burst.start(advertisement, size, start);
+  size_t copies = 0;
+  uint32_t lastSent = 0;
+  for (uint32_t t = 0; t < 1000; t++)
+  {
+    uint32_t now = start + t;
+    size_t packetSize;
+    const uint8_t *packet = burst.poll(now, packetSize);
+    if (!packet)
+    {
+      continue;
+    }
+    if (packetSize != size || memcmp(packet, advertisement, size) != 0 || (copies && now - lastSent != 40) ||
+        (copies == 0 && t != 0))
+    {
+      failures++;
+    }
+    lastSent = now;
+    copies++;
+  }
+  if (copies != 5 || burst.isActive() || burst.getDurationMillis() != 160)
+  {
+    failures++;
+  }
+
+  // a new event replaces the rest of the train
+  burst.start(advertisement, size, 0);
+  size_t packetSize;
+  burst.poll(0, packetSize);
+  if (burst.millisUntilNext(10) != 30 || burst.poll(10, packetSize) || !burst.start(advertisement, size, 20) ||
+      !burst.poll(20, packetSize))
+  {
+    failures++;
+  }
+
+  printf("burst scheduler: %zu identical copies 40 ms apart across the millis() wrap: %s\n", copies, failures ? "FAIL" : "OK");
+  return failures;
+}
+
+// receiver model: scan windows of windowMillis every intervalMillis (random phase), each advertising event
+// lost with lossPercent (interference), BLE adds a random 0 - 10 ms advDelay to every event
+struct Receiver
+{
+  const char *name;
+  uint32_t intervalMillis;
+  uint32_t windowMillis;
+  uint32_t lossPercent;
+};
+
+struct Pattern
+{
+  const char *name;
+  uint32_t count;
+  uint32_t spacingMillis;
+};
+
+static uint32_t g_random = 0x12345678;
+
+static uint32_t nextRandom()
+{
+  g_random ^= g_random << 13;
+  g_random ^= g_random >> 17;
+  g_random ^= g_random << 5;
+  return g_random;
+}
+
+static void simulate(const Receiver &receiver, const Pattern &pattern, size_t presses, double &delivered,
+                     double &meanLatency, double &duplicates)
+{
+  size_t received = 0;
+  double latencySum = 0;
+  size_t copiesReceived = 0;
+  for (size_t press = 0; press < presses; press++)
+  {
+    uint32_t phase = nextRandom() % receiver.intervalMillis;
+    bool first = true;
+    for (uint32_t copy = 0; copy < pattern.count; copy++)
+    {
+      uint32_t t = copy * pattern.spacingMillis + nextRandom() % 11;
+      bool inWindow = (t + phase) % receiver.intervalMillis < receiver.windowMillis;
+      if (!inWindow || nextRandom() % 100 < receiver.lossPercent)
+      {
+        continue;
+      }
+      copiesReceived++;
+      if (first)
+      {
+        received++;
+        latencySum += t;
+        first = false;
+      }
+    }
+  }
+  delivered = 100.0 * received / presses;
+  meanLatency = received ? latencySum / received : 0;
+  duplicates = static_cast<double>(copiesReceived - received) / presses;
+}
+
+static void reportSimulation()
+{
+  static const size_t PRESSES = 200000;
+  const Receiver receivers[] = {
+      {"continuous scan, 10% loss", 1000, 1000, 10},
+      {"scan 30 ms every 320 ms", 320, 30, 10},
+  };
+  const Pattern patterns[] = {
+      {"single advertisement", 1, 0},
+      {"long window 1 s / 20 ms", 50, 20},
+      {"burst 3 x 40 ms", 3, 40},
+      {"burst 4 x 40 ms", 4, 40},
+      {"burst 6 x 60 ms", 6, 60},
+      // spacing below the scan window, spanning the scan interval
+      {"burst 16 x 20 ms", 16, 20},
+  };
+
+  for (size_t r = 0; r < sizeof(receivers) / sizeof(receivers[0]); r++)
+  {
+    printf("\nbutton press to receiver, %s (%zu presses)\n", receivers[r].name, PRESSES);
+    printf("%-28s %12s %14s %12s %16s\n", "pattern", "delivered %", "latency ms", "adv events", "dropped by id");
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+    {
+      double delivered;
+      double latency;
+      double duplicates;
+      simulate(receivers[r], patterns[p], PRESSES, delivered, latency, duplicates);
+      printf("%-28s %12.2f %14.1f %12u %16.2f\n", patterns[p].name, delivered, latency, patterns[p].count, duplicates);
+    }
+  }
+}
+
+struct PacketContext
+{
+  BtHomeV2Device *device;
+  BtHomeV2BurstScheduler *burst;
+  uint32_t now;
+  uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+};
+
+static void buildPacket(void *context)
+{
+  PacketContext *ctx = static_cast<PacketContext *>(context);
+  ctx->device->clearMeasurementData();
+  ctx->device->setButtonEvent(Button_Event_Status_Press);
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+static void burstEvent(void *context)
+{
+  PacketContext *ctx = static_cast<PacketContext *>(context);
+  ctx->device->clearMeasurementData();
+  ctx->device->setButtonEvent(Button_Event_Status_Press);
+  ctx->burst->start(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer), ctx->now);
+  size_t size;
+  while (const uint8_t *packet = ctx->burst->poll(ctx->now, size))
+  {
+    benchConsume(packet, size);
+    ctx->now += DEFAULT_BURST_SPACING_MILLIS;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 200000);
+
+  int failures = checkPacketId();
+  failures += checkScheduler();
+  reportSimulation();
+
+  BtHomeV2Device plain("btn", "Button", true);
+  BtHomeV2Device withId("btn", "Button", true);
+  withId.enablePacketId();
+  BtHomeV2BurstScheduler burst;
+  PacketContext context = {&plain, &burst, 0, {}};
+
+  printBenchHeader("per event");
+  printBenchResult("packet", runBenchmark(buildPacket, &context, iterations), 0);
+  context.device = &withId;
+  printBenchResult("packet + packet id", runBenchmark(buildPacket, &context, iterations), 0);
+  printBenchResult("packet + id + burst of 4 polls", runBenchmark(burstEvent, &context, iterations), 0);
+  return failures;
+}
@@ -0,0 +1,316 @@
+// AES-CCM backends: known-answer checks for the BTHome nonce layout and CCM output, a cross-check
+// between the backends, and the cost per packet of each backend.
+
+#include "bench.h"
+
+#include <BtHomeV2Device.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static const uint8_t KAT_KEY[BIND_KEY_LEN] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1,
+                                              0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+static const uint8_t KAT_MAC[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, 0x8F, 0x80, 0xA5};
+
+// computed with an independent CCM (RFC 3610) implementation on top of OpenSSL AES-128-ECB
+struct KnownAnswer
+{
+  uint32_t counter;
+  const char *plaintext; // hex, empty means bytes 00 01 02 ... of the ciphertext length
+  const char *ciphertext;
+  const char *mic;
+};
+
+static const KnownAnswer KNOWN_ANSWERS[] = {
+    {0x00000001, "", "", "40fde4da"},
+    {0x00000001, "", "9f2d", "e505af08"},
+    {0x00112233, "02ca0903bf13", "27de76a609af", "43556b83"},
+    {0x01020304, "", "0cbf83a85a9724441b8d4409ca831d6d", "f9139ff7"},
+    {0xfffffffe, "", "2491e444fc1f635f71a58be376a18cfc4c", "68367814"},
+    {0x80000000, "", "217b4476a0dece11ce1e244588290d76c9c8d1055bd833c9a2cf7bbb611e1a134c9e9e7a4fd876d8", "105d928f"},
+};
+
+// reversed MAC, UUID, version | encrypt flag, counter little endian
+static const char *KAT_NONCE = "a5808fe64854d2fc4133221100";
+
+// temperature 25.06, humidity 50.55 (the KNOWN_ANSWERS[2] payload) from an encrypted device with counter 0x00112233
+static const char *KAT_ADVERTISEMENT = "020106" "1216d2fc41" "27de76a609af" "33221100" "43556b83";
+
+static size_t fromHex(const char *hex, uint8_t *bytes)
+{
+  size_t length = strlen(hex) / 2;
+  for (size_t i = 0; i < length; i++)
+  {
+    unsigned value;
+    sscanf(&hex[i * 2], "%2x", &value);
+    bytes[i] = value;
+  }
+  return length;
+}
+
+static int expectBytes(const char *what, const uint8_t *actual, const char *expectedHex)
+{
+  uint8_t expected[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+  size_t length = fromHex(expectedHex, expected);
+  if (memcmp(actual, expected, length) == 0)
+  {
+    return 0;
+  }
+
+  printf("FAIL %s: expected %s, got ", what, expectedHex);
+  for (size_t i = 0; i < length; i++)
+  {
+    printf("%02x", actual[i]);
+  }
+  printf("\n");
+  return 1;
+}
+
+template <typename Ccm>
+static int checkKnownAnswers(const char *backend)
+{
+  int failures = 0;
+  Ccm ccm;
+  ccm.setKey(KAT_KEY);
+
+  for (size_t i = 0; i < sizeof(KNOWN_ANSWERS) / sizeof(KNOWN_ANSWERS[0]); i++)
+  {
+    const KnownAnswer &answer = KNOWN_ANSWERS[i];
+    uint8_t plaintext[64];
+    size_t length = strlen(answer.ciphertext) / 2;
+    if (answer.plaintext[0])
+    {
+      fromHex(answer.plaintext, plaintext);
+    }
+    else
+    {
+      for (size_t j = 0; j < length; j++)
+      {
+        plaintext[j] = j;
+      }
+    }
+
+    uint8_t nonce[NONCE_LEN];
+    buildBtHomeNonce(nonce, KAT_MAC, answer.counter);
+
+    uint8_t ciphertext[64];
+    uint8_t mic[MIC_LEN];
+    char what[64];
+    snprintf(what, sizeof(what), "%s encrypt #%zu", backend, i);
+    ccm.encryptAndTag(nonce, plaintext, length, ciphertext, mic);
+    failures += expectBytes(what, ciphertext, answer.ciphertext);
+    failures += expectBytes(what, mic, answer.mic);
+
+    uint8_t decrypted[64];
+    snprintf(what, sizeof(what), "%s decrypt #%zu", backend, i);
+    if (!ccm.authDecrypt(nonce, ciphertext, length, decrypted, mic) || memcmp(decrypted, plaintext, length) != 0)
+    {
+      printf("FAIL %s\n", what);
+      failures++;
+    }
+
+    // every bit of the MIC and ciphertext is authenticated
+    mic[i % MIC_LEN] ^= 0x01;
+    if (ccm.authDecrypt(nonce, ciphertext, length, decrypted, mic))
+    {
+      printf("FAIL %s accepted a modified MIC\n", what);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+static int checkNonceAndPacket()
+{
+  int failures = 0;
+  uint8_t nonce[NONCE_LEN];
+  buildBtHomeNonce(nonce, KAT_MAC, 0x00112233);
+  failures += expectBytes("nonce layout", nonce, KAT_NONCE);
+
+  BtHomeV2Device device("", "", false, KAT_KEY, KAT_MAC, 0x00112233);
+  device.add<BtHomeSensors::temperature_int16_scale_0_01>(static_cast<int16_t>(2506) * 0.01);
+  device.add<BtHomeSensors::humidity_uint16>(static_cast<uint16_t>(5055) * 0.01);
+  uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+  device.getAdvertisementData(advertisement);
+  failures += expectBytes("encrypted advertisement", advertisement, KAT_ADVERTISEMENT);
+  return failures;
+}
+
+#if !defined(BTHOME_CCM_SOFTWARE)
+// random lengths and keys, both backends must agree byte for byte, also when encrypting in place
+static int crossCheckBackends()
+{
+  uint32_t state = 0x5eed;
+  int failures = 0;
+  for (size_t round = 0; round < 2000; round++)
+  {
+    uint8_t key[BIND_KEY_LEN];
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    uint8_t plaintext[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+    for (size_t i = 0; i < sizeof(key); i++)
+    {
+      state = state * 1664525u + 1013904223u;
+      key[i] = state >> 24;
+    }
+    for (size_t i = 0; i < sizeof(macAddress); i++)
+    {
+      state = state * 1664525u + 1013904223u;
+      macAddress[i] = state >> 24;
+    }
+    state = state * 1664525u + 1013904223u;
+    size_t length = (state >> 24) % sizeof(plaintext);
+    for (size_t i = 0; i < length; i++)
+    {
+      state = state * 1664525u + 1013904223u;
+      plaintext[i] = state >> 24;
+    }
+
+    uint8_t nonce[NONCE_LEN];
+    buildBtHomeNonce(nonce, macAddress, state);
+
+    BtHomeV2MbedtlsCcm reference;
+    BtHomeV2SoftwareCcm software;
+    reference.setKey(key);
+    software.setKey(key);
+
+    uint8_t expected[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+    uint8_t expectedMic[MIC_LEN];
+    uint8_t inPlace[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+    uint8_t mic[MIC_LEN];
+    reference.encryptAndTag(nonce, plaintext, length, expected, expectedMic);
+    memcpy(inPlace, plaintext, length);
+    software.encryptAndTag(nonce, inPlace, length, inPlace, mic);
+    if (memcmp(inPlace, expected, length) != 0 || memcmp(mic, expectedMic, MIC_LEN) != 0)
+    {
+      printf("FAIL backends differ for %zu bytes\n", length);
+      failures++;
+    }
+  }
+  return failures;
+}
+#endif
+
+struct CcmContext
+{
+  BtHomeV2SoftwareCcm *software;
+#if !defined(BTHOME_CCM_SOFTWARE)
+  BtHomeV2MbedtlsCcm *mbedtls;
+#endif
+  size_t length;
+  uint32_t counter;
+  uint8_t plaintext[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+  uint8_t ciphertext[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+  uint8_t mic[MIC_LEN];
+};
+
+template <typename Ccm>
+static void encryptPacket(Ccm &ccm, CcmContext &ctx)
+{
+  uint8_t nonce[NONCE_LEN];
+  buildBtHomeNonce(nonce, KAT_MAC, ctx.counter++);
+  ccm.encryptAndTag(nonce, ctx.plaintext, ctx.length, ctx.ciphertext, ctx.mic);
+  benchConsume(ctx.mic, MIC_LEN);
+}
+
+static void encryptSoftware(void *context)
+{
+  CcmContext *ctx = static_cast<CcmContext *>(context);
+  encryptPacket(*ctx->software, *ctx);
+}
+
+#if !defined(BTHOME_CCM_SOFTWARE)
+static void encryptMbedtls(void *context)
+{
+  CcmContext *ctx = static_cast<CcmContext *>(context);
+  encryptPacket(*ctx->mbedtls, *ctx);
+}
+#endif
+
+static void setKeySoftware(void *context)
+{
+  CcmContext *ctx = static_cast<CcmContext *>(context);
+  ctx->software->setKey(ctx->plaintext);
+}
+
+/// @brief Time stamp counter ticks per nanosecond, 0 when there is no TSC.
+static double ticksPerNanosecond()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t startTicks = __rdtsc();
+  do
+  {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+  } while ((end.tv_sec - start.tv_sec) * 1000000000.0 + (end.tv_nsec - start.tv_nsec) < 50000000.0);
+  uint64_t ticks = __rdtsc() - startTicks;
+  return ticks / ((end.tv_sec - start.tv_sec) * 1000000000.0 + (end.tv_nsec - start.tv_nsec));
+#else
+  return 0;
+#endif
+}
+
+static void printCycles(const char *name, const BenchResult &result, size_t bytes, double ticks)
+{
+  printBenchResult(name, result, bytes);
+  if (ticks > 0)
+  {
+    printf("%-40s %12.0f cycles (TSC)\n", "", result.nsPerOp * ticks);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 100000);
+
+  int failures = checkNonceAndPacket();
+  failures += checkKnownAnswers<BtHomeV2SoftwareCcm>("software");
+#if !defined(BTHOME_CCM_SOFTWARE)
+  failures += checkKnownAnswers<BtHomeV2MbedtlsCcm>("mbedtls");
+  failures += crossCheckBackends();
+#endif
+  printf("known-answer and cross checks: %s\n", failures ? "FAILED" : "passed");
+
+  double ticks = ticksPerNanosecond();
+  BtHomeV2SoftwareCcm software;
+  software.setKey(KAT_KEY);
+#if !defined(BTHOME_CCM_SOFTWARE)
+  BtHomeV2MbedtlsCcm mbedtls;
+  mbedtls.setKey(KAT_KEY);
+#endif
+
+  printBenchHeader("AES-CCM encrypt (per packet)");
+  // typical sensor packet, full legacy packet, full extended packet
+  const size_t lengths[] = {6, MAX_MEASUREMENT_SIZE - ENCRYPTION_ADDITIONAL_BYTES + 1,
+                            MAX_EXTENDED_ADVERTISEMENT_SIZE - HEADER_SIZE - ENCRYPTION_ADDITIONAL_BYTES + 1};
+  for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+  {
+    CcmContext context;
+    memset(&context, 0, sizeof(context));
+    context.software = &software;
+#if !defined(BTHOME_CCM_SOFTWARE)
+    context.mbedtls = &mbedtls;
+#endif
+    context.length = lengths[i];
+
+    char name[64];
+    snprintf(name, sizeof(name), "software/%zu bytes", lengths[i]);
+    printCycles(name, runBenchmark(encryptSoftware, &context, iterations), lengths[i], ticks);
+#if !defined(BTHOME_CCM_SOFTWARE)
+    snprintf(name, sizeof(name), "mbedtls/%zu bytes", lengths[i]);
+    printCycles(name, runBenchmark(encryptMbedtls, &context, iterations), lengths[i], ticks);
+#endif
+  }
+
+  printBenchHeader("AES key expansion");
+  CcmContext context;
+  memset(&context, 0, sizeof(context));
+  context.software = &software;
+  printCycles("software/setKey", runBenchmark(setKeySoftware, &context, iterations), 0, ticks);
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,390 @@
+// Batch AES-CCM decryption: checks BtHomeV2CcmBatch (portable and AES-NI) and BtHomeV2KeyStore::decryptBatch
+// against one-at-a-time decryption, including tampered packets, then the cost per packet for batches of 1 to 64.
+
+#include "bench.h"
+
+#include <BtHomeV2CcmBatch.h>
+#include <BtHomeV2Device.h>
+#include <BtHomeV2KeyStore.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t BENCH_KEY[BIND_KEY_LEN] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1,
+                                                0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+static const uint8_t BENCH_MAC[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, 0x8F, 0x80, 0xA5};
+
+static const size_t MAX_BATCH = 64;
+static const size_t SERVICE_DATA_OFFSET = 7; // flags AD, service data length, type and UUID
+
+static uint32_t g_random = 0x12345678;
+
+static uint32_t nextRandom()
+{
+  g_random ^= g_random << 13;
+  g_random ^= g_random >> 17;
+  g_random ^= g_random << 5;
+  return g_random;
+}
+
+static const char *cipherName(BtHomeBatchCipher cipher)
+{
+  return cipher == BTHOME_BATCH_AES_NI ? "AES-NI" : "portable";
+}
+
+/// @brief A packet encrypted with BtHomeV2Ccm, with its own key.
+struct CcmPacket
+{
+  uint8_t roundKeys[BtHomeV2SoftwareCcm::ROUND_KEYS_SIZE];
+  uint8_t nonce[NONCE_LEN];
+  uint8_t plaintext[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+  uint8_t ciphertext[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+  uint8_t mic[MIC_LEN];
+  size_t length;
+  bool tampered;
+};
+
+static void makeCcmPacket(CcmPacket &packet, size_t length)
+{
+  uint8_t key[BIND_KEY_LEN];
+  uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+  for (size_t i = 0; i < BIND_KEY_LEN; i++)
+  {
+    key[i] = static_cast<uint8_t>(nextRandom());
+  }
+  for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+  {
+    macAddress[i] = static_cast<uint8_t>(nextRandom());
+  }
+  for (size_t i = 0; i < length; i++)
+  {
+    packet.plaintext[i] = static_cast<uint8_t>(nextRandom());
+  }
+
+  packet.length = length;
+  buildBtHomeNonce(packet.nonce, macAddress, nextRandom());
+  BtHomeV2SoftwareCcm::expandKey(key, packet.roundKeys);
+  BtHomeV2Ccm ccm;
+  ccm.setKey(key);
+  ccm.encryptAndTag(packet.nonce, packet.plaintext, length, packet.ciphertext, packet.mic);
+
+  // one in four is modified in one bit of the ciphertext or the MIC
+  packet.tampered = nextRandom() % 4 == 0;
+  if (packet.tampered)
+  {
+    size_t bit = nextRandom() % (8 * (length + MIC_LEN));
+    uint8_t *bytes = bit / 8 < length ? &packet.ciphertext[bit / 8] : &packet.mic[bit / 8 - length];
+    *bytes ^= static_cast<uint8_t>(1u << (bit % 8));
+  }
+}
+
+static void fillJob(BtHomeCcmBatchJob &job, const CcmPacket &packet, uint8_t *output)
+{
+  job.roundKeys = packet.roundKeys;
+  memcpy(job.nonce, packet.nonce, NONCE_LEN);
+  job.input = packet.ciphertext;
+  job.length = packet.length;
+  job.output = output;
+  job.tag = packet.mic;
+  job.authenticated = false;
+}
+
+/// @brief Random batches of random lengths, partly tampered: same verdict and plaintext as the packets were made with.
+static int checkBatch(BtHomeBatchCipher cipher)
+{
+  BtHomeV2CcmBatch batch(cipher);
+  static CcmPacket packets[MAX_BATCH];
+  static uint8_t outputs[MAX_BATCH][MAX_EXTENDED_ADVERTISEMENT_SIZE];
+  BtHomeCcmBatchJob jobs[MAX_BATCH];
+  int failures = 0;
+  size_t checked = 0;
+  for (size_t round = 0; round < 300; round++)
+  {
+    size_t count = 1 + nextRandom() % MAX_BATCH;
+    size_t expected = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+      // mostly legacy packets, some up to a full extended packet
+      size_t length = nextRandom() % 4 ? nextRandom() % 12 : nextRandom() % 242;
+      makeCcmPacket(packets[i], length);
+      fillJob(jobs[i], packets[i], outputs[i]);
+      expected += !packets[i].tampered;
+    }
+    // in place for every other batch
+    if (round % 2)
+    {
+      for (size_t i = 0; i < count; i++)
+      {
+        jobs[i].output = packets[i].ciphertext;
+      }
+    }
+
+    size_t authenticated = batch.authDecrypt(jobs, count);
+    failures += authenticated != expected;
+    for (size_t i = 0; i < count; i++)
+    {
+      static const uint8_t ZEROS[MAX_EXTENDED_ADVERTISEMENT_SIZE] = {};
+      const uint8_t *plaintext = packets[i].tampered ? ZEROS : packets[i].plaintext;
+      if (jobs[i].authenticated == packets[i].tampered || memcmp(jobs[i].output, plaintext, packets[i].length) != 0)
+      {
+        failures++;
+      }
+    }
+    checked += count;
+  }
+
+  printf("%-8s batch, %zu packets of 0 to 241 bytes, a quarter tampered: %s\n", cipherName(batch.cipher()), checked,
+         failures ? "FAIL" : "OK");
+  return failures;
+}
+
+/// @brief A gateway's view: packets from encrypted BtHomeV2Devices, some from unknown devices, some plain,
+/// truncated or modified. decryptBatch has to give the same answers as decrypt.
+static int checkKeyStore()
+{
+  static const size_t DEVICES = 40;
+  static const size_t PACKETS = 1000;
+  BtHomeV2KeyStore keyStore(DEVICES);
+  BtHomeV2Device *devices[DEVICES];
+  uint8_t macAddresses[DEVICES][BLE_MAC_ADDRESS_LENGTH];
+  for (size_t d = 0; d < DEVICES; d++)
+  {
+    uint8_t key[BIND_KEY_LEN];
+    memcpy(macAddresses[d], BENCH_MAC, BLE_MAC_ADDRESS_LENGTH);
+    macAddresses[d][5] = static_cast<uint8_t>(d);
+    for (size_t i = 0; i < BIND_KEY_LEN; i++)
+    {
+      key[i] = static_cast<uint8_t>(nextRandom());
+    }
+    devices[d] = new BtHomeV2Device("dev", "Device", false, key, macAddresses[d], nextRandom(), d % 4 ? 31 : 64);
+    // the last few are not known to the gateway
+    if (d < DEVICES - 4)
+    {
+      keyStore.addKey(macAddresses[d], key);
+    }
+  }
+
+  static uint8_t advertisements[PACKETS][MAX_EXTENDED_ADVERTISEMENT_SIZE];
+  static uint8_t measurements[2][PACKETS][MAX_EXTENDED_ADVERTISEMENT_SIZE];
+  static BtHomeDecryptJob jobs[PACKETS];
+  for (size_t p = 0; p < PACKETS; p++)
+  {
+    size_t d = nextRandom() % DEVICES;
+    devices[d]->clearMeasurementData();
+    devices[d]->addScaled<BtHomeSensors::temperature_int16_scale_0_01>(static_cast<int32_t>(nextRandom() % 40000));
+    for (size_t extra = nextRandom() % 6; extra > 0; extra--)
+    {
+      devices[d]->addScaled<BtHomeSensors::power_uint24>(static_cast<int32_t>(nextRandom() % 100000));
+    }
+    devices[d]->getAdvertisementData(advertisements[p]);
+
+    BtHomeDecryptJob &job = jobs[p];
+    job.macAddress = macAddresses[d];
+    job.serviceData = &advertisements[p][SERVICE_DATA_OFFSET];
+    job.length = advertisements[p][3] - 3; // service data AD length without the type and UUID
+    job.measurements = measurements[0][p];
+
+    uint32_t fault = nextRandom() % 20;
+    if (fault == 0)
+    {
+      advertisements[p][SERVICE_DATA_OFFSET + 1 + nextRandom() % (job.length - 1)] ^= 0x10; // modified
+    }
+    else if (fault == 1)
+    {
+      job.length = 1 + nextRandom() % (COUNTER_LEN + MIC_LEN); // truncated
+    }
+    else if (fault == 2)
+    {
+      advertisements[p][SERVICE_DATA_OFFSET] &= ~FLAG_ENCRYPT; // not encrypted
+    }
+  }
+
+  int failures = 0;
+  size_t decrypted = keyStore.decryptBatch(jobs, PACKETS);
+  size_t statuses[5] = {};
+  for (size_t p = 0; p < PACKETS; p++)
+  {
+    const BtHomeDecryptJob &job = jobs[p];
+    size_t length = 0;
+    uint32_t counter = 0;
+    BtHomeDecryptStatus status = keyStore.decrypt(job.macAddress, job.serviceData, job.length, measurements[1][p], &length, &counter);
+    statuses[status]++;
+    if (status != job.status ||
+        (status == BTHOME_DECRYPT_OK && (length != job.measurementsLength || counter != job.counter ||
+                                         memcmp(measurements[1][p], job.measurements, length) != 0)))
+    {
+      failures++;
+    }
+  }
+  failures += decrypted != statuses[BTHOME_DECRYPT_OK];
+
+  printf("key store, %zu packets (%zu ok, %zu unknown device, %zu not encrypted, %zu truncated, %zu modified), "
+         "decryptBatch against decrypt: %s\n",
+         PACKETS, statuses[BTHOME_DECRYPT_OK], statuses[BTHOME_DECRYPT_UNKNOWN_DEVICE],
+         statuses[BTHOME_DECRYPT_NOT_ENCRYPTED], statuses[BTHOME_DECRYPT_TRUNCATED], statuses[BTHOME_DECRYPT_AUTH_FAILED],
+         failures ? "FAIL" : "OK");
+  for (size_t d = 0; d < DEVICES; d++)
+  {
+    delete devices[d];
+  }
+  return failures;
+}
+
+struct BatchContext
+{
+  size_t count;
+  CcmPacket *packets;
+  BtHomeV2Ccm *backends;
+  BtHomeV2SoftwareCcm *software;
+  BtHomeV2CcmBatch *batch;
+  BtHomeCcmBatchJob jobs[MAX_BATCH];
+  BtHomeV2KeyStore *keyStore;
+  BtHomeDecryptJob decryptJobs[MAX_BATCH];
+  uint8_t output[MAX_BATCH][MAX_EXTENDED_ADVERTISEMENT_SIZE];
+};
+
+template <typename Ccm>
+static void decryptEach(BatchContext *ctx, Ccm *contexts)
+{
+  for (size_t i = 0; i < ctx->count; i++)
+  {
+    const CcmPacket &packet = ctx->packets[i];
+    contexts[i].authDecrypt(packet.nonce, packet.ciphertext, packet.length, ctx->output[i], packet.mic);
+  }
+  benchConsume(ctx->output[0], 1);
+}
+
+static void decryptEachBackend(void *context)
+{
+  BatchContext *ctx = static_cast<BatchContext *>(context);
+  decryptEach(ctx, ctx->backends);
+}
+
+static void decryptEachSoftware(void *context)
+{
+  BatchContext *ctx = static_cast<BatchContext *>(context);
+  decryptEach(ctx, ctx->software);
+}
+
+static void decryptBatch(void *context)
+{
+  BatchContext *ctx = static_cast<BatchContext *>(context);
+  ctx->batch->authDecrypt(ctx->jobs, ctx->count);
+  benchConsume(ctx->output[0], 1);
+}
+
+static void keyStoreEach(void *context)
+{
+  BatchContext *ctx = static_cast<BatchContext *>(context);
+  for (size_t i = 0; i < ctx->count; i++)
+  {
+    BtHomeDecryptJob &job = ctx->decryptJobs[i];
+    ctx->keyStore->decrypt(job.macAddress, job.serviceData, job.length, job.measurements, &job.measurementsLength);
+  }
+  benchConsume(ctx->output[0], 1);
+}
+
+static void keyStoreBatch(void *context)
+{
+  BatchContext *ctx = static_cast<BatchContext *>(context);
+  ctx->keyStore->decryptBatch(ctx->decryptJobs, ctx->count);
+  benchConsume(ctx->output[0], 1);
+}
+
+#if defined(BTHOME_CCM_SOFTWARE)
+#define BTHOME_BACKEND_NAME "backend"
+#else
+#define BTHOME_BACKEND_NAME "mbedtls"
+#endif
+
+static double nsPerPacket(BenchFunction function, BatchContext &context, size_t iterations)
+{
+  size_t runs = iterations / context.count;
+  return runBenchmark(function, &context, runs ? runs : 1).nsPerOp / context.count;
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 200000);
+
+  int failures = checkBatch(BTHOME_BATCH_PORTABLE);
+  if (BtHomeV2CcmBatch::hasAesNi())
+  {
+    failures += checkBatch(BTHOME_BATCH_AES_NI);
+  }
+  else
+  {
+    printf("no AES-NI on this CPU, only the portable batch is checked\n");
+  }
+  failures += checkKeyStore();
+
+  // 64 devices with their own keys, each sending a full legacy packet (11 measurement bytes)
+  static const size_t LENGTH = MAX_MEASUREMENT_SIZE - ENCRYPTION_ADDITIONAL_BYTES + 1;
+  static CcmPacket packets[MAX_BATCH];
+  static BtHomeV2Ccm backends[MAX_BATCH];
+  static BtHomeV2SoftwareCcm software[MAX_BATCH];
+  static uint8_t advertisements[MAX_BATCH][MAX_ADVERTISEMENT_SIZE];
+  static uint8_t macAddresses[MAX_BATCH][BLE_MAC_ADDRESS_LENGTH];
+  BtHomeV2KeyStore keyStore(MAX_BATCH);
+  BtHomeV2CcmBatch portable(BTHOME_BATCH_PORTABLE);
+  BtHomeV2CcmBatch aesNi(BTHOME_BATCH_AES_NI);
+  static BatchContext context;
+  context.packets = packets;
+  context.backends = backends;
+  context.software = software;
+  context.keyStore = &keyStore;
+  for (size_t i = 0; i < MAX_BATCH; i++)
+  {
+    uint8_t key[BIND_KEY_LEN];
+    for (size_t j = 0; j < BIND_KEY_LEN; j++)
+    {
+      key[j] = static_cast<uint8_t>(nextRandom());
+    }
+    do
+    {
+      makeCcmPacket(packets[i], LENGTH);
+    } while (packets[i].tampered);
+    backends[i].setKey(key);
+    software[i].setKey(key);
+    BtHomeV2SoftwareCcm::expandKey(key, packets[i].roundKeys);
+    backends[i].encryptAndTag(packets[i].nonce, packets[i].plaintext, LENGTH, packets[i].ciphertext, packets[i].mic);
+    fillJob(context.jobs[i], packets[i], context.output[i]);
+
+    memcpy(macAddresses[i], BENCH_MAC, BLE_MAC_ADDRESS_LENGTH);
+    macAddresses[i][5] = static_cast<uint8_t>(i);
+    keyStore.addKey(macAddresses[i], key);
+    BtHomeV2Device device("dev", "Device", false, key, macAddresses[i], 1 + i);
+    for (size_t j = 0; j < 3; j++)
+    {
+      device.addScaled<BtHomeSensors::power_uint24>(static_cast<int32_t>(1000 * i + j));
+    }
+    device.addScaled<BtHomeSensors::battery_percentage>(90000);
+    device.getAdvertisementData(advertisements[i]);
+    BtHomeDecryptJob &job = context.decryptJobs[i];
+    job.macAddress = macAddresses[i];
+    job.serviceData = &advertisements[i][SERVICE_DATA_OFFSET];
+    job.length = advertisements[i][3] - 3; // service data AD length without the type and UUID
+    job.measurements = context.output[i];
+  }
+
+  // one at a time with the library's backend (mbedtls uses AES-NI itself when built with it) and the
+  // software backend, the portable batch compares with the latter
+  printf("\nAES-CCM decrypt, %zu byte packets, every packet with its own key (ns per packet)\n", LENGTH);
+  printf("%6s %10s %10s %10s %10s | %10s %10s | %10s %12s\n", "batch", BTHOME_BACKEND_NAME, "software", "portable",
+         "AES-NI", "portable", "AES-NI", "key store", "decryptBatch");
+  printf("%6s %21s %21s | %21s | %23s\n", "", "one at a time", "batch", "speedup", cipherName(BtHomeV2CcmBatch().cipher()));
+  for (size_t count = 1; count <= MAX_BATCH; count *= 2)
+  {
+    context.count = count;
+    double backendNs = nsPerPacket(decryptEachBackend, context, iterations);
+    double softwareNs = nsPerPacket(decryptEachSoftware, context, iterations / 4);
+    context.batch = &portable;
+    double portableNs = nsPerPacket(decryptBatch, context, iterations / 4);
+    context.batch = &aesNi;
+    double aesNiNs = aesNi.cipher() == BTHOME_BATCH_AES_NI ? nsPerPacket(decryptBatch, context, iterations) : 0;
+    double keyStoreNs = nsPerPacket(keyStoreEach, context, iterations);
+    double keyStoreBatchNs = nsPerPacket(keyStoreBatch, context, iterations);
+    printf("%6zu %10.1f %10.1f %10.1f %10.1f | %9.1fx %9.1fx | %10.1f %12.1f\n", count, backendNs, softwareNs, portableNs,
+           aesNiNs, softwareNs / portableNs, aesNiNs > 0 ? backendNs / aesNiNs : 0.0, keyStoreNs, keyStoreBatchNs);
+  }
+  return failures;
+}
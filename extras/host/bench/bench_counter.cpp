@@ -0,0 +1,316 @@
+// Counter persistence: wake-time cost of restoring and reserving the counter, flash writes per block size,
+// and crash simulations that check no counter is ever sent twice, also when the store fails to write.
+
+#include "bench.h"
+
+#include <BtHomeV2Device.h>
+#include <stdio.h>
+
+static const uint8_t BENCH_KEY[BIND_KEY_LEN] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1,
+                                                0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+static const uint8_t BENCH_MAC[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, 0x8F, 0x80, 0xA5};
+static const char *COUNTER_FILE = "bench_counter.bin";
+
+/// @brief In-memory store that counts writes, stands in for flash.
+class CountingCounterStore : public BtHomeV2CounterStore
+{
+public:
+  bool load(uint32_t &counter) override
+  {
+    if (!_stored)
+    {
+      return false;
+    }
+    counter = _counter;
+    return true;
+  }
+
+  bool save(uint32_t counter) override
+  {
+    _counter = counter;
+    _stored = true;
+    writes++;
+    return true;
+  }
+
+  size_t writes = 0;
+
+private:
+  uint32_t _counter = 0;
+  bool _stored = false;
+};
+
+/// @brief A store whose writes fail while failing is set, like flash that is full or worn out.
+class FailingCounterStore : public CountingCounterStore
+{
+public:
+  bool save(uint32_t counter) override { return !failing && CountingCounterStore::save(counter); }
+
+  bool failing = false;
+};
+
+struct WakeContext
+{
+  BtHomeV2CounterStore *store;
+  uint32_t blockSize;
+  uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+};
+
+// one deep sleep cycle: construct the device, restore the counter, send one packet
+static void wake(void *context)
+{
+  WakeContext *ctx = static_cast<WakeContext *>(context);
+  BtHomeV2Device device("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC);
+  if (ctx->store)
+  {
+    device.setCounterStore(ctx->store, ctx->blockSize);
+  }
+  device.addTemperature_neg327_to_327_Resolution_0_01(21.37f);
+  size_t size = device.getAdvertisementData(ctx->buffer);
+  benchConsume(ctx->buffer, size);
+}
+
+struct PacketContext
+{
+  BtHomeV2Device *device;
+  uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+};
+
+static void sendPacket(void *context)
+{
+  PacketContext *ctx = static_cast<PacketContext *>(context);
+  ctx->device->clearMeasurementData();
+  ctx->device->addTemperature_neg327_to_327_Resolution_0_01(21.37f);
+  size_t size = ctx->device->getAdvertisementData(ctx->buffer);
+  benchConsume(ctx->buffer, size);
+}
+
+static void runWakeCases(size_t iterations)
+{
+  printBenchHeader("wake (construct + restore counter + one packet)");
+
+  uint32_t rtcSlot = 0;
+  BtHomeV2RtcCounterStore rtcStore(&rtcSlot);
+  BtHomeV2FileCounterStore fileStore(COUNTER_FILE);
+  remove(COUNTER_FILE);
+
+  WakeContext none = {nullptr, 0, {}};
+  WakeContext rtc = {&rtcStore, 1, {}};
+  WakeContext file = {&fileStore, DEFAULT_COUNTER_BLOCK_SIZE, {}};
+
+  printBenchResult("no-store", runBenchmark(wake, &none, iterations), 0);
+  printBenchResult("rtc/block 1", runBenchmark(wake, &rtc, iterations), 0);
+  printBenchResult("file/block 256", runBenchmark(wake, &file, iterations / 10), 0);
+  remove(COUNTER_FILE);
+}
+
+static void runPacketCases(size_t iterations)
+{
+  printBenchHeader("steady state (per packet, amortised store writes)");
+
+  const uint32_t blockSizes[] = {1, 16, DEFAULT_COUNTER_BLOCK_SIZE, 4096};
+  for (size_t i = 0; i < sizeof(blockSizes) / sizeof(blockSizes[0]); i++)
+  {
+    remove(COUNTER_FILE);
+    BtHomeV2FileCounterStore fileStore(COUNTER_FILE);
+    BtHomeV2Device device("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC);
+    device.setCounterStore(&fileStore, blockSizes[i]);
+
+    PacketContext context;
+    context.device = &device;
+    char name[64];
+    snprintf(name, sizeof(name), "file/block %u", static_cast<unsigned>(blockSizes[i]));
+    printBenchResult(name, runBenchmark(sendPacket, &context, blockSizes[i] == 1 ? iterations / 10 : iterations), 0);
+  }
+  remove(COUNTER_FILE);
+}
+
+static void reportWear()
+{
+  // a packet every 10 seconds, flash sector rated for 100k erase cycles without wear leveling
+  static const double PACKETS_PER_DAY = 24 * 60 * 6;
+  static const double ERASE_CYCLES = 100000;
+  static const size_t PACKETS = 1000000;
+
+  printf("\nflash wear (%zu packets, continuous operation)\n", PACKETS);
+  printf("%-16s %12s %14s %16s\n", "block size", "writes", "writes/day", "years/sector");
+
+  const uint32_t blockSizes[] = {1, 16, DEFAULT_COUNTER_BLOCK_SIZE, 4096};
+  for (size_t i = 0; i < sizeof(blockSizes) / sizeof(blockSizes[0]); i++)
+  {
+    CountingCounterStore store;
+    BtHomeV2Device device("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC);
+    device.setCounterStore(&store, blockSizes[i]);
+    uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+    for (size_t packet = 0; packet < PACKETS; packet++)
+    {
+      device.clearMeasurementData();
+      device.addBatteryPercentage(87);
+      device.getAdvertisementData(buffer);
+    }
+
+    double writesPerDay = store.writes * PACKETS_PER_DAY / PACKETS;
+    printf("%-16u %12zu %14.1f %16.2f\n", static_cast<unsigned>(blockSizes[i]), store.writes, writesPerDay,
+           ERASE_CYCLES / writesPerDay / 365);
+  }
+}
+
+// restart at pseudo random points and check the counters sent are strictly increasing
+static int checkCrashRecovery()
+{
+  CountingCounterStore store;
+  uint32_t state = 12345;
+  uint32_t lastCounter = 0;
+  bool first = true;
+  size_t restarts = 0;
+  size_t packets = 0;
+  uint64_t skipped = 0;
+
+  for (restarts = 0; restarts < 2000; restarts++)
+  {
+    BtHomeV2Device device("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC);
+    device.setCounterStore(&store, DEFAULT_COUNTER_BLOCK_SIZE);
+
+    state = state * 1664525u + 1013904223u;
+    size_t packetsBeforeCrash = state >> 23; // 0 - 511
+    uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+    for (size_t i = 0; i < packetsBeforeCrash; i++)
+    {
+      uint32_t counter = device.getCounter();
+      if (!first && counter <= lastCounter)
+      {
+        printf("counter %u reused after restart %zu\n", static_cast<unsigned>(counter), restarts);
+        return 1;
+      }
+      if (!first)
+      {
+        skipped += counter - lastCounter - 1;
+      }
+      first = false;
+      lastCounter = counter;
+
+      device.clearMeasurementData();
+      device.addBatteryPercentage(87);
+      device.getAdvertisementData(buffer);
+      packets++;
+    }
+  }
+
+  printf("\ncrash recovery: %zu restarts, %zu packets, no counter reused, %.1f counters skipped per restart\n",
+         restarts, packets, static_cast<double>(skipped) / restarts);
+  return 0;
+}
+
+// as checkCrashRecovery, with stretches where every write fails: packets are refused instead of
+// sent with a counter that was never saved
+static int checkSaveFailures()
+{
+  FailingCounterStore store;
+  uint32_t state = 54321;
+  uint32_t lastCounter = 0;
+  bool first = true;
+  size_t refused = 0;
+  size_t packets = 0;
+
+  for (size_t restarts = 0; restarts < 2000; restarts++)
+  {
+    BtHomeV2Device device("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC);
+    device.setCounterStore(&store, 16);
+
+    state = state * 1664525u + 1013904223u;
+    size_t packetsBeforeCrash = state >> 25; // 0 - 127
+    uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+    for (size_t i = 0; i < packetsBeforeCrash; i++)
+    {
+      state = state * 1664525u + 1013904223u;
+      if ((state >> 24) < 8)
+      {
+        store.failing = !store.failing;
+      }
+
+      uint32_t counter = device.getCounter();
+      device.clearMeasurementData();
+      device.addBatteryPercentage(87);
+      if (device.getAdvertisementData(buffer) == 0)
+      {
+        refused++;
+        if (device.getCounter() != counter || device.getLastStatus() != BTHOME_ADVERTISEMENT_COUNTER_NOT_SAVED)
+        {
+          printf("counter advanced by a refused packet, or the refusal was not reported\n");
+          return 1;
+        }
+        continue;
+      }
+
+      if (!first && counter <= lastCounter)
+      {
+        printf("counter %u reused after a failed write\n", static_cast<unsigned>(counter));
+        return 1;
+      }
+      first = false;
+      lastCounter = counter;
+      packets++;
+    }
+  }
+
+  // an overflow sequence continues with the refused packet once the store works again
+  size_t sequencePackets[2] = {};
+  for (int failOnce = 0; failOnce < 2; failOnce++)
+  {
+    BtHomeV2Device device("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC);
+    store.failing = false;
+    device.setCounterStore(&store, 1);
+    device.enableOverflow(96);
+    for (uint8_t channel = 0; channel < 16; channel++)
+    {
+      device.addTemperature_neg327_to_327_Resolution_0_01(20.0f + channel);
+    }
+
+    // the first packet uses the reservation saved by setCounterStore, the second needs a new one
+    uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+    sequencePackets[failOnce] = device.nextAdvertisement(buffer) ? 1 : 0;
+    store.failing = failOnce;
+    while (device.nextAdvertisement(buffer))
+    {
+      sequencePackets[failOnce]++;
+    }
+    if (failOnce)
+    {
+      if (sequencePackets[failOnce] != 1 || device.getLastStatus() != BTHOME_ADVERTISEMENT_COUNTER_NOT_SAVED)
+      {
+        printf("overflow packet sent while the reservation failed, or the loop end looked like the sequence end\n");
+        return 1;
+      }
+      // the refused packet ended the loop early, the sequence resumes with it
+      store.failing = false;
+      while (device.nextAdvertisement(buffer))
+      {
+        sequencePackets[failOnce]++;
+      }
+    }
+    if (device.getLastStatus() != BTHOME_ADVERTISEMENT_SEQUENCE_DONE)
+    {
+      printf("overflow sequence end not reported as BTHOME_ADVERTISEMENT_SEQUENCE_DONE\n");
+      return 1;
+    }
+  }
+  if (sequencePackets[0] != sequencePackets[1])
+  {
+    printf("overflow sequence after a failed write: %zu packets, expected %zu\n", sequencePackets[1], sequencePackets[0]);
+    return 1;
+  }
+
+  printf("failing store: %zu packets sent, %zu refused while the reservation could not be saved, no counter reused\n",
+         packets, refused);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 100000);
+
+  runWakeCases(iterations);
+  runPacketCases(iterations);
+  reportWear();
+  return checkCrashRecovery() + checkSaveFailures();
+}
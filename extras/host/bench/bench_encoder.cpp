@@ -0,0 +1,275 @@
+// Encoder micro-benchmarks: one "packet" is clear + add measurements + getAdvertisementData.
+// The overflow cases encode a whole multi-packet sequence with nextAdvertisement per iteration,
+// the suppression cases clear + add + isAdvertisementNeeded and only encode when it is needed.
+// First checks that encrypted packets, encrypted in place in the output buffer, carry the plain packet's measurements.
+// Fails if any case allocates: clear, add and building packets must never touch the heap.
+
+#include "bench.h"
+
+#include <BtHomeV2Device.h>
+#include <BtHomeV2KeyStore.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t BENCH_KEY[BIND_KEY_LEN] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1,
+                                                0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+static const uint8_t BENCH_MAC[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, 0x8F, 0x80, 0xA5};
+
+typedef void (*SensorMix)(BtHomeV2Device &device, uint32_t iteration);
+
+static void emptyMix(BtHomeV2Device &, uint32_t)
+{
+  // header, names and (when encrypted) the MIC only
+}
+
+static void climateMix(BtHomeV2Device &device, uint32_t iteration)
+{
+  device.addTemperature_neg327_to_327_Resolution_0_01(21.37f + (iteration & 7));
+  device.addHumidityPercent_Resolution_0_01(48.2f);
+  device.addBatteryPercentage(87);
+}
+
+static void powerMeterMix(BtHomeV2Device &device, uint32_t iteration)
+{
+  device.addVoltage_0_to_65_resolution_0_001(3.291f);
+  device.addCurrentAmps_0_65_Resolution_0_001(0.125f);
+  device.addPower_0_to_167772_resolution_0_01(412.5f + (iteration & 3));
+  device.addEnergyKwh_0_to_16777(1234.567f);
+}
+
+static void binaryMix(BtHomeV2Device &device, uint32_t iteration)
+{
+  device.setDoorState((iteration & 1) ? Door_Sensor_Status_Open : Door_Sensor_Status_Closed);
+  device.setMotionState(Motion_Sensor_Status_Detected);
+  device.setBatteryState(BATTERY_STATE_NORMAL);
+}
+
+static void fullPacketMix(BtHomeV2Device &device, uint32_t iteration)
+{
+  // fill until the device refuses, which exercises the space check on every call
+  while (device.addCount_0_65535(static_cast<uint16_t>(iteration)))
+  {
+  }
+}
+
+struct EncoderCase
+{
+  const char *name;
+  SensorMix mix;
+  size_t encryptedFitsFrom; // smallest packet size holding the whole mix encrypted, 0 if it fills any packet
+};
+
+static const EncoderCase ENCODER_CASES[] = {
+    {"empty", emptyMix, MAX_ADVERTISEMENT_SIZE},
+    {"climate", climateMix, MAX_ADVERTISEMENT_SIZE},
+    {"power-meter", powerMeterMix, MAX_EXTENDED_ADVERTISEMENT_SIZE},
+    {"binary", binaryMix, MAX_ADVERTISEMENT_SIZE},
+    {"full-packet", fullPacketMix, 0},
+};
+
+struct EncoderContext
+{
+  BtHomeV2Device *device;
+  SensorMix mix;
+  uint32_t iteration;
+  size_t size;
+  uint8_t buffer[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+};
+
+static void encodePacket(void *context)
+{
+  EncoderContext *ctx = static_cast<EncoderContext *>(context);
+  ctx->device->clearMeasurementData();
+  ctx->mix(*ctx->device, ctx->iteration++);
+  ctx->size = ctx->device->getAdvertisementData(ctx->buffer);
+  benchConsume(ctx->buffer, ctx->size);
+}
+
+static void multiChannelMix(BtHomeV2Device &device, uint32_t iteration)
+{
+  // a 16 channel probe, about five legacy packets
+  for (uint8_t channel = 0; channel < 16; channel++)
+  {
+    device.addTemperature_neg327_to_327_Resolution_0_01(20.0f + channel + (iteration & 7));
+    device.addHumidityPercent_Resolution_1(40 + channel);
+  }
+}
+
+static void encodeSequence(void *context)
+{
+  EncoderContext *ctx = static_cast<EncoderContext *>(context);
+  ctx->device->clearMeasurementData();
+  ctx->mix(*ctx->device, ctx->iteration++);
+  ctx->size = 0;
+  while (size_t size = ctx->device->nextAdvertisement(ctx->buffer))
+  {
+    benchConsume(ctx->buffer, size);
+    ctx->size += size;
+  }
+}
+
+/// @return 1 if the case allocated.
+static int checkNoAllocations(const char *name, const BenchResult &result)
+{
+  if (result.allocationsPerOp == 0)
+  {
+    return 0;
+  }
+  printf("FAIL %s: %.2f heap allocations per operation\n", name, result.allocationsPerOp);
+  return 1;
+}
+
+static int runOverflowCase(const char *variant, BtHomeV2Device &device, size_t iterations)
+{
+  EncoderContext context;
+  context.device = &device;
+  context.mix = multiChannelMix;
+  context.iteration = 0;
+  context.size = 0;
+
+  BenchResult result = runBenchmark(encodeSequence, &context, iterations);
+
+  char name[64];
+  snprintf(name, sizeof(name), "%s/multi-channel", variant);
+  printBenchResult(name, result, context.size);
+  return checkNoAllocations(name, result);
+}
+
+static void encodeIfNeeded(void *context)
+{
+  EncoderContext *ctx = static_cast<EncoderContext *>(context);
+  ctx->device->clearMeasurementData();
+  ctx->mix(*ctx->device, ctx->iteration++);
+  if (ctx->device->isAdvertisementNeeded())
+  {
+    ctx->size = ctx->device->getAdvertisementData(ctx->buffer);
+    benchConsume(ctx->buffer, ctx->size);
+  }
+}
+
+static int runSuppressionCase(const char *variant, BtHomeV2Device &device, SensorMix mix, size_t iterations)
+{
+  EncoderContext context;
+  context.device = &device;
+  context.mix = mix;
+  context.iteration = 0;
+  context.size = 0;
+
+  BenchResult result = runBenchmark(encodeIfNeeded, &context, iterations);
+  printBenchResult(variant, result, context.size);
+  return checkNoAllocations(variant, result);
+}
+
+static int runEncoderCases(const char *variant, BtHomeV2Device &device, size_t iterations)
+{
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(ENCODER_CASES) / sizeof(ENCODER_CASES[0]); i++)
+  {
+    EncoderContext context;
+    context.device = &device;
+    context.mix = ENCODER_CASES[i].mix;
+    context.iteration = 0;
+    context.size = 0;
+
+    BenchResult result = runBenchmark(encodePacket, &context, iterations);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%s", variant, ENCODER_CASES[i].name);
+    printBenchResult(name, result, context.size);
+    failures += checkNoAllocations(name, result);
+  }
+  return failures;
+}
+
+/// @brief Service data AD: length at index 3, the measurements follow the device information byte.
+static const size_t SERVICE_DATA_LENGTH_INDEX = 3;
+static const size_t DEVICE_INFO_INDEX = 7;
+
+/// @brief Encrypted packets decrypt to the measurement bytes of a plain device given the same values.
+static int checkEncryptedMatchesPlain(size_t maxAdvertisementSize)
+{
+  BtHomeV2KeyStore keys(1);
+  keys.addKey(BENCH_MAC, BENCH_KEY);
+  BtHomeV2Device plain("short_name", "My longer device name", false, maxAdvertisementSize);
+  BtHomeV2Device encrypted("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC, 1, maxAdvertisementSize);
+  plain.enablePacketId();
+  encrypted.enablePacketId();
+
+  int failures = 0;
+  uint32_t expectedCounter = 1;
+  for (size_t i = 0; i < sizeof(ENCODER_CASES) / sizeof(ENCODER_CASES[0]); i++)
+  {
+    if (ENCODER_CASES[i].encryptedFitsFrom == 0 || ENCODER_CASES[i].encryptedFitsFrom > maxAdvertisementSize)
+    {
+      continue;
+    }
+    for (uint32_t iteration = 0; iteration < 4; iteration++)
+    {
+      uint8_t plainPacket[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+      uint8_t encryptedPacket[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+      plain.clearMeasurementData();
+      encrypted.clearMeasurementData();
+      ENCODER_CASES[i].mix(plain, iteration);
+      ENCODER_CASES[i].mix(encrypted, iteration);
+      plain.getAdvertisementData(plainPacket);
+      encrypted.getAdvertisementData(encryptedPacket);
+
+      const uint8_t *measurements = &plainPacket[DEVICE_INFO_INDEX + 1];
+      size_t measurementsLength = plainPacket[SERVICE_DATA_LENGTH_INDEX] - 4;
+      uint8_t decrypted[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+      size_t decryptedLength = 0;
+      uint32_t counter = 0;
+      BtHomeDecryptStatus status = keys.decrypt(BENCH_MAC, &encryptedPacket[DEVICE_INFO_INDEX],
+                                                encryptedPacket[SERVICE_DATA_LENGTH_INDEX] - 3, decrypted,
+                                                &decryptedLength, &counter);
+      if (status != BTHOME_DECRYPT_OK || counter != expectedCounter++ || decryptedLength != measurementsLength ||
+          memcmp(decrypted, measurements, measurementsLength) != 0)
+      {
+        printf("FAIL %zu byte packet, %s, iteration %u\n", maxAdvertisementSize, ENCODER_CASES[i].name, iteration);
+        failures++;
+      }
+    }
+  }
+  return failures;
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 200000);
+
+  int failures = checkEncryptedMatchesPlain(MAX_ADVERTISEMENT_SIZE) + checkEncryptedMatchesPlain(MAX_EXTENDED_ADVERTISEMENT_SIZE);
+  printf("encrypted in place, decrypts to the plain measurements: %s\n\n", failures ? "FAIL" : "OK");
+
+  BtHomeV2Device plain("short_name", "My longer device name", false);
+  BtHomeV2Device encrypted("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC);
+  BtHomeV2Device extended("short_name", "My longer device name", false, MAX_EXTENDED_ADVERTISEMENT_SIZE);
+  BtHomeV2Device extendedEncrypted("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC, 1, MAX_EXTENDED_ADVERTISEMENT_SIZE);
+
+  printBenchHeader("encoder (per packet)");
+  failures += runEncoderCases("plain", plain, iterations);
+  failures += runEncoderCases("encrypted", encrypted, iterations);
+  failures += runEncoderCases("extended", extended, iterations);
+  failures += runEncoderCases("extended-encrypted", extendedEncrypted, iterations);
+
+  BtHomeV2Device overflow("short_name", "My longer device name", false);
+  BtHomeV2Device overflowEncrypted("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC);
+  overflow.enableOverflow(96);
+  overflowEncrypted.enableOverflow(96);
+
+  printBenchHeader("encoder (per packet sequence)");
+  failures += runOverflowCase("overflow", overflow, iterations / 4);
+  failures += runOverflowCase("overflow-encrypted", overflowEncrypted, iterations / 4);
+
+  // the climate mix changes its temperature by 1 degree every iteration, so about half of the cycles stay within the deadband
+  BtHomeV2Device suppressed("short_name", "My longer device name", false);
+  suppressed.enableChangeSuppression(0);
+  suppressed.setDeadband<BtHomeSensors::temperature_int16_scale_0_01>(1.0f);
+  BtHomeV2Device suppressedEncrypted("short_name", "My longer device name", false, BENCH_KEY, BENCH_MAC);
+  suppressedEncrypted.enableChangeSuppression(0);
+  suppressedEncrypted.setDeadband<BtHomeSensors::temperature_int16_scale_0_01>(1.0f);
+
+  printBenchHeader("encoder (per cycle, change suppression)");
+  failures += runSuppressionCase("suppressed/climate", suppressed, climateMix, iterations);
+  failures += runSuppressionCase("suppressed-encrypted/climate", suppressedEncrypted, climateMix, iterations);
+  return failures;
+}
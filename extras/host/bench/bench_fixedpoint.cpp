@@ -0,0 +1,216 @@
+// Fixed-point encoding: addScaled (integer only) against the float path, on BTHome example values and on
+// a sweep over every sensor type, plus the cost per measurement of each path.
+
+#include "bench.h"
+
+#include <BaseDevice.h>
+#include <stdio.h>
+
+struct SensorEntry
+{
+  const char *name;
+  BtHomeType type;
+};
+
+#define BENCH_SENSOR_ENTRY(name, id, byteCount, signedValue, scaleNumerator, scaleDenominator) {#name, name},
+static const SensorEntry SENSORS[] = {BTHOME_SENSOR_TYPES(BENCH_SENSOR_ENTRY)};
+#undef BENCH_SENSOR_ENTRY
+
+// example values from the BTHome format description, as decimals in thousandths
+struct Example
+{
+  BtHomeType type;
+  int32_t milliUnits;
+};
+
+static const Example EXAMPLES[] = {
+    {temperature_int16_scale_0_01, 25060},
+    {humidity_uint16, 50550},
+    {pressure, 1008830},
+    {illuminance, 13460670},
+    {battery_percentage, 97000},
+    {co2, 1250000},
+    {voltage_0_001, 3074},
+    {power_uint24, 69140},
+    {energy_uint24, 1346067},
+    {dewpoint, 17380},
+    {moisture_uint16, 30740},
+    {rotation, 307400},
+    {speed, 133900},
+    {temperature_int16_scale_0_1, 27300},
+    {temperature_int16_scale_0_1, -27300},
+    {current_uint16, 13390},
+    {volume_uint16_scale_0_1, 2215100},
+};
+
+/// @brief Raw value of the single measurement in a cleared device, read back from the advertisement.
+static int64_t encodedRaw(BaseDevice &device, const BtHomeType &type)
+{
+  uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+  device.getAdvertisementData(advertisement);
+  const uint8_t *value = &advertisement[ADVERTISEMENT_HEADER_SIZE + TYPE_INDICATOR_SIZE];
+  uint64_t raw = 0;
+  for (uint8_t i = 0; i < type.byteCount; i++)
+  {
+    raw |= static_cast<uint64_t>(value[i]) << (8 * i);
+  }
+  if (type.signed_value && (value[type.byteCount - 1] & 0x80))
+  {
+    raw |= ~0ULL << (8 * type.byteCount);
+  }
+  device.resetMeasurement();
+  return static_cast<int64_t>(raw);
+}
+
+static int64_t floatRaw(BaseDevice &device, const BtHomeType &type, int32_t milliUnits)
+{
+  device.addFloat(type, milliUnits / 1000.0f);
+  return encodedRaw(device, type);
+}
+
+static int64_t scaledRaw(BaseDevice &device, const BtHomeType &type, int32_t milliUnits)
+{
+  device.addScaled(type, milliUnits);
+  return encodedRaw(device, type);
+}
+
+static int checkExamples(BaseDevice &device)
+{
+  int failures = 0;
+  size_t floatMismatches = 0;
+  printf("BTHome example values\n");
+  for (size_t i = 0; i < sizeof(EXAMPLES) / sizeof(EXAMPLES[0]); i++)
+  {
+    const Example &example = EXAMPLES[i];
+    int64_t exact = static_cast<int64_t>(example.milliUnits) * example.type.scaleDenominator / (example.type.scaleNumerator * 1000LL);
+    int64_t scaled = scaledRaw(device, example.type, example.milliUnits);
+    int64_t floating = floatRaw(device, example.type, example.milliUnits);
+    if (scaled != exact)
+    {
+      printf("FAIL 0x%02X %d: addScaled encoded %lld, expected %lld\n", example.type.id, example.milliUnits,
+             static_cast<long long>(scaled), static_cast<long long>(exact));
+      failures++;
+    }
+    if (floating != scaled)
+    {
+      printf("  0x%02X %.3f: float path %lld, addScaled %lld\n", example.type.id, example.milliUnits / 1000.0,
+             static_cast<long long>(floating), static_cast<long long>(scaled));
+      floatMismatches++;
+    }
+  }
+  printf("  %zu values, addScaled exact: %s, float path identical: %zu/%zu\n", sizeof(EXAMPLES) / sizeof(EXAMPLES[0]),
+         failures ? "no" : "yes", sizeof(EXAMPLES) / sizeof(EXAMPLES[0]) - floatMismatches, sizeof(EXAMPLES) / sizeof(EXAMPLES[0]));
+  return failures;
+}
+
+// every representable value (raw step) in a window around zero, for every sensor type
+static int sweepSensors(BaseDevice &device)
+{
+  static const int64_t WINDOW = 20000;
+  int failures = 0;
+  size_t values = 0;
+  size_t floatMismatches = 0;
+  size_t typesWithMismatches = 0;
+
+  for (size_t s = 0; s < sizeof(SENSORS) / sizeof(SENSORS[0]); s++)
+  {
+    const BtHomeType &type = SENSORS[s].type;
+    // milli units per raw step, integral for every table entry
+    int64_t step = type.scaleNumerator * 1000LL / type.scaleDenominator;
+    int64_t maxRaw = type.byteCount >= 4 ? WINDOW : ((1LL << (8 * type.byteCount - (type.signed_value ? 1 : 0))) - 1);
+    maxRaw = maxRaw < WINDOW ? maxRaw : WINDOW;
+    int64_t minRaw = type.signed_value ? -maxRaw : 0;
+    size_t mismatches = 0;
+
+    for (int64_t raw = minRaw; raw <= maxRaw; raw++)
+    {
+      int64_t milliUnits = raw * step;
+      if (milliUnits > INT32_MAX || milliUnits < INT32_MIN)
+      {
+        continue;
+      }
+      values++;
+      if (scaledRaw(device, type, milliUnits) != raw)
+      {
+        failures++;
+      }
+      if (floatRaw(device, type, milliUnits) != raw)
+      {
+        mismatches++;
+      }
+    }
+
+    floatMismatches += mismatches;
+    if (mismatches)
+    {
+      typesWithMismatches++;
+    }
+  }
+
+  printf("sweep: %zu values over %zu sensor types, addScaled exact: %s\n", values, sizeof(SENSORS) / sizeof(SENSORS[0]),
+         failures ? "no" : "yes");
+  printf("  float path differs for %zu values in %zu types (float rounding, e.g. 0.29 / 0.01 = 28.999998)\n",
+         floatMismatches, typesWithMismatches);
+  return failures;
+}
+
+struct EncodeContext
+{
+  BaseDevice *device;
+  int32_t milliUnits;
+  uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+};
+
+static void encodeFloat(void *context)
+{
+  EncodeContext *ctx = static_cast<EncodeContext *>(context);
+  float value = (ctx->milliUnits++ & 0xfff) / 1000.0f + 20.0f;
+  ctx->device->resetMeasurement();
+  ctx->device->addFloat(temperature_int16_scale_0_01, value);
+  ctx->device->addFloat(humidity_uint16, value * 2);
+  ctx->device->addFloat(pressure, value * 50);
+  ctx->device->addFloat(co2, value * 40);
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+static void encodeScaled(void *context)
+{
+  EncodeContext *ctx = static_cast<EncodeContext *>(context);
+  int32_t value = (ctx->milliUnits++ & 0xfff) + 20000;
+  ctx->device->resetMeasurement();
+  ctx->device->addScaled(temperature_int16_scale_0_01, value);
+  ctx->device->addScaled(humidity_uint16, value * 2);
+  ctx->device->addScaled(pressure, value * 50);
+  ctx->device->addScaled(co2, value * 40);
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+static void encodeScaledTemplate(void *context)
+{
+  EncodeContext *ctx = static_cast<EncodeContext *>(context);
+  int32_t value = (ctx->milliUnits++ & 0xfff) + 20000;
+  ctx->device->resetMeasurement();
+  ctx->device->addScaled<BtHomeSensors::temperature_int16_scale_0_01>(value);
+  ctx->device->addScaled<BtHomeSensors::humidity_uint16>(value * 2);
+  ctx->device->addScaled<BtHomeSensors::pressure>(value * 50);
+  ctx->device->addScaled<BtHomeSensors::co2>(value * 40);
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 200000);
+
+  BaseDevice device("", "", false);
+  int failures = checkExamples(device);
+  failures += sweepSensors(device);
+
+  // on a host the FPU hides the cost; on an FPU-less part (ESP32-C3) the float path calls soft-float routines
+  printBenchHeader("encode 4 measurements + packet");
+  EncodeContext context = {&device, 0, {}};
+  printBenchResult("addFloat", runBenchmark(encodeFloat, &context, iterations), 0);
+  printBenchResult("addScaled", runBenchmark(encodeScaled, &context, iterations), 0);
+  printBenchResult("addScaled<Sensor>", runBenchmark(encodeScaledTemplate, &context, iterations), 0);
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,132 @@
+// Decryption benchmarks: cached key schedules in BtHomeV2KeyStore versus setting the key per packet.
+
+#include "bench.h"
+
+#include <BtHomeV2Device.h>
+#include <BtHomeV2KeyStore.h>
+#include <BtHomeV2Parser.h>
+#include <stdio.h>
+
+static const size_t PACKET_COUNT = 64;
+
+static void deviceIdentity(uint32_t index, uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint8_t key[BIND_KEY_LEN])
+{
+  uint32_t state = index * 2654435761u + 1;
+  for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+  {
+    state = state * 1664525u + 1013904223u;
+    macAddress[i] = state >> 24;
+  }
+  for (size_t i = 0; i < BIND_KEY_LEN; i++)
+  {
+    state = state * 1664525u + 1013904223u;
+    key[i] = state >> 24;
+  }
+}
+
+struct Packet
+{
+  uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+  uint8_t key[BIND_KEY_LEN];
+  uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+  const uint8_t *serviceData;
+  size_t serviceDataLength;
+};
+
+struct DecryptContext
+{
+  BtHomeV2KeyStore *store;
+  Packet *packets;
+  size_t next;
+  size_t failures;
+};
+
+static void decryptCached(void *context)
+{
+  DecryptContext *ctx = static_cast<DecryptContext *>(context);
+  Packet &packet = ctx->packets[ctx->next++ % PACKET_COUNT];
+  uint8_t measurements[MAX_ADVERTISEMENT_SIZE];
+  size_t measurementsLength;
+  if (ctx->store->decrypt(packet.macAddress, packet.serviceData, packet.serviceDataLength, measurements, &measurementsLength) != BTHOME_DECRYPT_OK)
+  {
+    ctx->failures++;
+    return;
+  }
+  benchConsume(measurements, measurementsLength);
+}
+
+static void decryptWithSetkey(void *context)
+{
+  DecryptContext *ctx = static_cast<DecryptContext *>(context);
+  Packet &packet = ctx->packets[ctx->next++ % PACKET_COUNT];
+
+  size_t ciphertextLength = packet.serviceDataLength - 1 - COUNTER_LEN - MIC_LEN;
+  const uint8_t *ciphertext = &packet.serviceData[1];
+  const uint8_t *counterBytes = &ciphertext[ciphertextLength];
+  uint32_t counter = counterBytes[0] | (counterBytes[1] << 8) | (counterBytes[2] << 16) | (static_cast<uint32_t>(counterBytes[3]) << 24);
+  uint8_t nonce[NONCE_LEN];
+  buildBtHomeNonce(nonce, packet.macAddress, counter);
+
+  uint8_t measurements[MAX_ADVERTISEMENT_SIZE];
+  BtHomeV2Ccm ccm;
+  ccm.setKey(packet.key);
+  if (!ccm.authDecrypt(nonce, ciphertext, ciphertextLength, measurements, &counterBytes[COUNTER_LEN]))
+  {
+    ctx->failures++;
+  }
+  benchConsume(measurements, ciphertextLength);
+}
+
+static int runForKeyCount(size_t keyCount, size_t iterations)
+{
+  BtHomeV2KeyStore store(keyCount);
+  for (uint32_t i = 0; i < keyCount; i++)
+  {
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    uint8_t key[BIND_KEY_LEN];
+    deviceIdentity(i, macAddress, key);
+    store.addKey(macAddress, key);
+  }
+
+  // packets from devices spread over the whole store
+  static Packet packets[PACKET_COUNT];
+  for (size_t i = 0; i < PACKET_COUNT; i++)
+  {
+    Packet &packet = packets[i];
+    deviceIdentity((i * 7919) % keyCount, packet.macAddress, packet.key);
+    BtHomeV2Device device("enc", "encrypted", false, packet.key, packet.macAddress, 1000 + i);
+    device.addTemperature_neg327_to_327_Resolution_0_01(21.37f);
+    device.addHumidityPercent_Resolution_0_01(48.2f);
+    device.addBatteryPercentage(87);
+    size_t length = device.getAdvertisementData(packet.advertisement);
+    BtHomeV2Parser::findServiceData(packet.advertisement, length, &packet.serviceData, &packet.serviceDataLength);
+  }
+
+  DecryptContext context = {&store, packets, 0, 0};
+  char name[64];
+
+  BenchResult result = runBenchmark(decryptCached, &context, iterations);
+  snprintf(name, sizeof(name), "key-store/%zu keys", keyCount);
+  printBenchResult(name, result, packets[0].serviceDataLength);
+
+  result = runBenchmark(decryptWithSetkey, &context, iterations);
+  snprintf(name, sizeof(name), "setkey-per-packet/%zu keys", keyCount);
+  printBenchResult(name, result, packets[0].serviceDataLength);
+
+  if (context.failures)
+  {
+    printf("%zu packets failed to decrypt\n", context.failures);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 200000);
+
+  printBenchHeader("decrypt (per packet)");
+  int result = runForKeyCount(1000, iterations);
+  result |= runForKeyCount(10000, iterations);
+  return result;
+}
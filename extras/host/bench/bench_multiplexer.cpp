@@ -0,0 +1,401 @@
+// Virtual devices: table memory per device against a BtHomeV2Device each, a round trip of every packet
+// through the parser and key store, scheduling fairness and freshness, and the cost per advertising slot, which
+// must not allocate.
+
+#include "bench.h"
+
+#include <BtHomeV2Device.h>
+#include <BtHomeV2KeyStore.h>
+#include <BtHomeV2Multiplexer.h>
+#include <BtHomeV2Parser.h>
+#include <stdio.h>
+#include <vector>
+
+typedef BtHomeSensors::count_uint32 DeviceSensor;
+
+static const char *HUB_SHORT_NAME = "hub";
+static const char *HUB_COMPLETE_NAME = "Hub sensor";
+
+static void deviceIdentity(uint32_t index, uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint8_t key[BIND_KEY_LEN])
+{
+  uint32_t state = index * 2654435761u + 1;
+  for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+  {
+    state = state * 1664525u + 1013904223u;
+    macAddress[i] = state >> 24;
+  }
+  for (size_t i = 0; i < BIND_KEY_LEN; i++)
+  {
+    state = state * 1664525u + 1013904223u;
+    key[i] = state >> 24;
+  }
+}
+
+/// @brief Add devices 0..count-1, the odd ones encrypted.
+static void addDevices(BtHomeV2Multiplexer &multiplexer, size_t count, const uint8_t *weights = nullptr)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    uint8_t key[BIND_KEY_LEN];
+    deviceIdentity(static_cast<uint32_t>(i), macAddress, key);
+    multiplexer.addDevice(HUB_SHORT_NAME, HUB_COMPLETE_NAME, false, macAddress, (i & 1) ? key : nullptr, 1,
+                          weights ? weights[i] : 1);
+  }
+}
+
+static void reportMemory()
+{
+  printf("memory per virtual device: %zu bytes table (4 measurements) + names, BtHomeV2Device: %zu bytes\n",
+         BtHomeV2Multiplexer::bytesPerDevice(), sizeof(BtHomeV2Device));
+  printf("%-10s %16s %20s\n", "devices", "multiplexer B", "BtHomeV2Device B");
+  const size_t counts[] = {4, 16, 64};
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+  {
+    size_t multiplexer = sizeof(BtHomeV2Multiplexer) + counts[i] * BtHomeV2Multiplexer::bytesPerDevice();
+    printf("%-10zu %16zu %20zu\n", counts[i], multiplexer, counts[i] * sizeof(BtHomeV2Device));
+  }
+}
+
+// every packet decoded with the MAC of the device it was built for; values and counters must match that device
+static int checkRoundTrip()
+{
+  static const size_t DEVICES = 8;
+  static const size_t SLOTS = 4000;
+
+  BtHomeV2Multiplexer multiplexer(DEVICES);
+  addDevices(multiplexer, DEVICES);
+  BtHomeV2KeyStore keyStore(DEVICES);
+  for (size_t i = 1; i < DEVICES; i += 2)
+  {
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    uint8_t key[BIND_KEY_LEN];
+    deviceIdentity(static_cast<uint32_t>(i), macAddress, key);
+    keyStore.addKey(macAddress, key);
+  }
+
+  uint32_t expected[DEVICES];
+  uint32_t lastCounter[DEVICES] = {};
+  size_t slotsPerDevice[DEVICES] = {};
+  size_t failures = 0;
+
+  // nothing to send yet
+  {
+    uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+    size_t device;
+    if (multiplexer.nextAdvertisement(advertisement, device) ||
+        multiplexer.getLastStatus() != BTHOME_ADVERTISEMENT_NO_MEASUREMENTS)
+    {
+      failures++;
+    }
+  }
+
+  for (size_t slot = 0; slot < SLOTS; slot++)
+  {
+    // one device gets a new value every slot
+    size_t updated = slot % DEVICES;
+    expected[updated] = static_cast<uint32_t>(updated * 1000000 + slot);
+    multiplexer.clearMeasurements(updated);
+    multiplexer.add<DeviceSensor>(updated, expected[updated]);
+    if (slot < DEVICES)
+    {
+      continue;
+    }
+
+    uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+    size_t device;
+    size_t size = multiplexer.nextAdvertisement(advertisement, device);
+    slotsPerDevice[device]++;
+
+    const uint8_t *serviceData;
+    size_t serviceDataLength;
+    if (!BtHomeV2Parser::findServiceData(advertisement, size, &serviceData, &serviceDataLength))
+    {
+      failures++;
+      continue;
+    }
+
+    BtHomeV2Parser parser(serviceData, serviceDataLength);
+    uint8_t measurements[MAX_ADVERTISEMENT_SIZE];
+    bool encrypted = parser.isEncrypted();
+    if (encrypted)
+    {
+      size_t measurementsLength;
+      uint32_t counter;
+      if (keyStore.decrypt(multiplexer.getMacAddress(device), serviceData, serviceDataLength, measurements,
+                           &measurementsLength, &counter) != BTHOME_DECRYPT_OK ||
+          counter != lastCounter[device] + 1)
+      {
+        failures++;
+        continue;
+      }
+      lastCounter[device] = counter;
+      parser = BtHomeV2Parser::fromMeasurements(serviceData[0], measurements, measurementsLength);
+    }
+
+    BtHomeMeasurement measurement;
+    if (!parser.next(measurement) || static_cast<uint32_t>(measurement.rawValue) != expected[device] ||
+        encrypted != ((device & 1) == 1))
+    {
+      failures++;
+    }
+  }
+
+  size_t fewest = SLOTS;
+  size_t most = 0;
+  for (size_t i = 0; i < DEVICES; i++)
+  {
+    fewest = slotsPerDevice[i] < fewest ? slotsPerDevice[i] : fewest;
+    most = slotsPerDevice[i] > most ? slotsPerDevice[i] : most;
+  }
+  bool fair = most - fewest <= 1;
+  printf("\nround trip: %zu devices (half encrypted), %zu slots, round robin %zu - %zu slots per device, %zu failures: %s\n",
+         DEVICES, SLOTS - DEVICES, fewest, most, failures, !failures && fair ? "OK" : "FAIL");
+  return !failures && fair ? 0 : 1;
+}
+
+// a measurement the multiplexer accepts must reach the packet: 3 byte temperatures, 23 bytes of measurements in a
+// plain 31 byte packet, 11 when encrypted
+static int checkPacketSpace()
+{
+  static const size_t MEASUREMENTS = 10;
+  typedef BtHomeSensors::temperature_int16_scale_0_01 Temperature;
+
+  BtHomeV2Multiplexer multiplexer(2, MEASUREMENTS);
+  addDevices(multiplexer, 2);
+  BtHomeV2KeyStore keyStore(1);
+  uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+  uint8_t key[BIND_KEY_LEN];
+  deviceIdentity(1, macAddress, key);
+  keyStore.addKey(macAddress, key);
+
+  const size_t expectedAccepted[2] = {7, 3};
+  size_t accepted[2] = {};
+  for (size_t device = 0; device < 2; device++)
+  {
+    for (size_t i = 0; i < MEASUREMENTS; i++)
+    {
+      accepted[device] += multiplexer.addScaled<Temperature>(device, static_cast<int32_t>(20000 + i)) ? 1 : 0;
+    }
+  }
+
+  int failures = 0;
+  for (size_t slot = 0; slot < 2; slot++)
+  {
+    uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+    size_t device;
+    size_t size = multiplexer.nextAdvertisement(advertisement, device);
+    const uint8_t *serviceData;
+    size_t serviceDataLength;
+    if (!size || !BtHomeV2Parser::findServiceData(advertisement, size, &serviceData, &serviceDataLength))
+    {
+      failures++;
+      continue;
+    }
+
+    BtHomeV2Parser parser(serviceData, serviceDataLength);
+    uint8_t measurements[MAX_ADVERTISEMENT_SIZE];
+    size_t measurementsLength;
+    if (parser.isEncrypted())
+    {
+      if (keyStore.decrypt(macAddress, serviceData, serviceDataLength, measurements, &measurementsLength) !=
+          BTHOME_DECRYPT_OK)
+      {
+        failures++;
+        continue;
+      }
+      parser = BtHomeV2Parser::fromMeasurements(serviceData[0], measurements, measurementsLength);
+    }
+
+    size_t encoded = 0;
+    BtHomeMeasurement measurement;
+    while (parser.next(measurement))
+    {
+      encoded++;
+    }
+    printf("%s device: %zu of %zu temperatures accepted, %zu encoded\n", device ? "encrypted" : "plain", accepted[device],
+           MEASUREMENTS, encoded);
+    if (accepted[device] != expectedAccepted[device] || encoded != accepted[device])
+    {
+      failures++;
+    }
+  }
+  printf("packet space: %s\n", failures ? "FAIL" : "OK");
+  return failures;
+}
+
+struct ScheduleStats
+{
+  double meanLatency;
+  size_t maxLatency;
+  size_t maxGap;
+};
+
+// device i updates every updateEvery[i] slots; latency is the slots from an update to its first advertisement
+static ScheduleStats simulate(BtHomeSchedule schedule, const uint8_t *weights, const size_t *updateEvery, size_t devices,
+                              size_t slots, std::vector<size_t> &share)
+{
+  BtHomeV2Multiplexer multiplexer(devices, DEFAULT_MULTIPLEXER_MEASUREMENTS, schedule);
+  addDevices(multiplexer, devices, weights);
+  std::vector<long> pendingSince(devices, -1);
+  std::vector<size_t> lastSent(devices, 0);
+  share.assign(devices, 0);
+  ScheduleStats stats = {0, 0, 0};
+  size_t delivered = 0;
+  double latencySum = 0;
+
+  for (size_t slot = 0; slot < slots; slot++)
+  {
+    for (size_t i = 0; i < devices; i++)
+    {
+      if (slot % updateEvery[i] == 0)
+      {
+        multiplexer.clearMeasurements(i);
+        multiplexer.add<DeviceSensor>(i, static_cast<uint32_t>(slot));
+        if (pendingSince[i] < 0)
+        {
+          pendingSince[i] = static_cast<long>(slot);
+        }
+      }
+    }
+
+    uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+    size_t device;
+    multiplexer.nextAdvertisement(advertisement, device);
+    share[device]++;
+    size_t gap = slot - lastSent[device];
+    stats.maxGap = gap > stats.maxGap ? gap : stats.maxGap;
+    lastSent[device] = slot;
+    if (pendingSince[device] >= 0)
+    {
+      size_t latency = slot - static_cast<size_t>(pendingSince[device]);
+      latencySum += latency;
+      delivered++;
+      stats.maxLatency = latency > stats.maxLatency ? latency : stats.maxLatency;
+      pendingSince[device] = -1;
+    }
+  }
+
+  stats.meanLatency = delivered ? latencySum / delivered : 0;
+  return stats;
+}
+
+static int compareSchedules()
+{
+  static const size_t DEVICES = 8;
+  static const size_t SLOTS = 100000;
+  // a motion sensor and a meter that change often, the rest slowly
+  const size_t updateEvery[DEVICES] = {2, 3, 50, 50, 200, 200, 1000, 1000};
+  const uint8_t weights[DEVICES] = {1, 1, 1, 1, 1, 1, 1, 1};
+
+  printf("\nscheduling (%zu devices, %zu slots, updates every 2 / 3 / 50 / 50 / 200 / 200 / 1000 / 1000 slots)\n", DEVICES, SLOTS);
+  printf("%-14s %14s %14s %10s   %s\n", "schedule", "mean latency", "max latency", "max gap", "share of slots per device (%)");
+
+  int failures = 0;
+  const BtHomeSchedule schedules[] = {BTHOME_SCHEDULE_ROUND_ROBIN, BTHOME_SCHEDULE_FRESHNESS};
+  const char *names[] = {"round robin", "freshness"};
+  for (size_t s = 0; s < 2; s++)
+  {
+    std::vector<size_t> share;
+    ScheduleStats stats = simulate(schedules[s], weights, updateEvery, DEVICES, SLOTS, share);
+    printf("%-14s %14.2f %14zu %10zu  ", names[s], stats.meanLatency, stats.maxLatency, stats.maxGap);
+    for (size_t i = 0; i < DEVICES; i++)
+    {
+      printf(" %5.1f", 100.0 * share[i] / SLOTS);
+    }
+    printf("\n");
+    // no starvation: with weights of 1 every device is sent at least once per DEVICES * FRESHNESS_BOOST slots
+    if (stats.maxGap > DEVICES * FRESHNESS_BOOST)
+    {
+      printf("FAIL: a device waited %zu slots\n", stats.maxGap);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+struct SlotContext
+{
+  BtHomeV2Multiplexer *multiplexer;
+  BtHomeV2Device *device;
+  uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+};
+
+static void multiplexerSlot(void *context)
+{
+  SlotContext *ctx = static_cast<SlotContext *>(context);
+  size_t device;
+  benchConsume(ctx->buffer, ctx->multiplexer->nextAdvertisement(ctx->buffer, device));
+}
+
+static void dedicatedSlot(void *context)
+{
+  SlotContext *ctx = static_cast<SlotContext *>(context);
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+static int checkNoAllocations(const char *name, const BenchResult &result)
+{
+  if (result.allocationsPerOp == 0)
+  {
+    return 0;
+  }
+  printf("FAIL %s: %.2f heap allocations per slot\n", name, result.allocationsPerOp);
+  return 1;
+}
+
+// the multiplexer expands every key once in addDevice, a slot must not allocate even when it switches keys
+static int runTimings(size_t iterations)
+{
+  static const size_t DEVICES = 16;
+  uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+  uint8_t key[BIND_KEY_LEN];
+  deviceIdentity(1, macAddress, key);
+
+  BtHomeV2Multiplexer plain(DEVICES);
+  BtHomeV2Multiplexer mixed(DEVICES);
+  for (size_t i = 0; i < DEVICES; i++)
+  {
+    plain.addDevice(HUB_SHORT_NAME, HUB_COMPLETE_NAME, false, macAddress);
+  }
+  addDevices(mixed, DEVICES);
+  for (size_t i = 0; i < DEVICES; i++)
+  {
+    plain.add<DeviceSensor>(i, static_cast<uint32_t>(i));
+    plain.addScaled<BtHomeSensors::temperature_int16_scale_0_01>(i, 21370);
+    mixed.add<DeviceSensor>(i, static_cast<uint32_t>(i));
+    mixed.addScaled<BtHomeSensors::temperature_int16_scale_0_01>(i, 21370);
+  }
+
+  BtHomeV2Device plainDevice(HUB_SHORT_NAME, HUB_COMPLETE_NAME, false);
+  BtHomeV2Device encryptedDevice(HUB_SHORT_NAME, HUB_COMPLETE_NAME, false, key, macAddress);
+  plainDevice.add<DeviceSensor>(1u);
+  plainDevice.addScaled<BtHomeSensors::temperature_int16_scale_0_01>(21370);
+  encryptedDevice.add<DeviceSensor>(1u);
+  encryptedDevice.addScaled<BtHomeSensors::temperature_int16_scale_0_01>(21370);
+
+  printBenchHeader("per advertising slot (2 measurements)");
+  SlotContext context = {&plain, &plainDevice, {}};
+  printBenchResult("dedicated device/plain", runBenchmark(dedicatedSlot, &context, iterations), 0);
+  BenchResult plainResult = runBenchmark(multiplexerSlot, &context, iterations);
+  printBenchResult("multiplexer/16 plain", plainResult, 0);
+  context.device = &encryptedDevice;
+  context.multiplexer = &mixed;
+  printBenchResult("dedicated device/encrypted", runBenchmark(dedicatedSlot, &context, iterations), 0);
+  BenchResult mixedResult = runBenchmark(multiplexerSlot, &context, iterations);
+  printBenchResult("multiplexer/16 half encrypted", mixedResult, 0);
+  return checkNoAllocations("multiplexer/16 plain", plainResult) +
+         checkNoAllocations("multiplexer/16 half encrypted", mixedResult);
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 200000);
+
+  reportMemory();
+  int failures = checkRoundTrip();
+  failures += checkPacketSpace();
+  failures += compareSchedules();
+  failures += runTimings(iterations);
+  return failures;
+}
@@ -0,0 +1,337 @@
+// Name policy and scan response: checks which packets carry the name AD structures for each policy, the bytes
+// and airtime saved for typical packets over a day of advertising, and what names reach a receiver when they
+// move to the scan response.
+
+#include "bench.h"
+
+#include <BaseDevice.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t BENCH_KEY[BIND_KEY_LEN] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1,
+                                                0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+static const uint8_t BENCH_MAC[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, 0x8F, 0x80, 0xA5};
+
+// the service data AD follows the 3 byte flags AD, the names come after it
+static const size_t SERVICE_DATA_AD = 3;
+
+/// @brief Size of the flags and service data ADs; anything after them is a name.
+static size_t withoutNames(const uint8_t *advertisement)
+{
+  return SERVICE_DATA_AD + 1 + advertisement[SERVICE_DATA_AD];
+}
+
+static void addClimate(BaseDevice &device, uint32_t i)
+{
+  device.resetMeasurement();
+  device.add<BtHomeSensors::temperature_int16_scale_0_01>(static_cast<int>(20 + i % 5));
+  device.add<BtHomeSensors::humidity_uint16>(static_cast<int>(40 + i % 20));
+  device.add<BtHomeSensors::battery_percentage>(95);
+}
+
+/// @return Bit i set if packet i carried a name, for the first 32 packets.
+static uint32_t namePattern(BtHomeNamePolicy policy, uint16_t count)
+{
+  BaseDevice device("ws", "Weather", false);
+  BaseDevice reference("ws", "Weather", false);
+  if (!device.setNamePolicy(policy, count))
+  {
+    return 0xDEADBEEF;
+  }
+  uint32_t pattern = 0;
+  for (uint32_t i = 0; i < 32; i++)
+  {
+    uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+    uint8_t expected[MAX_ADVERTISEMENT_SIZE];
+    addClimate(device, i);
+    addClimate(reference, i);
+    size_t size = device.getAdvertisementData(advertisement);
+    reference.getAdvertisementData(expected);
+    // the measurements are untouched, only the names come and go
+    size_t measurementsEnd = withoutNames(advertisement);
+    if (memcmp(advertisement, expected, measurementsEnd) != 0)
+    {
+      return 0xDEADBEEF;
+    }
+    if (size > measurementsEnd)
+    {
+      pattern |= 1u << i;
+    }
+  }
+  return pattern;
+}
+
+static int checkPolicies()
+{
+  int failures = 0;
+  failures += namePattern(BTHOME_NAME_ALWAYS, 1) != 0xFFFFFFFFu;
+  failures += namePattern(BTHOME_NAME_EVERY_NTH, 1) != 0xFFFFFFFFu;
+  // packets 0, 5, 10, ...
+  failures += namePattern(BTHOME_NAME_EVERY_NTH, 5) != 0x42108421u;
+  failures += namePattern(BTHOME_NAME_FIRST_N, 3) != 0x7u;
+  failures += namePattern(BTHOME_NAME_FIRST_N, 0) != 0u;
+  failures += namePattern(BTHOME_NAME_NEVER, 1) != 0u;
+
+  BaseDevice device("ws", "Weather", false);
+  failures += device.setNamePolicy(BTHOME_NAME_EVERY_NTH, 0);
+
+  // a due name that does not fit is sent in the next packet with room, then the count restarts
+  device.setNamePolicy(BTHOME_NAME_EVERY_NTH, 3);
+  uint32_t pattern = 0;
+  for (uint32_t i = 0; i < 12; i++)
+  {
+    uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+    addClimate(device, i);
+    if (i == 3 || i == 4)
+    {
+      // 23 measurement bytes, not even the short name fits
+      for (int j = 0; j < 5; j++)
+      {
+        device.add<BtHomeSensors::humidity_uint16>(50);
+      }
+    }
+    size_t size = device.getAdvertisementData(advertisement);
+    if (size > withoutNames(advertisement))
+    {
+      pattern |= 1u << i;
+    }
+  }
+  // 0, 3 and 4 full so 5, then 8, 11
+  failures += pattern != ((1u << 0) | (1u << 5) | (1u << 8) | (1u << 11));
+
+  printf("name policies (always, every Nth, first N, never, deferred when full): %s\n", failures ? "FAIL" : "OK");
+  return failures;
+}
+
+static bool hasNameAD(const uint8_t *data, size_t size, uint8_t type, const char *name)
+{
+  for (size_t i = 0; i + 1 < size; i += data[i] + 1)
+  {
+    if (data[i + 1] == type && data[i] == strlen(name) + 1 && memcmp(&data[i + 2], name, strlen(name)) == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// all 23 measurement bytes of a plain 31 byte packet
+static void fillPacket(BaseDevice &device)
+{
+  device.resetMeasurement();
+  device.add<BtHomeSensors::temperature_int16_scale_0_01>(21.5f);
+  for (int i = 0; i < 5; i++)
+  {
+    device.add<BtHomeSensors::power_uint24>(100 + i);
+  }
+}
+
+static int checkScanResponse()
+{
+  int failures = 0;
+  uint8_t primary[MAX_ADVERTISEMENT_SIZE];
+  uint8_t scanResponse[MAX_ADVERTISEMENT_SIZE];
+  uint8_t reference[MAX_ADVERTISEMENT_SIZE];
+
+  // small packet: the reference carries both names, the scan response mode only measurements
+  BaseDevice standard("ws", "Weather", false);
+  BaseDevice scannable("ws", "Weather", false);
+  scannable.enableScanResponse();
+  addClimate(standard, 0);
+  addClimate(scannable, 0);
+  size_t referenceSize = standard.getAdvertisementData(reference);
+  size_t primarySize = scannable.getAdvertisementData(primary);
+  size_t scanResponseSize = scannable.getScanResponseData(scanResponse);
+  if (primarySize != withoutNames(reference) || memcmp(primary, reference, primarySize) != 0 ||
+      referenceSize - primarySize != scanResponseSize || memcmp(&reference[primarySize], scanResponse, scanResponseSize) != 0 ||
+      !hasNameAD(scanResponse, scanResponseSize, COMPLETE_NAME, "Weather") || !hasNameAD(scanResponse, scanResponseSize, SHORT_NAME, "ws"))
+  {
+    failures++;
+  }
+
+  // full packet: the names no longer fit the primary packet, the scan response still has them
+  fillPacket(standard);
+  fillPacket(scannable);
+  referenceSize = standard.getAdvertisementData(reference);
+  primarySize = scannable.getAdvertisementData(primary);
+  if (referenceSize != withoutNames(reference) || primarySize != referenceSize || memcmp(primary, reference, primarySize) != 0 ||
+      scannable.getScanResponseData(scanResponse) != scanResponseSize)
+  {
+    failures++;
+  }
+
+  // 22 + 12 bytes of name ADs: the complete name takes the scan response, the short one does not fit any more
+  BaseDevice longNames("sensor0123", "Weather station 0123", false);
+  scanResponseSize = longNames.getScanResponseData(scanResponse);
+  if (scanResponseSize != 22 || !hasNameAD(scanResponse, scanResponseSize, COMPLETE_NAME, "Weather station 0123"))
+  {
+    failures++;
+  }
+
+  printf("scan response (names moved out, measurements unchanged, full packets, long names): %s\n", failures ? "FAIL" : "OK");
+  return failures;
+}
+
+/// @brief Bytes per advertising event an active scanner receives, with the names in the packet or in the scan response.
+static void reportScanResponse()
+{
+  struct Case
+  {
+    const char *name;
+    bool encrypted;
+    bool full;
+  };
+  const Case cases[] = {
+      {"climate, plain", false, false},
+      {"climate, encrypted", true, false},
+      {"full packet, plain", false, true},
+      {"full packet, encrypted", true, true},
+  };
+
+  printf("\nnames \"Weather sensor\" / \"weather\", per advertising event to an active scanner\n");
+  printf("%-24s %-16s %10s %10s %12s %14s\n", "packet", "names", "primary", "scan rsp", "measurement", "names sent");
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+  {
+    for (int mode = 0; mode < 2; mode++)
+    {
+      BaseDevice *device = cases[c].encrypted ? new BaseDevice("weather", "Weather sensor", false, BENCH_KEY, BENCH_MAC, 1)
+                                              : new BaseDevice("weather", "Weather sensor", false);
+      if (mode)
+      {
+        device->enableScanResponse();
+      }
+      if (cases[c].full)
+      {
+        fillPacket(*device);
+        device->add<BtHomeSensors::battery_percentage>(95);
+      }
+      else
+      {
+        addClimate(*device, 0);
+      }
+
+      uint8_t primary[MAX_ADVERTISEMENT_SIZE];
+      uint8_t scanResponse[MAX_ADVERTISEMENT_SIZE];
+      size_t primarySize = device->getAdvertisementData(primary);
+      size_t scanResponseSize = mode ? device->getScanResponseData(scanResponse) : 0;
+      const uint8_t *names = mode ? scanResponse : &primary[withoutNames(primary)];
+      size_t namesSize = mode ? scanResponseSize : primarySize - withoutNames(primary);
+      bool complete = hasNameAD(names, namesSize, COMPLETE_NAME, "Weather sensor");
+      bool shortName = hasNameAD(names, namesSize, SHORT_NAME, "weather");
+      // service data length minus AD type, UUID, device information byte and when encrypted counter and MIC
+      size_t measurementBytes = primary[SERVICE_DATA_AD] - 4 - (cases[c].encrypted ? COUNTER_LEN + MIC_LEN : 0);
+      printf("%-24s %-16s %10zu %10zu %12zu %14s\n", cases[c].name, mode ? "scan response" : "in the packet", primarySize,
+             scanResponseSize, measurementBytes, complete && shortName ? "both" : complete ? "complete" : shortName ? "short" : "none");
+      delete device;
+    }
+  }
+}
+
+struct PacketType
+{
+  const char *name;
+  bool encrypted;
+  int measurements;
+};
+
+struct PolicyCase
+{
+  const char *name;
+  BtHomeNamePolicy policy;
+  uint16_t count;
+};
+
+// legacy advertising on the 1M PHY: preamble, access address, PDU header, advertiser address and CRC around the
+// advertising data, 8 us per byte, sent on the 3 advertising channels in every advertising event
+static const double US_PER_BYTE = 8.0;
+static const size_t AIR_OVERHEAD_BYTES = 1 + 4 + 2 + BLE_MAC_ADDRESS_LENGTH + 3;
+static const int ADVERTISING_CHANNELS = 3;
+
+static void reportAirtime()
+{
+  static const uint32_t PACKETS = 8640; // every 10 s for a day
+  const PacketType types[] = {
+      {"climate, plain", false, 3},
+      {"climate, encrypted", true, 3},
+      {"button, plain", false, 1},
+  };
+  const PolicyCase policies[] = {
+      {"always", BTHOME_NAME_ALWAYS, 1},
+      {"every 10th", BTHOME_NAME_EVERY_NTH, 10},
+      {"every 60th", BTHOME_NAME_EVERY_NTH, 60},
+      {"first 30", BTHOME_NAME_FIRST_N, 30},
+      {"never", BTHOME_NAME_NEVER, 1},
+  };
+
+  for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++)
+  {
+    printf("\n%s, %u packets (every 10 s for a day), names \"ws\" / \"Weather\"\n", types[t].name, PACKETS);
+    printf("%-14s %12s %16s %14s\n", "names", "bytes/pkt", "airtime us/evt", "saved %");
+    double alwaysAirtime = 0;
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+    {
+      BaseDevice *device = types[t].encrypted ? new BaseDevice("ws", "Weather", false, BENCH_KEY, BENCH_MAC, 1)
+                                              : new BaseDevice("ws", "Weather", false);
+      device->setNamePolicy(policies[p].policy, policies[p].count);
+      uint64_t bytes = 0;
+      for (uint32_t i = 0; i < PACKETS; i++)
+      {
+        uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+        if (types[t].measurements == 1)
+        {
+          device->resetMeasurement();
+          device->addState(button, Button_Event_Status_Press);
+        }
+        else
+        {
+          addClimate(*device, i);
+        }
+        bytes += device->getAdvertisementData(advertisement);
+      }
+      delete device;
+
+      double bytesPerPacket = static_cast<double>(bytes) / PACKETS;
+      double airtime = (bytesPerPacket + AIR_OVERHEAD_BYTES) * US_PER_BYTE * ADVERTISING_CHANNELS;
+      if (p == 0)
+      {
+        alwaysAirtime = airtime;
+      }
+      printf("%-14s %12.1f %16.0f %14.1f\n", policies[p].name, bytesPerPacket, airtime, 100.0 * (1.0 - airtime / alwaysAirtime));
+    }
+  }
+}
+
+struct PacketContext
+{
+  BaseDevice *device;
+  uint32_t iteration;
+  uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+};
+
+static void climatePacket(void *context)
+{
+  PacketContext *ctx = static_cast<PacketContext *>(context);
+  addClimate(*ctx->device, ctx->iteration++);
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 500000);
+
+  int failures = checkPolicies();
+  failures += checkScanResponse();
+  reportAirtime();
+  reportScanResponse();
+
+  BaseDevice always("ws", "Weather", false);
+  BaseDevice everyTenth("ws", "Weather", false);
+  everyTenth.setNamePolicy(BTHOME_NAME_EVERY_NTH, 10);
+  PacketContext context = {&always, 0, {}};
+
+  printBenchHeader("climate packet");
+  printBenchResult("names always", runBenchmark(climatePacket, &context, iterations), 0);
+  context.device = &everyTenth;
+  printBenchResult("names every 10th", runBenchmark(climatePacket, &context, iterations), 0);
+  return failures;
+}
@@ -0,0 +1,188 @@
+// Decoder benchmarks: one op is walking every measurement of a packet built by BtHomeV2Device.
+// First checks the uint32 types: wire bytes as the library always encoded them, decoded without sign extension.
+
+#include "bench.h"
+
+#include <BtHomeV2Device.h>
+#include <BtHomeV2Parser.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef void (*SensorMix)(BtHomeV2Device &device);
+
+static void climateMix(BtHomeV2Device &device)
+{
+  device.addTemperature_neg327_to_327_Resolution_0_01(-4.25f);
+  device.addHumidityPercent_Resolution_0_01(48.2f);
+  device.addBatteryPercentage(87);
+}
+
+static void powerMeterMix(BtHomeV2Device &device)
+{
+  device.addVoltage_0_to_65_resolution_0_001(3.291f);
+  device.addCurrentAmps_0_65_Resolution_0_001(0.125f);
+  device.addPower_0_to_167772_resolution_0_01(412.5f);
+  device.addEnergyKwh_0_to_16777(1234.567f);
+}
+
+static void mixedMix(BtHomeV2Device &device)
+{
+  device.setDoorState(Door_Sensor_Status_Open);
+  device.addText("ok");
+  device.setDimmerEvent(Dimmer_Event_Status_RotateLeft, 3);
+  device.addCount_neg32768_32767(-300);
+}
+
+static void fullPacketMix(BtHomeV2Device &device)
+{
+  while (device.addCount_0_255(42))
+  {
+  }
+}
+
+typedef bool (*AddUnsigned32)(BtHomeV2Device &device, uint32_t value);
+
+static bool addCount(BtHomeV2Device &device, uint32_t value) { return device.addCount_0_4294967295(value); }
+static bool addEnergy(BtHomeV2Device &device, uint32_t value) { return device.addEnergyKwh_0_to_4294967(value / 1000.0f); }
+static bool addGas(BtHomeV2Device &device, uint32_t value) { return device.addGasM3_0_to_4294967(value / 1000.0f); }
+static bool addVolume(BtHomeV2Device &device, uint32_t value)
+{
+  return device.addVolumeLitres_0_to_4294967_resolution_0_001(value / 1000.0f);
+}
+static bool addVolumeStorage(BtHomeV2Device &device, uint32_t value) { return device.addVolumeStorageLitres(value / 1000.0f); }
+static bool addWater(BtHomeV2Device &device, uint32_t value) { return device.addWaterLitres(value / 1000.0f); }
+
+/// @brief A uint32 object and the bytes the encoder wrote for it before these types were flagged unsigned.
+struct Unsigned32Case
+{
+  const char *name;
+  AddUnsigned32 add;
+  uint32_t value; // thousandths of the unit for the float wrappers
+  uint8_t expected[5];
+};
+
+static const Unsigned32Case UNSIGNED32_CASES[] = {
+    {"count", addCount, 1, {0x3E, 0x01, 0x00, 0x00, 0x00}},
+    {"count", addCount, 2147483648u, {0x3E, 0x00, 0x00, 0x00, 0x80}},
+    {"count", addCount, 4294967295u, {0x3E, 0xFF, 0xFF, 0xFF, 0xFF}},
+    {"energy", addEnergy, 1234567, {0x4D, 0x87, 0xD6, 0x12, 0x00}},
+    {"energy", addEnergy, 3000000000u, {0x4D, 0x00, 0x5D, 0xD0, 0xB2}},
+    {"gas", addGas, 1234567, {0x4C, 0x87, 0xD6, 0x12, 0x00}},
+    {"gas", addGas, 3000000000u, {0x4C, 0x00, 0x5D, 0xD0, 0xB2}},
+    {"volume", addVolume, 1234567, {0x4E, 0x87, 0xD6, 0x12, 0x00}},
+    {"volume", addVolume, 3000000000u, {0x4E, 0x00, 0x5D, 0xD0, 0xB2}},
+    {"volume storage", addVolumeStorage, 1234567, {0x55, 0x87, 0xD6, 0x12, 0x00}},
+    {"volume storage", addVolumeStorage, 3000000000u, {0x55, 0x00, 0x5D, 0xD0, 0xB2}},
+    {"water", addWater, 1234567, {0x4F, 0x87, 0xD6, 0x12, 0x00}},
+    {"water", addWater, 3000000000u, {0x4F, 0x00, 0x5D, 0xD0, 0xB2}},
+};
+
+static int checkUnsigned32Types()
+{
+  int failures = 0;
+  BtHomeV2Device device("short_name", "My longer device name", false);
+  for (size_t i = 0; i < sizeof(UNSIGNED32_CASES) / sizeof(UNSIGNED32_CASES[0]); i++)
+  {
+    const Unsigned32Case &check = UNSIGNED32_CASES[i];
+    uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+    device.clearMeasurementData();
+    check.add(device, check.value);
+    size_t length = device.getAdvertisementData(advertisement);
+
+    BtHomeV2Parser parser = BtHomeV2Parser::fromAdvertisement(advertisement, length);
+    BtHomeMeasurement measurement;
+    uint32_t expectedRaw = check.expected[1] | (check.expected[2] << 8) | (check.expected[3] << 16) |
+                           (static_cast<uint32_t>(check.expected[4]) << 24);
+    if (!parser.next(measurement) || memcmp(measurement.data - 1, check.expected, sizeof(check.expected)) != 0 ||
+        measurement.rawValue != static_cast<int64_t>(expectedRaw))
+    {
+      printf("FAIL %s %u\n", check.name, check.value);
+      failures++;
+    }
+  }
+  printf("uint32 types, wire bytes and decoded values: %s\n\n", failures ? "FAIL" : "OK");
+  return failures;
+}
+
+struct ParserCase
+{
+  const char *name;
+  SensorMix mix;
+};
+
+static const ParserCase PARSER_CASES[] = {
+    {"climate", climateMix},
+    {"power-meter", powerMeterMix},
+    {"mixed", mixedMix},
+    {"full-packet", fullPacketMix},
+};
+
+struct ParserContext
+{
+  uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+  size_t advertisementLength;
+  const uint8_t *serviceData;
+  size_t serviceDataLength;
+  size_t measurements;
+  double checksum;
+};
+
+static void parseServiceData(void *context)
+{
+  ParserContext *ctx = static_cast<ParserContext *>(context);
+  BtHomeV2Parser parser(ctx->serviceData, ctx->serviceDataLength);
+  BtHomeMeasurement measurement;
+  size_t count = 0;
+  while (parser.next(measurement))
+  {
+    ctx->checksum += static_cast<double>(measurement.rawValue);
+    count++;
+  }
+  ctx->measurements = count;
+}
+
+static void parseAdvertisement(void *context)
+{
+  ParserContext *ctx = static_cast<ParserContext *>(context);
+  BtHomeV2Parser parser = BtHomeV2Parser::fromAdvertisement(ctx->advertisement, ctx->advertisementLength);
+  BtHomeMeasurement measurement;
+  size_t count = 0;
+  while (parser.next(measurement))
+  {
+    ctx->checksum += measurement.value();
+    count++;
+  }
+  ctx->measurements = count;
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 1000000);
+  int failures = checkUnsigned32Types();
+
+  printBenchHeader("parser (per packet)");
+  for (size_t i = 0; i < sizeof(PARSER_CASES) / sizeof(PARSER_CASES[0]); i++)
+  {
+    BtHomeV2Device device("short_name", "My longer device name", false);
+    PARSER_CASES[i].mix(device);
+
+    ParserContext context;
+    context.advertisementLength = device.getAdvertisementData(context.advertisement);
+    context.checksum = 0;
+    if (!BtHomeV2Parser::findServiceData(context.advertisement, context.advertisementLength, &context.serviceData, &context.serviceDataLength))
+    {
+      printf("%s: no BTHome service data found\n", PARSER_CASES[i].name);
+      return 1;
+    }
+
+    char name[64];
+    BenchResult result = runBenchmark(parseServiceData, &context, iterations);
+    snprintf(name, sizeof(name), "service-data/%s (%zu objects)", PARSER_CASES[i].name, context.measurements);
+    printBenchResult(name, result, context.serviceDataLength);
+
+    result = runBenchmark(parseAdvertisement, &context, iterations);
+    snprintf(name, sizeof(name), "advertisement+value/%s", PARSER_CASES[i].name);
+    printBenchResult(name, result, context.advertisementLength);
+  }
+  return failures;
+}
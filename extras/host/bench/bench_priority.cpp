@@ -0,0 +1,316 @@
+// Priority packing: a simulation of a device offering more measurements than fit in its packet, comparing
+// how often and how regularly each sensor is advertised when the first added values win, when only the
+// priority counts, and with BtHomeV2PriorityPacker (priority * age). Plus a packet check and the cost per wake.
+
+#include "bench.h"
+
+#include <BaseDevice.h>
+#include <BtHomeV2Parser.h>
+#include <BtHomeV2PriorityPacker.h>
+#include <stdio.h>
+
+static const uint8_t BENCH_KEY[BIND_KEY_LEN] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1,
+                                                0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+static const uint8_t BENCH_MAC[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, 0x8F, 0x80, 0xA5};
+
+struct SensorSpec
+{
+  const char *name;
+  BtHomeType type;
+  uint8_t priority;
+};
+
+// a weather station with power monitoring: 41 measurement bytes, registered in this order
+static const SensorSpec SENSORS[] = {
+    {"battery", battery_percentage, 1},
+    {"voltage", voltage_0_001, 1},
+    {"temperature", temperature_int16_scale_0_01, 8},
+    {"humidity", humidity_uint16, 8},
+    {"pressure", pressure, 4},
+    {"illuminance", illuminance, 4},
+    {"co2", co2, 6},
+    {"power", power_uint24, 6},
+    {"energy", energy_uint24, 2},
+    {"count", count_uint32, 2},
+    {"moisture", moisture_uint16, 3},
+    {"pm2.5", pm2_5, 3},
+};
+static const size_t SENSOR_COUNT = sizeof(SENSORS) / sizeof(SENSORS[0]);
+
+static BtHomeState stateOf(const BtHomeType &type)
+{
+  return BtHomeState{type.id, type.byteCount};
+}
+
+static uint32_t g_random = 0x12345678;
+
+static uint32_t nextRandom()
+{
+  g_random ^= g_random << 13;
+  g_random ^= g_random >> 17;
+  g_random ^= g_random << 5;
+  return g_random;
+}
+
+enum Policy
+{
+  POLICY_FIRST_ADDED,
+  POLICY_PRIORITY_ONLY,
+  POLICY_PRIORITY_AGE,
+  POLICY_COUNT
+};
+
+static const char *const POLICY_NAMES[POLICY_COUNT] = {"first added wins", "priority only", "priority * age"};
+
+struct SensorStats
+{
+  size_t sent;
+  size_t maxGap;
+  long lastSent;
+};
+
+static uint32_t valueMask(uint8_t byteCount)
+{
+  return byteCount >= 4 ? 0xFFFFFFFFu : (1u << (8 * byteCount)) - 1;
+}
+
+/// @brief The measurements in a plain packet are exactly the sensors sent, with their latest values.
+static bool packetMatches(const uint8_t *advertisement, size_t size, const bool sent[SENSOR_COUNT],
+                          const uint32_t values[SENSOR_COUNT])
+{
+  BtHomeV2Parser parser = BtHomeV2Parser::fromAdvertisement(advertisement, size);
+  size_t found = 0;
+  BtHomeMeasurement measurement;
+  while (parser.next(measurement))
+  {
+    size_t i = 0;
+    while (i < SENSOR_COUNT && SENSORS[i].type.id != measurement.info.id)
+    {
+      i++;
+    }
+    if (i == SENSOR_COUNT || !sent[i] ||
+        (static_cast<uint32_t>(measurement.rawValue) & valueMask(SENSORS[i].type.byteCount)) != values[i])
+    {
+      return false;
+    }
+    found++;
+  }
+
+  size_t expected = 0;
+  for (size_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    expected += sent[i];
+  }
+  return parser.status() == BTHOME_PARSE_OK && found == expected;
+}
+
+/// @return Number of packets with a mismatch, only checked for plain packets.
+static int simulate(Policy policy, bool encrypted, size_t packets, SensorStats stats[SENSOR_COUNT])
+{
+  BaseDevice *device = encrypted ? new BaseDevice("ws", "Weather", false, BENCH_KEY, BENCH_MAC, 1)
+                                 : new BaseDevice("ws", "Weather", false);
+  BtHomeV2PriorityPacker packer(SENSOR_COUNT);
+  for (size_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    packer.addSensor(stateOf(SENSORS[i].type), SENSORS[i].priority);
+    stats[i].sent = 0;
+    stats[i].maxGap = 0;
+    stats[i].lastSent = -1;
+  }
+
+  // priority only: a fixed order, highest first
+  size_t byPriority[SENSOR_COUNT];
+  for (size_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    size_t position = i;
+    while (position > 0 && SENSORS[byPriority[position - 1]].priority < SENSORS[i].priority)
+    {
+      byPriority[position] = byPriority[position - 1];
+      position--;
+    }
+    byPriority[position] = i;
+  }
+
+  int mismatches = 0;
+  uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+  for (size_t packet = 0; packet < packets; packet++)
+  {
+    // every sensor has a new reading on every wake
+    uint32_t values[SENSOR_COUNT];
+    bool sent[SENSOR_COUNT];
+    for (size_t i = 0; i < SENSOR_COUNT; i++)
+    {
+      values[i] = nextRandom() & valueMask(SENSORS[i].type.byteCount);
+      packer.setEncoded(i, values[i]);
+    }
+
+    device->resetMeasurement();
+    for (size_t i = 0; i < SENSOR_COUNT; i++)
+    {
+      if (policy == POLICY_FIRST_ADDED)
+      {
+        sent[i] = device->addEncoded(stateOf(SENSORS[i].type), values[i]);
+      }
+      else if (policy == POLICY_PRIORITY_ONLY)
+      {
+        size_t sensor = byPriority[i];
+        sent[sensor] = device->addEncoded(stateOf(SENSORS[sensor].type), values[sensor]);
+      }
+    }
+    if (policy == POLICY_PRIORITY_AGE)
+    {
+      packer.fill(*device);
+      for (size_t i = 0; i < SENSOR_COUNT; i++)
+      {
+        sent[i] = packer.getAge(i) == 0;
+      }
+    }
+
+    size_t size = device->getAdvertisementData(advertisement);
+    if (!encrypted && !packetMatches(advertisement, size, sent, values))
+    {
+      mismatches++;
+    }
+
+    for (size_t i = 0; i < SENSOR_COUNT; i++)
+    {
+      if (!sent[i])
+      {
+        continue;
+      }
+      size_t gap = static_cast<size_t>(static_cast<long>(packet) - stats[i].lastSent);
+      if (gap > stats[i].maxGap)
+      {
+        stats[i].maxGap = gap;
+      }
+      stats[i].lastSent = static_cast<long>(packet);
+      stats[i].sent++;
+    }
+  }
+
+  // a sensor still waiting at the end counts its open gap too
+  for (size_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    size_t gap = static_cast<size_t>(static_cast<long>(packets) - stats[i].lastSent);
+    if (gap > stats[i].maxGap)
+    {
+      stats[i].maxGap = gap;
+    }
+  }
+  delete device;
+  return mismatches;
+}
+
+static int reportSimulation(bool encrypted)
+{
+  static const size_t PACKETS = 10000;
+  SensorStats stats[POLICY_COUNT][SENSOR_COUNT];
+  int failures = 0;
+  for (int policy = 0; policy < POLICY_COUNT; policy++)
+  {
+    failures += simulate(static_cast<Policy>(policy), encrypted, PACKETS, stats[policy]);
+  }
+
+  printf("\n%s 31 byte packet, %d measurement bytes per packet, 41 offered (%zu packets)\n",
+         encrypted ? "encrypted" : "plain", encrypted ? 11 : 23, PACKETS);
+  printf("%-12s %4s %5s", "sensor", "prio", "bytes");
+  for (int policy = 0; policy < POLICY_COUNT; policy++)
+  {
+    printf(" | %-22s", POLICY_NAMES[policy]);
+  }
+  printf("\n%-12s %4s %5s", "", "", "");
+  for (int policy = 0; policy < POLICY_COUNT; policy++)
+  {
+    printf(" | %10s %11s", "sent %", "max gap");
+  }
+  printf("\n");
+
+  for (size_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    printf("%-12s %4u %5u", SENSORS[i].name, SENSORS[i].priority, SENSORS[i].type.byteCount + 1u);
+    for (int policy = 0; policy < POLICY_COUNT; policy++)
+    {
+      const SensorStats &s = stats[policy][i];
+      if (s.sent)
+      {
+        printf(" | %10.1f %11zu", 100.0 * s.sent / PACKETS, s.maxGap);
+      }
+      else
+      {
+        printf(" | %10.1f %11s", 0.0, "never");
+      }
+    }
+    printf("\n");
+
+    // every sensor gets through: within twice (highest / own priority) x (bytes offered / bytes per packet)
+    const SensorStats &aged = stats[POLICY_PRIORITY_AGE][i];
+    if (!aged.sent || aged.maxGap > 2u * 8u * 41u / (SENSORS[i].priority * (encrypted ? 11u : 23u)) + 1u)
+    {
+      failures++;
+    }
+  }
+  printf("packets hold the chosen sensors, every sensor within its bound: %s\n", failures ? "FAIL" : "OK");
+  return failures;
+}
+
+struct WakeContext
+{
+  BaseDevice *device;
+  BtHomeV2PriorityPacker *packer;
+  uint32_t iteration;
+  uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+};
+
+static void wakeFirstAdded(void *context)
+{
+  WakeContext *ctx = static_cast<WakeContext *>(context);
+  uint32_t value = ctx->iteration++;
+  ctx->device->resetMeasurement();
+  for (size_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    ctx->device->addEncoded(stateOf(SENSORS[i].type), value + i);
+  }
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+static void wakePacker(void *context)
+{
+  WakeContext *ctx = static_cast<WakeContext *>(context);
+  uint32_t value = ctx->iteration++;
+  for (size_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    ctx->packer->setEncoded(i, value + i);
+  }
+  ctx->device->resetMeasurement();
+  ctx->packer->fill(*ctx->device);
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+static void fillOnly(void *context)
+{
+  WakeContext *ctx = static_cast<WakeContext *>(context);
+  ctx->device->resetMeasurement();
+  ctx->packer->fill(*ctx->device);
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 500000);
+
+  int failures = reportSimulation(false);
+  failures += reportSimulation(true);
+
+  BaseDevice device("ws", "Weather", false);
+  BtHomeV2PriorityPacker packer(SENSOR_COUNT);
+  for (size_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    packer.setEncoded(packer.addSensor(stateOf(SENSORS[i].type), SENSORS[i].priority), i);
+  }
+  WakeContext context = {&device, &packer, 0, {}};
+
+  printBenchHeader("12 sensors, 41 bytes offered (per wake)");
+  printBenchResult("first added wins + packet", runBenchmark(wakeFirstAdded, &context, iterations), 0);
+  printBenchResult("packer set + fill + packet", runBenchmark(wakePacker, &context, iterations), 0);
+  printBenchResult("packer fill only", runBenchmark(fillOnly, &context, iterations), 0);
+  return failures;
+}
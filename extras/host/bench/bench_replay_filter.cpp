@@ -0,0 +1,462 @@
+// Replay filter: window checks, a comparison with a reference model on a stream with copies, reordering,
+// replays and forged counters, then the cost per lookup with 100k tracked devices against std::unordered_map
+// and a gateway pipeline where every packet arrives through three proxies.
+
+#include "bench.h"
+
+#include <BtHomeV2KeyStore.h>
+#include <BtHomeV2Parser.h>
+#include <BtHomeV2ReplayFilter.h>
+#include <chrono>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+static const uint8_t BENCH_MAC[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, 0x8F, 0x80, 0xA5};
+static const size_t DEVICES = 100000;
+static const uint32_t WINDOW = BtHomeV2ReplayFilter::REPLAY_WINDOW_SIZE;
+
+static uint32_t g_random = 0x12345678;
+
+static uint32_t nextRandom()
+{
+  g_random ^= g_random << 13;
+  g_random ^= g_random >> 17;
+  g_random ^= g_random << 5;
+  return g_random;
+}
+
+static void deviceMac(size_t device, uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH])
+{
+  memcpy(macAddress, BENCH_MAC, 3);
+  macAddress[3] = static_cast<uint8_t>(device >> 16);
+  macAddress[4] = static_cast<uint8_t>(device >> 8);
+  macAddress[5] = static_cast<uint8_t>(device);
+}
+
+static int expect(const char *what, BtHomeReplayStatus actual, BtHomeReplayStatus expected)
+{
+  if (actual == expected)
+  {
+    return 0;
+  }
+  printf("FAIL %s: status %d, expected %d\n", what, actual, expected);
+  return 1;
+}
+
+static int checkWindow()
+{
+  int failures = 0;
+  BtHomeV2ReplayFilter filter(2);
+  const uint8_t *mac = BENCH_MAC;
+
+  failures += expect("unknown device", filter.check(mac, 100), BTHOME_REPLAY_NEW);
+  failures += expect("first packet", filter.accept(mac, 100), BTHOME_REPLAY_NEW);
+  failures += expect("same packet", filter.check(mac, 100), BTHOME_REPLAY_DUPLICATE);
+  failures += expect("next packet", filter.accept(mac, 101), BTHOME_REPLAY_NEW);
+  failures += expect("lost packets", filter.accept(mac, 105), BTHOME_REPLAY_NEW);
+  failures += expect("late packet", filter.accept(mac, 103), BTHOME_REPLAY_NEW);
+  failures += expect("late copy", filter.accept(mac, 103), BTHOME_REPLAY_DUPLICATE);
+  failures += expect("older copy", filter.check(mac, 100), BTHOME_REPLAY_DUPLICATE);
+  failures += expect("never seen, in window", filter.check(mac, 102), BTHOME_REPLAY_NEW);
+  failures += expect("edge of the window", filter.check(mac, 105 - WINDOW + 1), BTHOME_REPLAY_NEW);
+  failures += expect("below the window", filter.check(mac, 105 - WINDOW), BTHOME_REPLAY_TOO_OLD);
+
+  // check changes nothing, so a forged counter can not move the window
+  failures += expect("forged counter", filter.check(mac, 0xFFFFFFF0), BTHOME_REPLAY_NEW);
+  failures += expect("after forged counter", filter.check(mac, 104), BTHOME_REPLAY_NEW);
+
+  // a jump beyond the window forgets everything below it
+  failures += expect("jump", filter.accept(mac, 105 + WINDOW + 10), BTHOME_REPLAY_NEW);
+  failures += expect("before the jump", filter.check(mac, 105), BTHOME_REPLAY_TOO_OLD);
+  failures += expect("just below the jump", filter.accept(mac, 105 + WINDOW + 9), BTHOME_REPLAY_NEW);
+
+  // a device that restarted its counter is too old until removed
+  failures += expect("restarted device", filter.check(mac, 1), BTHOME_REPLAY_TOO_OLD);
+  failures += filter.remove(mac) ? 0 : 1;
+  failures += expect("after remove", filter.accept(mac, 1), BTHOME_REPLAY_NEW);
+
+  uint8_t other[BLE_MAC_ADDRESS_LENGTH];
+  uint8_t third[BLE_MAC_ADDRESS_LENGTH];
+  deviceMac(1, other);
+  deviceMac(2, third);
+  failures += expect("second device", filter.accept(other, 7), BTHOME_REPLAY_NEW);
+  failures += expect("full", filter.accept(third, 7), BTHOME_REPLAY_TABLE_FULL);
+  failures += expect("full, check", filter.check(third, 7), BTHOME_REPLAY_NEW);
+  failures += filter.size() == 2 ? 0 : 1;
+
+  printf("window checks: %s\n", failures ? "FAIL" : "OK");
+  return failures;
+}
+
+/// @brief What the filter should answer, from every counter ever accepted per device.
+struct ReferenceDevice
+{
+  uint32_t highest;
+  std::set<uint32_t> seen;
+};
+
+struct SentPacket
+{
+  uint32_t device;
+  uint32_t counter;
+};
+
+/// @brief A stream from few devices so their packets interleave: copies, late packets, old replays and forgeries.
+static int checkAgainstModel()
+{
+  static const size_t MODEL_DEVICES = 500;
+  static const size_t PACKETS = 500000;
+  BtHomeV2ReplayFilter filter(MODEL_DEVICES);
+  std::vector<ReferenceDevice> reference(MODEL_DEVICES);
+  std::vector<bool> known(MODEL_DEVICES, false);
+  std::vector<uint32_t> counters(MODEL_DEVICES, 0);
+  std::vector<SentPacket> sent;
+  size_t statuses[4] = {};
+  int failures = 0;
+
+  for (size_t p = 0; p < PACKETS; p++)
+  {
+    SentPacket packet;
+    bool forged = false;
+    uint32_t kind = nextRandom() % 100;
+    if (kind < 55 || sent.empty())
+    {
+      // a new packet, sometimes after lost ones
+      packet.device = nextRandom() % MODEL_DEVICES;
+      counters[packet.device] += 1 + (nextRandom() % 8 == 0 ? nextRandom() % 40 : 0);
+      packet.counter = counters[packet.device];
+      sent.push_back(packet);
+    }
+    else if (kind < 90)
+    {
+      // a copy or a late packet from the last few thousand
+      size_t back = 1 + nextRandom() % (sent.size() < 3000 ? sent.size() : 3000);
+      packet = sent[sent.size() - back];
+    }
+    else if (kind < 97)
+    {
+      // a replay of anything ever sent
+      packet = sent[nextRandom() % sent.size()];
+    }
+    else
+    {
+      // forged: a counter that fails the MIC, so it is checked but never accepted
+      packet.device = nextRandom() % MODEL_DEVICES;
+      packet.counter = nextRandom();
+      forged = true;
+    }
+
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    deviceMac(packet.device, macAddress);
+    ReferenceDevice &model = reference[packet.device];
+    BtHomeReplayStatus expected = BTHOME_REPLAY_NEW;
+    if (known[packet.device])
+    {
+      if (packet.counter <= model.highest && model.highest - packet.counter >= WINDOW)
+      {
+        expected = BTHOME_REPLAY_TOO_OLD;
+      }
+      else if (model.seen.count(packet.counter))
+      {
+        expected = BTHOME_REPLAY_DUPLICATE;
+      }
+    }
+
+    BtHomeReplayStatus status = filter.check(macAddress, packet.counter);
+    failures += status != expected;
+    statuses[status]++;
+    if (status == BTHOME_REPLAY_NEW && !forged)
+    {
+      failures += filter.accept(macAddress, packet.counter) != BTHOME_REPLAY_NEW;
+      model.highest = known[packet.device] && model.highest > packet.counter ? model.highest : packet.counter;
+      model.seen.insert(packet.counter);
+      known[packet.device] = true;
+    }
+  }
+
+  printf("reference model, %zu packets from %zu devices (%zu new, %zu duplicate, %zu too old): %s\n", PACKETS,
+         MODEL_DEVICES, statuses[BTHOME_REPLAY_NEW], statuses[BTHOME_REPLAY_DUPLICATE], statuses[BTHOME_REPLAY_TOO_OLD],
+         failures ? "FAIL" : "OK");
+  return failures;
+}
+
+/// @brief Removing devices keeps every other one findable (backward shift deletion).
+static int checkRemove(BtHomeV2ReplayFilter &filter)
+{
+  int failures = 0;
+  for (size_t d = 0; d < DEVICES; d += 2)
+  {
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    deviceMac(d, macAddress);
+    failures += !filter.remove(macAddress);
+  }
+  for (size_t d = 0; d < DEVICES; d++)
+  {
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    deviceMac(d, macAddress);
+    // counter 1 was accepted for every device: a tracked one is never new
+    bool tracked = filter.check(macAddress, 1) != BTHOME_REPLAY_NEW;
+    failures += tracked != (d % 2 == 1);
+  }
+  failures += filter.size() != DEVICES / 2;
+  printf("remove every other of %zu devices, the rest still found: %s\n", DEVICES, failures ? "FAIL" : "OK");
+  return failures;
+}
+
+/// @brief The same window in a node based hash map, for comparison.
+class UnorderedMapFilter
+{
+public:
+  explicit UnorderedMapFilter(size_t capacity) { _devices.reserve(capacity); }
+
+  BtHomeReplayStatus check(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter) const
+  {
+    std::unordered_map<uint64_t, Window>::const_iterator found = _devices.find(keyOf(macAddress));
+    if (found == _devices.end() || counter > found->second.highest)
+    {
+      return BTHOME_REPLAY_NEW;
+    }
+    uint32_t age = found->second.highest - counter;
+    if (age >= WINDOW)
+    {
+      return BTHOME_REPLAY_TOO_OLD;
+    }
+    return (found->second.bits >> age) & 1 ? BTHOME_REPLAY_DUPLICATE : BTHOME_REPLAY_NEW;
+  }
+
+  void accept(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter)
+  {
+    Window &window = _devices[keyOf(macAddress)];
+    if (counter > window.highest)
+    {
+      uint32_t shift = counter - window.highest;
+      window.bits = shift < WINDOW ? (window.bits << shift) | 1 : 1;
+      window.highest = counter;
+    }
+    else
+    {
+      window.bits |= 1u << (window.highest - counter);
+    }
+  }
+
+private:
+  struct Window
+  {
+    uint32_t highest = 0;
+    uint32_t bits = 0;
+  };
+
+  static uint64_t keyOf(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH])
+  {
+    uint64_t value = 0;
+    for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+    {
+      value = (value << 8) | macAddress[i];
+    }
+    return value;
+  }
+
+  std::unordered_map<uint64_t, Window> _devices;
+};
+
+struct LookupContext
+{
+  BtHomeV2ReplayFilter *filter;
+  UnorderedMapFilter *map;
+  uint32_t counter;
+};
+
+static void randomDevice(uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH])
+{
+  deviceMac(nextRandom() % DEVICES, macAddress);
+}
+
+static void checkFilter(void *context)
+{
+  LookupContext *ctx = static_cast<LookupContext *>(context);
+  uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+  randomDevice(macAddress);
+  uint8_t status = ctx->filter->check(macAddress, ctx->counter);
+  benchConsume(&status, 1);
+}
+
+static void acceptFilter(void *context)
+{
+  LookupContext *ctx = static_cast<LookupContext *>(context);
+  uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+  randomDevice(macAddress);
+  uint8_t status = ctx->filter->accept(macAddress, ctx->counter++);
+  benchConsume(&status, 1);
+}
+
+static void checkMap(void *context)
+{
+  LookupContext *ctx = static_cast<LookupContext *>(context);
+  uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+  randomDevice(macAddress);
+  uint8_t status = ctx->map->check(macAddress, ctx->counter);
+  benchConsume(&status, 1);
+}
+
+static void acceptMap(void *context)
+{
+  LookupContext *ctx = static_cast<LookupContext *>(context);
+  uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+  randomDevice(macAddress);
+  ctx->map->accept(macAddress, ctx->counter++);
+  benchConsume(macAddress, 1);
+}
+
+static void deviceKey(size_t device, uint8_t key[BIND_KEY_LEN])
+{
+  for (size_t i = 0; i < BIND_KEY_LEN; i++)
+  {
+    key[i] = static_cast<uint8_t>((device * 0x9E3779B1u) >> (i % 4 * 8)) ^ static_cast<uint8_t>(i * 29);
+  }
+}
+
+/// @brief Received service data: device information, 11 encrypted measurement bytes, counter, MIC.
+struct ReceivedPacket
+{
+  uint32_t device;
+  uint8_t serviceData[1 + 11 + COUNTER_LEN + MIC_LEN];
+};
+
+/// @brief A gateway behind three proxies: every packet arrives three times, the copies a few packets apart.
+static std::vector<ReceivedPacket> receivedStream(size_t packets)
+{
+  std::vector<uint32_t> counters(DEVICES, 1000);
+  std::vector<ReceivedPacket> stream;
+  stream.reserve(packets * 3);
+  BtHomeV2Ccm ccm;
+  for (size_t p = 0; p < packets; p++)
+  {
+    ReceivedPacket packet;
+    packet.device = nextRandom() % DEVICES;
+    uint8_t key[BIND_KEY_LEN];
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    uint8_t nonce[NONCE_LEN];
+    deviceKey(packet.device, key);
+    deviceMac(packet.device, macAddress);
+    uint32_t counter = counters[packet.device]++;
+    buildBtHomeNonce(nonce, macAddress, counter);
+    ccm.setKey(key);
+
+    uint8_t plaintext[11];
+    for (size_t i = 0; i < sizeof(plaintext); i++)
+    {
+      plaintext[i] = static_cast<uint8_t>(nextRandom());
+    }
+    packet.serviceData[0] = FLAG_VERSION | FLAG_ENCRYPT;
+    uint8_t *counterBytes = &packet.serviceData[1 + sizeof(plaintext)];
+    for (size_t i = 0; i < COUNTER_LEN; i++)
+    {
+      counterBytes[i] = static_cast<uint8_t>(counter >> (8 * i));
+    }
+    ccm.encryptAndTag(nonce, plaintext, sizeof(plaintext), &packet.serviceData[1], &counterBytes[COUNTER_LEN]);
+    for (int copy = 0; copy < 3; copy++)
+    {
+      stream.push_back(packet);
+    }
+  }
+
+  // proxies forward at different times: move every packet a few places
+  for (size_t i = 0; i + 8 < stream.size(); i++)
+  {
+    std::swap(stream[i], stream[i + nextRandom() % 8]);
+  }
+  return stream;
+}
+
+/// @return ns per received packet, and the number of packets decrypted.
+static double runPipeline(const std::vector<ReceivedPacket> &stream, BtHomeV2KeyStore &keys, BtHomeV2ReplayFilter *filter,
+                          size_t *decrypted)
+{
+  *decrypted = 0;
+  uint8_t plaintext[sizeof(ReceivedPacket::serviceData)];
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < stream.size(); i++)
+  {
+    const ReceivedPacket &packet = stream[i];
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    deviceMac(packet.device, macAddress);
+    BtHomeV2Parser parser(packet.serviceData, sizeof(packet.serviceData));
+    uint32_t counter;
+    if (filter && (!parser.encryptionCounter(counter) || filter->check(macAddress, counter) != BTHOME_REPLAY_NEW))
+    {
+      continue;
+    }
+
+    size_t plaintextLength;
+    if (keys.decrypt(macAddress, packet.serviceData, sizeof(packet.serviceData), plaintext, &plaintextLength, &counter) ==
+        BTHOME_DECRYPT_OK)
+    {
+      (*decrypted)++;
+      if (filter)
+      {
+        filter->accept(macAddress, counter);
+      }
+    }
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  benchConsume(plaintext, sizeof(plaintext));
+  return ns / stream.size();
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 2000000);
+
+  int failures = checkWindow();
+  failures += checkAgainstModel();
+
+  BtHomeV2ReplayFilter filter(DEVICES);
+  UnorderedMapFilter map(DEVICES);
+  for (size_t d = 0; d < DEVICES; d++)
+  {
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    deviceMac(d, macAddress);
+    filter.accept(macAddress, 1);
+    map.accept(macAddress, 1);
+  }
+  printf("\n%zu devices: %zu bytes of table, %.1f bytes per device\n", DEVICES, filter.memoryBytes(),
+         static_cast<double>(filter.memoryBytes()) / DEVICES);
+
+  LookupContext context = {&filter, &map, 1};
+  printBenchHeader("replay window, random device of 100k (per packet)");
+  printBenchResult("BtHomeV2ReplayFilter check", runBenchmark(checkFilter, &context, iterations), 0);
+  printBenchResult("std::unordered_map check", runBenchmark(checkMap, &context, iterations), 0);
+  context.counter = 2;
+  printBenchResult("BtHomeV2ReplayFilter accept", runBenchmark(acceptFilter, &context, iterations), 0);
+  context.counter = 2;
+  printBenchResult("std::unordered_map accept", runBenchmark(acceptMap, &context, iterations), 0);
+
+  // the gateway: 100k devices with keys, 3 copies of every packet
+  BtHomeV2KeyStore keys(DEVICES);
+  for (size_t d = 0; d < DEVICES; d++)
+  {
+    uint8_t key[BIND_KEY_LEN];
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    deviceKey(d, key);
+    deviceMac(d, macAddress);
+    keys.addKey(macAddress, key);
+  }
+  std::vector<ReceivedPacket> stream = receivedStream(iterations / 20 + 1000);
+  BtHomeV2ReplayFilter gatewayFilter(DEVICES);
+  size_t decryptedAll;
+  size_t decryptedFiltered;
+  double all = runPipeline(stream, keys, nullptr, &decryptedAll);
+  double filtered = runPipeline(stream, keys, &gatewayFilter, &decryptedFiltered);
+  size_t unique = stream.size() / 3;
+  printf("\ngateway, %zu received packets, each sent once and heard by 3 proxies (ns per received packet)\n", stream.size());
+  printf("%-40s %12.1f   %zu decrypted\n", "decrypt every copy", all, decryptedAll);
+  printf("%-40s %12.1f   %zu decrypted\n", "check counter, decrypt new, accept", filtered, decryptedFiltered);
+  failures += decryptedAll != stream.size() || decryptedFiltered != unique;
+  printf("every packet decrypted exactly once with the filter: %s\n", decryptedFiltered == unique ? "OK" : "FAIL");
+
+  failures += checkRemove(filter);
+  return failures;
+}
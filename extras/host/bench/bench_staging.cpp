@@ -0,0 +1,437 @@
+// Concurrent staging: a stress run with producer threads plus a timer signal standing in for a sensor ISR,
+// checking every accepted measurement arrives exactly once and in order, then the producer latency of
+// BtHomeV2Staging against a mutex around the device.
+
+#include "bench.h"
+
+#include <BtHomeV2Parser.h>
+#include <BtHomeV2Staging.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <thread>
+#include <vector>
+
+typedef BtHomeSensors::count_uint32 StagedSensor;
+
+static const uint32_t PRODUCER_SHIFT = 24;
+static const uint32_t SEQUENCE_MASK = (1u << PRODUCER_SHIFT) - 1;
+static const size_t MAX_PRODUCERS = 8;
+// one more producer than threads: the signal handler
+static const size_t MAX_SOURCES = MAX_PRODUCERS + 1;
+
+struct StressState
+{
+  BtHomeV2Staging *staging;
+  size_t perProducer;
+  // accepted[source][sequence], written by the source only
+  std::vector<uint8_t> accepted[MAX_SOURCES];
+  std::atomic<uint32_t> rejected;
+};
+
+static StressState *g_stress = nullptr;
+// only touched by the handler and the consumer thread, the one thread that takes SIGALRM
+static uint32_t g_isrSequence = 0;
+static uint32_t g_isrSource = 0;
+
+static void isrProducer(int)
+{
+  StressState *state = g_stress;
+  if (!state || g_isrSequence >= state->perProducer)
+  {
+    return;
+  }
+
+  uint32_t sequence = g_isrSequence++;
+  if (state->staging->stage<StagedSensor>((g_isrSource << PRODUCER_SHIFT) | sequence))
+  {
+    state->accepted[g_isrSource][sequence] = 1;
+  }
+  else
+  {
+    state->rejected.fetch_add(1);
+  }
+}
+
+static void taskProducer(StressState *state, uint32_t source)
+{
+  for (uint32_t sequence = 0; sequence < state->perProducer; sequence++)
+  {
+    if (state->staging->stage<StagedSensor>((source << PRODUCER_SHIFT) | sequence))
+    {
+      state->accepted[source][sequence] = 1;
+    }
+    else
+    {
+      state->rejected.fetch_add(1);
+    }
+    if ((sequence & 15) == 15)
+    {
+      std::this_thread::yield();
+    }
+  }
+}
+
+struct Receiver
+{
+  std::vector<uint8_t> received[MAX_SOURCES];
+  int64_t last[MAX_SOURCES];
+  size_t duplicates = 0;
+  size_t outOfOrder = 0;
+  size_t packets = 0;
+
+  void packet(const uint8_t *advertisement, size_t size)
+  {
+    packets++;
+    BtHomeV2Parser parser = BtHomeV2Parser::fromAdvertisement(advertisement, size);
+    BtHomeMeasurement measurement;
+    while (parser.next(measurement))
+    {
+      uint32_t value = static_cast<uint32_t>(measurement.rawValue);
+      uint32_t source = value >> PRODUCER_SHIFT;
+      uint32_t sequence = value & SEQUENCE_MASK;
+      if (received[source][sequence])
+      {
+        duplicates++;
+      }
+      received[source][sequence] = 1;
+      if (static_cast<int64_t>(sequence) <= last[source])
+      {
+        outOfOrder++;
+      }
+      last[source] = sequence;
+    }
+  }
+};
+
+static void drain(BtHomeV2Staging &staging, BaseDevice &device, Receiver &receiver, bool final)
+{
+  // the retired buffer first, then the one that was active, so nothing is left behind at the end
+  for (int pass = 0; pass < (final ? 2 : 1); pass++)
+  {
+    device.resetMeasurement();
+    while (!staging.collect(device))
+    {
+      std::this_thread::yield();
+    }
+
+    uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+    while (size_t size = device.nextAdvertisement(advertisement))
+    {
+      receiver.packet(advertisement, size);
+    }
+  }
+}
+
+static int runStress(size_t producers, size_t perProducer)
+{
+  BtHomeV2Staging staging(DEFAULT_STAGING_CAPACITY);
+  BaseDevice device("", "", false);
+  device.enableOverflow(MAX_OVERFLOW_MEASUREMENT_BUFFER_SIZE);
+
+  StressState state;
+  state.staging = &staging;
+  state.perProducer = perProducer;
+  state.rejected.store(0);
+  Receiver receiver;
+  for (size_t source = 0; source <= producers; source++)
+  {
+    state.accepted[source].assign(perProducer, 0);
+    receiver.received[source].assign(perProducer, 0);
+    receiver.last[source] = -1;
+  }
+
+  // the "ISR": SIGALRM interrupts the consumer, also inside collect. The timer signal goes to the process, so it
+  // is blocked in every other thread; otherwise the handler could run on two threads at once, which an ISR never does
+  g_isrSource = static_cast<uint32_t>(producers);
+  g_isrSequence = 0;
+  g_stress = &state;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = isrProducer;
+  sigaction(SIGALRM, &action, nullptr);
+
+  // new threads inherit the blocked signal
+  sigset_t alarm;
+  sigemptyset(&alarm);
+  sigaddset(&alarm, SIGALRM);
+  pthread_sigmask(SIG_BLOCK, &alarm, nullptr);
+
+  std::vector<std::thread> threads;
+  for (size_t source = 0; source < producers; source++)
+  {
+    threads.emplace_back(taskProducer, &state, static_cast<uint32_t>(source));
+  }
+
+  std::atomic<bool> done(false);
+  std::thread joiner([&]() {
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+      threads[i].join();
+    }
+    done.store(true);
+  });
+  pthread_sigmask(SIG_UNBLOCK, &alarm, nullptr);
+  struct itimerval timer = {{0, 50}, {0, 50}};
+  setitimer(ITIMER_REAL, &timer, nullptr);
+
+  size_t collects = 0;
+  while (!done.load())
+  {
+    drain(staging, device, receiver, false);
+    collects++;
+    std::this_thread::yield();
+  }
+  joiner.join();
+
+  struct itimerval stop = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_REAL, &stop, nullptr);
+  g_stress = nullptr;
+  drain(staging, device, receiver, true);
+
+  size_t accepted = 0;
+  size_t lost = 0;
+  size_t unexpected = 0;
+  for (size_t source = 0; source <= producers; source++)
+  {
+    for (size_t sequence = 0; sequence < perProducer; sequence++)
+    {
+      accepted += state.accepted[source][sequence];
+      lost += state.accepted[source][sequence] && !receiver.received[source][sequence];
+      unexpected += !state.accepted[source][sequence] && receiver.received[source][sequence];
+    }
+  }
+
+  bool ok = !lost && !unexpected && !receiver.duplicates && !receiver.outOfOrder &&
+            staging.getDropped() == state.rejected.load();
+  printf("stress %zu threads + timer signal: %zu staged (%u from the signal), %u rejected (full), %zu collects, %zu packets\n",
+         producers, accepted, g_isrSequence, state.rejected.load(), collects, receiver.packets);
+  printf("  lost %zu, unexpected %zu, duplicates %zu, out of order %zu, dropped counter %s: %s\n", lost, unexpected,
+         receiver.duplicates, receiver.outOfOrder, staging.getDropped() == state.rejected.load() ? "matches" : "differs",
+         ok ? "OK" : "FAIL");
+  return ok ? 0 : 1;
+}
+
+// contention: producers time every add, the consumer keeps building packets until they are done
+
+struct LatencyResult
+{
+  double nsPerOp;
+  double p99;
+  double max;
+  size_t rejected;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double nanoseconds(Clock::time_point start, Clock::time_point end)
+{
+  return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+static LatencyResult summarize(std::vector<std::vector<float> > &latencies, double elapsed, size_t operations, size_t rejected)
+{
+  std::vector<float> all;
+  for (size_t i = 0; i < latencies.size(); i++)
+  {
+    all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+  }
+  std::sort(all.begin(), all.end());
+  LatencyResult result;
+  result.nsPerOp = elapsed / operations;
+  result.p99 = all[all.size() * 99 / 100];
+  result.max = all.back();
+  result.rejected = rejected;
+  return result;
+}
+
+static LatencyResult contendStaging(size_t producers, size_t perProducer)
+{
+  BtHomeV2Staging staging(DEFAULT_STAGING_CAPACITY);
+  BaseDevice device("", "", false);
+  device.enableOverflow(MAX_OVERFLOW_MEASUREMENT_BUFFER_SIZE);
+  std::vector<std::vector<float> > latencies(producers, std::vector<float>(perProducer));
+  std::atomic<size_t> running(producers);
+  std::atomic<size_t> rejected(0);
+
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < producers; p++)
+  {
+    threads.emplace_back([&, p]() {
+      for (size_t i = 0; i < perProducer; i++)
+      {
+        Clock::time_point before = Clock::now();
+        bool stored = staging.stage<StagedSensor>(static_cast<uint32_t>(i));
+        latencies[p][i] = static_cast<float>(nanoseconds(before, Clock::now()));
+        rejected += !stored;
+        if ((i & 15) == 15)
+        {
+          std::this_thread::yield();
+        }
+      }
+      running--;
+    });
+  }
+
+  uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+  while (running.load())
+  {
+    device.resetMeasurement();
+    if (staging.collect(device))
+    {
+      while (size_t size = device.nextAdvertisement(advertisement))
+      {
+        benchConsume(advertisement, size);
+      }
+    }
+    std::this_thread::yield();
+  }
+  for (size_t p = 0; p < producers; p++)
+  {
+    threads[p].join();
+  }
+  double elapsed = nanoseconds(start, Clock::now());
+  return summarize(latencies, elapsed, producers * perProducer, rejected.load());
+}
+
+static LatencyResult contendMutex(size_t producers, size_t perProducer)
+{
+  BaseDevice device("", "", false);
+  device.enableOverflow(MAX_OVERFLOW_MEASUREMENT_BUFFER_SIZE);
+  std::mutex mutex;
+  std::vector<std::vector<float> > latencies(producers, std::vector<float>(perProducer));
+  std::atomic<size_t> running(producers);
+  std::atomic<size_t> rejected(0);
+
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < producers; p++)
+  {
+    threads.emplace_back([&, p]() {
+      for (size_t i = 0; i < perProducer; i++)
+      {
+        Clock::time_point before = Clock::now();
+        bool stored;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          stored = device.add<StagedSensor>(static_cast<uint32_t>(i));
+        }
+        latencies[p][i] = static_cast<float>(nanoseconds(before, Clock::now()));
+        rejected += !stored;
+        if ((i & 15) == 15)
+        {
+          std::this_thread::yield();
+        }
+      }
+      running--;
+    });
+  }
+
+  uint8_t advertisement[MAX_ADVERTISEMENT_SIZE];
+  while (running.load())
+  {
+    {
+      // the packet is built under the lock so it is consistent
+      std::lock_guard<std::mutex> lock(mutex);
+      while (size_t size = device.nextAdvertisement(advertisement))
+      {
+        benchConsume(advertisement, size);
+      }
+      device.resetMeasurement();
+    }
+    std::this_thread::yield();
+  }
+  for (size_t p = 0; p < producers; p++)
+  {
+    threads[p].join();
+  }
+  double elapsed = nanoseconds(start, Clock::now());
+  return summarize(latencies, elapsed, producers * perProducer, rejected.load());
+}
+
+struct SingleContext
+{
+  BtHomeV2Staging *staging;
+  BaseDevice *device;
+  std::mutex *mutex;
+  uint32_t value;
+};
+
+// a producer's own cost without contention, one packet per buffer's worth of measurements
+static void stageOne(void *context)
+{
+  SingleContext *ctx = static_cast<SingleContext *>(context);
+  ctx->staging->stage<StagedSensor>(ctx->value);
+  if ((++ctx->value % DEFAULT_STAGING_CAPACITY) == 0)
+  {
+    ctx->device->resetMeasurement();
+    ctx->staging->collect(*ctx->device);
+  }
+}
+
+static void lockedAddOne(void *context)
+{
+  SingleContext *ctx = static_cast<SingleContext *>(context);
+  {
+    std::lock_guard<std::mutex> lock(*ctx->mutex);
+    ctx->device->add<StagedSensor>(ctx->value);
+  }
+  if ((++ctx->value % DEFAULT_STAGING_CAPACITY) == 0)
+  {
+    std::lock_guard<std::mutex> lock(*ctx->mutex);
+    ctx->device->resetMeasurement();
+  }
+}
+
+static void runSingleThreaded(size_t iterations)
+{
+  BtHomeV2Staging staging(DEFAULT_STAGING_CAPACITY);
+  BaseDevice device("", "", false);
+  device.enableOverflow(MAX_OVERFLOW_MEASUREMENT_BUFFER_SIZE);
+  std::mutex mutex;
+  SingleContext context = {&staging, &device, &mutex, 0};
+
+  printBenchHeader("uncontended, per measurement (collect / reset amortised)");
+  printBenchResult("staging", runBenchmark(stageOne, &context, iterations), 0);
+  context.value = 0;
+  printBenchResult("mutex + add", runBenchmark(lockedAddOne, &context, iterations), 0);
+}
+
+static void printLatency(const char *name, const LatencyResult &result)
+{
+  printf("%-40s %12.1f %12.1f %12.1f %10zu\n", name, result.nsPerOp, result.p99, result.max, result.rejected);
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 200000);
+
+  int failures = 0;
+  const size_t threadCounts[] = {1, 2, 4};
+  for (size_t i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++)
+  {
+    failures += runStress(threadCounts[i], iterations);
+  }
+
+  runSingleThreaded(iterations * 10);
+
+  printf("\nproducer latency (consumer builds packets concurrently, %u hardware threads)\n", std::thread::hardware_concurrency());
+  printf("%-40s %12s %12s %12s %10s\n", "case", "wall ns/op", "p99 ns", "max ns", "rejected");
+  for (size_t i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++)
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "staging/%zu producers", threadCounts[i]);
+    printLatency(name, contendStaging(threadCounts[i], iterations));
+    snprintf(name, sizeof(name), "mutex/%zu producers", threadCounts[i]);
+    printLatency(name, contendMutex(threadCounts[i], iterations));
+  }
+
+  return failures;
+}
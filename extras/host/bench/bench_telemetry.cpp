@@ -0,0 +1,195 @@
+// Encoder telemetry: checks the counters (when built with BTHOME_TELEMETRY), prints them for a few device types
+// and the cost per packet. Built twice, as bench_telemetry (counters) and bench_telemetry_disabled, to compare.
+
+#include "bench.h"
+
+#include <BtHomeV2Device.h>
+#include <BtHomeV2PriorityPacker.h>
+#include <stdio.h>
+
+static const uint8_t BENCH_KEY[BIND_KEY_LEN] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1,
+                                                0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+static const uint8_t BENCH_MAC[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, 0x8F, 0x80, 0xA5};
+
+#if defined(BTHOME_TELEMETRY)
+static const bool COUNTING = true;
+#else
+static const bool COUNTING = false;
+#endif
+
+static bool equal(const BtHomeTelemetry &t, uint32_t packets, uint32_t bytes, uint32_t rejected, uint32_t completeDropped,
+                  uint32_t allDropped, uint32_t encryptions)
+{
+  if (!COUNTING)
+  {
+    packets = bytes = rejected = completeDropped = allDropped = encryptions = 0;
+  }
+  return t.packetsBuilt == packets && t.bytesEmitted == bytes && t.measurementsRejected == rejected &&
+         t.completeNamesDropped == completeDropped && t.allNamesDropped == allDropped && t.encryptions == encryptions &&
+         (encryptions != 0) == (t.encryptTicks != 0);
+}
+
+static int checkCounters()
+{
+  int failures = 0;
+  uint8_t advertisement[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+
+  // 8 header + 3 measurement bytes leave 20: the 22 byte complete name AD is dropped, the short name is sent
+  BtHomeV2Device device("sensor", "Garden sensor north", false);
+  device.add<BtHomeSensors::temperature_int16_scale_0_01>(21.5f);
+  size_t first = device.getAdvertisementData(advertisement);
+  if (!equal(device.getTelemetry(), 1, first, 0, 1, 0, 0))
+  {
+    failures++;
+  }
+
+  // fill it up: 23 bytes, the 7th humidity is rejected, no room for any name
+  int rejected = 0;
+  for (int i = 0; i < 7; i++)
+  {
+    rejected += !device.add<BtHomeSensors::humidity_uint16>(50.0f);
+  }
+  size_t second = device.getAdvertisementData(advertisement);
+  if (rejected != 1 || !equal(device.getTelemetry(), 2, first + second, 1, 2, 1, 0))
+  {
+    failures++;
+  }
+
+  device.resetTelemetry();
+  if (!equal(device.getTelemetry(), 0, 0, 0, 0, 0, 0))
+  {
+    failures++;
+  }
+
+  // encrypted, every packet of an overflow sequence is one encryption
+  BaseDevice encrypted("sensor", "Garden", false, BENCH_KEY, BENCH_MAC, 1);
+  encrypted.enableOverflow(40);
+  for (int i = 0; i < 10; i++)
+  {
+    encrypted.add<BtHomeSensors::power_uint24>(100 + i);
+  }
+  uint32_t packets = 0;
+  uint32_t bytes = 0;
+  while (size_t size = encrypted.nextAdvertisement(advertisement))
+  {
+    packets++;
+    bytes += size;
+  }
+  // 11 measurement bytes per packet hold 2 power values, the 7 bytes left are too few for either 8 byte name AD
+  if (packets != 5 || !equal(encrypted.getTelemetry(), packets, bytes, 0, packets, packets, packets))
+  {
+    failures++;
+  }
+
+  // priority packing spills 12 humidities over two packets of 7 (23 bytes): deferred, not rejected
+  BaseDevice packed("sensor", "Garden", false);
+  BtHomeV2PriorityPacker packer;
+  for (int i = 0; i < 12; i++)
+  {
+    packer.set<BtHomeSensors::humidity_uint16>(packer.addSensor<BtHomeSensors::humidity_uint16>(), 50.0f);
+  }
+  size_t spilled = 0;
+  for (int packet = 0; packet < 2; packet++)
+  {
+    packed.resetMeasurement();
+    spilled += 12 - packer.fill(packed);
+    packed.getAdvertisementData(advertisement);
+  }
+  if (spilled != 10 || packed.getTelemetry().measurementsRejected != 0)
+  {
+    failures++;
+  }
+
+  printf("counters %s, sizeof(BaseDevice) %zu bytes, checks: %s\n", COUNTING ? "compiled in" : "compiled out",
+         sizeof(BaseDevice), failures ? "FAIL" : "OK");
+  return failures;
+}
+
+struct DeviceType
+{
+  const char *name;
+  bool encrypted;
+  size_t maxAdvertisementSize;
+  int measurements;
+};
+
+/// @brief What the counters show after a day of packets for a few device types.
+static void reportDeviceTypes()
+{
+  if (!COUNTING)
+  {
+    return;
+  }
+
+  static const uint32_t PACKETS = 8640; // every 10 s for a day
+  const DeviceType types[] = {
+      {"climate, plain", false, MAX_ADVERTISEMENT_SIZE, 3},
+      {"climate, encrypted", true, MAX_ADVERTISEMENT_SIZE, 3},
+      {"meter, encrypted, 8 values", true, MAX_ADVERTISEMENT_SIZE, 8},
+      {"meter, encrypted, 8 values, BLE 5", true, 64, 8},
+  };
+
+  printf("\n%-36s %8s %10s %10s %10s %10s %14s\n", "device type", "packets", "bytes/pkt", "rejected", "no complete",
+         "no name", "cycles/encrypt");
+  for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++)
+  {
+    const DeviceType &type = types[t];
+    BaseDevice *device = type.encrypted
+                             ? new BaseDevice("meter", "Basement meter", false, BENCH_KEY, BENCH_MAC, 1, type.maxAdvertisementSize)
+                             : new BaseDevice("meter", "Basement meter", false, type.maxAdvertisementSize);
+    uint8_t advertisement[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+    for (uint32_t packet = 0; packet < PACKETS; packet++)
+    {
+      device->resetMeasurement();
+      device->add<BtHomeSensors::temperature_int16_scale_0_01>(20.0f + (packet % 50) * 0.1f);
+      for (int i = 1; i < type.measurements; i++)
+      {
+        device->add<BtHomeSensors::power_uint24>(packet + i);
+      }
+      benchConsume(advertisement, device->getAdvertisementData(advertisement));
+    }
+
+    BtHomeTelemetry telemetry = device->getTelemetry();
+    printf("%-36s %8u %10.1f %10u %10u %10u %14.0f\n", type.name, telemetry.packetsBuilt,
+           static_cast<double>(telemetry.bytesEmitted) / telemetry.packetsBuilt, telemetry.measurementsRejected,
+           telemetry.completeNamesDropped, telemetry.allNamesDropped,
+           telemetry.encryptions ? static_cast<double>(telemetry.encryptTicks) / telemetry.encryptions : 0.0);
+    delete device;
+  }
+}
+
+struct PacketContext
+{
+  BaseDevice *device;
+  uint32_t iteration;
+  uint8_t buffer[MAX_ADVERTISEMENT_SIZE];
+};
+
+static void climatePacket(void *context)
+{
+  PacketContext *ctx = static_cast<PacketContext *>(context);
+  uint32_t i = ctx->iteration++;
+  ctx->device->resetMeasurement();
+  ctx->device->add<BtHomeSensors::temperature_int16_scale_0_01>(static_cast<int>(i % 40));
+  ctx->device->add<BtHomeSensors::humidity_uint16>(static_cast<int>(i % 100));
+  ctx->device->add<BtHomeSensors::battery_percentage>(95);
+  benchConsume(ctx->buffer, ctx->device->getAdvertisementData(ctx->buffer));
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = benchIterations(argc, argv, 500000);
+
+  int failures = checkCounters();
+  reportDeviceTypes();
+
+  BaseDevice plain("climate", "Climate", false);
+  BaseDevice encrypted("climate", "Climate", false, BENCH_KEY, BENCH_MAC, 1);
+  PacketContext context = {&plain, 0, {}};
+
+  printBenchHeader(COUNTING ? "climate packet, counters compiled in" : "climate packet, counters compiled out");
+  printBenchResult("plain", runBenchmark(climatePacket, &context, iterations), 0);
+  context.device = &encrypted;
+  printBenchResult("encrypted", runBenchmark(climatePacket, &context, iterations / 10), 0);
+  return failures;
+}
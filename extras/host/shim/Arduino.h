@@ -0,0 +1,43 @@
+#ifndef BTHOME_HOST_ARDUINO_H
+#define BTHOME_HOST_ARDUINO_H
+
+// Minimal stand-in for the Arduino core so the library sources can be built
+// and profiled on a workstation. Only what the library itself uses is provided.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+typedef uint8_t byte;
+
+#define DEC 10
+#define HEX 16
+
+/// @brief Serial replacement. Output is discarded so debug prints in the library do not skew timings.
+class HostSerial
+{
+public:
+  void begin(unsigned long) {}
+  template <typename T>
+  size_t print(T) { return 0; }
+  template <typename T>
+  size_t print(T, int) { return 0; }
+  size_t println() { return 0; }
+  template <typename T>
+  size_t println(T) { return 0; }
+  template <typename T>
+  size_t println(T, int) { return 0; }
+  size_t printf(const char *, ...) { return 0; }
+};
+
+extern HostSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+#endif // BTHOME_HOST_ARDUINO_H
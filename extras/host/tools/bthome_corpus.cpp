@@ -0,0 +1,445 @@
+// Synthetic BTHome traffic as an HCI log for bthome_replay: devices built with BtHomeV2Device (plain, encrypted
+// and BLE 5 extended), with other advertisers and other HCI events in between. The same arguments give the same file.
+//
+//   bthome_corpus corpus.btsnoop [--packets N] [--devices N] [--encrypted %] [--extended %] [--noise %] [--seed N] [--raw]
+//
+// Also writes corpus.btsnoop.keys: the bind keys, and the totals bthome_replay checks its decoding against.
+
+#include "hci_log.h"
+
+#include <BtHomeV2Device.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+struct SensorSpec
+{
+  BtHomeType type;
+  int32_t minimum; // raw value range
+  int32_t maximum;
+};
+
+// milliUnits = raw * 1000 * scaleNumerator / scaleDenominator stays within int32 for all of these
+static const SensorSpec SENSORS[] = {
+    {temperature_int16_scale_0_01, -2000, 4000},
+    {humidity_uint16, 1000, 10000},
+    {pressure, 95000, 105000},
+    {illuminance, 0, 2000000},
+    {co2, 400, 5000},
+    {battery_percentage, 0, 100},
+    {voltage_0_001, 2000, 3300},
+    {power_uint24, 0, 500000},
+    {moisture_uint16, 0, 10000},
+    {count_uint32, 0, 1000000},
+};
+static const size_t SENSOR_COUNT = sizeof(SENSORS) / sizeof(SENSORS[0]);
+static const size_t MAX_SENSORS_PER_DEVICE = 4;
+static const size_t EXTENDED_ADVERTISEMENT_SIZE = 64;
+
+static uint32_t g_random = 0x12345678;
+
+static uint32_t nextRandom()
+{
+  g_random ^= g_random << 13;
+  g_random ^= g_random >> 17;
+  g_random ^= g_random << 5;
+  return g_random;
+}
+
+static bool chance(uint32_t percent)
+{
+  return nextRandom() % 100 < percent;
+}
+
+struct Options
+{
+  const char *output = nullptr;
+  uint32_t packets = 100000;
+  uint32_t devices = 200;
+  uint32_t encryptedPercent = 30;
+  uint32_t extendedPercent = 10;
+  uint32_t noisePercent = 20;
+  uint32_t seed = 1;
+  bool raw = false;
+};
+
+struct Device
+{
+  BtHomeV2Device *device;
+  uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+  uint8_t key[BIND_KEY_LEN];
+  bool encrypted;
+  bool extended;
+  size_t sensors[MAX_SENSORS_PER_DEVICE];
+  size_t sensorCount;
+};
+
+/// @brief What bthome_replay should find, summed from the values given to the devices.
+struct Totals
+{
+  size_t packets;
+  size_t encrypted;
+  size_t measurements;
+  uint64_t checksum;
+};
+
+/// @brief Writes HCI events as btsnoop records (H4 datalink) or as a raw H4 stream.
+class HciLogWriter
+{
+public:
+  HciLogWriter(FILE *file, bool raw) : _file(file), _raw(raw)
+  {
+    if (!_raw)
+    {
+      uint8_t header[BTSNOOP_HEADER_SIZE];
+      memcpy(header, BTSNOOP_MAGIC, sizeof(BTSNOOP_MAGIC));
+      writeBigEndian32(&header[8], BTSNOOP_VERSION);
+      writeBigEndian32(&header[12], BTSNOOP_DATALINK_H4);
+      fwrite(header, 1, sizeof(header), _file);
+    }
+  }
+
+  /// @param event - Event code, parameter length and parameters.
+  void writeEvent(const uint8_t *event, size_t length, uint64_t timestamp)
+  {
+    if (!_raw)
+    {
+      uint8_t record[BTSNOOP_RECORD_HEADER_SIZE];
+      writeBigEndian32(&record[0], static_cast<uint32_t>(length + 1));
+      writeBigEndian32(&record[4], static_cast<uint32_t>(length + 1));
+      writeBigEndian32(&record[8], BTSNOOP_FLAG_RECEIVED | BTSNOOP_FLAG_COMMAND_OR_EVENT);
+      writeBigEndian32(&record[12], 0);
+      writeBigEndian64(&record[16], timestamp);
+      fwrite(record, 1, sizeof(record), _file);
+    }
+    fputc(H4_EVENT, _file);
+    fwrite(event, 1, length, _file);
+  }
+
+private:
+  FILE *_file;
+  bool _raw;
+};
+
+/// @return Size of the LE Meta event with one report carrying the advertisement.
+static size_t buildReportEvent(uint8_t *event, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], const uint8_t *data,
+                               size_t length, bool extended)
+{
+  int8_t rssi = static_cast<int8_t>(-40 - static_cast<int>(nextRandom() % 55));
+  size_t index = HCI_EVENT_HEADER_SIZE;
+  event[0] = HCI_EVENT_LE_META;
+  if (extended)
+  {
+    event[index++] = HCI_LE_EXTENDED_ADVERTISING_REPORT;
+    event[index++] = 1; // reports
+    event[index++] = 0; // event type: non-connectable, non-scannable, data complete
+    event[index++] = 0;
+  }
+  else
+  {
+    event[index++] = HCI_LE_ADVERTISING_REPORT;
+    event[index++] = 1;    // reports
+    event[index++] = 0x03; // ADV_NONCONN_IND
+  }
+  event[index++] = 0x01; // random address
+
+  // HCI sends addresses least significant byte first
+  for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+  {
+    event[index++] = macAddress[BLE_MAC_ADDRESS_LENGTH - 1 - i];
+  }
+
+  if (extended)
+  {
+    event[index++] = 0x03; // primary PHY: LE Coded (long range)
+    event[index++] = 0x03; // secondary PHY
+    event[index++] = 0xFF; // no advertising set id
+    event[index++] = 0x7F; // TX power not available
+    event[index++] = static_cast<uint8_t>(rssi);
+    event[index++] = 0; // no periodic advertising
+    event[index++] = 0;
+    event[index++] = 0; // no direct address
+    memset(&event[index], 0, BLE_MAC_ADDRESS_LENGTH);
+    index += BLE_MAC_ADDRESS_LENGTH;
+  }
+
+  event[index++] = static_cast<uint8_t>(length);
+  memcpy(&event[index], data, length);
+  index += length;
+  if (!extended)
+  {
+    event[index++] = static_cast<uint8_t>(rssi);
+  }
+  event[1] = static_cast<uint8_t>(index - HCI_EVENT_HEADER_SIZE);
+  return index;
+}
+
+/// @brief Something a scanner sees besides BTHome: iBeacons, other service data and command completes.
+static size_t buildNoiseEvent(uint8_t *event)
+{
+  uint8_t data[MAX_ADVERTISEMENT_SIZE];
+  uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+  for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+  {
+    macAddress[i] = static_cast<uint8_t>(nextRandom());
+  }
+
+  uint32_t kind = nextRandom() % 10;
+  if (kind == 0)
+  {
+    // Command Complete of LE Set Scan Enable
+    static const uint8_t COMMAND_COMPLETE[] = {HCI_EVENT_COMMAND_COMPLETE, 4, 1, 0x0C, 0x20, 0x00};
+    memcpy(event, COMMAND_COMPLETE, sizeof(COMMAND_COMPLETE));
+    return sizeof(COMMAND_COMPLETE);
+  }
+
+  size_t length = 0;
+  data[length++] = 2;
+  data[length++] = 0x01; // flags
+  data[length++] = 0x06;
+  if (kind < 6)
+  {
+    // iBeacon: Apple manufacturer data with a UUID, major, minor and TX power
+    data[length++] = 26;
+    data[length++] = 0xFF;
+    data[length++] = 0x4C;
+    data[length++] = 0x00;
+    data[length++] = 0x02;
+    data[length++] = 0x15;
+    for (int i = 0; i < 21; i++)
+    {
+      data[length++] = static_cast<uint8_t>(nextRandom());
+    }
+  }
+  else
+  {
+    // service data of another 16 bit UUID (0xFE95)
+    size_t payload = 4 + nextRandom() % 16;
+    data[length++] = static_cast<uint8_t>(3 + payload);
+    data[length++] = 0x16;
+    data[length++] = 0x95;
+    data[length++] = 0xFE;
+    for (size_t i = 0; i < payload; i++)
+    {
+      data[length++] = static_cast<uint8_t>(nextRandom());
+    }
+  }
+  return buildReportEvent(event, macAddress, data, length, false);
+}
+
+static void createDevices(const Options &options, std::vector<Device> &devices)
+{
+  devices.resize(options.devices);
+  for (uint32_t d = 0; d < options.devices; d++)
+  {
+    Device &device = devices[d];
+    const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH] = {0x54, 0x48, 0xE6, static_cast<uint8_t>(d >> 16),
+                                                        static_cast<uint8_t>(d >> 8), static_cast<uint8_t>(d)};
+    memcpy(device.macAddress, macAddress, sizeof(macAddress));
+    for (size_t i = 0; i < BIND_KEY_LEN; i++)
+    {
+      device.key[i] = static_cast<uint8_t>(nextRandom());
+    }
+    device.encrypted = chance(options.encryptedPercent);
+    device.extended = chance(options.extendedPercent);
+
+    // one to four different sensors
+    device.sensorCount = 1 + nextRandom() % MAX_SENSORS_PER_DEVICE;
+    for (size_t i = 0; i < device.sensorCount; i++)
+    {
+      bool duplicate;
+      do
+      {
+        device.sensors[i] = nextRandom() % SENSOR_COUNT;
+        duplicate = false;
+        for (size_t j = 0; j < i; j++)
+        {
+          duplicate |= device.sensors[j] == device.sensors[i];
+        }
+      } while (duplicate);
+    }
+
+    char shortName[MAX_LENGTH_SHORT_NAME + 1];
+    char completeName[MAX_LENGTH_COMPLETE_NAME + 1];
+    snprintf(shortName, sizeof(shortName), "s%04x", static_cast<unsigned>(d & 0xFFFF));
+    snprintf(completeName, sizeof(completeName), "Sensor %u", static_cast<unsigned>(d));
+    size_t maxAdvertisementSize = device.extended ? EXTENDED_ADVERTISEMENT_SIZE : MAX_ADVERTISEMENT_SIZE;
+    device.device = device.encrypted
+                        ? new BtHomeV2Device(shortName, completeName, false, device.key, device.macAddress, 1, maxAdvertisementSize)
+                        : new BtHomeV2Device(shortName, completeName, false, maxAdvertisementSize);
+  }
+}
+
+/// @brief One packet of a device with fresh random values, added through the fixed-point path so the
+/// raw values, and so the checksum, are exact.
+static size_t buildPacket(Device &device, uint8_t *advertisement, Totals &totals)
+{
+  device.device->clearMeasurementData();
+  for (size_t i = 0; i < device.sensorCount; i++)
+  {
+    const SensorSpec &sensor = SENSORS[device.sensors[i]];
+    int32_t raw = sensor.minimum + static_cast<int32_t>(nextRandom() % static_cast<uint32_t>(sensor.maximum - sensor.minimum + 1));
+    int32_t milliPerRaw = static_cast<int32_t>(1000 * sensor.type.scaleNumerator / sensor.type.scaleDenominator);
+    if (device.device->addScaled(sensor.type, raw * milliPerRaw))
+    {
+      totals.measurements++;
+      totals.checksum += (static_cast<uint64_t>(sensor.type.id) << 48) + static_cast<uint64_t>(static_cast<int64_t>(raw));
+    }
+  }
+  totals.packets++;
+  totals.encrypted += device.encrypted;
+  return device.device->getAdvertisementData(advertisement);
+}
+
+static void printMacAddress(FILE *file, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH])
+{
+  for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+  {
+    fprintf(file, i ? ":%02X" : "%02X", macAddress[i]);
+  }
+}
+
+static bool writeKeys(const Options &options, const std::vector<Device> &devices, const Totals &totals)
+{
+  std::string path = std::string(options.output) + ".keys";
+  FILE *file = fopen(path.c_str(), "w");
+  if (!file)
+  {
+    return false;
+  }
+
+  fprintf(file, "# bthome_corpus: %u packets, %u devices, seed %u\n", options.packets, options.devices, options.seed);
+  fprintf(file, "expect %zu %zu %zu %016llx\n", totals.packets, totals.encrypted, totals.measurements,
+          static_cast<unsigned long long>(totals.checksum));
+  for (size_t d = 0; d < devices.size(); d++)
+  {
+    if (!devices[d].encrypted)
+    {
+      continue;
+    }
+    fprintf(file, "key ");
+    printMacAddress(file, devices[d].macAddress);
+    fprintf(file, " ");
+    for (size_t i = 0; i < BIND_KEY_LEN; i++)
+    {
+      fprintf(file, "%02x", devices[d].key[i]);
+    }
+    fprintf(file, "\n");
+  }
+  return fclose(file) == 0;
+}
+
+static bool parseOptions(int argc, char **argv, Options &options)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *argument = argv[i];
+    uint32_t *value = nullptr;
+    if (!strcmp(argument, "--raw"))
+    {
+      options.raw = true;
+      continue;
+    }
+    else if (!strcmp(argument, "--packets"))
+    {
+      value = &options.packets;
+    }
+    else if (!strcmp(argument, "--devices"))
+    {
+      value = &options.devices;
+    }
+    else if (!strcmp(argument, "--encrypted"))
+    {
+      value = &options.encryptedPercent;
+    }
+    else if (!strcmp(argument, "--extended"))
+    {
+      value = &options.extendedPercent;
+    }
+    else if (!strcmp(argument, "--noise"))
+    {
+      value = &options.noisePercent;
+    }
+    else if (!strcmp(argument, "--seed"))
+    {
+      value = &options.seed;
+    }
+    else if (argument[0] != '-' && !options.output)
+    {
+      options.output = argument;
+      continue;
+    }
+
+    if (!value || i + 1 >= argc)
+    {
+      return false;
+    }
+    *value = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 0));
+  }
+  return options.output && options.devices > 0 && options.devices <= 0x1000000 && options.noisePercent < 100;
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  if (!parseOptions(argc, argv, options))
+  {
+    fprintf(stderr, "usage: %s corpus.btsnoop [--packets N] [--devices N] [--encrypted %%] [--extended %%] [--noise %%] "
+                    "[--seed N] [--raw]\n",
+            argv[0]);
+    return 1;
+  }
+
+  FILE *file = fopen(options.output, "wb");
+  if (!file)
+  {
+    perror(options.output);
+    return 1;
+  }
+
+  g_random = options.seed ? options.seed * 0x9E3779B9u : 0x12345678;
+  std::vector<Device> devices;
+  createDevices(options, devices);
+
+  HciLogWriter writer(file, options.raw);
+  Totals totals = {};
+  uint64_t timestamp = BTSNOOP_UNIX_EPOCH + 1767225600ull * 1000000; // 2026-01-01
+  uint8_t advertisement[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+  uint8_t event[HCI_EVENT_HEADER_SIZE + 255];
+  size_t records = 0;
+  while (totals.packets < options.packets)
+  {
+    timestamp += nextRandom() % 20000;
+    size_t length;
+    if (chance(options.noisePercent))
+    {
+      length = buildNoiseEvent(event);
+    }
+    else
+    {
+      Device &device = devices[nextRandom() % devices.size()];
+      size_t size = buildPacket(device, advertisement, totals);
+      length = buildReportEvent(event, device.macAddress, advertisement, size, device.extended);
+    }
+    writer.writeEvent(event, length, timestamp);
+    records++;
+  }
+
+  bool written = fclose(file) == 0 && writeKeys(options, devices, totals);
+  for (size_t d = 0; d < devices.size(); d++)
+  {
+    delete devices[d].device;
+  }
+  if (!written)
+  {
+    fprintf(stderr, "%s: write failed\n", options.output);
+    return 1;
+  }
+
+  printf("%s: %zu %s records, %zu BTHome packets (%zu encrypted), %zu measurements, keys in %s.keys\n", options.output,
+         records, options.raw ? "raw H4" : "btsnoop", totals.packets, totals.encrypted, totals.measurements,
+         options.output);
+  return 0;
+}
@@ -0,0 +1,637 @@
+// Replays a btsnoop or raw H4 HCI log (from bthome_corpus, btmon -w, an Android bug report or the ESP-IDF HCI logger)
+// through the library's decoder: finds the BTHome service data in every LE advertising report, decrypts it with the
+// keys given and decodes it with the descriptor table. Prints what it found, packets/s and the cost of each stage.
+//
+//   bthome_replay capture.btsnoop [--keys file] [--repeat N]
+//
+// The keys file has lines "key AA:BB:CC:DD:EE:FF <32 hex digits>". The one bthome_corpus writes next to its log is
+// used when --keys is not given; its "expect" line is checked against the decoded totals.
+
+#include "hci_log.h"
+
+#include <BtHomeV2KeyStore.h>
+#include <BtHomeV2Parser.h>
+#include <chrono>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// @brief A read-only mapping of a whole file, so records are parsed in place without read() copies.
+class MappedFile
+{
+public:
+  explicit MappedFile(const char *path)
+  {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+      return;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) == 0 && status.st_size > 0)
+    {
+      void *data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED)
+      {
+        _data = static_cast<const uint8_t *>(data);
+        _size = static_cast<size_t>(status.st_size);
+        madvise(data, _size, MADV_SEQUENTIAL);
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile()
+  {
+    if (_data)
+    {
+      munmap(const_cast<uint8_t *>(_data), _size);
+    }
+  }
+
+  bool isOpen() const { return _data != nullptr; }
+  const uint8_t *data() const { return _data; }
+  size_t size() const { return _size; }
+
+private:
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *_data = nullptr;
+  size_t _size = 0;
+};
+
+enum HciLogFormat
+{
+  HCI_LOG_UNKNOWN,
+  HCI_LOG_BTSNOOP_H4,
+  HCI_LOG_BTSNOOP_HCI,
+  HCI_LOG_RAW_H4
+};
+
+static const char *const FORMAT_NAMES[] = {"unknown", "btsnoop (H4)", "btsnoop (HCI)", "raw H4"};
+
+/// @brief Walks the HCI events of a btsnoop file or raw H4 stream in place. Commands and data packets are skipped.
+class HciLogReader
+{
+public:
+  HciLogReader(const uint8_t *data, size_t size) : _data(data), _size(size)
+  {
+    if (size >= BTSNOOP_HEADER_SIZE && memcmp(data, BTSNOOP_MAGIC, sizeof(BTSNOOP_MAGIC)) == 0)
+    {
+      uint32_t datalink = readBigEndian32(&data[12]);
+      if (readBigEndian32(&data[8]) == BTSNOOP_VERSION)
+      {
+        _format = datalink == BTSNOOP_DATALINK_H4 ? HCI_LOG_BTSNOOP_H4
+                  : datalink == BTSNOOP_DATALINK_HCI ? HCI_LOG_BTSNOOP_HCI
+                                                       : HCI_LOG_UNKNOWN;
+      }
+      _position = BTSNOOP_HEADER_SIZE;
+    }
+    else if (size > 0 && data[0] >= H4_COMMAND && data[0] <= H4_EVENT)
+    {
+      _format = HCI_LOG_RAW_H4;
+    }
+  }
+
+  HciLogFormat format() const { return _format; }
+
+  /// @brief The next HCI event.
+  /// @param event - Set to the event code, followed by the parameter length and the parameters.
+  /// @return false at the end of the log, or at a truncated record (see truncated()).
+  bool nextEvent(const uint8_t **event, size_t *length)
+  {
+    while (_position < _size)
+    {
+      const uint8_t *packet;
+      size_t packetLength;
+      bool isEvent;
+      if (_format == HCI_LOG_RAW_H4)
+      {
+        if (!nextH4Packet(&packet, &packetLength))
+        {
+          return false;
+        }
+        isEvent = packet[0] == H4_EVENT;
+        packet++;
+        packetLength--;
+      }
+      else
+      {
+        if (_format == HCI_LOG_UNKNOWN || _size - _position < BTSNOOP_RECORD_HEADER_SIZE)
+        {
+          _truncated = _format != HCI_LOG_UNKNOWN;
+          return false;
+        }
+        const uint8_t *record = &_data[_position];
+        packetLength = readBigEndian32(&record[4]);
+        if (packetLength > _size - _position - BTSNOOP_RECORD_HEADER_SIZE)
+        {
+          _truncated = true;
+          return false;
+        }
+        packet = &record[BTSNOOP_RECORD_HEADER_SIZE];
+        _position += BTSNOOP_RECORD_HEADER_SIZE + packetLength;
+        _records++;
+
+        if (_format == HCI_LOG_BTSNOOP_H4)
+        {
+          isEvent = packetLength > 0 && packet[0] == H4_EVENT;
+          packet++;
+          packetLength = packetLength > 0 ? packetLength - 1 : 0;
+        }
+        else
+        {
+          uint32_t flags = readBigEndian32(&record[8]);
+          isEvent = (flags & (BTSNOOP_FLAG_COMMAND_OR_EVENT | BTSNOOP_FLAG_RECEIVED)) ==
+                    (BTSNOOP_FLAG_COMMAND_OR_EVENT | BTSNOOP_FLAG_RECEIVED);
+        }
+      }
+
+      // the parameter length must agree with the record, a snap length may have cut the event
+      if (isEvent && packetLength >= HCI_EVENT_HEADER_SIZE && packet[1] + HCI_EVENT_HEADER_SIZE <= packetLength)
+      {
+        *event = packet;
+        *length = packet[1] + HCI_EVENT_HEADER_SIZE;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t records() const { return _records; }
+  bool truncated() const { return _truncated; }
+
+private:
+  /// @brief A raw H4 stream has no records, the length is in the header of each packet type.
+  bool nextH4Packet(const uint8_t **packet, size_t *length)
+  {
+    const uint8_t *start = &_data[_position];
+    size_t available = _size - _position;
+    size_t header;
+    size_t payload;
+    switch (start[0])
+    {
+    case H4_COMMAND: // opcode, length
+      header = 4;
+      payload = available >= header ? start[3] : 0;
+      break;
+    case 0x02: // ACL: handle, 16 bit length
+      header = 5;
+      payload = available >= header ? start[3] | (start[4] << 8) : 0;
+      break;
+    case 0x03: // SCO: handle, length
+      header = 4;
+      payload = available >= header ? start[3] : 0;
+      break;
+    case H4_EVENT: // event code, length
+      header = 3;
+      payload = available >= header ? start[2] : 0;
+      break;
+    default:
+      _truncated = true; // lost sync, nothing after this can be trusted
+      return false;
+    }
+
+    if (available < header || available - header < payload)
+    {
+      _truncated = true;
+      return false;
+    }
+    *packet = start;
+    *length = header + payload;
+    _position += header + payload;
+    _records++;
+    return true;
+  }
+
+  const uint8_t *_data;
+  size_t _size;
+  size_t _position = 0;
+  size_t _records = 0;
+  HciLogFormat _format = HCI_LOG_UNKNOWN;
+  bool _truncated = false;
+};
+
+struct AdvertisingReport
+{
+  const uint8_t *address; // least significant byte first, as sent over HCI
+  const uint8_t *data;
+  size_t length;
+  bool extended;
+};
+
+/// @brief Call callback(const AdvertisingReport &) for every complete report of an LE (Extended) Advertising Report event.
+/// @details Reports are read one after the other, as controllers send them and BlueZ reads them. Extended
+/// reports whose data continues in a later event are skipped, BTHome fits one event.
+/// @return Number of reports skipped as fragments or malformed.
+template <typename Callback>
+static size_t forEachReport(const uint8_t *event, size_t length, Callback callback)
+{
+  if (event[0] != HCI_EVENT_LE_META || length < HCI_EVENT_HEADER_SIZE + 2)
+  {
+    return 0;
+  }
+
+  uint8_t subevent = event[HCI_EVENT_HEADER_SIZE];
+  bool extended = subevent == HCI_LE_EXTENDED_ADVERTISING_REPORT;
+  if (subevent != HCI_LE_ADVERTISING_REPORT && !extended)
+  {
+    return 0;
+  }
+
+  size_t reports = event[HCI_EVENT_HEADER_SIZE + 1];
+  size_t position = HCI_EVENT_HEADER_SIZE + 2;
+  size_t header = extended ? HCI_EXTENDED_ADVERTISING_REPORT_HEADER : HCI_ADVERTISING_REPORT_HEADER;
+  size_t trailer = extended ? 0 : HCI_ADVERTISING_REPORT_TRAILER;
+  size_t skipped = 0;
+  for (size_t i = 0; i < reports; i++)
+  {
+    if (length - position < header || length - position - header < event[position + header - 1] + trailer)
+    {
+      return skipped + reports - i;
+    }
+
+    const uint8_t *report = &event[position];
+    AdvertisingReport advertisingReport;
+    advertisingReport.address = &report[extended ? HCI_EXTENDED_REPORT_ADDRESS_OFFSET : HCI_REPORT_ADDRESS_OFFSET];
+    advertisingReport.length = report[header - 1];
+    advertisingReport.data = &report[header];
+    advertisingReport.extended = extended;
+    position += header + advertisingReport.length + trailer;
+
+    // bits 5-6 of the extended event type: 0 complete, 1 more data to come, 2 truncated
+    if (extended && (report[0] & 0x60) != 0)
+    {
+      skipped++;
+      continue;
+    }
+    callback(advertisingReport);
+  }
+  return skipped;
+}
+
+enum Stage
+{
+  STAGE_RECORDS,
+  STAGE_REPORTS,
+  STAGE_EXTRACT,
+  STAGE_DECRYPT,
+  STAGE_DECODE,
+  STAGE_COUNT
+};
+
+static const char *const STAGE_NAMES[STAGE_COUNT] = {"read records", "advertising reports", "find service data",
+                                                     "decrypt (AES-CCM)", "decode (descriptors)"};
+static const char *const STAGE_ITEMS[STAGE_COUNT] = {"event", "event", "report", "encrypted", "packet"};
+
+struct ReplayTotals
+{
+  size_t events;
+  size_t eventBytes;
+  size_t reports;
+  size_t extendedReports;
+  size_t skippedReports;
+  size_t packets;
+  size_t encrypted;
+  size_t decrypted;
+  size_t unknownDevice;
+  size_t decryptFailed;
+  size_t parseErrors;
+  size_t measurements;
+  uint64_t checksum;
+};
+
+/// @brief One pass over the log, up to and including LAST. Running it for every stage and taking the
+/// differences gives the cost per stage without timing calls inside the loop.
+template <int LAST>
+static ReplayTotals replay(const MappedFile &file, BtHomeV2KeyStore &keyStore)
+{
+  ReplayTotals totals = {};
+  HciLogReader reader(file.data(), file.size());
+  const uint8_t *event;
+  size_t length;
+  while (reader.nextEvent(&event, &length))
+  {
+    totals.events++;
+    totals.eventBytes += length;
+    if (LAST < STAGE_REPORTS)
+    {
+      continue;
+    }
+
+    totals.skippedReports += forEachReport(event, length, [&](const AdvertisingReport &report) {
+      totals.reports++;
+      totals.extendedReports += report.extended;
+      if (LAST < STAGE_EXTRACT)
+      {
+        return;
+      }
+
+      const uint8_t *serviceData;
+      size_t serviceDataLength;
+      if (!BtHomeV2Parser::findServiceData(report.data, report.length, &serviceData, &serviceDataLength))
+      {
+        return;
+      }
+      totals.packets++;
+      bool encrypted = serviceData[0] & FLAG_ENCRYPT;
+      totals.encrypted += encrypted;
+      if (LAST < STAGE_DECRYPT)
+      {
+        return;
+      }
+
+      uint8_t measurements[MAX_EXTENDED_ADVERTISEMENT_SIZE];
+      size_t measurementsLength = 0;
+      if (encrypted)
+      {
+        uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+        for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+        {
+          macAddress[i] = report.address[BLE_MAC_ADDRESS_LENGTH - 1 - i];
+        }
+        BtHomeDecryptStatus status =
+            keyStore.decrypt(macAddress, serviceData, serviceDataLength, measurements, &measurementsLength);
+        if (status != BTHOME_DECRYPT_OK)
+        {
+          totals.unknownDevice += status == BTHOME_DECRYPT_UNKNOWN_DEVICE;
+          totals.decryptFailed += status != BTHOME_DECRYPT_UNKNOWN_DEVICE;
+          return;
+        }
+        totals.decrypted++;
+      }
+      if (LAST < STAGE_DECODE)
+      {
+        return;
+      }
+
+      BtHomeV2Parser parser = encrypted ? BtHomeV2Parser::fromMeasurements(serviceData[0], measurements, measurementsLength)
+                                        : BtHomeV2Parser(serviceData, serviceDataLength);
+      BtHomeMeasurement measurement;
+      while (parser.next(measurement))
+      {
+        totals.measurements++;
+        totals.checksum += (static_cast<uint64_t>(measurement.info.id) << 48) + static_cast<uint64_t>(measurement.rawValue);
+      }
+      totals.parseErrors += parser.status() != BTHOME_PARSE_OK;
+    });
+  }
+  return totals;
+}
+
+// keeps the optimiser from dropping passes whose totals are never printed
+static volatile uint64_t g_sink;
+
+typedef ReplayTotals (*ReplayFunction)(const MappedFile &, BtHomeV2KeyStore &);
+
+static const ReplayFunction STAGE_REPLAYS[STAGE_COUNT] = {replay<STAGE_RECORDS>, replay<STAGE_REPORTS>,
+                                                          replay<STAGE_EXTRACT>, replay<STAGE_DECRYPT>,
+                                                          replay<STAGE_DECODE>};
+
+static double elapsedNs(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct Expectation
+{
+  bool present;
+  size_t packets;
+  size_t encrypted;
+  size_t measurements;
+  uint64_t checksum;
+};
+
+static bool parseKey(const char *line, uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint8_t key[BIND_KEY_LEN])
+{
+  unsigned int bytes[BLE_MAC_ADDRESS_LENGTH];
+  char hex[2 * BIND_KEY_LEN + 1];
+  if (sscanf(line, "key %2x:%2x:%2x:%2x:%2x:%2x %32s", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5],
+             hex) != 7 ||
+      strlen(hex) != 2 * BIND_KEY_LEN)
+  {
+    return false;
+  }
+
+  for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+  {
+    macAddress[i] = static_cast<uint8_t>(bytes[i]);
+  }
+  for (size_t i = 0; i < BIND_KEY_LEN; i++)
+  {
+    char digits[3] = {hex[2 * i], hex[2 * i + 1], 0};
+    char *end;
+    key[i] = static_cast<uint8_t>(strtoul(digits, &end, 16));
+    if (*end)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// @brief Read the keys file twice: once to size the key store, once to fill it.
+static BtHomeV2KeyStore *loadKeys(const char *path, bool required, Expectation &expectation)
+{
+  FILE *file = fopen(path, "r");
+  if (!file)
+  {
+    if (required)
+    {
+      perror(path);
+      return nullptr;
+    }
+    return new BtHomeV2KeyStore(1);
+  }
+
+  char line[256];
+  size_t keys = 0;
+  while (fgets(line, sizeof(line), file))
+  {
+    keys += strncmp(line, "key ", 4) == 0;
+  }
+
+  BtHomeV2KeyStore *keyStore = new BtHomeV2KeyStore(keys ? keys : 1);
+  rewind(file);
+  size_t lineNumber = 0;
+  bool valid = true;
+  while (valid && fgets(line, sizeof(line), file))
+  {
+    lineNumber++;
+    unsigned long long checksum;
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    uint8_t key[BIND_KEY_LEN];
+    if (strncmp(line, "key ", 4) == 0)
+    {
+      valid = parseKey(line, macAddress, key) && keyStore->addKey(macAddress, key);
+    }
+    else if (strncmp(line, "expect ", 7) == 0)
+    {
+      valid = sscanf(line, "expect %zu %zu %zu %llx", &expectation.packets, &expectation.encrypted,
+                     &expectation.measurements, &checksum) == 4;
+      expectation.checksum = checksum;
+      expectation.present = valid;
+    }
+  }
+  fclose(file);
+
+  if (!valid)
+  {
+    fprintf(stderr, "%s:%zu: expected \"key AA:BB:CC:DD:EE:FF <32 hex digits>\" or \"expect ...\"\n", path, lineNumber);
+    delete keyStore;
+    return nullptr;
+  }
+  return keyStore;
+}
+
+static void printTotals(const ReplayTotals &totals)
+{
+  printf("HCI events %zu, advertising reports %zu (extended %zu, skipped %zu)\n", totals.events, totals.reports,
+         totals.extendedReports, totals.skippedReports);
+  printf("BTHome packets %zu, encrypted %zu: decrypted %zu, unknown device %zu, failed %zu\n", totals.packets,
+         totals.encrypted, totals.decrypted, totals.unknownDevice, totals.decryptFailed);
+  printf("measurements %zu, parse errors %zu, checksum %016llx\n", totals.measurements, totals.parseErrors,
+         static_cast<unsigned long long>(totals.checksum));
+}
+
+/// @return The number of items a stage handles, for its cost per item.
+static size_t stageItems(int stage, const ReplayTotals &totals)
+{
+  switch (stage)
+  {
+  case STAGE_RECORDS:
+  case STAGE_REPORTS:
+    return totals.events;
+  case STAGE_EXTRACT:
+    return totals.reports;
+  case STAGE_DECRYPT:
+    return totals.encrypted;
+  default:
+    return totals.packets;
+  }
+}
+
+static void printStages(const double bestNs[STAGE_COUNT], const ReplayTotals &totals, size_t fileSize)
+{
+  printf("\n%-24s %10s %10s %12s %12s %7s\n", "stage", "items", "per", "ns/item", "ns/packet", "share");
+  double previous = 0;
+  for (int stage = 0; stage < STAGE_COUNT; stage++)
+  {
+    // a stage costs the difference to the pass before, which can come out slightly negative in the noise
+    double ns = bestNs[stage] > previous ? bestNs[stage] - previous : 0;
+    previous = bestNs[stage] > previous ? bestNs[stage] : previous;
+    size_t items = stageItems(stage, totals);
+    printf("%-24s %10zu %10s %12.1f %12.1f %6.1f%%\n", STAGE_NAMES[stage], items, STAGE_ITEMS[stage],
+           items ? ns / items : 0.0, totals.packets ? ns / totals.packets : 0.0, 100.0 * ns / bestNs[STAGE_COUNT - 1]);
+  }
+
+  double seconds = bestNs[STAGE_COUNT - 1] / 1e9;
+  printf("%-24s %10zu %10s %12.1f %12.1f %6.1f%%\n", "total", totals.packets, "packet",
+         totals.packets ? bestNs[STAGE_COUNT - 1] / totals.packets : 0.0,
+         totals.packets ? bestNs[STAGE_COUNT - 1] / totals.packets : 0.0, 100.0);
+  printf("\n%.0f BTHome packets/s, %.0f HCI events/s, %.1f MB/s of log\n", totals.packets / seconds,
+         totals.events / seconds, fileSize / seconds / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+  const char *logPath = nullptr;
+  const char *keysPath = nullptr;
+  size_t repeat = 5;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--keys") && i + 1 < argc)
+    {
+      keysPath = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--repeat") && i + 1 < argc)
+    {
+      repeat = strtoul(argv[++i], nullptr, 0);
+    }
+    else if (argv[i][0] != '-' && !logPath)
+    {
+      logPath = argv[i];
+    }
+    else
+    {
+      logPath = nullptr;
+      break;
+    }
+  }
+  if (!logPath || repeat == 0)
+  {
+    fprintf(stderr, "usage: %s capture.btsnoop [--keys file] [--repeat N]\n", argv[0]);
+    return 1;
+  }
+
+  MappedFile file(logPath);
+  if (!file.isOpen())
+  {
+    fprintf(stderr, "%s: cannot map the file\n", logPath);
+    return 1;
+  }
+  HciLogReader probe(file.data(), file.size());
+  if (probe.format() == HCI_LOG_UNKNOWN)
+  {
+    fprintf(stderr, "%s: neither a btsnoop file (H4 or HCI datalink) nor a raw H4 stream\n", logPath);
+    return 1;
+  }
+
+  std::string defaultKeysPath = std::string(logPath) + ".keys";
+  Expectation expectation = {};
+  BtHomeV2KeyStore *keyStore = loadKeys(keysPath ? keysPath : defaultKeysPath.c_str(), keysPath != nullptr, expectation);
+  if (!keyStore)
+  {
+    return 1;
+  }
+
+  // the first pass also pages the file in
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  ReplayTotals totals = replay<STAGE_DECODE>(file, *keyStore);
+  double coldNs = elapsedNs(start);
+
+  double bestNs[STAGE_COUNT];
+  for (int stage = 0; stage < STAGE_COUNT; stage++)
+  {
+    bestNs[stage] = 0;
+    for (size_t r = 0; r < repeat; r++)
+    {
+      start = std::chrono::steady_clock::now();
+      ReplayTotals pass = STAGE_REPLAYS[stage](file, *keyStore);
+      double ns = elapsedNs(start);
+      bestNs[stage] = r == 0 || ns < bestNs[stage] ? ns : bestNs[stage];
+      g_sink += pass.events + pass.reports + pass.packets + pass.checksum;
+    }
+  }
+
+  HciLogReader reader(file.data(), file.size());
+  const uint8_t *event;
+  size_t length;
+  while (reader.nextEvent(&event, &length))
+  {
+  }
+  printf("%s: %s, %.1f MB, %zu records%s, %zu keys\n", logPath, FORMAT_NAMES[probe.format()], file.size() / 1e6,
+         reader.records(), reader.truncated() ? " (truncated at the end)" : "", keyStore->size());
+  printTotals(totals);
+  printStages(bestNs, totals, file.size());
+  printf("first pass, paging the file in: %.1f ms (best pass %.1f ms, %zu repeats per stage)\n", coldNs / 1e6,
+         bestNs[STAGE_COUNT - 1] / 1e6, repeat);
+  delete keyStore;
+
+  if (!expectation.present)
+  {
+    return 0;
+  }
+  bool matches = totals.packets == expectation.packets && totals.encrypted == expectation.encrypted &&
+                 totals.decrypted == expectation.encrypted && totals.measurements == expectation.measurements &&
+                 totals.checksum == expectation.checksum && totals.parseErrors == 0;
+  printf("totals against the corpus: %s\n", matches ? "OK" : "FAIL");
+  return matches ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+#ifndef BTHOME_HOST_HCI_LOG_H
+#define BTHOME_HOST_HCI_LOG_H
+
+// The parts of the btsnoop file format and of HCI that bthome_corpus writes and bthome_replay reads:
+// LE Advertising Report and LE Extended Advertising Report events, either in a btsnoop file
+// (as written by btmon, Android and the ESP-IDF HCI logger) or as a raw stream of H4 packets.
+
+#include <stddef.h>
+#include <stdint.h>
+
+static const uint8_t BTSNOOP_MAGIC[8] = {'b', 't', 's', 'n', 'o', 'o', 'p', 0};
+static const size_t BTSNOOP_HEADER_SIZE = 16;  // magic, version, datalink type
+static const size_t BTSNOOP_RECORD_HEADER_SIZE = 24; // original length, included length, flags, drops, timestamp
+static const uint32_t BTSNOOP_VERSION = 1;
+static const uint32_t BTSNOOP_DATALINK_HCI = 1001; // no packet type byte, the flags tell commands/events from data
+static const uint32_t BTSNOOP_DATALINK_H4 = 1002;  // every packet starts with its H4 packet type
+static const uint32_t BTSNOOP_FLAG_RECEIVED = 0x01;
+static const uint32_t BTSNOOP_FLAG_COMMAND_OR_EVENT = 0x02;
+// timestamps are microseconds since 0000-01-01, this is 1970-01-01
+static const uint64_t BTSNOOP_UNIX_EPOCH = 0x00dcddb30f2f8000ull;
+
+static const uint8_t H4_COMMAND = 0x01;
+static const uint8_t H4_EVENT = 0x04;
+static const size_t HCI_EVENT_HEADER_SIZE = 2; // event code, parameter length
+
+static const uint8_t HCI_EVENT_COMMAND_COMPLETE = 0x0E;
+static const uint8_t HCI_EVENT_LE_META = 0x3E;
+static const uint8_t HCI_LE_ADVERTISING_REPORT = 0x02;
+static const uint8_t HCI_LE_EXTENDED_ADVERTISING_REPORT = 0x0D;
+
+// bytes of one report around the advertising data, up to the data length byte and after the data
+static const size_t HCI_ADVERTISING_REPORT_HEADER = 9;           // event type, address type, address, data length
+static const size_t HCI_ADVERTISING_REPORT_TRAILER = 1;          // RSSI
+static const size_t HCI_EXTENDED_ADVERTISING_REPORT_HEADER = 24; // ... address, PHYs, SID, TX power, RSSI, interval, direct address, data length
+static const size_t HCI_REPORT_ADDRESS_OFFSET = 2;               // legacy report, after event type and address type
+static const size_t HCI_EXTENDED_REPORT_ADDRESS_OFFSET = 3;      // extended report, the event type has 2 bytes
+
+inline uint32_t readBigEndian32(const uint8_t *data)
+{
+  return (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) |
+         (static_cast<uint32_t>(data[2]) << 8) | data[3];
+}
+
+inline uint64_t readBigEndian64(const uint8_t *data)
+{
+  return (static_cast<uint64_t>(readBigEndian32(data)) << 32) | readBigEndian32(data + 4);
+}
+
+inline void writeBigEndian32(uint8_t *data, uint32_t value)
+{
+  data[0] = static_cast<uint8_t>(value >> 24);
+  data[1] = static_cast<uint8_t>(value >> 16);
+  data[2] = static_cast<uint8_t>(value >> 8);
+  data[3] = static_cast<uint8_t>(value);
+}
+
+inline void writeBigEndian64(uint8_t *data, uint64_t value)
+{
+  writeBigEndian32(data, static_cast<uint32_t>(value >> 32));
+  writeBigEndian32(data + 4, static_cast<uint32_t>(value));
+}
+
+#endif // BTHOME_HOST_HCI_LOG_H
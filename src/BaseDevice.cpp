@@ -1,45 +1,500 @@
 #include "Arduino.h"
 #include "BaseDevice.h"
+#include "BtHomeV2CounterStore.h"
+
+struct Deadband
+{
+  uint8_t id;
+  bool signed_value;
+  uint32_t threshold; // in encoded (raw) steps
+};
+
+// the measurements of the last advertisement, compared against by isAdvertisementNeeded
+struct ChangeSuppression
+{
+  uint8_t *sentData = nullptr;
+  MeasurementEntry *sentEntries = nullptr;
+  uint8_t sentEntryCount = 0;
+  bool sent = false;
+  uint32_t lastSentMillis = 0;
+  uint32_t maxSilenceMillis = 0;
+  Deadband *deadbands = nullptr;
+  uint8_t deadbandCapacity = 0;
+  uint8_t deadbandCount = 0;
+};
+
+/// @brief Write a name AD structure (length, type, name without terminator).
+/// @return Size of the AD structure.
+static uint8_t serializeNameAD(uint8_t *ad, uint8_t type, const char *name, size_t maxLength)
+{
+  size_t nameLength = strnlen(name, maxLength);
+  ad[0] = nameLength + TYPE_INDICATOR_SIZE;
+  ad[1] = type;
+  memcpy(&ad[NAME_AD_OVERHEAD], name, nameLength);
+  return nameLength + NAME_AD_OVERHEAD;
+}
 
 /// @brief
 /// @param shortName - Short name of the device - sent when space is limited. Max 12 characters.
 /// @param completeName - Full name of the device - sent when space is available.
 /// @param isTriggerBased
-BaseDevice::BaseDevice(const char *shortName, const char *completeName, bool isTriggerBased)
+/// @param maxAdvertisementSize - Packet size, from MAX_ADVERTISEMENT_SIZE (legacy) up to MAX_EXTENDED_ADVERTISEMENT_SIZE (BLE 5 extended advertising).
+BaseDevice::BaseDevice(const char *shortName, const char *completeName, bool isTriggerBased, size_t maxAdvertisementSize)
     : _triggerDevice(isTriggerBased)
 {
+  maxAdvertisementSize = std::min(std::max(maxAdvertisementSize, MAX_ADVERTISEMENT_SIZE), MAX_EXTENDED_ADVERTISEMENT_SIZE);
+  _maxAdvertisementSize = maxAdvertisementSize;
+  if (maxAdvertisementSize > MAX_ADVERTISEMENT_SIZE)
+  {
+    allocateMeasurementBuffer(maxAdvertisementSize - HEADER_SIZE + 1);
+  }
 
-  strncpy(_shortName, shortName, MAX_LENGTH_SHORT_NAME);
-  _shortName[MAX_LENGTH_SHORT_NAME] = '\0';
-
-  strncpy(_completeName, completeName, MAX_LENGTH_COMPLETE_NAME);
-  _completeName[MAX_LENGTH_COMPLETE_NAME] = '\0';
+  _completeNameADLength = serializeNameAD(_nameADs, COMPLETE_NAME, completeName, MAX_LENGTH_COMPLETE_NAME);
+  _shortNameADLength = serializeNameAD(&_nameADs[_completeNameADLength], SHORT_NAME, shortName, MAX_LENGTH_SHORT_NAME);
+  serializeHeaderTemplate();
 
   resetMeasurement();
 }
 
 BaseDevice::BaseDevice(const char *shortName, const char *completeName, bool isTriggerBased,
-                       uint8_t const *const key, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter)
-    : BaseDevice(shortName, completeName, isTriggerBased)
+                       uint8_t const *const key, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter,
+                       size_t maxAdvertisementSize)
+    : BaseDevice(shortName, completeName, isTriggerBased, maxAdvertisementSize)
 {
   _useEncryption = true;
   _counter = counter;
+  serializeHeaderTemplate();
 
   memcpy(bindKey, key, sizeof(uint8_t) * BIND_KEY_LEN);
   memcpy(_macAddress, macAddress, BLE_MAC_ADDRESS_LENGTH);
-  mbedtls_ccm_init(&this->_encryptCTX);
-  mbedtls_ccm_setkey(&this->_encryptCTX, MBEDTLS_CIPHER_ID_AES, bindKey, ENCRYPTION_KEY_LENGTH * 8);
+  _encryptCTX.setKey(bindKey);
+}
+
+/// @brief Switch to another device identity, so one encoder can build packets for several devices (see BtHomeV2Multiplexer).
+/// @details The measurements are kept. The names are copied, the key is expanded again unless expandedKey is given.
+/// @param key - nullptr for an unencrypted device, macAddress and counter are ignored then.
+/// @param expandedKey - A context already keyed, used until the next setIdentity instead of expanding key again; key
+/// may be nullptr then. Kept by pointer. With the mbedtls backend every expansion allocates, so callers switching
+/// often keep one each.
+void BaseDevice::setIdentity(const char *shortName, const char *completeName, bool isTriggerBased,
+                             uint8_t const *const key, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter,
+                             BtHomeV2Ccm *expandedKey)
+{
+  _completeNameADLength = serializeNameAD(_nameADs, COMPLETE_NAME, completeName, MAX_LENGTH_COMPLETE_NAME);
+  _shortNameADLength = serializeNameAD(&_nameADs[_completeNameADLength], SHORT_NAME, shortName, MAX_LENGTH_SHORT_NAME);
+  _triggerDevice = isTriggerBased;
+  _useEncryption = key != nullptr || expandedKey != nullptr;
+  serializeHeaderTemplate();
+
+  if (_useEncryption)
+  {
+    _counter = counter;
+    memcpy(_macAddress, macAddress, BLE_MAC_ADDRESS_LENGTH);
+    _cipher = expandedKey ? expandedKey : &_encryptCTX;
+    if (!expandedKey)
+    {
+      memcpy(bindKey, key, BIND_KEY_LEN);
+      _encryptCTX.setKey(bindKey);
+    }
+  }
+}
+
+/// @brief Serialize the bytes in front of the measurements, they only depend on the device configuration.
+/// The service data length (index 3) is filled in per packet.
+void BaseDevice::serializeHeaderTemplate()
+{
+  uint8_t indicatorByte = FLAG_VERSION;
+
+  if (_triggerDevice)
+  {
+    indicatorByte |= FLAG_TRIGGER;
+  }
+
+  if (_useEncryption)
+  {
+    indicatorByte |= FLAG_ENCRYPT;
+  }
+
+  _headerTemplate[0] = FLAG1;
+  _headerTemplate[1] = FLAG2;
+  _headerTemplate[2] = FLAG3;
+  _headerTemplate[3] = 0;            // Length of the Service Data
+  _headerTemplate[4] = SERVICE_DATA; // DO NOT CHANGE -- Service Data - 16-bit UUID
+  _headerTemplate[5] = UUID1;        // DO NOT CHANGE -- UUID
+  _headerTemplate[6] = UUID2;        // DO NOT CHANGE -- UUID
+  _headerTemplate[7] = indicatorByte;
+}
+
+BaseDevice::~BaseDevice()
+{
+  if (_sensorData != _legacySensorData)
+  {
+    delete[] _sensorData;
+    delete[] _entries;
+  }
+
+  if (_suppression)
+  {
+    delete[] _suppression->sentData;
+    delete[] _suppression->sentEntries;
+    delete[] _suppression->deadbands;
+    delete _suppression;
+  }
+}
+
+/// @brief Replace the measurement buffer. Only called while configuring the device;
+/// adding, clearing and advertising reuse the buffer.
+void BaseDevice::allocateMeasurementBuffer(size_t bufferSize)
+{
+  if (_sensorData != _legacySensorData)
+  {
+    delete[] _sensorData;
+    delete[] _entries;
+  }
+
+  _sensorDataCapacity = bufferSize;
+  _entryCapacity = bufferSize / MIN_MEASUREMENT_ENTRY_SIZE;
+  _sensorData = new uint8_t[_sensorDataCapacity];
+  _entries = new MeasurementEntry[_entryCapacity];
+  resetMeasurement();
+
+  if (_suppression)
+  {
+    allocateChangeSuppression();
+  }
+}
+
+/// @brief (Re)allocate the copy of the last advertised measurements, sized like the measurement buffer.
+void BaseDevice::allocateChangeSuppression()
+{
+  delete[] _suppression->sentData;
+  delete[] _suppression->sentEntries;
+  _suppression->sentData = new uint8_t[_sensorDataCapacity];
+  _suppression->sentEntries = new MeasurementEntry[_entryCapacity];
+  _suppression->sentEntryCount = 0;
+  _suppression->sent = false;
+}
+
+/// @brief Only advertise when a measurement changed, see isAdvertisementNeeded.
+/// @details Call once while setting up, this allocates a copy of the measurement buffer.
+/// @param maxSilenceMillis - Heartbeat, advertise at least this often even if nothing changed. 0 disables it.
+/// @param maxDeadbands - Number of sensors that can get a deadband with setDeadband.
+/// @return false if already enabled.
+bool BaseDevice::enableChangeSuppression(uint32_t maxSilenceMillis, size_t maxDeadbands)
+{
+  if (_suppression)
+  {
+    return false;
+  }
+
+  _suppression = new ChangeSuppression();
+  _suppression->maxSilenceMillis = maxSilenceMillis;
+  _suppression->deadbandCapacity = std::min(maxDeadbands, static_cast<size_t>(UINT8_MAX));
+  _suppression->deadbands = new Deadband[_suppression->deadbandCapacity];
+  allocateChangeSuppression();
+  return true;
+}
+
+/// @brief Treat changes of a sensor up to threshold as unchanged. Sensors without a deadband count any change.
+/// @param sensor - The sensor type, applies to every measurement of this type.
+/// @param threshold - In the sensor's unit, rounded to its resolution. Setting it again replaces the threshold.
+/// @return false if change suppression is not enabled or all deadbands are in use.
+bool BaseDevice::setDeadband(BtHomeType sensor, float threshold)
+{
+  if (!_suppression)
+  {
+    return false;
+  }
+
+  Deadband *deadband = nullptr;
+  for (uint8_t i = 0; i < _suppression->deadbandCount; i++)
+  {
+    if (_suppression->deadbands[i].id == sensor.id)
+    {
+      deadband = &_suppression->deadbands[i];
+    }
+  }
+
+  if (!deadband)
+  {
+    if (_suppression->deadbandCount >= _suppression->deadbandCapacity)
+    {
+      return false;
+    }
+    deadband = &_suppression->deadbands[_suppression->deadbandCount++];
+  }
+
+  deadband->id = sensor.id;
+  deadband->signed_value = sensor.signed_value;
+  deadband->threshold = static_cast<uint32_t>((threshold < 0 ? -threshold : threshold) / sensor.scale + 0.5f);
+  return true;
+}
+
+static int64_t readEncodedValue(const uint8_t *data, uint8_t byteCount, bool signedValue)
+{
+  uint64_t value = 0;
+  for (uint8_t i = 0; i < byteCount; i++)
+  {
+    value |= static_cast<uint64_t>(data[i]) << (8 * i);
+  }
+
+  if (signedValue && byteCount > 0 && byteCount < 8 && (data[byteCount - 1] & 0x80))
+  {
+    value |= ~0ULL << (8 * byteCount);
+  }
+  return static_cast<int64_t>(value);
+}
+
+/// @brief Whether the current measurements differ from the last advertisement.
+/// @details Compares the encoded bytes, so changes below the sensor resolution never count.
+/// Always true until the first advertisement, when the set of measurements changed, or when the heartbeat is due.
+/// Without enableChangeSuppression every cycle needs an advertisement.
+bool BaseDevice::isAdvertisementNeeded() const
+{
+  if (!_suppression || !_suppression->sent)
+  {
+    return true;
+  }
+
+  if (_suppression->maxSilenceMillis && static_cast<uint32_t>(millis()) - _suppression->lastSentMillis >= _suppression->maxSilenceMillis)
+  {
+    return true;
+  }
+
+  if (_entryCount != _suppression->sentEntryCount)
+  {
+    return true;
+  }
+
+  for (uint8_t i = 0; i < _entryCount; i++)
+  {
+    const MeasurementEntry &current = _entries[i];
+    const MeasurementEntry &sent = _suppression->sentEntries[i];
+    const uint8_t *currentBytes = &_sensorData[current.offset];
+    const uint8_t *sentBytes = &_suppression->sentData[sent.offset];
+
+    if (current.length != sent.length || currentBytes[0] != sentBytes[0])
+    {
+      return true;
+    }
+
+    if (memcmp(currentBytes, sentBytes, current.length) == 0)
+    {
+      continue;
+    }
+
+    const Deadband *deadband = nullptr;
+    for (uint8_t d = 0; d < _suppression->deadbandCount; d++)
+    {
+      if (_suppression->deadbands[d].id == currentBytes[0])
+      {
+        deadband = &_suppression->deadbands[d];
+      }
+    }
+
+    if (!deadband)
+    {
+      return true;
+    }
+
+    // skip the object id
+    uint8_t byteCount = current.length - 1;
+    int64_t delta = readEncodedValue(currentBytes + 1, byteCount, deadband->signed_value) -
+                    readEncodedValue(sentBytes + 1, byteCount, deadband->signed_value);
+    if (static_cast<uint64_t>(delta < 0 ? -delta : delta) > deadband->threshold)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/// @brief Remember the measurements being advertised for isAdvertisementNeeded.
+void BaseDevice::recordTransmitted()
+{
+  memcpy(_suppression->sentData, _sensorData, _sensorDataIdx);
+  memcpy(_suppression->sentEntries, _entries, _entryCount * sizeof(MeasurementEntry));
+  _suppression->sentEntryCount = _entryCount;
+  _suppression->lastSentMillis = millis();
+  _suppression->sent = true;
+}
+
+/// @brief Accept more measurements than fit in one packet. Use nextAdvertisement to get all packets.
+/// @details Call once while setting up, it clears the current measurements.
+/// @param maxMeasurementBytes - Total size of all measurements (object ids included), up to MAX_OVERFLOW_MEASUREMENT_BUFFER_SIZE.
+/// @return false if maxMeasurementBytes is out of range.
+bool BaseDevice::enableOverflow(size_t maxMeasurementBytes)
+{
+  if (maxMeasurementBytes > MAX_OVERFLOW_MEASUREMENT_BUFFER_SIZE)
+  {
+    return false;
+  }
+
+  _overflow = true;
+  if (maxMeasurementBytes > _sensorDataCapacity)
+  {
+    allocateMeasurementBuffer(maxMeasurementBytes);
+  }
+  resetMeasurement();
+  return true;
+}
+
+/// @brief Start every packet with a packet id (object 0x00) that changes with every packet built.
+/// @details Receivers drop a packet whose id they have just seen, so the same advertisement can be sent
+/// several times (see BtHomeV2BurstScheduler) and is still handled once. Costs PACKET_ID_SIZE bytes per packet;
+/// call while setting up, before adding measurements. The id starts at 1; a device that is constructed again on
+/// every wake must continue it with setPacketId, or the receiver drops every event after the first as a copy.
+void BaseDevice::enablePacketId()
+{
+  _packetIdEnabled = true;
+}
+
+/// @brief Continue the packet ids after packetId, e.g. getPacketId() before deep sleep, kept in RTC memory.
+/// @details The next packet built gets packetId + 1.
+void BaseDevice::setPacketId(uint8_t packetId)
+{
+  _packetId = packetId;
+}
+
+/// @brief Keep the encryption counter in store, so it continues after deep sleep or a reboot.
+/// @details Loads the stored counter (the constructor's counter is used when the store is empty) and
+/// reserves the next blockSize counters by saving counter + blockSize. The store is written again only
+/// when the block is used up. After a crash the device continues after the reserved block, skipping
+/// at most blockSize counters but never reusing one. No packet is encrypted with a counter beyond the saved
+/// reservation: while a reservation can not be saved, getAdvertisementData and nextAdvertisement return 0 and
+/// the next call tries again. getLastStatus tells this apart from the end of an overflow sequence.
+/// @param store - Must outlive the device.
+/// @param blockSize - Packets per store write. 1 for RTC memory, e.g. 256 for flash.
+/// @return false if the reservation could not be saved.
+bool BaseDevice::setCounterStore(BtHomeV2CounterStore *store, uint32_t blockSize)
+{
+  _counterStore = store;
+  _counterBlockSize = blockSize ? blockSize : 1;
+
+  uint32_t storedCounter;
+  if (_counterStore->load(storedCounter) && storedCounter > _counter)
+  {
+    _counter = storedCounter;
+  }
+
+  _counterReservedUntil = 0;
+  return reserveCounters();
+}
+
+/// @brief Save the end of the next counter block.
+/// @return false if the store could not save it. The old reservation is kept, so nothing beyond it is sent.
+bool BaseDevice::reserveCounters()
+{
+  uint32_t reservedUntil = _counter + _counterBlockSize;
+  // the stored value is the first counter after a restart, so it can not be 0 (empty RTC slot) when wrapping
+  if (reservedUntil < _counter)
+  {
+    reservedUntil = UINT32_MAX;
+  }
+
+  if (!_counterStore->save(reservedUntil))
+  {
+    return false;
+  }
+  _counterReservedUntil = reservedUntil;
+  return true;
+}
+
+/// @brief Choose which packets carry the names, to save bytes and airtime when the receiver already knows the device.
+/// @details Measurements always come first, names only use the space left. A due name that does not fit is sent in
+/// the next packet it fits in, so EVERY_NTH and FIRST_N count packets that actually carried a name. Setting a policy
+/// restarts it, the next packet carries the name. After deep sleep the device starts over; choose ALWAYS or NEVER
+/// per wake from a counter kept in RTC memory instead.
+/// @param count - N for BTHOME_NAME_EVERY_NTH and BTHOME_NAME_FIRST_N.
+/// @return false if count is 0 for BTHOME_NAME_EVERY_NTH.
+bool BaseDevice::setNamePolicy(BtHomeNamePolicy policy, uint16_t count)
+{
+  if (policy == BTHOME_NAME_EVERY_NTH && count == 0)
+  {
+    return false;
+  }
+
+  _namePolicy = policy;
+  _namePolicyCount = count;
+  // EVERY_NTH: as if the last name was N packets ago
+  _namePackets = policy == BTHOME_NAME_EVERY_NTH ? count - 1 : 0;
+  return true;
+}
+
+bool BaseDevice::isNameDue() const
+{
+  switch (_namePolicy)
+  {
+  case BTHOME_NAME_EVERY_NTH:
+    return _namePackets >= _namePolicyCount - 1;
+  case BTHOME_NAME_FIRST_N:
+    return _namePackets < _namePolicyCount;
+  case BTHOME_NAME_NEVER:
+    return false;
+  default:
+    return true;
+  }
+}
+
+/// @brief Advance the name policy after every packet. A due name that did not fit stays due.
+void BaseDevice::recordName(bool sent)
+{
+  if (_namePolicy == BTHOME_NAME_EVERY_NTH)
+  {
+    if (sent)
+    {
+      _namePackets = 0;
+    }
+    else if (_namePackets < UINT16_MAX)
+    {
+      _namePackets++;
+    }
+  }
+  else if (_namePolicy == BTHOME_NAME_FIRST_N && sent)
+  {
+    _namePackets++;
+  }
+}
+
+/// @brief Encoder counters since construction or resetTelemetry. All zero unless built with BTHOME_TELEMETRY.
+BtHomeTelemetry BaseDevice::getTelemetry() const
+{
+#if defined(BTHOME_TELEMETRY)
+  return _telemetry;
+#else
+  return BtHomeTelemetry{};
+#endif
+}
+
+void BaseDevice::resetTelemetry()
+{
+#if defined(BTHOME_TELEMETRY)
+  _telemetry = BtHomeTelemetry{};
+#endif
 }
 
 /// @brief Clear the measurement data.
 void BaseDevice::resetMeasurement()
 {
   _sensorDataIdx = 0;
-  _sensorData.clear();
+  _entryCount = 0;
+  _nextPacketEntry = 0;
+  _packetSequenceDone = false;
+}
+
+/// @brief Bytes available for measurements in a single packet.
+int BaseDevice::packetMeasurementSpace() const
+{
+  // the index is at the next entry point, so there is one byte extra
+  static const uint8_t CURRENT_BYTE = 1;
+
+  return (_maxAdvertisementSize - HEADER_SIZE) + CURRENT_BYTE - (_useEncryption ? ENCRYPTION_ADDITIONAL_BYTES : 0) -
+         (_packetIdEnabled ? PACKET_ID_SIZE : 0);
 }
 
 /// @brief Check that there is enough space in the sensor data packet for the given size.
-/// @details The sensor data packet has a maximum length defined by MEASUREMENT_MAX_LEN.
+/// @details The sensor data packet has a maximum length of the packet size minus HEADER_SIZE.
 /// @param size
 /// @return Returns true if there is enough space for the given size, false otherwise.
 bool BaseDevice::hasEnoughSpace(BtHomeState sensor)
@@ -49,11 +504,34 @@ bool BaseDevice::hasEnoughSpace(BtHomeState sensor)
 
 bool BaseDevice::hasEnoughSpace(uint8_t size)
 {
-  // the index is at the next entry point, so there is one byte extra
-  static const uint8_t CURRENT_BYTE = 1;
+  bool enough = fits(size);
+  if (!enough)
+  {
+    BTHOME_TELEMETRY_ADD(measurementsRejected, 1);
+  }
+  return enough;
+}
 
-  int remainingBytes = (MAX_MEASUREMENT_SIZE - _sensorDataIdx) + CURRENT_BYTE - (_useEncryption ? ENCRYPTION_ADDITIONAL_BYTES : 0);
-  return remainingBytes >= size;
+/// @brief Whether addEncoded would take a value of this sensor now.
+/// @details Counts nothing, so callers that leave a value for a later packet (see BtHomeV2PriorityPacker) probe with
+/// this instead of having the add refused and counted as a rejected measurement.
+bool BaseDevice::hasRoomFor(BtHomeState sensor) const
+{
+  return fits(sensor.byteCount + TYPE_INDICATOR_SIZE);
+}
+
+bool BaseDevice::fits(uint8_t size) const
+{
+  if (_entryCount >= _entryCapacity)
+  {
+    return false;
+  }
+  if (_overflow)
+  {
+    // every measurement must still fit in a packet of its own
+    return packetMeasurementSpace() >= size && _sensorDataCapacity - _sensorDataIdx >= size;
+  }
+  return packetMeasurementSpace() - _sensorDataIdx >= size;
 }
 
 /// @brief Add a state or step value to the sensor data packet.
@@ -87,6 +565,21 @@ bool BaseDevice::addState(BtHomeState sensor, uint8_t state, uint8_t steps)
   return pushBytes(stepState, sensor);
 }
 
+/// @brief Add a value that is already scaled, e.g. collected from BtHomeV2Staging.
+/// @param sensor - Object id and byte count, the low byteCount bytes of rawValue are written.
+bool BaseDevice::addEncoded(BtHomeState sensor, uint32_t rawValue)
+{
+  if (!hasEnoughSpace(sensor))
+  {
+    return false;
+  }
+
+  return pushBytes(rawValue, sensor);
+}
+
+/// @brief Integer data, in the unit of the type.
+/// @details Scaled with the exact ratio, value * denominator / numerator truncated toward zero. Up to 3.1.0 this
+/// was a double division, which could come out one step low (3 on a 0.1 resolution type gave 29).
 bool BaseDevice::addUnsignedInteger(BtHomeType sensor, uint64_t value)
 {
   return addInteger(sensor, value);
@@ -104,7 +597,21 @@ bool BaseDevice::addInteger(BtHomeType sensor, T value)
   {
     return false;
   }
-  auto scaledValue = static_cast<T>(static_cast<double>(value) / sensor.scale);
+
+  T scaledValue;
+  if (sensor.scaleNumerator == sensor.scaleDenominator && sensor.scaleNumerator)
+  {
+    scaledValue = value;
+  }
+  else if (sensor.scaleNumerator)
+  {
+    // exact ratio, the same result as add<Sensor>() and no (soft) floating point
+    scaledValue = value * static_cast<T>(sensor.scaleDenominator) / static_cast<T>(sensor.scaleNumerator);
+  }
+  else
+  {
+    scaledValue = static_cast<T>(static_cast<double>(value) / sensor.scale);
+  }
   return pushBytes(scaledValue, sensor);
 }
 
@@ -119,26 +626,77 @@ bool BaseDevice::addFloat(BtHomeType sensor, float value)
     return false;
   }
 
-  float factor = sensor.scale;
-  float scaledValue = value / factor;
-  return pushBytes(static_cast<uint64_t>(scaledValue), sensor);
+  // value / 1.0f is exact, skip the division for unscaled types
+  float scaledValue = sensor.scaleNumerator == sensor.scaleDenominator && sensor.scaleNumerator ? value : value / sensor.scale;
+  return pushBytes(static_cast<uint64_t>(static_cast<int64_t>(scaledValue)), sensor);
+}
+
+/// @brief Fixed-point data: the value in thousandths of the unit, e.g. 21370 for 21.37 °C.
+/// @details Integer multiply and divide only, for parts without an FPU. Truncates toward zero like addFloat.
+/// See add<Sensor> / addScaled<Sensor> for the compile-time variant.
+/// @return false if there is not enough space, or the type has no exact resolution (scaleNumerator 0).
+bool BaseDevice::addScaled(BtHomeType sensor, int32_t milliUnits)
+{
+  static const int64_t MILLI = 1000;
+
+  if (!sensor.scaleNumerator || !hasEnoughSpace(sensor))
+  {
+    return false;
+  }
+
+  int64_t product = static_cast<int64_t>(milliUnits) * sensor.scaleDenominator;
+  int64_t divisor = sensor.scaleNumerator * MILLI;
+  int64_t raw;
+  if (product >= INT32_MIN && product <= INT32_MAX && divisor <= INT32_MAX)
+  {
+    // 32 bit division is a single instruction on the ESP32 cores, 64 bit is a library call
+    raw = static_cast<int32_t>(product) / static_cast<int32_t>(divisor);
+  }
+  else
+  {
+    raw = product / divisor;
+  }
+  return pushBytes(static_cast<uint64_t>(raw), sensor);
 }
 
 bool BaseDevice::pushBytes(uint64_t value2, BtHomeState sensor)
 {
-  std::vector<uint8_t> vector;
-  vector.push_back(sensor.id);
+  uint8_t *entry = insertEntry(sensor.id, sensor.byteCount + TYPE_INDICATOR_SIZE);
 
   for (uint8_t i = 0; i < sensor.byteCount; i++)
   {
-    vector.push_back(static_cast<byte>((value2 >> (8 * i)) & 0xff));
+    entry[TYPE_INDICATOR_SIZE + i] = static_cast<byte>((value2 >> (8 * i)) & 0xff);
   }
 
-  _sensorData.push_back(vector);
-  _sensorDataIdx += sensor.byteCount + TYPE_INDICATOR_SIZE;
   return true;
 }
 
+/// @brief Reserve the next entry in the measurement buffer and index it in object id order.
+/// @details Home Assistant expects the objects sorted by id. Entries with the same id keep the
+/// order they were added in, so the packet layout is deterministic.
+/// Callers must check hasEnoughSpace first; no bounds checking is done here.
+/// @param id - Object id, written as the first byte of the entry.
+/// @param length - Total entry length, including the object id.
+/// @return Pointer to the first byte of the reserved entry.
+uint8_t *BaseDevice::insertEntry(uint8_t id, uint8_t length)
+{
+  uint8_t position = _entryCount;
+  while (position > 0 && _sensorData[_entries[position - 1].offset] > id)
+  {
+    _entries[position] = _entries[position - 1];
+    position--;
+  }
+
+  MeasurementEntry &entry = _entries[position];
+  entry.offset = _sensorDataIdx;
+  entry.length = length;
+  _entryCount++;
+  _sensorDataIdx += length;
+
+  _sensorData[entry.offset] = id;
+  return &_sensorData[entry.offset];
+}
+
 /// @brief TEXT and RAW data
 /// @param sensor
 /// @param value
@@ -153,149 +711,202 @@ bool BaseDevice::addRaw(uint8_t sensorId, uint8_t *value, uint8_t size)
     return false;
   }
 
-  std::vector<uint8_t> vector;
-  vector.push_back(sensorId);
-  vector.push_back(size);
-
-  for (uint8_t i = 0; i < size; i++)
-  {
-    vector.push_back(value[i] & 0xff);
-  }
-
-  _sensorData.push_back(vector);
-  _sensorDataIdx += size + RAW_HEADER_BYTE_SIZE;
+  uint8_t *entry = insertEntry(sensorId, size + RAW_HEADER_BYTE_SIZE);
+  entry[1] = size;
+  memcpy(&entry[RAW_HEADER_BYTE_SIZE], value, size);
   return true;
 }
 
+/// @brief Build the advertisement.
+/// @details In overflow mode this is the first packet only, see nextAdvertisement.
+/// @param buffer - Receives the advertisement. Must hold getMaxAdvertisementSize() bytes.
+/// @return Number of bytes written, 0 if the counter store could not save the next counter reservation.
 size_t BaseDevice::getAdvertisementData(uint8_t buffer[MAX_ADVERTISEMENT_SIZE])
 {
-  uint8_t serviceData[MAX_ADVERTISEMENT_SIZE];
-  uint8_t serviceDataIndex = 0;
+  return buildAdvertisement(buffer, 0, packetEnd(0));
+}
 
-  serviceData[serviceDataIndex++] = SERVICE_DATA; // DO NOT CHANGE -- Service Data - 16-bit UUID
-  serviceData[serviceDataIndex++] = UUID1;        // DO NOT CHANGE -- UUID
-  serviceData[serviceDataIndex++] = UUID2;        // DO NOT CHANGE -- UUID
+/// @brief The name AD structures for the scan response, sent to active scanners that request it.
+/// @details The complete name, and the short name if it still fits in the 31 bytes. Use with enableScanResponse
+/// so the primary packet keeps all of its space for measurements.
+/// @param buffer - Receives the scan response data.
+/// @return Number of bytes written.
+size_t BaseDevice::getScanResponseData(uint8_t buffer[MAX_ADVERTISEMENT_SIZE]) const
+{
+  size_t nameStart;
+  size_t nameEnd;
+  fitNames(MAX_ADVERTISEMENT_SIZE, nameStart, nameEnd);
+  memcpy(buffer, &_nameADs[nameStart], nameEnd - nameStart);
+  return nameEnd - nameStart;
+}
 
-  uint8_t indicatorByte = FLAG_VERSION;
+/// @brief Leave the names out of every packet, they are sent in the scan response (getScanResponseData) instead.
+/// @details For scannable advertising (ADV_SCAN_IND). The primary packet is then only flags and service data, the
+/// name policy no longer applies.
+void BaseDevice::enableScanResponse()
+{
+  _namesInScanResponse = true;
+}
 
-  if (_triggerDevice)
+/// @brief The range of _nameADs that fits: the complete name if it fits, then the short name if it still fits.
+/// @details Both are adjacent in _nameADs, so the result is one copy.
+void BaseDevice::fitNames(size_t remaining, size_t &nameStart, size_t &nameEnd) const
+{
+  nameStart = 0;
+  nameEnd = 0;
+  if (_completeNameADLength <= remaining)
   {
-    indicatorByte |= FLAG_TRIGGER;
+    nameEnd = _completeNameADLength;
+    remaining -= _completeNameADLength;
+  }
+  else
+  {
+    nameStart = nameEnd = _completeNameADLength;
   }
 
-  if (_useEncryption)
+  if (_shortNameADLength <= remaining)
   {
-    indicatorByte |= FLAG_ENCRYPT;
+    nameEnd = _completeNameADLength + _shortNameADLength;
   }
+}
 
-  serviceData[serviceDataIndex++] = indicatorByte;
+/// @brief Build the next packet of the measurements, for when they do not fit in one advertisement.
+/// @details Each packet holds a run of the sorted measurements and, when encrypted, uses its own counter.
+/// Returns 0 once every measurement has been sent; the next call starts over from the first packet.
+///   while (size_t size = device.nextAdvertisement(buffer)) { send(buffer, size); }
+/// @param buffer - Receives the advertisement. Must hold getMaxAdvertisementSize() bytes.
+/// @return Number of bytes written, 0 at the end of the sequence (getLastStatus is BTHOME_ADVERTISEMENT_SEQUENCE_DONE).
+/// Also 0 if the counter store could not save the next counter reservation (BTHOME_ADVERTISEMENT_COUNTER_NOT_SAVED);
+/// the sequence then continues with the same packet on the next call.
+size_t BaseDevice::nextAdvertisement(uint8_t buffer[MAX_ADVERTISEMENT_SIZE])
+{
+  if (_packetSequenceDone)
+  {
+    _packetSequenceDone = false;
+    _nextPacketEntry = 0;
+    _lastStatus = BTHOME_ADVERTISEMENT_SEQUENCE_DONE;
+    return 0;
+  }
 
-  uint8_t sortedBytes[MAX_ADVERTISEMENT_SIZE];
-  size_t sortedBytesLength = getMeasurementByteArray(sortedBytes);
+  uint8_t firstEntry = _nextPacketEntry;
+  uint8_t endEntry = packetEnd(firstEntry);
+  size_t size = buildAdvertisement(buffer, firstEntry, endEntry);
+  if (size)
+  {
+    _nextPacketEntry = endEntry;
+    _packetSequenceDone = _nextPacketEntry >= _entryCount;
+  }
+  return size;
+}
 
-  if (_useEncryption)
+/// @brief One past the last entry that fits in a packet starting at firstEntry.
+uint8_t BaseDevice::packetEnd(uint8_t firstEntry) const
+{
+  int space = packetMeasurementSpace();
+  uint8_t end = firstEntry;
+  while (end < _entryCount && _entries[end].length <= space)
   {
+    space -= _entries[end].length;
+    end++;
+  }
+  return end;
+}
 
-    uint8_t ciphertext[MAX_ADVERTISEMENT_SIZE];
-    uint8_t encryptionTag[MIC_LEN];
-    uint8_t nonce[NONCE_LEN];
-    uint8_t *countPtr = (uint8_t *)(&this->_counter);
-
-    nonce[0] = _macAddress[5];
-    nonce[1] = _macAddress[4];
-    nonce[2] = _macAddress[3];
-    nonce[3] = _macAddress[2];
-    nonce[4] = _macAddress[1];
-    nonce[5] = _macAddress[0];
-    nonce[6] = UUID1;
-    nonce[7] = UUID2;
-    nonce[8] = FLAG_VERSION | FLAG_ENCRYPT;
-    memcpy(&nonce[9], countPtr, MIC_LEN);
-
-    mbedtls_ccm_encrypt_and_tag(&_encryptCTX, sortedBytesLength, nonce, NONCE_LEN, 0, 0,
-                                &sortedBytes[0], &ciphertext[0], encryptionTag,
-                                MIC_LEN);
-
-    for (uint8_t i = 0; i < _sensorDataIdx; i++)
-    {
-      serviceData[serviceDataIndex++] = ciphertext[i];
-    }
-    // writeCounter
-    serviceData[serviceDataIndex++] = nonce[9];
-    serviceData[serviceDataIndex++] = nonce[10];
-    serviceData[serviceDataIndex++] = nonce[11];
-    serviceData[serviceDataIndex++] = nonce[12];
-    this->_counter++;
-    // writeMIC
-    serviceData[serviceDataIndex++] = encryptionTag[0];
-    serviceData[serviceDataIndex++] = encryptionTag[1];
-    serviceData[serviceDataIndex++] = encryptionTag[2];
-    serviceData[serviceDataIndex++] = encryptionTag[3];
+size_t BaseDevice::buildAdvertisement(uint8_t *buffer, uint8_t firstEntry, uint8_t endEntry)
+{
+  // never encrypt with a counter that would be sent again after a restart
+  if (_useEncryption && _counterStore && _counter >= _counterReservedUntil && !reserveCounters())
+  {
+    _lastStatus = BTHOME_ADVERTISEMENT_COUNTER_NOT_SAVED;
+    return 0;
   }
-  else
+  _lastStatus = BTHOME_ADVERTISEMENT_OK;
+
+  if (_suppression && firstEntry == 0)
   {
-    for (uint8_t i = 0; i < sortedBytesLength; i++)
-    {
-      serviceData[serviceDataIndex++] = sortedBytes[i]; // Add the sensor data to the Service Data
-    }
+    recordTransmitted();
   }
 
-  uint8_t bufferDataIndex = 0;
   // head
-  buffer[bufferDataIndex++] = FLAG1;
-  buffer[bufferDataIndex++] = FLAG2;
-  buffer[bufferDataIndex++] = FLAG3;
-  byte sd_length = serviceDataIndex;     // Generate the length of the Service Data
-  buffer[bufferDataIndex++] = sd_length; // Add the length of the Service Data
+  memcpy(buffer, _headerTemplate, ADVERTISEMENT_HEADER_SIZE);
+  size_t serviceDataLengthIndex = 3; // filled in once the Service Data is written
+  size_t bufferDataIndex = ADVERTISEMENT_HEADER_SIZE;
+
+  // the sorted measurements go straight into the advertisement and are encrypted there, in place
+  uint8_t *measurements = &buffer[bufferDataIndex];
+  size_t measurementSpace = _maxAdvertisementSize - bufferDataIndex - (_useEncryption ? COUNTER_LEN + MIC_LEN : 0);
+  size_t measurementsLength = 0;
+  if (_packetIdEnabled)
+  {
+    // object id 0x00 sorts first
+    measurements[0] = packet_id.id;
+    measurements[1] = ++_packetId;
+    measurementsLength = PACKET_ID_SIZE;
+  }
+  measurementsLength += getMeasurementByteArray(&measurements[measurementsLength], measurementSpace - measurementsLength,
+                                                firstEntry, endEntry);
+  bufferDataIndex += measurementsLength;
 
-  for (size_t i = 0; i < serviceDataIndex; i++)
+  if (_useEncryption)
   {
-    buffer[bufferDataIndex++] = serviceData[i];
-    /* code */
+    uint8_t nonce[NONCE_LEN];
+    buildBtHomeNonce(nonce, _macAddress, _counter);
+
+    // ciphertext in place of the measurements, then counter, then MIC
+    uint8_t *counter = &buffer[bufferDataIndex];
+    uint8_t *encryptionTag = &counter[COUNTER_LEN];
+#if defined(BTHOME_TELEMETRY)
+    uint32_t startTicks = btHomeTelemetryTicks();
+#endif
+    _cipher->encryptAndTag(nonce, measurements, measurementsLength, measurements, encryptionTag);
+#if defined(BTHOME_TELEMETRY)
+    _telemetry.encryptTicks += static_cast<uint32_t>(btHomeTelemetryTicks() - startTicks);
+    _telemetry.encryptions++;
+#endif
+    memcpy(counter, &nonce[NONCE_LEN - COUNTER_LEN], COUNTER_LEN);
+    this->_counter++;
+    bufferDataIndex += COUNTER_LEN + MIC_LEN;
   }
 
-#define CURRENT_BYTE 1
+  buffer[serviceDataLengthIndex] = bufferDataIndex - serviceDataLengthIndex - 1; // Length of the Service Data
 
-  // prefer long name
-  size_t completeNameLength = strnlen(_completeName, MAX_LENGTH_COMPLETE_NAME);
-  bool canFitLongName = bufferDataIndex + completeNameLength + TYPE_INDICATOR_SIZE + CURRENT_BYTE <= MAX_ADVERTISEMENT_SIZE;
-  if (canFitLongName)
+  size_t nameStart = 0;
+  size_t nameEnd = 0;
+  if (!_namesInScanResponse && isNameDue())
   {
-    buffer[bufferDataIndex++] = completeNameLength + TYPE_INDICATOR_SIZE;
-    buffer[bufferDataIndex++] = COMPLETE_NAME;
-    memcpy(&buffer[bufferDataIndex], _completeName, completeNameLength);
-    bufferDataIndex += completeNameLength;
+    fitNames(_maxAdvertisementSize - bufferDataIndex, nameStart, nameEnd);
+    if (nameStart != 0)
+    {
+      BTHOME_TELEMETRY_ADD(completeNamesDropped, 1);
+    }
+    if (nameStart == nameEnd)
+    {
+      BTHOME_TELEMETRY_ADD(allNamesDropped, 1);
+    }
   }
 
-  size_t shortNameLength = strnlen(_shortName, MAX_LENGTH_SHORT_NAME);
-  bool canFitShortName = bufferDataIndex + TYPE_INDICATOR_SIZE + shortNameLength + CURRENT_BYTE <= MAX_ADVERTISEMENT_SIZE;
-  if (canFitShortName)
+  // at most a few dozen bytes, a plain loop beats the memcpy call setup here
+  for (size_t i = nameStart; i < nameEnd; i++)
   {
-    buffer[bufferDataIndex++] = shortNameLength + TYPE_INDICATOR_SIZE;
-    buffer[bufferDataIndex++] = SHORT_NAME; // 0x08 for short name
-    memcpy(&buffer[bufferDataIndex], _shortName, shortNameLength);
-    bufferDataIndex += shortNameLength;
+    buffer[bufferDataIndex++] = _nameADs[i];
   }
+  recordName(nameEnd > nameStart);
+  BTHOME_TELEMETRY_ADD(packetsBuilt, 1);
+  BTHOME_TELEMETRY_ADD(bytesEmitted, bufferDataIndex);
   return bufferDataIndex;
 }
 
-size_t BaseDevice::getMeasurementByteArray(uint8_t sortedBytes[MAX_ADVERTISEMENT_SIZE])
+size_t BaseDevice::getMeasurementByteArray(uint8_t *measurements, size_t capacity, uint8_t firstEntry, uint8_t endEntry)
 {
-    // 1. Sort entries by object_id (first byte)
-    std::sort(_sensorData.begin(), _sensorData.end(),
-              [](const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) {
-                  return a[0] < b[0];
-              });
-
-    // 2. Flatten directly into sortedBytes, avoiding extra RAM
+    // The entry index is already in object_id order, so flatten directly into the advertisement
     size_t idx = 0;
-    for (const std::vector<uint8_t>& entry : _sensorData) {
-        for (uint8_t b : entry) {
-            if (idx >= MAX_ADVERTISEMENT_SIZE) {
-                return idx;
-            }
-            sortedBytes[idx++] = b;
+    for (uint8_t i = firstEntry; i < endEntry; i++) {
+        const MeasurementEntry &entry = _entries[i];
+        if (idx + entry.length > capacity) {
+            return idx;
         }
+        memcpy(&measurements[idx], &_sensorData[entry.offset], entry.length);
+        idx += entry.length;
     }
     return idx;
 }
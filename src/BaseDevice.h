@@ -1,49 +1,353 @@
+#ifndef BT_HOME_BASE_DEVICE_H
+#define BT_HOME_BASE_DEVICE_H
+
 #include "definitions.h"
 #include <Arduino.h>
 #include <data_types.h>
-#include "mbedtls/ccm.h"
+#include "BtHomeV2Ccm.h"
+#include "BtHomeV2Telemetry.h"
+#include <type_traits>
 static const size_t MAX_ADVERTISEMENT_SIZE = 31;
+// BLE 5 extended advertising data limit for a single advertising PDU
+static const size_t MAX_EXTENDED_ADVERTISEMENT_SIZE = 255;
 static const size_t HEADER_SIZE = 9;
 static const size_t MAX_MEASUREMENT_SIZE = MAX_ADVERTISEMENT_SIZE - HEADER_SIZE;
 static const size_t TYPE_INDICATOR_SIZE = 1;
+// flags AD structure, service data length and type, UUID and device information byte
+static const size_t ADVERTISEMENT_HEADER_SIZE = 8;
+// length and type byte of a name AD structure
+static const size_t NAME_AD_OVERHEAD = 2;
 static const size_t NULL_TERMINATOR_SIZE = 1;
-static const size_t ENCRYPTION_KEY_LENGTH = 16;
-static const size_t BLE_MAC_ADDRESS_LENGTH = 6;
-static const size_t NONCE_LEN = 13;
-static const size_t MIC_LEN = 4;
-
-#define BIND_KEY_LEN 16
 #define ENCRYPTION_ADDITIONAL_BYTES 12
+// packet id object (0x00) and its value, in front of the measurements when enabled
+static const size_t PACKET_ID_SIZE = 2;
+
+// hasEnoughSpace allows one byte more than the packet size minus HEADER_SIZE (the index points at the next entry)
+static const size_t MEASUREMENT_BUFFER_SIZE = MAX_MEASUREMENT_SIZE + 1;
+// smallest entry is an object id followed by a single byte
+static const size_t MIN_MEASUREMENT_ENTRY_SIZE = TYPE_INDICATOR_SIZE + 1;
+static const size_t MAX_MEASUREMENT_ENTRIES = MEASUREMENT_BUFFER_SIZE / MIN_MEASUREMENT_ENTRY_SIZE;
+static const size_t MAX_EXTENDED_MEASUREMENT_BUFFER_SIZE = MAX_EXTENDED_ADVERTISEMENT_SIZE - HEADER_SIZE + 1;
+// entry offsets are single bytes
+static const size_t MAX_OVERFLOW_MEASUREMENT_BUFFER_SIZE = 255;
+
+// change suppression state, allocated by enableChangeSuppression
+struct ChangeSuppression;
+class BtHomeV2CounterStore;
+
+// packets per counter reservation, see setCounterStore
+static const uint32_t DEFAULT_COUNTER_BLOCK_SIZE = 256;
+
+// which packets carry the name AD structures, see BaseDevice::setNamePolicy
+enum BtHomeNamePolicy
+{
+  BTHOME_NAME_ALWAYS,
+  BTHOME_NAME_EVERY_NTH,
+  BTHOME_NAME_FIRST_N,
+  BTHOME_NAME_NEVER
+};
+
+// what the last getAdvertisementData or nextAdvertisement call did, see BaseDevice::getLastStatus
+enum BtHomeAdvertisementStatus
+{
+  BTHOME_ADVERTISEMENT_OK,                // a packet was built
+  BTHOME_ADVERTISEMENT_SEQUENCE_DONE,     // nextAdvertisement: every packet of the measurements has been built
+  BTHOME_ADVERTISEMENT_NO_MEASUREMENTS,   // BtHomeV2Multiplexer: no virtual device has measurements
+  BTHOME_ADVERTISEMENT_COUNTER_NOT_SAVED, // the counter store could not save the next reservation, nothing was encrypted
+  BTHOME_ADVERTISEMENT_REJECTED           // BtHomeV2Multiplexer: the encoder refused a measurement, nothing was built
+};
+
+/// @brief Location of a single measurement (object id + value bytes) inside the measurement buffer.
+/// @details The entries are kept ordered by object id; the data itself stays in insertion order.
+struct MeasurementEntry
+{
+  uint8_t offset;
+  uint8_t length;
+};
 
 class BaseDevice
 {
 public:
-  BaseDevice(const char *shortName, const char *completeName, bool isTriggerBased, uint8_t const *const key, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter);
-  BaseDevice(const char *shortName, const char *completeName, bool isTriggerBased);
+  BaseDevice(const char *shortName, const char *completeName, bool isTriggerBased, uint8_t const *const key, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter,
+             size_t maxAdvertisementSize = MAX_ADVERTISEMENT_SIZE);
+  BaseDevice(const char *shortName, const char *completeName, bool isTriggerBased, size_t maxAdvertisementSize = MAX_ADVERTISEMENT_SIZE);
+  ~BaseDevice();
+  void setIdentity(const char *shortName, const char *completeName, bool isTriggerBased,
+                   uint8_t const *const key, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter,
+                   BtHomeV2Ccm *expandedKey = nullptr);
   size_t getAdvertisementData(uint8_t buffer[MAX_ADVERTISEMENT_SIZE]);
+  size_t nextAdvertisement(uint8_t buffer[MAX_ADVERTISEMENT_SIZE]);
+  size_t getScanResponseData(uint8_t buffer[MAX_ADVERTISEMENT_SIZE]) const;
+  void enableScanResponse();
+  size_t getMaxAdvertisementSize() const { return _maxAdvertisementSize; }
+  bool enableOverflow(size_t maxMeasurementBytes);
+  void enablePacketId();
+  void setPacketId(uint8_t packetId);
+  bool setNamePolicy(BtHomeNamePolicy policy, uint16_t count = 1);
+  /// @brief Packet id of the last packet built.
+  uint8_t getPacketId() const { return _packetId; }
+  bool enableChangeSuppression(uint32_t maxSilenceMillis, size_t maxDeadbands);
+  bool setDeadband(BtHomeType sensor, float threshold);
+  bool isAdvertisementNeeded() const;
+  bool setCounterStore(BtHomeV2CounterStore *store, uint32_t blockSize = DEFAULT_COUNTER_BLOCK_SIZE);
+  uint32_t getCounter() const { return _counter; }
+  /// @brief Why the last getAdvertisementData or nextAdvertisement call returned 0.
+  BtHomeAdvertisementStatus getLastStatus() const { return _lastStatus; }
+  BtHomeTelemetry getTelemetry() const;
+  void resetTelemetry();
   void resetMeasurement();
   bool addState(BtHomeState, uint8_t state);
   bool addState(BtHomeState sensor, uint8_t state, uint8_t steps);
+  bool addEncoded(BtHomeState sensor, uint32_t rawValue);
+  bool hasRoomFor(BtHomeState sensor) const;
   bool addUnsignedInteger(BtHomeType sensor, uint64_t value);
   bool addSignedInteger(BtHomeType sensor, int64_t value);
   bool addFloat(BtHomeType sensor, float value);
+  bool addScaled(BtHomeType sensor, int32_t milliUnits);
   bool addRaw(uint8_t sensor, uint8_t *value, uint8_t size);
+  template <typename Sensor, typename T>
+  bool add(T value);
+  template <typename Sensor>
+  bool addScaled(int32_t milliUnits);
+  template <typename Budget, typename... Values>
+  bool setMeasurements(Values... values);
 
 private:
+  template <typename... Sensors>
+  friend struct BtHomeSensorSet;
+  BaseDevice(const BaseDevice &) = delete;
+  BaseDevice &operator=(const BaseDevice &) = delete;
+  template <typename Sensor, typename T>
+  void pushUnchecked(T value);
   bool pushBytes(uint64_t value2, BtHomeState sensor);
+  uint8_t *insertEntry(uint8_t id, uint8_t length);
+  void allocateMeasurementBuffer(size_t bufferSize);
+  int packetMeasurementSpace() const;
+  uint8_t packetEnd(uint8_t firstEntry) const;
+  size_t buildAdvertisement(uint8_t *buffer, uint8_t firstEntry, uint8_t endEntry);
+  void allocateChangeSuppression();
+  void recordTransmitted();
+  uint8_t _maxAdvertisementSize = MAX_ADVERTISEMENT_SIZE;
   uint8_t _sensorDataIdx = 0;
-  std::vector<std::vector<uint8_t>> _sensorData;
-  char _shortName[MAX_LENGTH_SHORT_NAME + NULL_TERMINATOR_SIZE];
-  char _completeName[MAX_LENGTH_COMPLETE_NAME + NULL_TERMINATOR_SIZE];
+  // legacy sized devices use the inline buffers, larger packets and overflow allocate once when configured
+  uint8_t _legacySensorData[MEASUREMENT_BUFFER_SIZE];
+  MeasurementEntry _legacyEntries[MAX_MEASUREMENT_ENTRIES];
+  uint8_t *_sensorData = _legacySensorData;
+  MeasurementEntry *_entries = _legacyEntries;
+  uint8_t _sensorDataCapacity = MEASUREMENT_BUFFER_SIZE;
+  uint8_t _entryCapacity = MAX_MEASUREMENT_ENTRIES;
+  uint8_t _entryCount = 0;
+  bool _overflow = false;
+  uint8_t _nextPacketEntry = 0;
+  bool _packetSequenceDone = false;
+  ChangeSuppression *_suppression = nullptr;
+  // serialized once in the constructor, copied into every packet
+  uint8_t _headerTemplate[ADVERTISEMENT_HEADER_SIZE];
+  // complete name AD structure followed by the short name AD structure
+  uint8_t _nameADs[MAX_LENGTH_COMPLETE_NAME + MAX_LENGTH_SHORT_NAME + 2 * NAME_AD_OVERHEAD];
+  uint8_t _completeNameADLength = 0;
+  uint8_t _shortNameADLength = 0;
+  BtHomeNamePolicy _namePolicy = BTHOME_NAME_ALWAYS;
+  uint16_t _namePolicyCount = 1;
+  // EVERY_NTH: packets since the name was last sent, FIRST_N: packets that carried the name
+  uint16_t _namePackets = 0;
+  // names go into the scan response only, see enableScanResponse
+  bool _namesInScanResponse = false;
+  bool isNameDue() const;
+  void recordName(bool sent);
+  void fitNames(size_t remaining, size_t &nameStart, size_t &nameEnd) const;
+  void serializeHeaderTemplate();
   bool hasEnoughSpace(BtHomeState sensor);
   bool hasEnoughSpace(uint8_t size);
+  bool fits(uint8_t size) const;
   template <typename T>
   bool addInteger(BtHomeType sensor, T value);
   bool _triggerDevice = false;
   bool _useEncryption = false;
+  bool _packetIdEnabled = false;
+  uint8_t _packetId = 0;
   uint32_t _counter = 1;
-  mbedtls_ccm_context _encryptCTX;
+  BtHomeV2CounterStore *_counterStore = nullptr;
+  uint32_t _counterBlockSize = DEFAULT_COUNTER_BLOCK_SIZE;
+  uint32_t _counterReservedUntil = 0;
+  BtHomeAdvertisementStatus _lastStatus = BTHOME_ADVERTISEMENT_OK;
+#if defined(BTHOME_TELEMETRY)
+  BtHomeTelemetry _telemetry = {};
+#endif
+  bool reserveCounters();
+  BtHomeV2Ccm _encryptCTX;
+  BtHomeV2Ccm *_cipher = &_encryptCTX;
   uint8_t _macAddress[BLE_MAC_ADDRESS_LENGTH];
   uint8_t bindKey[BIND_KEY_LEN];
-  size_t getMeasurementByteArray(uint8_t sortedBytes[MAX_ADVERTISEMENT_SIZE]);
+  size_t getMeasurementByteArray(uint8_t *measurements, size_t capacity, uint8_t firstEntry, uint8_t endEntry);
 };
+
+/// @brief Compile-time scaling for BaseDevice::add<Sensor>().
+/// @details Integer inputs use the exact ratio of the descriptor. Float inputs divide by the
+/// same float scale as addFloat, so the encoded bytes are identical. Unscaled types skip the division.
+template <typename Sensor, bool IsIntegral>
+struct BtHomeSensorScaler;
+
+template <typename Sensor>
+struct BtHomeSensorScaler<Sensor, true>
+{
+  template <typename T>
+  static uint64_t scale(T value)
+  {
+    return static_cast<uint64_t>(static_cast<int64_t>(value) * static_cast<int64_t>(Sensor::scaleDenominator) / static_cast<int64_t>(Sensor::scaleNumerator));
+  }
+};
+
+template <typename Sensor>
+struct BtHomeSensorScaler<Sensor, false>
+{
+  static uint64_t scale(float value)
+  {
+    // via int64_t so negative values keep their two's complement bytes
+    return static_cast<uint64_t>(static_cast<int64_t>(Sensor::unscaled ? value : value / Sensor::scale));
+  }
+};
+
+constexpr uint32_t btHomeGcd(uint32_t a, uint32_t b)
+{
+  return b == 0 ? a : btHomeGcd(b, a % b);
+}
+
+/// @brief raw = milliUnits * numerator / denominator, the sensor resolution divided by 1000 and reduced.
+template <typename Sensor>
+struct BtHomeMilliScale
+{
+  static constexpr uint32_t MILLI = 1000;
+  static constexpr uint32_t divisor = btHomeGcd(Sensor::scaleDenominator, Sensor::scaleNumerator * MILLI);
+  static constexpr int64_t numerator = Sensor::scaleDenominator / divisor;
+  static constexpr int64_t denominator = Sensor::scaleNumerator * MILLI / divisor;
+};
+
+/// @brief A fixed set of compile-time descriptors, e.g. BtHomeSensorSet<BtHomeSensors::temperature_int16_scale_0_01, BtHomeSensors::humidity_uint16>.
+/// @details count and measurementBytes (object ids included) are constants. Check it against a packet with BtHomePayloadBudget.
+template <typename... Sensors>
+struct BtHomeSensorSet;
+
+template <>
+struct BtHomeSensorSet<>
+{
+  static constexpr size_t count = 0;
+  static constexpr size_t measurementBytes = 0;
+
+  static void push(BaseDevice &) {}
+};
+
+template <typename First, typename... Rest>
+struct BtHomeSensorSet<First, Rest...>
+{
+  static constexpr size_t count = 1 + BtHomeSensorSet<Rest...>::count;
+  static constexpr size_t measurementBytes = First::byteCount + TYPE_INDICATOR_SIZE + BtHomeSensorSet<Rest...>::measurementBytes;
+
+  template <typename T, typename... Values>
+  static void push(BaseDevice &device, T value, Values... values)
+  {
+    device.pushUnchecked<First>(value);
+    BtHomeSensorSet<Rest...>::push(device, values...);
+  }
+};
+
+/// @brief Encoded size of a sensor set in a packet, computed at compile time.
+/// @details Fails to compile with a static_assert if the set does not fit in one packet of the given configuration,
+/// using the same limit as the runtime space check. Instantiated as soon as a member is used, e.g. by setMeasurements.
+///
+///   typedef BtHomeSensorSet<BtHomeSensors::temperature_int16_scale_0_01, BtHomeSensors::humidity_uint16> ClimateSet;
+///   typedef BtHomePayloadBudget<ClimateSet, true> ClimateBudget; // encrypted, 31 byte packet
+///   static_assert(sizeof(DEVICE_NAME) - 1 <= ClimateBudget::maxCompleteNameLength, "name is not sent");
+template <typename Set, bool Encrypted = false, bool PacketId = false, size_t MaxAdvertisementSize = MAX_ADVERTISEMENT_SIZE>
+struct BtHomePayloadBudget
+{
+  static_assert(MaxAdvertisementSize >= MAX_ADVERTISEMENT_SIZE && MaxAdvertisementSize <= MAX_EXTENDED_ADVERTISEMENT_SIZE,
+                "packet size must be between MAX_ADVERTISEMENT_SIZE and MAX_EXTENDED_ADVERTISEMENT_SIZE");
+
+  typedef Set Sensors;
+  /// @brief Measurement bytes a device of this configuration accepts (see BaseDevice::packetMeasurementSpace).
+  static constexpr size_t measurementSpace = MaxAdvertisementSize - HEADER_SIZE + 1 - (Encrypted ? ENCRYPTION_ADDITIONAL_BYTES : 0) -
+                                             (PacketId ? PACKET_ID_SIZE : 0);
+
+  static_assert(Set::measurementBytes <= measurementSpace, "the sensor set does not fit in one advertisement");
+
+  /// @brief Size of the packet without names.
+  static constexpr size_t packetBytes = ADVERTISEMENT_HEADER_SIZE + (PacketId ? PACKET_ID_SIZE : 0) + Set::measurementBytes +
+                                        (Encrypted ? COUNTER_LEN + MIC_LEN : 0);
+  /// @brief Bytes left for the name AD structures.
+  static constexpr size_t nameSpace = MaxAdvertisementSize - packetBytes;
+  /// @brief Longest complete name that is still sent, 0 if there is no room for one.
+  static constexpr size_t maxCompleteNameLength =
+      nameSpace <= NAME_AD_OVERHEAD ? 0 : (nameSpace - NAME_AD_OVERHEAD < MAX_LENGTH_COMPLETE_NAME ? nameSpace - NAME_AD_OVERHEAD : MAX_LENGTH_COMPLETE_NAME);
+};
+
+/// @brief Scale and store without checking the space, callers guarantee it.
+template <typename Sensor, typename T>
+void BaseDevice::pushUnchecked(T value)
+{
+  uint64_t scaledValue = BtHomeSensorScaler<Sensor, std::is_integral<T>::value>::scale(value);
+  pushBytes(scaledValue, BtHomeState{Sensor::id, Sensor::byteCount});
+}
+
+/// @brief Add a measurement described by a compile-time descriptor, e.g. add<BtHomeSensors::humidity_uint16>(48.2f).
+/// @details Object id, byte width and scale are resolved at compile time.
+/// @return false if there is not enough space left in the packet.
+template <typename Sensor, typename T>
+bool BaseDevice::add(T value)
+{
+  if (!hasEnoughSpace(static_cast<uint8_t>(Sensor::byteCount + TYPE_INDICATOR_SIZE)))
+  {
+    return false;
+  }
+
+  pushUnchecked<Sensor>(value);
+  return true;
+}
+
+/// @brief Replace the measurements with one value per sensor of a fixed set, in the order of the set.
+/// @details Budget is a BtHomePayloadBudget, so the set is checked against the packet at compile time and the
+/// per-measurement space checks are skipped. What remains is one comparison in case the device is configured
+/// differently from the budget (encryption, packet id, packet size).
+/// @return false if the set does not fit the device, nothing is added then.
+template <typename Budget, typename... Values>
+bool BaseDevice::setMeasurements(Values... values)
+{
+  typedef typename Budget::Sensors Set;
+  static_assert(sizeof...(Values) == Set::count, "one value per sensor of the set");
+
+  if (packetMeasurementSpace() < static_cast<int>(Set::measurementBytes))
+  {
+    BTHOME_TELEMETRY_ADD(measurementsRejected, Set::count);
+    return false;
+  }
+
+  resetMeasurement();
+  Set::push(*this, values...);
+  return true;
+}
+
+/// @brief Fixed-point add<>: the value in thousandths of the unit, e.g. addScaled<BtHomeSensors::temperature_int16_scale_0_01>(21370) for 21.37 °C.
+/// @details The ratio is reduced at compile time, every table entry becomes a division by a constant
+/// (a multiply and shift), so no floating point code is needed. Truncates toward zero like add().
+template <typename Sensor>
+bool BaseDevice::addScaled(int32_t milliUnits)
+{
+  if (!hasEnoughSpace(static_cast<uint8_t>(Sensor::byteCount + TYPE_INDICATOR_SIZE)))
+  {
+    return false;
+  }
+
+  typedef BtHomeMilliScale<Sensor> Scale;
+  int64_t raw;
+  if (Scale::numerator == 1)
+  {
+    raw = milliUnits / static_cast<int32_t>(Scale::denominator);
+  }
+  else
+  {
+    raw = static_cast<int64_t>(milliUnits) * Scale::numerator / Scale::denominator;
+  }
+  return pushBytes(static_cast<uint64_t>(raw), BtHomeState{Sensor::id, Sensor::byteCount});
+}
+
+#endif // BT_HOME_BASE_DEVICE_H
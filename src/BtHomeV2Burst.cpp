@@ -0,0 +1,54 @@
+#include "BtHomeV2Burst.h"
+
+BtHomeV2BurstScheduler::BtHomeV2BurstScheduler(uint8_t count, uint16_t spacingMillis, size_t maxAdvertisementSize)
+    : _count(count ? count : 1), _spacingMillis(spacingMillis)
+{
+  if (maxAdvertisementSize > MAX_ADVERTISEMENT_SIZE)
+  {
+    _capacity = std::min(maxAdvertisementSize, MAX_EXTENDED_ADVERTISEMENT_SIZE);
+    _packet = new uint8_t[_capacity];
+  }
+}
+
+BtHomeV2BurstScheduler::~BtHomeV2BurstScheduler()
+{
+  if (_packet != _legacyPacket)
+  {
+    delete[] _packet;
+  }
+}
+
+bool BtHomeV2BurstScheduler::start(const uint8_t *advertisement, size_t size, uint32_t nowMillis)
+{
+  if (size > _capacity)
+  {
+    return false;
+  }
+
+  memcpy(_packet, advertisement, size);
+  _size = size;
+  _remaining = _count;
+  _nextMillis = nowMillis;
+  return true;
+}
+
+const uint8_t *BtHomeV2BurstScheduler::poll(uint32_t nowMillis, size_t &size)
+{
+  // signed difference, so millis() wrapping around is handled
+  if (!_remaining || static_cast<int32_t>(nowMillis - _nextMillis) < 0)
+  {
+    return nullptr;
+  }
+
+  _remaining--;
+  // from now rather than from the planned time, a late poll never sends two copies back to back
+  _nextMillis = nowMillis + _spacingMillis;
+  size = _size;
+  return _packet;
+}
+
+uint32_t BtHomeV2BurstScheduler::millisUntilNext(uint32_t nowMillis) const
+{
+  int32_t remaining = static_cast<int32_t>(_nextMillis - nowMillis);
+  return remaining > 0 ? static_cast<uint32_t>(remaining) : 0;
+}
@@ -0,0 +1,60 @@
+#ifndef BT_HOME_V2_BURST_H
+#define BT_HOME_V2_BURST_H
+
+#include <Arduino.h>
+#include "BaseDevice.h"
+
+static const uint8_t DEFAULT_BURST_COUNT = 4;
+static const uint16_t DEFAULT_BURST_SPACING_MILLIS = 40;
+
+/// @brief Sends each event as a short train of identical advertisements.
+/// @details A receiver scanning with a duty cycle can miss a single advertisement; a few copies spaced a little
+/// apart are enough instead of advertising for a long window. Enable the packet id on the device
+/// (enablePacketId) so the receiver handles the event once and drops the copies. A device that sleeps between
+/// events restores the id on wake, or every event gets the same id and is dropped:
+///
+///   RTC_DATA_ATTR uint8_t lastPacketId = 0;
+///   btHome.setPacketId(lastPacketId);
+///   size_t size = btHome.getAdvertisementData(advertisementData);
+///   lastPacketId = btHome.getPacketId();
+///   burst.start(advertisementData, size, millis());
+///   ...
+///   if (const uint8_t *packet = burst.poll(millis(), size)) sendAdvertisement(packet, size);
+class BtHomeV2BurstScheduler
+{
+public:
+  /// @param count - Copies per event, at least 1.
+  /// @param spacingMillis - Time between the copies.
+  /// @param maxAdvertisementSize - Largest packet that is started, larger than MAX_ADVERTISEMENT_SIZE allocates once here.
+  BtHomeV2BurstScheduler(uint8_t count = DEFAULT_BURST_COUNT, uint16_t spacingMillis = DEFAULT_BURST_SPACING_MILLIS,
+                         size_t maxAdvertisementSize = MAX_ADVERTISEMENT_SIZE);
+  ~BtHomeV2BurstScheduler();
+
+  /// @brief Start the train for a new event, replacing the rest of a train still running. The first copy is due now.
+  /// @return false if the packet is larger than maxAdvertisementSize.
+  bool start(const uint8_t *advertisement, size_t size, uint32_t nowMillis);
+
+  /// @brief The packet if a copy is due, nullptr otherwise. The next copy is due spacingMillis later.
+  const uint8_t *poll(uint32_t nowMillis, size_t &size);
+
+  bool isActive() const { return _remaining > 0; }
+  /// @brief Time until poll returns the next copy, 0 if one is due. For sleeping between copies.
+  uint32_t millisUntilNext(uint32_t nowMillis) const;
+  /// @brief Time from the first to the last copy of a train.
+  uint32_t getDurationMillis() const { return static_cast<uint32_t>(_count - 1) * _spacingMillis; }
+
+private:
+  BtHomeV2BurstScheduler(const BtHomeV2BurstScheduler &) = delete;
+  BtHomeV2BurstScheduler &operator=(const BtHomeV2BurstScheduler &) = delete;
+
+  uint8_t _legacyPacket[MAX_ADVERTISEMENT_SIZE];
+  uint8_t *_packet = _legacyPacket;
+  size_t _capacity = MAX_ADVERTISEMENT_SIZE;
+  size_t _size = 0;
+  uint8_t _count;
+  uint8_t _remaining = 0;
+  uint16_t _spacingMillis;
+  uint32_t _nextMillis = 0;
+};
+
+#endif // BT_HOME_V2_BURST_H
@@ -0,0 +1,241 @@
+#include "BtHomeV2Ccm.h"
+
+static const size_t AES_BLOCK_SIZE = 16;
+static const size_t AES_ROUNDS = 10;
+// 15 - NONCE_LEN, the size of the length and block counter fields
+static const uint8_t CCM_LENGTH_SIZE = 2;
+
+#if !defined(BTHOME_CCM_SOFTWARE)
+BtHomeV2MbedtlsCcm::BtHomeV2MbedtlsCcm()
+{
+  mbedtls_ccm_init(&_context);
+}
+
+BtHomeV2MbedtlsCcm::~BtHomeV2MbedtlsCcm()
+{
+  mbedtls_ccm_free(&_context);
+}
+
+bool BtHomeV2MbedtlsCcm::setKey(const uint8_t key[ENCRYPTION_KEY_LENGTH])
+{
+  return mbedtls_ccm_setkey(&_context, MBEDTLS_CIPHER_ID_AES, key, ENCRYPTION_KEY_LENGTH * 8) == 0;
+}
+
+bool BtHomeV2MbedtlsCcm::encryptAndTag(const uint8_t nonce[NONCE_LEN], const uint8_t *input, size_t length, uint8_t *output,
+                                       uint8_t *tag, size_t tagLength)
+{
+  return mbedtls_ccm_encrypt_and_tag(&_context, length, nonce, NONCE_LEN, 0, 0, input, output, tag, tagLength) == 0;
+}
+
+bool BtHomeV2MbedtlsCcm::authDecrypt(const uint8_t nonce[NONCE_LEN], const uint8_t *input, size_t length, uint8_t *output,
+                                     const uint8_t *tag, size_t tagLength)
+{
+  return mbedtls_ccm_auth_decrypt(&_context, length, nonce, NONCE_LEN, 0, 0, input, output, tag, tagLength) == 0;
+}
+#endif
+
+static const uint8_t AES_SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static inline uint8_t xtime(uint8_t value)
+{
+  return (value << 1) ^ ((value & 0x80) ? 0x1b : 0x00);
+}
+
+bool BtHomeV2SoftwareCcm::setKey(const uint8_t key[ENCRYPTION_KEY_LENGTH])
+{
+  expandKey(key, _roundKeys);
+  return true;
+}
+
+void BtHomeV2SoftwareCcm::expandKey(const uint8_t key[ENCRYPTION_KEY_LENGTH], uint8_t roundKeys[ROUND_KEYS_SIZE])
+{
+  memcpy(roundKeys, key, ENCRYPTION_KEY_LENGTH);
+
+  uint8_t roundConstant = 0x01;
+  for (size_t i = ENCRYPTION_KEY_LENGTH; i < ROUND_KEYS_SIZE; i += 4)
+  {
+    uint8_t word[4];
+    memcpy(word, &roundKeys[i - 4], 4);
+    if (i % ENCRYPTION_KEY_LENGTH == 0)
+    {
+      // RotWord, SubWord, Rcon
+      uint8_t first = word[0];
+      word[0] = AES_SBOX[word[1]] ^ roundConstant;
+      word[1] = AES_SBOX[word[2]];
+      word[2] = AES_SBOX[word[3]];
+      word[3] = AES_SBOX[first];
+      roundConstant = xtime(roundConstant);
+    }
+
+    for (size_t j = 0; j < 4; j++)
+    {
+      roundKeys[i + j] = roundKeys[i + j - ENCRYPTION_KEY_LENGTH] ^ word[j];
+    }
+  }
+}
+
+void BtHomeV2SoftwareCcm::encryptBlock(const uint8_t input[AES_BLOCK_SIZE], uint8_t output[AES_BLOCK_SIZE]) const
+{
+  // ShiftRows as a gather: the state is column major, row r rotates left by r columns
+  static const uint8_t SHIFT_ROWS[AES_BLOCK_SIZE] = {0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11};
+
+  uint8_t state[AES_BLOCK_SIZE];
+  for (size_t i = 0; i < AES_BLOCK_SIZE; i++)
+  {
+    state[i] = input[i] ^ _roundKeys[i];
+  }
+
+  for (size_t round = 1; round < AES_ROUNDS; round++)
+  {
+    uint8_t shifted[AES_BLOCK_SIZE];
+    for (size_t i = 0; i < AES_BLOCK_SIZE; i++)
+    {
+      shifted[i] = AES_SBOX[state[SHIFT_ROWS[i]]];
+    }
+
+    // MixColumns and AddRoundKey
+    const uint8_t *roundKey = &_roundKeys[round * AES_BLOCK_SIZE];
+    for (size_t column = 0; column < AES_BLOCK_SIZE; column += 4)
+    {
+      uint8_t a0 = shifted[column];
+      uint8_t a1 = shifted[column + 1];
+      uint8_t a2 = shifted[column + 2];
+      uint8_t a3 = shifted[column + 3];
+      uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+      state[column] = a0 ^ all ^ xtime(a0 ^ a1) ^ roundKey[column];
+      state[column + 1] = a1 ^ all ^ xtime(a1 ^ a2) ^ roundKey[column + 1];
+      state[column + 2] = a2 ^ all ^ xtime(a2 ^ a3) ^ roundKey[column + 2];
+      state[column + 3] = a3 ^ all ^ xtime(a3 ^ a0) ^ roundKey[column + 3];
+    }
+  }
+
+  // the last round has no MixColumns
+  const uint8_t *roundKey = &_roundKeys[AES_ROUNDS * AES_BLOCK_SIZE];
+  for (size_t i = 0; i < AES_BLOCK_SIZE; i++)
+  {
+    output[i] = AES_SBOX[state[SHIFT_ROWS[i]]] ^ roundKey[i];
+  }
+}
+
+/// @brief Key stream block A_i (RFC 3610): flags, nonce, block counter.
+void BtHomeV2SoftwareCcm::ctrBlock(const uint8_t nonce[NONCE_LEN], uint16_t index, uint8_t keyStream[AES_BLOCK_SIZE]) const
+{
+  uint8_t block[AES_BLOCK_SIZE];
+  block[0] = CCM_LENGTH_SIZE - 1;
+  memcpy(&block[1], nonce, NONCE_LEN);
+  block[14] = index >> 8;
+  block[15] = index & 0xff;
+  encryptBlock(block, keyStream);
+}
+
+/// @brief CBC-MAC of B_0: flags, nonce, message length.
+void BtHomeV2SoftwareCcm::macStart(const uint8_t nonce[NONCE_LEN], size_t length, size_t tagLength, uint8_t mac[AES_BLOCK_SIZE]) const
+{
+  uint8_t block[AES_BLOCK_SIZE];
+  block[0] = ((tagLength - 2) / 2) << 3 | (CCM_LENGTH_SIZE - 1);
+  memcpy(&block[1], nonce, NONCE_LEN);
+  block[14] = length >> 8;
+  block[15] = length & 0xff;
+  encryptBlock(block, mac);
+}
+
+static bool validCcmParameters(size_t length, size_t tagLength)
+{
+  return length <= 0xffff && tagLength >= 4 && tagLength <= AES_BLOCK_SIZE && tagLength % 2 == 0;
+}
+
+bool BtHomeV2SoftwareCcm::encryptAndTag(const uint8_t nonce[NONCE_LEN], const uint8_t *input, size_t length, uint8_t *output,
+                                        uint8_t *tag, size_t tagLength)
+{
+  if (!validCcmParameters(length, tagLength))
+  {
+    return false;
+  }
+
+  uint8_t mac[AES_BLOCK_SIZE];
+  uint8_t keyStream[AES_BLOCK_SIZE];
+  macStart(nonce, length, tagLength, mac);
+
+  for (size_t offset = 0; offset < length; offset += AES_BLOCK_SIZE)
+  {
+    size_t blockLength = length - offset < AES_BLOCK_SIZE ? length - offset : AES_BLOCK_SIZE;
+
+    // MAC the plaintext before it is overwritten when encrypting in place
+    for (size_t i = 0; i < blockLength; i++)
+    {
+      mac[i] ^= input[offset + i];
+    }
+    encryptBlock(mac, mac);
+
+    ctrBlock(nonce, offset / AES_BLOCK_SIZE + 1, keyStream);
+    for (size_t i = 0; i < blockLength; i++)
+    {
+      output[offset + i] = input[offset + i] ^ keyStream[i];
+    }
+  }
+
+  ctrBlock(nonce, 0, keyStream);
+  for (size_t i = 0; i < tagLength; i++)
+  {
+    tag[i] = mac[i] ^ keyStream[i];
+  }
+  return true;
+}
+
+bool BtHomeV2SoftwareCcm::authDecrypt(const uint8_t nonce[NONCE_LEN], const uint8_t *input, size_t length, uint8_t *output,
+                                      const uint8_t *tag, size_t tagLength)
+{
+  if (!validCcmParameters(length, tagLength))
+  {
+    return false;
+  }
+
+  uint8_t mac[AES_BLOCK_SIZE];
+  uint8_t keyStream[AES_BLOCK_SIZE];
+  macStart(nonce, length, tagLength, mac);
+
+  for (size_t offset = 0; offset < length; offset += AES_BLOCK_SIZE)
+  {
+    size_t blockLength = length - offset < AES_BLOCK_SIZE ? length - offset : AES_BLOCK_SIZE;
+
+    ctrBlock(nonce, offset / AES_BLOCK_SIZE + 1, keyStream);
+    for (size_t i = 0; i < blockLength; i++)
+    {
+      output[offset + i] = input[offset + i] ^ keyStream[i];
+      mac[i] ^= output[offset + i];
+    }
+    encryptBlock(mac, mac);
+  }
+
+  // compare in constant time
+  ctrBlock(nonce, 0, keyStream);
+  uint8_t difference = 0;
+  for (size_t i = 0; i < tagLength; i++)
+  {
+    difference |= tag[i] ^ mac[i] ^ keyStream[i];
+  }
+
+  if (difference)
+  {
+    memset(output, 0, length);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,91 @@
+#ifndef BT_HOME_V2_CCM_H
+#define BT_HOME_V2_CCM_H
+
+#include "definitions.h"
+#include <Arduino.h>
+
+#if !defined(BTHOME_CCM_SOFTWARE)
+#include "mbedtls/ccm.h"
+#endif
+
+static const size_t ENCRYPTION_KEY_LENGTH = 16;
+static const size_t BLE_MAC_ADDRESS_LENGTH = 6;
+static const size_t NONCE_LEN = 13;
+static const size_t MIC_LEN = 4;
+
+#define BIND_KEY_LEN 16
+static const size_t COUNTER_LEN = 4;
+
+/// @brief Build the AES-CCM nonce: reversed MAC, UUID, version and encrypt flags, counter (little endian).
+/// @details Shared by the encoder and the decoder so both sides always agree on the layout.
+inline void buildBtHomeNonce(uint8_t nonce[NONCE_LEN], const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter)
+{
+  for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+  {
+    nonce[i] = macAddress[BLE_MAC_ADDRESS_LENGTH - 1 - i];
+  }
+  nonce[6] = UUID1;
+  nonce[7] = UUID2;
+  nonce[8] = FLAG_VERSION | FLAG_ENCRYPT;
+  nonce[9] = counter & 0xff;
+  nonce[10] = (counter >> 8) & 0xff;
+  nonce[11] = (counter >> 16) & 0xff;
+  nonce[12] = (counter >> 24) & 0xff;
+}
+
+// AES-128-CCM backends as used by BTHome: 13 byte nonce, no additional data, 4 byte MIC.
+// Every backend has the same interface and input and output may be the same buffer.
+// BtHomeV2Ccm is the one the library uses, define BTHOME_CCM_SOFTWARE (see definitions.h) for the portable one.
+
+#if !defined(BTHOME_CCM_SOFTWARE)
+/// @brief mbedtls backend. On the ESP32 mbedtls uses the AES peripheral, on a host AES-NI when mbedtls is built with it.
+class BtHomeV2MbedtlsCcm
+{
+public:
+  BtHomeV2MbedtlsCcm();
+  ~BtHomeV2MbedtlsCcm();
+  bool setKey(const uint8_t key[ENCRYPTION_KEY_LENGTH]);
+  bool encryptAndTag(const uint8_t nonce[NONCE_LEN], const uint8_t *input, size_t length, uint8_t *output,
+                     uint8_t *tag, size_t tagLength = MIC_LEN);
+  /// @return false if the MIC does not match.
+  bool authDecrypt(const uint8_t nonce[NONCE_LEN], const uint8_t *input, size_t length, uint8_t *output,
+                   const uint8_t *tag, size_t tagLength = MIC_LEN);
+
+private:
+  BtHomeV2MbedtlsCcm(const BtHomeV2MbedtlsCcm &) = delete;
+  BtHomeV2MbedtlsCcm &operator=(const BtHomeV2MbedtlsCcm &) = delete;
+  mbedtls_ccm_context _context;
+};
+#endif
+
+/// @brief Portable software backend, table based byte-wise AES. No dependencies, 176 bytes of round keys per key.
+class BtHomeV2SoftwareCcm
+{
+public:
+  bool setKey(const uint8_t key[ENCRYPTION_KEY_LENGTH]);
+  bool encryptAndTag(const uint8_t nonce[NONCE_LEN], const uint8_t *input, size_t length, uint8_t *output,
+                     uint8_t *tag, size_t tagLength = MIC_LEN);
+  /// @return false if the MIC does not match, output is cleared then.
+  bool authDecrypt(const uint8_t nonce[NONCE_LEN], const uint8_t *input, size_t length, uint8_t *output,
+                   const uint8_t *tag, size_t tagLength = MIC_LEN);
+
+  static const size_t ROUND_KEYS_SIZE = 176;
+
+  /// @brief The AES-128 key schedule in FIPS-197 byte order, also the layout AES-NI and BtHomeV2CcmBatch use.
+  static void expandKey(const uint8_t key[ENCRYPTION_KEY_LENGTH], uint8_t roundKeys[ROUND_KEYS_SIZE]);
+  const uint8_t *roundKeys() const { return _roundKeys; }
+
+private:
+  void encryptBlock(const uint8_t input[16], uint8_t output[16]) const;
+  void ctrBlock(const uint8_t nonce[NONCE_LEN], uint16_t index, uint8_t keyStream[16]) const;
+  void macStart(const uint8_t nonce[NONCE_LEN], size_t length, size_t tagLength, uint8_t mac[16]) const;
+  uint8_t _roundKeys[ROUND_KEYS_SIZE];
+};
+
+#if defined(BTHOME_CCM_SOFTWARE)
+typedef BtHomeV2SoftwareCcm BtHomeV2Ccm;
+#else
+typedef BtHomeV2MbedtlsCcm BtHomeV2Ccm;
+#endif
+
+#endif // BT_HOME_V2_CCM_H
@@ -0,0 +1,353 @@
+#include "BtHomeV2CcmBatch.h"
+
+// AES-NI needs GCC or Clang on x86, the instructions are enabled per function and chosen at run time,
+// so the library is still built for any x86 CPU
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BTHOME_BATCH_HAS_AES_NI
+#include <wmmintrin.h>
+#endif
+
+static const size_t AES_BLOCK_SIZE = 16;
+static const size_t AES_ROUNDS = 10;
+// 15 - NONCE_LEN, the size of the length and block counter fields
+static const uint8_t CCM_LENGTH_SIZE = 2;
+// a packet hands the cipher at most three blocks per step: A_0 and B_0 in the first step, A_i and the CBC-MAC
+static const size_t BLOCKS_PER_LANE = 3;
+static const size_t PORTABLE_WIDTH = 4;
+static const size_t AES_NI_WIDTH = 8;
+
+/// @brief One AES block to encrypt, with the key schedule of its packet.
+struct BlockJob
+{
+  const uint8_t *roundKeys;
+  const uint8_t *input;
+  uint8_t *output;
+};
+
+// Te0 of the usual 32 bit table implementation: S-box output times (2, 1, 1, 3), little endian.
+// The other three tables are rotations of it, the S-box itself is byte 1.
+static const uint32_t AES_TE0[256] = {
+    0xa56363c6, 0x847c7cf8, 0x997777ee, 0x8d7b7bf6, 0x0df2f2ff, 0xbd6b6bd6, 0xb16f6fde, 0x54c5c591,
+    0x50303060, 0x03010102, 0xa96767ce, 0x7d2b2b56, 0x19fefee7, 0x62d7d7b5, 0xe6abab4d, 0x9a7676ec,
+    0x45caca8f, 0x9d82821f, 0x40c9c989, 0x877d7dfa, 0x15fafaef, 0xeb5959b2, 0xc947478e, 0x0bf0f0fb,
+    0xecadad41, 0x67d4d4b3, 0xfda2a25f, 0xeaafaf45, 0xbf9c9c23, 0xf7a4a453, 0x967272e4, 0x5bc0c09b,
+    0xc2b7b775, 0x1cfdfde1, 0xae93933d, 0x6a26264c, 0x5a36366c, 0x413f3f7e, 0x02f7f7f5, 0x4fcccc83,
+    0x5c343468, 0xf4a5a551, 0x34e5e5d1, 0x08f1f1f9, 0x937171e2, 0x73d8d8ab, 0x53313162, 0x3f15152a,
+    0x0c040408, 0x52c7c795, 0x65232346, 0x5ec3c39d, 0x28181830, 0xa1969637, 0x0f05050a, 0xb59a9a2f,
+    0x0907070e, 0x36121224, 0x9b80801b, 0x3de2e2df, 0x26ebebcd, 0x6927274e, 0xcdb2b27f, 0x9f7575ea,
+    0x1b090912, 0x9e83831d, 0x742c2c58, 0x2e1a1a34, 0x2d1b1b36, 0xb26e6edc, 0xee5a5ab4, 0xfba0a05b,
+    0xf65252a4, 0x4d3b3b76, 0x61d6d6b7, 0xceb3b37d, 0x7b292952, 0x3ee3e3dd, 0x712f2f5e, 0x97848413,
+    0xf55353a6, 0x68d1d1b9, 0x00000000, 0x2cededc1, 0x60202040, 0x1ffcfce3, 0xc8b1b179, 0xed5b5bb6,
+    0xbe6a6ad4, 0x46cbcb8d, 0xd9bebe67, 0x4b393972, 0xde4a4a94, 0xd44c4c98, 0xe85858b0, 0x4acfcf85,
+    0x6bd0d0bb, 0x2aefefc5, 0xe5aaaa4f, 0x16fbfbed, 0xc5434386, 0xd74d4d9a, 0x55333366, 0x94858511,
+    0xcf45458a, 0x10f9f9e9, 0x06020204, 0x817f7ffe, 0xf05050a0, 0x443c3c78, 0xba9f9f25, 0xe3a8a84b,
+    0xf35151a2, 0xfea3a35d, 0xc0404080, 0x8a8f8f05, 0xad92923f, 0xbc9d9d21, 0x48383870, 0x04f5f5f1,
+    0xdfbcbc63, 0xc1b6b677, 0x75dadaaf, 0x63212142, 0x30101020, 0x1affffe5, 0x0ef3f3fd, 0x6dd2d2bf,
+    0x4ccdcd81, 0x140c0c18, 0x35131326, 0x2fececc3, 0xe15f5fbe, 0xa2979735, 0xcc444488, 0x3917172e,
+    0x57c4c493, 0xf2a7a755, 0x827e7efc, 0x473d3d7a, 0xac6464c8, 0xe75d5dba, 0x2b191932, 0x957373e6,
+    0xa06060c0, 0x98818119, 0xd14f4f9e, 0x7fdcdca3, 0x66222244, 0x7e2a2a54, 0xab90903b, 0x8388880b,
+    0xca46468c, 0x29eeeec7, 0xd3b8b86b, 0x3c141428, 0x79dedea7, 0xe25e5ebc, 0x1d0b0b16, 0x76dbdbad,
+    0x3be0e0db, 0x56323264, 0x4e3a3a74, 0x1e0a0a14, 0xdb494992, 0x0a06060c, 0x6c242448, 0xe45c5cb8,
+    0x5dc2c29f, 0x6ed3d3bd, 0xefacac43, 0xa66262c4, 0xa8919139, 0xa4959531, 0x37e4e4d3, 0x8b7979f2,
+    0x32e7e7d5, 0x43c8c88b, 0x5937376e, 0xb76d6dda, 0x8c8d8d01, 0x64d5d5b1, 0xd24e4e9c, 0xe0a9a949,
+    0xb46c6cd8, 0xfa5656ac, 0x07f4f4f3, 0x25eaeacf, 0xaf6565ca, 0x8e7a7af4, 0xe9aeae47, 0x18080810,
+    0xd5baba6f, 0x887878f0, 0x6f25254a, 0x722e2e5c, 0x241c1c38, 0xf1a6a657, 0xc7b4b473, 0x51c6c697,
+    0x23e8e8cb, 0x7cdddda1, 0x9c7474e8, 0x211f1f3e, 0xdd4b4b96, 0xdcbdbd61, 0x868b8b0d, 0x858a8a0f,
+    0x907070e0, 0x423e3e7c, 0xc4b5b571, 0xaa6666cc, 0xd8484890, 0x05030306, 0x01f6f6f7, 0x120e0e1c,
+    0xa36161c2, 0x5f35356a, 0xf95757ae, 0xd0b9b969, 0x91868617, 0x58c1c199, 0x271d1d3a, 0xb99e9e27,
+    0x38e1e1d9, 0x13f8f8eb, 0xb398982b, 0x33111122, 0xbb6969d2, 0x70d9d9a9, 0x898e8e07, 0xa7949433,
+    0xb69b9b2d, 0x221e1e3c, 0x92878715, 0x20e9e9c9, 0x49cece87, 0xff5555aa, 0x78282850, 0x7adfdfa5,
+    0x8f8c8c03, 0xf8a1a159, 0x80898909, 0x170d0d1a, 0xdabfbf65, 0x31e6e6d7, 0xc6424284, 0xb86868d0,
+    0xc3414182, 0xb0999929, 0x772d2d5a, 0x110f0f1e, 0xcbb0b07b, 0xfc5454a8, 0xd6bbbb6d, 0x3a16162c,
+};
+
+static inline uint32_t rotateLeft(uint32_t value, unsigned bits)
+{
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static inline uint32_t load32(const uint8_t *bytes)
+{
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+static inline void store32(uint8_t *bytes, uint32_t value)
+{
+  bytes[0] = value & 0xff;
+  bytes[1] = (value >> 8) & 0xff;
+  bytes[2] = (value >> 16) & 0xff;
+  bytes[3] = value >> 24;
+}
+
+static inline uint32_t roundColumn(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+  return AES_TE0[a & 0xff] ^ rotateLeft(AES_TE0[(b >> 8) & 0xff], 8) ^ rotateLeft(AES_TE0[(c >> 16) & 0xff], 16) ^
+         rotateLeft(AES_TE0[d >> 24], 24);
+}
+
+static inline uint32_t lastRoundColumn(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+  return ((AES_TE0[a & 0xff] >> 8) & 0xff) | (AES_TE0[(b >> 8) & 0xff] & 0xff00) |
+         ((AES_TE0[(c >> 16) & 0xff] << 8) & 0xff0000) | ((AES_TE0[d >> 24] << 16) & 0xff000000);
+}
+
+/// @brief WIDTH blocks round by round, so the table lookups of different blocks overlap.
+/// @details Columns are little endian words; row r of column j comes from column j + r (ShiftRows).
+template <size_t WIDTH>
+static void encryptGroupPortable(const BlockJob *blocks)
+{
+  uint32_t state[WIDTH][4];
+  for (size_t lane = 0; lane < WIDTH; lane++)
+  {
+    for (size_t column = 0; column < 4; column++)
+    {
+      state[lane][column] = load32(&blocks[lane].input[4 * column]) ^ load32(&blocks[lane].roundKeys[4 * column]);
+    }
+  }
+
+  for (size_t round = 1; round < AES_ROUNDS; round++)
+  {
+    for (size_t lane = 0; lane < WIDTH; lane++)
+    {
+      const uint8_t *roundKey = &blocks[lane].roundKeys[round * AES_BLOCK_SIZE];
+      uint32_t *s = state[lane];
+      uint32_t s0 = s[0], s1 = s[1], s2 = s[2], s3 = s[3];
+      s[0] = roundColumn(s0, s1, s2, s3) ^ load32(&roundKey[0]);
+      s[1] = roundColumn(s1, s2, s3, s0) ^ load32(&roundKey[4]);
+      s[2] = roundColumn(s2, s3, s0, s1) ^ load32(&roundKey[8]);
+      s[3] = roundColumn(s3, s0, s1, s2) ^ load32(&roundKey[12]);
+    }
+  }
+
+  for (size_t lane = 0; lane < WIDTH; lane++)
+  {
+    const uint8_t *roundKey = &blocks[lane].roundKeys[AES_ROUNDS * AES_BLOCK_SIZE];
+    const uint32_t *s = state[lane];
+    uint8_t *output = blocks[lane].output;
+    store32(&output[0], lastRoundColumn(s[0], s[1], s[2], s[3]) ^ load32(&roundKey[0]));
+    store32(&output[4], lastRoundColumn(s[1], s[2], s[3], s[0]) ^ load32(&roundKey[4]));
+    store32(&output[8], lastRoundColumn(s[2], s[3], s[0], s[1]) ^ load32(&roundKey[8]));
+    store32(&output[12], lastRoundColumn(s[3], s[0], s[1], s[2]) ^ load32(&roundKey[12]));
+  }
+}
+
+static void encryptBlocksPortable(const BlockJob *blocks, size_t count)
+{
+  for (; count >= PORTABLE_WIDTH; blocks += PORTABLE_WIDTH, count -= PORTABLE_WIDTH)
+  {
+    encryptGroupPortable<PORTABLE_WIDTH>(blocks);
+  }
+  if (count >= 2)
+  {
+    encryptGroupPortable<2>(blocks);
+    blocks += 2;
+    count -= 2;
+  }
+  if (count)
+  {
+    encryptGroupPortable<1>(blocks);
+  }
+}
+
+#if defined(BTHOME_BATCH_HAS_AES_NI)
+/// @brief WIDTH blocks round by round: AESENC has a latency of several cycles but starts one or two per cycle.
+template <size_t WIDTH>
+__attribute__((target("aes,sse2"))) static void encryptGroupAesNi(const BlockJob *blocks)
+{
+  __m128i state[WIDTH];
+  for (size_t lane = 0; lane < WIDTH; lane++)
+  {
+    state[lane] = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(blocks[lane].input)),
+                                _mm_loadu_si128(reinterpret_cast<const __m128i *>(blocks[lane].roundKeys)));
+  }
+  for (size_t round = 1; round < AES_ROUNDS; round++)
+  {
+    for (size_t lane = 0; lane < WIDTH; lane++)
+    {
+      const __m128i *roundKey = reinterpret_cast<const __m128i *>(&blocks[lane].roundKeys[round * AES_BLOCK_SIZE]);
+      state[lane] = _mm_aesenc_si128(state[lane], _mm_loadu_si128(roundKey));
+    }
+  }
+  for (size_t lane = 0; lane < WIDTH; lane++)
+  {
+    const __m128i *roundKey = reinterpret_cast<const __m128i *>(&blocks[lane].roundKeys[AES_ROUNDS * AES_BLOCK_SIZE]);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(blocks[lane].output),
+                     _mm_aesenclast_si128(state[lane], _mm_loadu_si128(roundKey)));
+  }
+}
+
+__attribute__((target("aes,sse2"))) static void encryptBlocksAesNi(const BlockJob *blocks, size_t count)
+{
+  for (; count >= AES_NI_WIDTH; blocks += AES_NI_WIDTH, count -= AES_NI_WIDTH)
+  {
+    encryptGroupAesNi<AES_NI_WIDTH>(blocks);
+  }
+  if (count >= 4)
+  {
+    encryptGroupAesNi<4>(blocks);
+    blocks += 4;
+    count -= 4;
+  }
+  if (count >= 2)
+  {
+    encryptGroupAesNi<2>(blocks);
+    blocks += 2;
+    count -= 2;
+  }
+  if (count)
+  {
+    encryptGroupAesNi<1>(blocks);
+  }
+}
+#endif
+
+typedef void (*EncryptBlocksFunction)(const BlockJob *blocks, size_t count);
+
+/// @brief CCM state of one packet in a group.
+struct Lane
+{
+  uint8_t counterBlock[AES_BLOCK_SIZE]; // A_i
+  uint8_t macInput[AES_BLOCK_SIZE];     // B_0, then X_i ^ P_i
+  uint8_t mac[AES_BLOCK_SIZE];          // X_i
+  uint8_t keyStream[AES_BLOCK_SIZE];    // E(A_i)
+  uint8_t tagMask[AES_BLOCK_SIZE];      // E(A_0)
+  uint8_t firstCounterBlock[AES_BLOCK_SIZE];
+  size_t blocks;
+  bool valid;
+};
+
+static void setBlockIndex(uint8_t block[AES_BLOCK_SIZE], size_t index)
+{
+  block[14] = (index >> 8) & 0xff;
+  block[15] = index & 0xff;
+}
+
+/// @details Step 0 encrypts A_0, B_0 and A_1 of every packet. Step i decrypts block i with E(A_i), then
+/// encrypts the CBC-MAC of it together with A_(i+1). Each step is one call with the blocks of all packets.
+static size_t decryptGroup(BtHomeCcmBatchJob *jobs, size_t count, EncryptBlocksFunction encryptBlocks)
+{
+  Lane lanes[BtHomeV2CcmBatch::BATCH_LANES];
+  BlockJob blocks[BtHomeV2CcmBatch::BATCH_LANES * BLOCKS_PER_LANE];
+  size_t blockCount = 0;
+  size_t steps = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    const BtHomeCcmBatchJob &job = jobs[i];
+    Lane &lane = lanes[i];
+    lane.valid = job.length <= 0xffff;
+    if (!lane.valid)
+    {
+      lane.blocks = 0;
+      continue;
+    }
+
+    // RFC 3610 with a 2 byte length field: flags, nonce, block index or message length
+    lane.blocks = (job.length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+    lane.firstCounterBlock[0] = CCM_LENGTH_SIZE - 1;
+    memcpy(&lane.firstCounterBlock[1], job.nonce, NONCE_LEN);
+    setBlockIndex(lane.firstCounterBlock, 0);
+    memcpy(lane.counterBlock, lane.firstCounterBlock, AES_BLOCK_SIZE);
+    setBlockIndex(lane.counterBlock, 1);
+    lane.macInput[0] = ((MIC_LEN - 2) / 2) << 3 | (CCM_LENGTH_SIZE - 1);
+    memcpy(&lane.macInput[1], job.nonce, NONCE_LEN);
+    setBlockIndex(lane.macInput, job.length);
+
+    blocks[blockCount++] = BlockJob{job.roundKeys, lane.firstCounterBlock, lane.tagMask};
+    blocks[blockCount++] = BlockJob{job.roundKeys, lane.macInput, lane.mac};
+    if (lane.blocks)
+    {
+      blocks[blockCount++] = BlockJob{job.roundKeys, lane.counterBlock, lane.keyStream};
+    }
+    steps = lane.blocks > steps ? lane.blocks : steps;
+  }
+  encryptBlocks(blocks, blockCount);
+
+  for (size_t step = 1; step <= steps; step++)
+  {
+    blockCount = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+      const BtHomeCcmBatchJob &job = jobs[i];
+      Lane &lane = lanes[i];
+      if (step > lane.blocks)
+      {
+        continue;
+      }
+
+      size_t offset = (step - 1) * AES_BLOCK_SIZE;
+      size_t blockLength = job.length - offset < AES_BLOCK_SIZE ? job.length - offset : AES_BLOCK_SIZE;
+      memcpy(lane.macInput, lane.mac, AES_BLOCK_SIZE);
+      for (size_t j = 0; j < blockLength; j++)
+      {
+        uint8_t plaintext = job.input[offset + j] ^ lane.keyStream[j];
+        job.output[offset + j] = plaintext;
+        lane.macInput[j] ^= plaintext;
+      }
+
+      blocks[blockCount++] = BlockJob{job.roundKeys, lane.macInput, lane.mac};
+      if (step < lane.blocks)
+      {
+        setBlockIndex(lane.counterBlock, step + 1);
+        blocks[blockCount++] = BlockJob{job.roundKeys, lane.counterBlock, lane.keyStream};
+      }
+    }
+    encryptBlocks(blocks, blockCount);
+  }
+
+  // compare in constant time
+  size_t authenticated = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    BtHomeCcmBatchJob &job = jobs[i];
+    uint8_t difference = lanes[i].valid ? 0 : 1;
+    for (size_t j = 0; lanes[i].valid && j < MIC_LEN; j++)
+    {
+      difference |= job.tag[j] ^ lanes[i].mac[j] ^ lanes[i].tagMask[j];
+    }
+
+    job.authenticated = difference == 0;
+    if (job.authenticated)
+    {
+      authenticated++;
+    }
+    else
+    {
+      memset(job.output, 0, job.length);
+    }
+  }
+  return authenticated;
+}
+
+BtHomeV2CcmBatch::BtHomeV2CcmBatch(BtHomeBatchCipher cipher)
+    : _cipher(cipher != BTHOME_BATCH_PORTABLE && hasAesNi() ? BTHOME_BATCH_AES_NI : BTHOME_BATCH_PORTABLE)
+{
+}
+
+bool BtHomeV2CcmBatch::hasAesNi()
+{
+#if defined(BTHOME_BATCH_HAS_AES_NI)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("aes");
+#else
+  return false;
+#endif
+}
+
+size_t BtHomeV2CcmBatch::authDecrypt(BtHomeCcmBatchJob *jobs, size_t count) const
+{
+  EncryptBlocksFunction encryptBlocks = encryptBlocksPortable;
+#if defined(BTHOME_BATCH_HAS_AES_NI)
+  if (_cipher == BTHOME_BATCH_AES_NI)
+  {
+    encryptBlocks = encryptBlocksAesNi;
+  }
+#endif
+
+  size_t authenticated = 0;
+  for (size_t first = 0; first < count; first += BATCH_LANES)
+  {
+    size_t group = count - first < BATCH_LANES ? count - first : BATCH_LANES;
+    authenticated += decryptGroup(&jobs[first], group, encryptBlocks);
+  }
+  return authenticated;
+}
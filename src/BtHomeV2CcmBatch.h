@@ -0,0 +1,62 @@
+#ifndef BT_HOME_V2_CCM_BATCH_H
+#define BT_HOME_V2_CCM_BATCH_H
+
+#include <Arduino.h>
+#include "BtHomeV2Ccm.h"
+
+/// @brief The block cipher code BtHomeV2CcmBatch runs.
+enum BtHomeBatchCipher
+{
+  BTHOME_BATCH_AUTO,     // AES-NI when the CPU has it, otherwise portable
+  BTHOME_BATCH_PORTABLE, // 32 bit table based AES, any CPU
+  BTHOME_BATCH_AES_NI    // x86 AES instructions, detected at run time
+};
+
+/// @brief One packet of a batch, the arguments and result of a single authDecrypt call.
+struct BtHomeCcmBatchJob
+{
+  const uint8_t *roundKeys; // from BtHomeV2SoftwareCcm::expandKey
+  uint8_t nonce[NONCE_LEN]; // from buildBtHomeNonce, as the encoder builds it
+  const uint8_t *input;
+  size_t length;
+  uint8_t *output; // may be input
+  const uint8_t *tag; // MIC_LEN bytes
+  bool authenticated; // set by authDecrypt
+};
+
+/// @brief AES-CCM decryption of many BTHome packets at once, for gateways receiving thousands per second.
+/// @details A packet of up to 16 bytes takes four AES blocks and the CBC-MAC block has to wait for the key
+/// stream, so decrypting packets one by one leaves the AES unit mostly idle. The batch runs the blocks of
+/// BATCH_LANES packets side by side, each step handing the cipher all independent blocks at once:
+/// AES-NI keeps eight blocks in flight, the portable code overlaps the table lookups of four.
+///
+///   BtHomeV2CcmBatch batch;
+///   BtHomeCcmBatchJob jobs[32]; // round keys, nonce, ciphertext, MIC and output of each packet
+///   size_t authenticated = batch.authDecrypt(jobs, count);
+///
+/// BtHomeV2KeyStore::decryptBatch builds the jobs from received service data. Nothing is allocated.
+class BtHomeV2CcmBatch
+{
+public:
+  /// @param cipher - BTHOME_BATCH_AES_NI falls back to the portable code on CPUs without AES-NI.
+  explicit BtHomeV2CcmBatch(BtHomeBatchCipher cipher = BTHOME_BATCH_AUTO);
+
+  /// @brief The cipher in use, never BTHOME_BATCH_AUTO.
+  BtHomeBatchCipher cipher() const { return _cipher; }
+
+  /// @brief Verify and decrypt every job, with MIC_LEN byte tags. The output of a job that fails is cleared.
+  /// @details Same results as BtHomeV2Ccm::authDecrypt for each job. Lengths above 65535 bytes fail.
+  /// @return Number of jobs authenticated.
+  size_t authDecrypt(BtHomeCcmBatchJob *jobs, size_t count) const;
+
+  /// @brief true on x86 CPUs with the AES instructions (and a compiler that can target them).
+  static bool hasAesNi();
+
+  /// @brief Packets processed side by side.
+  static const size_t BATCH_LANES = 8;
+
+private:
+  BtHomeBatchCipher _cipher;
+};
+
+#endif // BT_HOME_V2_CCM_BATCH_H
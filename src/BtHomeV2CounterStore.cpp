@@ -0,0 +1,123 @@
+#include "BtHomeV2CounterStore.h"
+
+#include <stdio.h>
+
+#if defined(ESP32)
+#include <Preferences.h>
+#endif
+
+static const size_t COUNTER_FILE_SIZE = 4;
+
+bool BtHomeV2RtcCounterStore::load(uint32_t &counter)
+{
+  if (*_slot == 0)
+  {
+    return false;
+  }
+
+  counter = *_slot;
+  return true;
+}
+
+bool BtHomeV2RtcCounterStore::save(uint32_t counter)
+{
+  *_slot = counter;
+  return true;
+}
+
+#if defined(ESP32)
+bool BtHomeV2NvsCounterStore::load(uint32_t &counter)
+{
+  Preferences preferences;
+  if (!preferences.begin(_namespace, true))
+  {
+    return false;
+  }
+
+  bool found = preferences.isKey(_key);
+  if (found)
+  {
+    counter = preferences.getUInt(_key);
+  }
+  preferences.end();
+  return found;
+}
+
+bool BtHomeV2NvsCounterStore::save(uint32_t counter)
+{
+  Preferences preferences;
+  if (!preferences.begin(_namespace, false))
+  {
+    return false;
+  }
+
+  bool written = preferences.putUInt(_key, counter) == sizeof(counter);
+  preferences.end();
+  return written;
+}
+#endif
+
+static bool temporaryCounterPath(char *temporaryPath, size_t size, const char *path)
+{
+  return snprintf(temporaryPath, size, "%s.tmp", path) < static_cast<int>(size);
+}
+
+bool BtHomeV2FileCounterStore::load(uint32_t &counter)
+{
+  FILE *file = fopen(_path, "rb");
+  if (!file)
+  {
+    // a crash between remove and rename in save leaves only the temporary file
+    char temporaryPath[128];
+    if (temporaryCounterPath(temporaryPath, sizeof(temporaryPath), _path))
+    {
+      file = fopen(temporaryPath, "rb");
+    }
+  }
+
+  if (!file)
+  {
+    return false;
+  }
+
+  uint8_t bytes[COUNTER_FILE_SIZE];
+  bool complete = fread(bytes, 1, COUNTER_FILE_SIZE, file) == COUNTER_FILE_SIZE;
+  fclose(file);
+  if (!complete)
+  {
+    return false;
+  }
+
+  // little endian, like the counter in the advertisement
+  counter = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+  return true;
+}
+
+bool BtHomeV2FileCounterStore::save(uint32_t counter)
+{
+  char temporaryPath[128];
+  if (!temporaryCounterPath(temporaryPath, sizeof(temporaryPath), _path))
+  {
+    return false;
+  }
+
+  FILE *file = fopen(temporaryPath, "wb");
+  if (!file)
+  {
+    return false;
+  }
+
+  uint8_t bytes[COUNTER_FILE_SIZE] = {
+      static_cast<uint8_t>(counter), static_cast<uint8_t>(counter >> 8),
+      static_cast<uint8_t>(counter >> 16), static_cast<uint8_t>(counter >> 24)};
+  bool written = fwrite(bytes, 1, COUNTER_FILE_SIZE, file) == COUNTER_FILE_SIZE;
+  written = fclose(file) == 0 && written;
+
+  // rename replaces the old counter atomically on POSIX; remove first for file systems that refuse to overwrite
+  if (written && rename(temporaryPath, _path) != 0)
+  {
+    remove(_path);
+    written = rename(temporaryPath, _path) == 0;
+  }
+  return written;
+}
@@ -0,0 +1,67 @@
+#ifndef BT_HOME_V2_COUNTER_STORE_H
+#define BT_HOME_V2_COUNTER_STORE_H
+
+#include <Arduino.h>
+
+/// @brief Keeps the encryption counter across deep sleep and reboots, see BtHomeV2Device::setCounterStore.
+/// @details The device stores the first counter value it has not reserved yet, one block ahead of the
+/// packets actually sent. After a crash it continues from the stored value, so counters are never reused
+/// and the store is written only once per block.
+class BtHomeV2CounterStore
+{
+public:
+  virtual ~BtHomeV2CounterStore() {}
+
+  /// @return false if nothing has been stored yet (or the stored value is unreadable).
+  virtual bool load(uint32_t &counter) = 0;
+  virtual bool save(uint32_t counter) = 0;
+};
+
+/// @brief Counter in RTC memory, survives deep sleep but not a power loss.
+/// @details Writes are free, use it with a block size of 1:
+///   RTC_DATA_ATTR uint32_t btHomeCounter = 0;
+///   BtHomeV2RtcCounterStore counterStore(&btHomeCounter);
+class BtHomeV2RtcCounterStore : public BtHomeV2CounterStore
+{
+public:
+  /// @param slot - Variable in RTC memory, 0 means empty.
+  explicit BtHomeV2RtcCounterStore(uint32_t *slot) : _slot(slot) {}
+  bool load(uint32_t &counter) override;
+  bool save(uint32_t counter) override;
+
+private:
+  uint32_t *_slot;
+};
+
+#if defined(ESP32)
+/// @brief Counter in NVS (flash) through Preferences, survives power loss.
+/// @details Every save is a flash write, use a block size of e.g. 256.
+class BtHomeV2NvsCounterStore : public BtHomeV2CounterStore
+{
+public:
+  BtHomeV2NvsCounterStore(const char *nvsNamespace = "bthome", const char *key = "counter")
+      : _namespace(nvsNamespace), _key(key) {}
+  bool load(uint32_t &counter) override;
+  bool save(uint32_t counter) override;
+
+private:
+  const char *_namespace;
+  const char *_key;
+};
+#endif
+
+/// @brief Counter in a file, e.g. on SPIFFS/LittleFS mounted through the VFS or on a host.
+/// @details Saves write a temporary file and rename it, so a crash never leaves a torn counter.
+class BtHomeV2FileCounterStore : public BtHomeV2CounterStore
+{
+public:
+  /// @param path - Kept by pointer, must outlive the store.
+  explicit BtHomeV2FileCounterStore(const char *path) : _path(path) {}
+  bool load(uint32_t &counter) override;
+  bool save(uint32_t counter) override;
+
+private:
+  const char *_path;
+};
+
+#endif // BT_HOME_V2_COUNTER_STORE_H
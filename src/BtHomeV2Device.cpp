@@ -17,92 +17,197 @@ BtHomeV2Device::BtHomeV2Device(const char *shortName, const char *completeName,
 {
 }
 
-BtHomeV2Device::BtHomeV2Device(const char *shortName, const char *completeName, bool isTriggerBased, uint8_t const* const key, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter) : _baseDevice(shortName, completeName, isTriggerBased, key, macAddress, counter){
+BtHomeV2Device::BtHomeV2Device(const char *shortName, const char *completeName, bool isTriggerDevice, size_t maxAdvertisementSize) : _baseDevice(shortName, completeName, isTriggerDevice, maxAdvertisementSize)
+{
+}
+
+BtHomeV2Device::BtHomeV2Device(const char *shortName, const char *completeName, bool isTriggerBased, uint8_t const* const key, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter,
+                               size_t maxAdvertisementSize) : _baseDevice(shortName, completeName, isTriggerBased, key, macAddress, counter, maxAdvertisementSize){
+}
+
+bool BtHomeV2Device::addScaled(BtHomeType sensor, int32_t milliUnits)
+{
+    return _baseDevice.addScaled(sensor, milliUnits);
+}
+
+bool BtHomeV2Device::enableOverflow(size_t maxMeasurementBytes)
+{
+    return _baseDevice.enableOverflow(maxMeasurementBytes);
+}
+
+size_t BtHomeV2Device::nextAdvertisement(uint8_t buffer[MAX_ADVERTISEMENT_SIZE])
+{
+    return _baseDevice.nextAdvertisement(buffer);
+}
+
+BtHomeAdvertisementStatus BtHomeV2Device::getLastStatus() const
+{
+    return _baseDevice.getLastStatus();
+}
+
+bool BtHomeV2Device::enableChangeSuppression(uint32_t maxSilenceMillis, size_t maxDeadbands)
+{
+    return _baseDevice.enableChangeSuppression(maxSilenceMillis, maxDeadbands);
+}
+
+bool BtHomeV2Device::setDeadband(BtHomeType sensor, float threshold)
+{
+    return _baseDevice.setDeadband(sensor, threshold);
+}
+
+bool BtHomeV2Device::isAdvertisementNeeded() const
+{
+    return _baseDevice.isAdvertisementNeeded();
+}
+
+void BtHomeV2Device::enablePacketId()
+{
+    _baseDevice.enablePacketId();
+}
+
+void BtHomeV2Device::setPacketId(uint8_t packetId)
+{
+    _baseDevice.setPacketId(packetId);
+}
+
+size_t BtHomeV2Device::getScanResponseData(uint8_t buffer[MAX_ADVERTISEMENT_SIZE]) const
+{
+    return _baseDevice.getScanResponseData(buffer);
+}
+
+void BtHomeV2Device::enableScanResponse()
+{
+    _baseDevice.enableScanResponse();
+}
+
+bool BtHomeV2Device::setNamePolicy(BtHomeNamePolicy policy, uint16_t count)
+{
+    return _baseDevice.setNamePolicy(policy, count);
+}
+
+uint8_t BtHomeV2Device::getPacketId() const
+{
+    return _baseDevice.getPacketId();
+}
+
+bool BtHomeV2Device::collectStaged(BtHomeV2Staging &staging)
+{
+    return staging.collect(_baseDevice);
+}
+
+size_t BtHomeV2Device::packPrioritized(BtHomeV2PriorityPacker &packer)
+{
+    return packer.fill(_baseDevice);
+}
+
+bool BtHomeV2Device::setCounterStore(BtHomeV2CounterStore *store, uint32_t blockSize)
+{
+    return _baseDevice.setCounterStore(store, blockSize);
+}
+
+uint32_t BtHomeV2Device::getCounter() const
+{
+    return _baseDevice.getCounter();
+}
+
+BtHomeTelemetry BtHomeV2Device::getTelemetry() const
+{
+    return _baseDevice.getTelemetry();
+}
+
+void BtHomeV2Device::resetTelemetry()
+{
+    _baseDevice.resetTelemetry();
+}
+
+size_t BtHomeV2Device::getMaxAdvertisementSize() const
+{
+    return _baseDevice.getMaxAdvertisementSize();
 }
 
 bool BtHomeV2Device::addTemperature_neg44_to_44_Resolution_0_35(float degreesCelsius)
 {
-    return _baseDevice.addFloat(temperature_int8_scale_0_35, degreesCelsius);
+    return _baseDevice.add<BtHomeSensors::temperature_int8_scale_0_35>(degreesCelsius);
 }
 bool BtHomeV2Device::addTemperature_neg127_to_127_Resolution_1(int8_t degreesCelsius)
 {
-    return _baseDevice.addFloat(temperature_int8, degreesCelsius);
+    return _baseDevice.add<BtHomeSensors::temperature_int8>(degreesCelsius);
 }
 bool BtHomeV2Device::addTemperature_neg3276_to_3276_Resolution_0_1(float degreesCelsius)
 {
-    return _baseDevice.addFloat(temperature_int16_scale_0_1, degreesCelsius);
+    return _baseDevice.add<BtHomeSensors::temperature_int16_scale_0_1>(degreesCelsius);
 }
 bool BtHomeV2Device::addTemperature_neg327_to_327_Resolution_0_01(float degreesCelsius)
 {
-    return _baseDevice.addFloat(temperature_int16_scale_0_01, degreesCelsius);
+    return _baseDevice.add<BtHomeSensors::temperature_int16_scale_0_01>(degreesCelsius);
 }
 
 bool BtHomeV2Device::addDistanceMetres(float metres)
 {
-    return _baseDevice.addFloat(distance_metre, metres);
+    return _baseDevice.add<BtHomeSensors::distance_metre>(metres);
 }
 
 bool BtHomeV2Device::addDistanceMillimetres(uint16_t millimetres)
 {
-    return _baseDevice.addUnsignedInteger(distance_millimetre, millimetres);
+    return _baseDevice.add<BtHomeSensors::distance_millimetre>(millimetres);
 }
 
 bool BtHomeV2Device::addCount_0_4294967295(uint32_t count)
 {
-    return _baseDevice.addUnsignedInteger(count_uint32, count);
+    return _baseDevice.add<BtHomeSensors::count_uint32>(count);
 }
 
 bool BtHomeV2Device::addCount_0_255(uint8_t count)
 {
     Serial.print("Adding count 0-255: ");
     Serial.println(count);
-    return _baseDevice.addUnsignedInteger(count_uint8, count);
+    return _baseDevice.add<BtHomeSensors::count_uint8>(count);
 }
 bool BtHomeV2Device::addCount_0_65535(uint16_t count)
 {
-    return _baseDevice.addUnsignedInteger(count_uint16, count);
+    return _baseDevice.add<BtHomeSensors::count_uint16>(count);
 }
 bool BtHomeV2Device::addCount_neg128_127(int8_t count)
 {
-    return _baseDevice.addSignedInteger(count_int8, static_cast<uint64_t>(count));
+    return _baseDevice.add<BtHomeSensors::count_int8>(count);
 }
 bool BtHomeV2Device::addCount_neg32768_32767(int16_t count)
 {
-    return _baseDevice.addSignedInteger(count_int16, static_cast<uint64_t>(count));
+    return _baseDevice.add<BtHomeSensors::count_int16>(count);
 }
 bool BtHomeV2Device::addCount_neg2147483648_2147483647(int32_t count)
 {
-    return _baseDevice.addSignedInteger(count_int32, static_cast<uint64_t>(count));
+    return _baseDevice.add<BtHomeSensors::count_int32>(count);
 }
 
 bool BtHomeV2Device::addHumidityPercent_Resolution_0_01(float humidityPercent)
 {
-    return _baseDevice.addFloat(humidity_uint16, humidityPercent);
+    return _baseDevice.add<BtHomeSensors::humidity_uint16>(humidityPercent);
 }
 
 bool BtHomeV2Device::addHumidityPercent_Resolution_1(uint8_t humidityPercent)
 {
-    return _baseDevice.addFloat(humidity_uint8, humidityPercent);
+    return _baseDevice.add<BtHomeSensors::humidity_uint8>(humidityPercent);
 }
 
 bool BtHomeV2Device::addText(const char text[])
 {
-    return _baseDevice.addRaw(0x53, (uint8_t *)text, strlen(text));
+    return _baseDevice.addRaw(OBJECT_ID_TEXT, (uint8_t *)text, strlen(text));
 }
 
 bool BtHomeV2Device::addTime(uint32_t secondsSinceEpoch)
 {
-    return _baseDevice.addUnsignedInteger(timestamp, secondsSinceEpoch);
+    return _baseDevice.add<BtHomeSensors::timestamp>(secondsSinceEpoch);
 }
 
 bool BtHomeV2Device::addRaw(uint8_t *bytes, uint8_t size)
 {
-    return _baseDevice.addRaw(0x54, bytes, size);
+    return _baseDevice.addRaw(OBJECT_ID_RAW, bytes, size);
 }
 
 bool BtHomeV2Device::addBatteryPercentage(uint8_t batteryPercentage)
 {
-    return _baseDevice.addUnsignedInteger(battery_percentage, batteryPercentage);
+    return _baseDevice.add<BtHomeSensors::battery_percentage>(batteryPercentage);
 }
 
 bool BtHomeV2Device::setBatteryState(BATTERY_STATE batteryState)
@@ -257,185 +362,185 @@ bool BtHomeV2Device::setDimmerEvent(Dimmer_Event_Status dimmerEvent, uint8_t ste
 
 bool BtHomeV2Device::addAccelerationMs2(float value)
 {
-    return _baseDevice.addFloat(acceleration, value);
+    return _baseDevice.add<BtHomeSensors::acceleration>(value);
 }
 
 bool BtHomeV2Device::addChannel(uint8_t value)
 {
-    return _baseDevice.addUnsignedInteger(channel, value);
+    return _baseDevice.add<BtHomeSensors::channel>(value);
 }
 
 bool BtHomeV2Device::addCo2Ppm(uint16_t value)
 {
-    return _baseDevice.addUnsignedInteger(co2, value);
+    return _baseDevice.add<BtHomeSensors::co2>(value);
 }
 
 bool BtHomeV2Device::addConductivityMicrosecondsPerCm(float value)
 {
-    return _baseDevice.addFloat(conductivity, value);
+    return _baseDevice.add<BtHomeSensors::conductivity>(value);
 }
 
 bool BtHomeV2Device::addCurrentAmps_neg32_to_32_Resolution_0_001(float value)
 {
-    return _baseDevice.addFloat(current_int16, value);
+    return _baseDevice.add<BtHomeSensors::current_int16>(value);
 }
 
 bool BtHomeV2Device::addCurrentAmps_0_65_Resolution_0_001(float value)
 {
-    return _baseDevice.addFloat(current_uint16, value);
+    return _baseDevice.add<BtHomeSensors::current_uint16>(value);
 }
 
 bool BtHomeV2Device::addDewPointDegreesCelsius(float value)
 {
-    return _baseDevice.addFloat(dewpoint, value);
+    return _baseDevice.add<BtHomeSensors::dewpoint>(value);
 }
 
 bool BtHomeV2Device::addDirectionDegrees(float value)
 {
-    return _baseDevice.addFloat(direction, value);
+    return _baseDevice.add<BtHomeSensors::direction>(value);
 }
 
 bool BtHomeV2Device::addDurationSeconds(float value)
 {
-    return _baseDevice.addFloat(duration_uint24, value);
+    return _baseDevice.add<BtHomeSensors::duration_uint24>(value);
 }
 
 bool BtHomeV2Device::addEnergyKwh_0_to_16777(float value)
 {
-    return _baseDevice.addFloat(energy_uint24, value);
+    return _baseDevice.add<BtHomeSensors::energy_uint24>(value);
 }
 
 bool BtHomeV2Device::addEnergyKwh_0_to_4294967(float value)
 {
-    return _baseDevice.addFloat(energy_uint32, value);
+    return _baseDevice.add<BtHomeSensors::energy_uint32>(value);
 }
 
 bool BtHomeV2Device::addGasM3_0_to_16777(float value)
 {
-    return _baseDevice.addFloat(gas_uint24, value);
+    return _baseDevice.add<BtHomeSensors::gas_uint24>(value);
 }
 
 bool BtHomeV2Device::addGasM3_0_to_4294967(float value)
 {
-    return _baseDevice.addFloat(gas_uint32, value);
+    return _baseDevice.add<BtHomeSensors::gas_uint32>(value);
 }
 
 bool BtHomeV2Device::addGyroscopeDegreeSeconds(float value)
 {
-    return _baseDevice.addFloat(gyroscope, value);
+    return _baseDevice.add<BtHomeSensors::gyroscope>(value);
 }
 
 bool BtHomeV2Device::addIlluminanceLux(float value)
 {
-    return _baseDevice.addFloat(illuminance, value);
+    return _baseDevice.add<BtHomeSensors::illuminance>(value);
 }
 
 bool BtHomeV2Device::addMassKg(float value)
 {
-    return _baseDevice.addFloat(mass_kg, value);
+    return _baseDevice.add<BtHomeSensors::mass_kg>(value);
 }
 
 bool BtHomeV2Device::addMassLb(float value)
 {
-    return _baseDevice.addFloat(mass_lb, value);
+    return _baseDevice.add<BtHomeSensors::mass_lb>(value);
 }
 
 bool BtHomeV2Device::addMoisturePercent_Resolution_1(uint8_t value)
 {
-    return _baseDevice.addUnsignedInteger(moisture_uint8, value);
+    return _baseDevice.add<BtHomeSensors::moisture_uint8>(value);
 }
 
 bool BtHomeV2Device::addMoisturePercent_Resolution_0_01(float value)
 {
-    return _baseDevice.addFloat(moisture_uint16, value);
+    return _baseDevice.add<BtHomeSensors::moisture_uint16>(value);
 }
 
 bool BtHomeV2Device::addPm2_5UgM3(uint16_t value)
 {
-    return _baseDevice.addUnsignedInteger(pm2_5, value);
+    return _baseDevice.add<BtHomeSensors::pm2_5>(value);
 }
 
 bool BtHomeV2Device::addPm10UgM3(uint16_t value)
 {
-    return _baseDevice.addUnsignedInteger(pm10, value);
+    return _baseDevice.add<BtHomeSensors::pm10>(value);
 }
 
 bool BtHomeV2Device::addPower_neg21474836_to_21474836_resolution_0_01(float value)
 {
-    return _baseDevice.addFloat(power_int32, value);
+    return _baseDevice.add<BtHomeSensors::power_int32>(value);
 }
 
 bool BtHomeV2Device::addPower_0_to_167772_resolution_0_01(float value)
 {
-    return _baseDevice.addFloat(power_uint24, value);
+    return _baseDevice.add<BtHomeSensors::power_uint24>(value);
 }
 
 bool BtHomeV2Device::addPrecipitationMm(float value)
 {
-    return _baseDevice.addFloat(precipitation, value);
+    return _baseDevice.add<BtHomeSensors::precipitation>(value);
 }
 
 bool BtHomeV2Device::addPressureHpa(float value)
 {
-    return _baseDevice.addFloat(pressure, value);
+    return _baseDevice.add<BtHomeSensors::pressure>(value);
 }
 
 bool BtHomeV2Device::addRotationDegrees(float value)
 {
-    return _baseDevice.addFloat(rotation, value);
+    return _baseDevice.add<BtHomeSensors::rotation>(value);
 }
 
 bool BtHomeV2Device::addSpeedMs(float value)
 {
-    return _baseDevice.addFloat(speed, value);
+    return _baseDevice.add<BtHomeSensors::speed>(value);
 }
 
 bool BtHomeV2Device::addTvocUgm3(uint16_t value)
 {
-    return _baseDevice.addUnsignedInteger(tvoc, value);
+    return _baseDevice.add<BtHomeSensors::tvoc>(value);
 }
 
 bool BtHomeV2Device::addVoltage_0_to_6550_resolution_0_1(float value)
 {
-    return _baseDevice.addFloat(voltage_0_1, value);
+    return _baseDevice.add<BtHomeSensors::voltage_0_1>(value);
 }
 
 bool BtHomeV2Device::addVoltage_0_to_65_resolution_0_001(float value)
 {
-    return _baseDevice.addFloat(voltage_0_001, value);
+    return _baseDevice.add<BtHomeSensors::voltage_0_001>(value);
 }
 
 bool BtHomeV2Device::addVolumeLitres_0_to_6555_resolution_0_1(float value)
 {
-    return _baseDevice.addFloat(volume_uint16_scale_0_1, value);
+    return _baseDevice.add<BtHomeSensors::volume_uint16_scale_0_1>(value);
 }
 
 bool BtHomeV2Device::addVolumeLitres_0_to_65550_resolution_1(uint16_t value)
 {
-    return _baseDevice.addUnsignedInteger(volume_uint16_scale_1, value);
+    return _baseDevice.add<BtHomeSensors::volume_uint16_scale_1>(value);
 }
 
 bool BtHomeV2Device::addVolumeLitres_0_to_4294967_resolution_0_001(float value)
 {
-    return _baseDevice.addFloat(volume_uint32, value);
+    return _baseDevice.add<BtHomeSensors::volume_uint32>(value);
 }
 
 bool BtHomeV2Device::addVolumeStorageLitres(float value)
 {
-    return _baseDevice.addFloat(volume_storage, value);
+    return _baseDevice.add<BtHomeSensors::volume_storage>(value);
 }
 
 bool BtHomeV2Device::addVolumeFlowRateM3hr(float value)
 {
-    return _baseDevice.addFloat(volume_flow_rate, value);
+    return _baseDevice.add<BtHomeSensors::volume_flow_rate>(value);
 }
 
 bool BtHomeV2Device::addUvIndex(float value)
 {
-    return _baseDevice.addFloat(UV_index, value);
+    return _baseDevice.add<BtHomeSensors::UV_index>(value);
 }
 
 bool BtHomeV2Device::addWaterLitres(float value)
 {
-    return _baseDevice.addFloat(water_litre, value);
+    return _baseDevice.add<BtHomeSensors::water_litre>(value);
 }
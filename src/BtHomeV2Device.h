@@ -5,6 +5,10 @@
 
 #include <Arduino.h>
 #include "BaseDevice.h"
+#include "BtHomeV2CounterStore.h"
+#include "BtHomeV2Staging.h"
+#include "BtHomeV2Burst.h"
+#include "BtHomeV2PriorityPacker.h"
 
 /**
  * @file BTHome.h
@@ -26,12 +30,149 @@ public:
     /// @param completeName  Full name of the device - sent when space is available. Max 20 characters
     /// @param isTriggerDevice - If the device sends data when triggered
     BtHomeV2Device(const char *shortName, const char *completeName, bool isTriggerDevice);
-    BtHomeV2Device(const char *shortName, const char *completeName, bool isTriggerBased, uint8_t const *const key, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter = 1);
 
+    /// @brief Device with a larger packet for BLE 5 extended advertising.
+    /// @param maxAdvertisementSize Packet size, MAX_ADVERTISEMENT_SIZE (31) up to MAX_EXTENDED_ADVERTISEMENT_SIZE (255).
+    /// The measurement buffer is allocated once here when larger than the legacy size.
+    BtHomeV2Device(const char *shortName, const char *completeName, bool isTriggerDevice, size_t maxAdvertisementSize);
+    BtHomeV2Device(const char *shortName, const char *completeName, bool isTriggerBased, uint8_t const *const key, const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter = 1,
+                   size_t maxAdvertisementSize = MAX_ADVERTISEMENT_SIZE);
+
+    /// @brief Build the advertisement.
+    /// @param buffer Must hold getMaxAdvertisementSize() bytes.
+    /// @return Number of bytes, 0 when encrypted and the counter store could not save the next reservation.
     size_t getAdvertisementData(uint8_t buffer[MAX_ADVERTISEMENT_SIZE]);
 
+    /// @brief The name AD structures for the scan response of scannable advertising.
+    size_t getScanResponseData(uint8_t buffer[MAX_ADVERTISEMENT_SIZE]) const;
+
+    /// @brief Send the names only in the scan response, the packet then holds just flags and service data.
+    /// @details Call once while setting up, and set getScanResponseData as the scan response.
+    void enableScanResponse();
+
+    /// @brief Accept more measurements than fit in one packet, e.g. a probe with many channels.
+    /// @details Call once while setting up. Send the packets with nextAdvertisement.
+    /// @param maxMeasurementBytes Total size of all measurements, one byte per object id plus its value. Max 255.
+    bool enableOverflow(size_t maxMeasurementBytes);
+
+    /// @brief Build the next packet when the measurements do not fit in one advertisement.
+    /// @details Every packet is sorted and, when encrypted, uses its own counter.
+    ///   while (size_t size = device.nextAdvertisement(buffer)) { sendAdvertisement(buffer, size); }
+    /// @return The packet size, 0 after the last packet (the next call starts over) or while the counter store
+    /// can not be written, see getLastStatus.
+    size_t nextAdvertisement(uint8_t buffer[MAX_ADVERTISEMENT_SIZE]);
+
+    /// @brief Why the last getAdvertisementData or nextAdvertisement call returned 0.
+    /// @details BTHOME_ADVERTISEMENT_SEQUENCE_DONE after the last packet of a sequence, BTHOME_ADVERTISEMENT_COUNTER_NOT_SAVED
+    /// when encryption stopped because the next counter reservation could not be saved; retry later then.
+    BtHomeAdvertisementStatus getLastStatus() const;
+
+    size_t getMaxAdvertisementSize() const;
+
+    /// @brief Start every packet with a packet id, so receivers drop repeated copies (see BtHomeV2BurstScheduler).
+    /// @details Call once while setting up. Uses 2 bytes of each packet. The id starts at 1 with every construction,
+    /// so a device rebuilt on every wake continues it with setPacketId.
+    void enablePacketId();
+
+    /// @brief Continue the packet ids after packetId, e.g. getPacketId() saved in RTC memory before deep sleep.
+    /// @details The next packet built gets packetId + 1.
+    void setPacketId(uint8_t packetId);
+
+    /// @brief Packet id of the last packet built.
+    uint8_t getPacketId() const;
+
+    /// @brief Send the names in every packet (default), every Nth packet, the first N packets or never.
+    /// @details e.g. setNamePolicy(BTHOME_NAME_EVERY_NTH, 10). Measurements keep the space first; a due name that
+    /// does not fit goes into the next packet with room for it.
+    /// @return false if count is 0 for BTHOME_NAME_EVERY_NTH.
+    bool setNamePolicy(BtHomeNamePolicy policy, uint16_t count = 1);
+
+    /// @brief Persist the encryption counter, so a restarted device does not reuse counters and get replay-rejected.
+    /// @details Call once while setting up an encrypted device. The counter continues from the store, and the
+    /// store is written once per blockSize packets. After a crash up to blockSize counters are skipped.
+    /// While the store can not be written no packet is encrypted, getAdvertisementData returns 0 and retries next time.
+    /// @param store e.g. BtHomeV2RtcCounterStore (block size 1), BtHomeV2NvsCounterStore or BtHomeV2FileCounterStore (e.g. 256). Must outlive the device.
+    /// @return false if the store could not be written.
+    bool setCounterStore(BtHomeV2CounterStore *store, uint32_t blockSize = DEFAULT_COUNTER_BLOCK_SIZE);
+
+    /// @brief The counter the next encrypted packet uses.
+    uint32_t getCounter() const;
+
+    /// @brief Encoder counters (packets, bytes, rejected measurements, dropped names, encryption cost) since construction or resetTelemetry.
+    /// @details Only counted when the library is built with BTHOME_TELEMETRY, all zero otherwise.
+    BtHomeTelemetry getTelemetry() const;
+    void resetTelemetry();
+
+    /// @brief Only advertise when a measurement changed. Check isAdvertisementNeeded before advertising.
+    /// @details Call once while setting up, it keeps a copy of the measurements last advertised.
+    /// @param maxSilenceMillis Heartbeat, advertise at least this often even if nothing changed. 0 disables it.
+    /// @param maxDeadbands Number of sensor types that can get a deadband.
+    bool enableChangeSuppression(uint32_t maxSilenceMillis, size_t maxDeadbands = 4);
+
+    /// @brief Ignore changes up to threshold for all measurements of a sensor type.
+    /// @details e.g. setDeadband(temperature_int16_scale_0_01, 0.2f). Other sensors count any change of the encoded value.
+    bool setDeadband(BtHomeType sensor, float threshold);
+
+    /// @brief setDeadband with a compile-time descriptor, e.g. setDeadband<BtHomeSensors::temperature_int16_scale_0_01>(0.2f)
+    template <typename Sensor>
+    bool setDeadband(float threshold)
+    {
+        return _baseDevice.setDeadband(Sensor::type(), threshold);
+    }
+
+    /// @brief Whether the measurements added since clearMeasurementData need to be advertised.
+    /// @details False when every measurement is within its deadband of the last advertisement and the heartbeat is not due,
+    /// so the radio can stay off. Always true without enableChangeSuppression.
+    bool isAdvertisementNeeded() const;
+
     void clearMeasurementData();
 
+    /// @brief Add the measurements interrupts and other tasks staged since the last call, see BtHomeV2Staging::collect.
+    /// @return false if a producer is still writing, nothing was added then. Try again later.
+    bool collectStaged(BtHomeV2Staging &staging);
+
+    /// @brief Fill the space left in the packet with the most important and most overdue values, see BtHomeV2PriorityPacker::fill.
+    /// @return Number of measurements added.
+    size_t packPrioritized(BtHomeV2PriorityPacker &packer);
+
+    /**
+     * @brief Add a measurement using a compile-time descriptor from BtHomeSensors.
+     * @details e.g. add<BtHomeSensors::temperature_int16_scale_0_01>(21.5f)
+     */
+    template <typename Sensor, typename T>
+    bool add(T value)
+    {
+        return _baseDevice.add<Sensor>(value);
+    }
+
+    /**
+     * @brief Add a fixed-point measurement in thousandths of the unit, without floating point code.
+     * @details e.g. addScaled<BtHomeSensors::temperature_int16_scale_0_01>(21370) for 21.37 °C.
+     * Encodes the same bytes as add() with the decimal value, truncating toward zero.
+     */
+    template <typename Sensor>
+    bool addScaled(int32_t milliUnits)
+    {
+        return _baseDevice.addScaled<Sensor>(milliUnits);
+    }
+
+    /**
+     * @brief Replace the measurements with one value per sensor of a fixed set, checked at compile time.
+     * @details e.g. setMeasurements<ClimateBudget>(21.5f, 48.2f, 95) with a BtHomePayloadBudget. An oversized set
+     * does not compile; the space is not checked per measurement.
+     * @return false if the device is configured with less space than the budget assumes.
+     */
+    template <typename Budget, typename... Values>
+    bool setMeasurements(Values... values)
+    {
+        return _baseDevice.setMeasurements<Budget>(values...);
+    }
+
+    /**
+     * @brief Runtime variant of addScaled<Sensor>, e.g. addScaled(temperature_int16_scale_0_01, 21370).
+     */
+    bool addScaled(BtHomeType sensor, int32_t milliUnits);
+
     /**
      * @brief Set a generic count value in the packet.
      * @param count Arbitrary count (e.g., event count).
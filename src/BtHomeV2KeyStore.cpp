@@ -0,0 +1,238 @@
+#include "BtHomeV2KeyStore.h"
+
+static const size_t DEVICE_INFO_SIZE = 1;
+
+static uint64_t macToInteger(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH])
+{
+  uint64_t value = 0;
+  for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+  {
+    value = (value << 8) | macAddress[i];
+  }
+  return value;
+}
+
+BtHomeV2KeyStore::BtHomeV2KeyStore(size_t capacity)
+    : _capacity(capacity)
+{
+  // keep the table at most half full so probe sequences stay short
+  size_t slotCount = 2;
+  while (slotCount < capacity * 2)
+  {
+    slotCount <<= 1;
+  }
+  _slotMask = slotCount - 1;
+
+  _entries = new Entry[capacity];
+  _slots = new uint32_t[slotCount];
+  for (size_t i = 0; i < slotCount; i++)
+  {
+    _slots[i] = EMPTY_SLOT;
+  }
+
+  // entries never move (the CCM contexts can not be copied), unused ones are kept on a stack
+  _freeEntries = new uint32_t[capacity];
+  for (size_t i = 0; i < capacity; i++)
+  {
+    _freeEntries[i] = capacity - 1 - i;
+  }
+}
+
+BtHomeV2KeyStore::~BtHomeV2KeyStore()
+{
+  delete[] _entries;
+  delete[] _slots;
+  delete[] _freeEntries;
+}
+
+/// @brief Home slot of a MAC address (Fibonacci hashing).
+size_t BtHomeV2KeyStore::slotFor(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH]) const
+{
+  return static_cast<size_t>((macToInteger(macAddress) * 0x9E3779B97F4A7C15ull) >> 32) & _slotMask;
+}
+
+/// @brief Slot holding the MAC address, or the empty slot where it would be inserted.
+size_t BtHomeV2KeyStore::findSlot(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH]) const
+{
+  size_t slot = slotFor(macAddress);
+  while (_slots[slot] != EMPTY_SLOT && memcmp(_entries[_slots[slot]].macAddress, macAddress, BLE_MAC_ADDRESS_LENGTH) != 0)
+  {
+    slot = (slot + 1) & _slotMask;
+  }
+  return slot;
+}
+
+bool BtHomeV2KeyStore::addKey(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], const uint8_t key[BIND_KEY_LEN])
+{
+  size_t slot = findSlot(macAddress);
+  if (_slots[slot] == EMPTY_SLOT)
+  {
+    if (_size >= _capacity)
+    {
+      return false;
+    }
+    uint32_t entry = _freeEntries[_capacity - 1 - _size];
+    _slots[slot] = entry;
+    memcpy(_entries[entry].macAddress, macAddress, BLE_MAC_ADDRESS_LENGTH);
+    _size++;
+  }
+
+  Entry &entry = _entries[_slots[slot]];
+#if !defined(BTHOME_CCM_SOFTWARE)
+  BtHomeV2SoftwareCcm::expandKey(key, entry.roundKeys);
+#endif
+  return entry.context.setKey(key);
+}
+
+bool BtHomeV2KeyStore::removeKey(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH])
+{
+  size_t slot = findSlot(macAddress);
+  if (_slots[slot] == EMPTY_SLOT)
+  {
+    return false;
+  }
+
+  _size--;
+  _freeEntries[_capacity - 1 - _size] = _slots[slot];
+
+  // backward shift deletion, so no tombstones are needed
+  size_t hole = slot;
+  size_t next = (hole + 1) & _slotMask;
+  while (_slots[next] != EMPTY_SLOT)
+  {
+    size_t home = slotFor(_entries[_slots[next]].macAddress);
+    // move the entry into the hole if its home slot is not between the hole and its current slot
+    if (((next - home) & _slotMask) >= ((next - hole) & _slotMask))
+    {
+      _slots[hole] = _slots[next];
+      hole = next;
+    }
+    next = (next + 1) & _slotMask;
+  }
+  _slots[hole] = EMPTY_SLOT;
+  return true;
+}
+
+bool BtHomeV2KeyStore::hasKey(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH]) const
+{
+  return _slots[findSlot(macAddress)] != EMPTY_SLOT;
+}
+
+/// @brief The checks and lookup shared by decrypt and decryptBatch.
+BtHomeDecryptStatus BtHomeV2KeyStore::locate(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], const uint8_t *serviceData, size_t length,
+                                             Entry **entry, size_t *ciphertextLength, uint32_t *counter)
+{
+  if (length < DEVICE_INFO_SIZE || !(serviceData[0] & FLAG_ENCRYPT))
+  {
+    return BTHOME_DECRYPT_NOT_ENCRYPTED;
+  }
+  if (length < DEVICE_INFO_SIZE + COUNTER_LEN + MIC_LEN)
+  {
+    return BTHOME_DECRYPT_TRUNCATED;
+  }
+
+  size_t slot = findSlot(macAddress);
+  if (_slots[slot] == EMPTY_SLOT)
+  {
+    return BTHOME_DECRYPT_UNKNOWN_DEVICE;
+  }
+
+  *entry = &_entries[_slots[slot]];
+  *ciphertextLength = length - DEVICE_INFO_SIZE - COUNTER_LEN - MIC_LEN;
+  const uint8_t *counterBytes = &serviceData[DEVICE_INFO_SIZE + *ciphertextLength];
+  *counter = counterBytes[0] | (counterBytes[1] << 8) | (counterBytes[2] << 16) | (static_cast<uint32_t>(counterBytes[3]) << 24);
+  return BTHOME_DECRYPT_OK;
+}
+
+const uint8_t *BtHomeV2KeyStore::roundKeys(const Entry &entry) const
+{
+#if defined(BTHOME_CCM_SOFTWARE)
+  return entry.context.roundKeys();
+#else
+  return entry.roundKeys;
+#endif
+}
+
+BtHomeDecryptStatus BtHomeV2KeyStore::decrypt(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], const uint8_t *serviceData, size_t length,
+                                              uint8_t *measurements, size_t *measurementsLength, uint32_t *counter)
+{
+  Entry *entry;
+  size_t ciphertextLength;
+  uint32_t packetCounter;
+  BtHomeDecryptStatus status = locate(macAddress, serviceData, length, &entry, &ciphertextLength, &packetCounter);
+  if (status != BTHOME_DECRYPT_OK)
+  {
+    return status;
+  }
+
+  const uint8_t *ciphertext = &serviceData[DEVICE_INFO_SIZE];
+  const uint8_t *mic = &ciphertext[ciphertextLength + COUNTER_LEN];
+  uint8_t nonce[NONCE_LEN];
+  buildBtHomeNonce(nonce, macAddress, packetCounter);
+
+  if (!entry->context.authDecrypt(nonce, ciphertext, ciphertextLength, measurements, mic))
+  {
+    return BTHOME_DECRYPT_AUTH_FAILED;
+  }
+
+  *measurementsLength = ciphertextLength;
+  if (counter)
+  {
+    *counter = packetCounter;
+  }
+  return BTHOME_DECRYPT_OK;
+}
+
+/// @details Jobs go to the batch in groups of BATCH_LANES that passed the checks, so unknown devices
+/// and short packets do not leave lanes empty.
+size_t BtHomeV2KeyStore::decryptBatch(BtHomeDecryptJob *jobs, size_t count)
+{
+  BtHomeCcmBatchJob batch[BtHomeV2CcmBatch::BATCH_LANES];
+  BtHomeDecryptJob *pending[BtHomeV2CcmBatch::BATCH_LANES];
+  size_t pendingCount = 0;
+  size_t decrypted = 0;
+  for (size_t i = 0; i <= count; i++)
+  {
+    if (i < count)
+    {
+      BtHomeDecryptJob &job = jobs[i];
+      Entry *entry;
+      size_t ciphertextLength;
+      job.measurementsLength = 0;
+      job.status = locate(job.macAddress, job.serviceData, job.length, &entry, &ciphertextLength, &job.counter);
+      if (job.status != BTHOME_DECRYPT_OK)
+      {
+        continue;
+      }
+
+      BtHomeCcmBatchJob &batchJob = batch[pendingCount];
+      batchJob.roundKeys = roundKeys(*entry);
+      buildBtHomeNonce(batchJob.nonce, job.macAddress, job.counter);
+      batchJob.input = &job.serviceData[DEVICE_INFO_SIZE];
+      batchJob.length = ciphertextLength;
+      batchJob.output = job.measurements;
+      batchJob.tag = &job.serviceData[DEVICE_INFO_SIZE + ciphertextLength + COUNTER_LEN];
+      pending[pendingCount++] = &job;
+      if (pendingCount < BtHomeV2CcmBatch::BATCH_LANES)
+      {
+        continue;
+      }
+    }
+
+    _batch.authDecrypt(batch, pendingCount);
+    for (size_t j = 0; j < pendingCount; j++)
+    {
+      if (batch[j].authenticated)
+      {
+        pending[j]->measurementsLength = batch[j].length;
+        decrypted++;
+      }
+      else
+      {
+        pending[j]->status = BTHOME_DECRYPT_AUTH_FAILED;
+      }
+    }
+    pendingCount = 0;
+  }
+  return decrypted;
+}
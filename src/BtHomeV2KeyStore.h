@@ -0,0 +1,96 @@
+#ifndef BT_HOME_V2_KEY_STORE_H
+#define BT_HOME_V2_KEY_STORE_H
+
+#include <Arduino.h>
+#include "BaseDevice.h"
+#include "BtHomeV2CcmBatch.h"
+
+enum BtHomeDecryptStatus
+{
+  BTHOME_DECRYPT_OK,
+  BTHOME_DECRYPT_UNKNOWN_DEVICE,
+  BTHOME_DECRYPT_NOT_ENCRYPTED,
+  BTHOME_DECRYPT_TRUNCATED,
+  BTHOME_DECRYPT_AUTH_FAILED
+};
+
+/// @brief One packet for BtHomeV2KeyStore::decryptBatch: the arguments and results of a decrypt call.
+struct BtHomeDecryptJob
+{
+  const uint8_t *macAddress;
+  const uint8_t *serviceData;
+  size_t length;
+  uint8_t *measurements; // must hold length bytes
+  size_t measurementsLength;
+  uint32_t counter;
+  BtHomeDecryptStatus status;
+};
+
+/// @brief Bind keys of encrypted BTHome devices, looked up by MAC address.
+/// @details The AES key schedule of every device is expanded once in addKey and kept,
+/// so decrypting a packet costs one lookup plus the CCM operation.
+/// All memory is allocated in the constructor (and by mbedtls in addKey when that is the CCM backend), none per packet.
+class BtHomeV2KeyStore
+{
+public:
+  /// @param capacity - Maximum number of devices.
+  explicit BtHomeV2KeyStore(size_t capacity);
+  ~BtHomeV2KeyStore();
+
+  /// @brief Add a device, or replace the key of a known device.
+  /// @return false if the store is full.
+  bool addKey(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], const uint8_t key[BIND_KEY_LEN]);
+  bool removeKey(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH]);
+  bool hasKey(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH]) const;
+  size_t size() const { return _size; }
+  size_t capacity() const { return _capacity; }
+
+  /// @brief Verify and decrypt encrypted BTHome service data.
+  /// @param macAddress - Advertiser address, as passed to the encrypting BtHomeV2Device.
+  /// @param serviceData - Service data starting at the device information byte (see BtHomeV2Parser).
+  /// @param length
+  /// @param measurements - Receives the plaintext measurements. Must hold length bytes.
+  /// @param measurementsLength - Set to the number of plaintext bytes.
+  /// @param counter - Optional, set to the packet counter.
+  /// @details Parse the result with BtHomeV2Parser::fromMeasurements(serviceData[0], measurements, *measurementsLength).
+  BtHomeDecryptStatus decrypt(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], const uint8_t *serviceData, size_t length,
+                              uint8_t *measurements, size_t *measurementsLength, uint32_t *counter = nullptr);
+
+  /// @brief decrypt for many packets at once, through BtHomeV2CcmBatch instead of the CCM backend.
+  /// @details Gives the same status, measurements and counter per job as decrypt. Worth it from a few
+  /// packets per call, e.g. everything a scan callback collected since the last loop.
+  /// @return Number of jobs with status BTHOME_DECRYPT_OK.
+  size_t decryptBatch(BtHomeDecryptJob *jobs, size_t count);
+
+private:
+  BtHomeV2KeyStore(const BtHomeV2KeyStore &) = delete;
+  BtHomeV2KeyStore &operator=(const BtHomeV2KeyStore &) = delete;
+
+  struct Entry
+  {
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    BtHomeV2Ccm context;
+#if !defined(BTHOME_CCM_SOFTWARE)
+    // the batch path needs the key schedule itself, mbedtls keeps it to itself
+    uint8_t roundKeys[BtHomeV2SoftwareCcm::ROUND_KEYS_SIZE];
+#endif
+  };
+
+  static const uint32_t EMPTY_SLOT = 0xffffffff;
+
+  size_t findSlot(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH]) const;
+  size_t slotFor(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH]) const;
+  BtHomeDecryptStatus locate(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], const uint8_t *serviceData, size_t length,
+                             Entry **entry, size_t *ciphertextLength, uint32_t *counter);
+  const uint8_t *roundKeys(const Entry &entry) const;
+
+  Entry *_entries;
+  uint32_t *_slots; // open addressing, linear probing; holds indices into _entries
+  uint32_t *_freeEntries; // stack of unused entries, the top is at _capacity - 1 - _size
+  size_t _capacity;
+  size_t _slotMask;
+  size_t _size = 0;
+  BtHomeV2CcmBatch _batch;
+};
+
+#endif // BT_HOME_V2_KEY_STORE_H
@@ -0,0 +1,177 @@
+#include "BtHomeV2Multiplexer.h"
+
+BtHomeV2Multiplexer::BtHomeV2Multiplexer(size_t maxDevices, size_t measurementsPerDevice, BtHomeSchedule schedule,
+                                         size_t maxAdvertisementSize)
+    : _encoder("", "", false, maxAdvertisementSize), _capacity(maxDevices),
+      _measurementsPerDevice(measurementsPerDevice), _schedule(schedule)
+{
+  _devices = new VirtualDevice[maxDevices];
+  _ciphers = new BtHomeV2Ccm[maxDevices];
+  _measurements = new Measurement[maxDevices * measurementsPerDevice];
+}
+
+BtHomeV2Multiplexer::~BtHomeV2Multiplexer()
+{
+  delete[] _devices;
+  delete[] _ciphers;
+  delete[] _measurements;
+}
+
+size_t BtHomeV2Multiplexer::bytesPerDevice(size_t measurementsPerDevice)
+{
+  return sizeof(VirtualDevice) + sizeof(BtHomeV2Ccm) + measurementsPerDevice * sizeof(Measurement);
+}
+
+int BtHomeV2Multiplexer::addDevice(const char *shortName, const char *completeName, bool isTriggerBased,
+                                   const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], const uint8_t *key, uint32_t counter,
+                                   uint8_t weight)
+{
+  if (_size >= _capacity)
+  {
+    return -1;
+  }
+
+  VirtualDevice &device = _devices[_size];
+  device.shortName = shortName;
+  device.completeName = completeName;
+  device.counter = counter;
+  device.credit = 0;
+  memcpy(device.macAddress, macAddress, BLE_MAC_ADDRESS_LENGTH);
+  device.encrypted = key != nullptr;
+  if (device.encrypted)
+  {
+    _ciphers[_size].setKey(key);
+  }
+  device.weight = weight ? weight : 1;
+  device.measurementCount = 0;
+  device.measurementBytes = 0;
+  device.triggerBased = isTriggerBased;
+  device.fresh = false;
+  return static_cast<int>(_size++);
+}
+
+bool BtHomeV2Multiplexer::clearMeasurements(size_t device)
+{
+  if (device >= _size)
+  {
+    return false;
+  }
+
+  _devices[device].measurementCount = 0;
+  _devices[device].measurementBytes = 0;
+  return true;
+}
+
+/// @return false if the device does not exist, has no room left or the value is wider than 4 bytes.
+bool BtHomeV2Multiplexer::addEncoded(size_t device, BtHomeState sensor, uint32_t rawValue)
+{
+  if (device >= _size || sensor.byteCount > sizeof(rawValue) || _devices[device].measurementCount >= _measurementsPerDevice)
+  {
+    return false;
+  }
+
+  VirtualDevice &virtualDevice = _devices[device];
+  uint8_t size = sensor.byteCount + TYPE_INDICATOR_SIZE;
+  if (measurementSpace(virtualDevice) - virtualDevice.measurementBytes < size)
+  {
+    return false;
+  }
+
+  virtualDevice.measurementBytes += size;
+  Measurement &measurement = _measurements[device * _measurementsPerDevice + virtualDevice.measurementCount++];
+  measurement.value = rawValue;
+  measurement.id = sensor.id;
+  measurement.byteCount = sensor.byteCount;
+  virtualDevice.fresh = true;
+  return true;
+}
+
+/// @brief Measurement bytes the shared encoder accepts for this device, see BaseDevice::packetMeasurementSpace.
+int BtHomeV2Multiplexer::measurementSpace(const VirtualDevice &device) const
+{
+  return static_cast<int>(_encoder.getMaxAdvertisementSize() - HEADER_SIZE) + 1 -
+         (device.encrypted ? ENCRYPTION_ADDITIONAL_BYTES : 0);
+}
+
+/// @return Index of the device for the next slot, or _size if no device has measurements.
+size_t BtHomeV2Multiplexer::scheduleNext()
+{
+  if (_schedule == BTHOME_SCHEDULE_ROUND_ROBIN)
+  {
+    for (size_t i = 0; i < _size; i++)
+    {
+      size_t device = _nextDevice;
+      _nextDevice = (_nextDevice + 1) % _size;
+      if (_devices[device].measurementCount)
+      {
+        return device;
+      }
+    }
+    return _size;
+  }
+
+  size_t best = _size;
+  int32_t total = 0;
+  for (size_t i = 0; i < _size; i++)
+  {
+    VirtualDevice &device = _devices[i];
+    if (!device.measurementCount)
+    {
+      continue;
+    }
+
+    int32_t weight = device.fresh ? device.weight * FRESHNESS_BOOST : device.weight;
+    device.credit += weight;
+    total += weight;
+    if (best == _size || device.credit > _devices[best].credit)
+    {
+      best = i;
+    }
+  }
+
+  if (best != _size)
+  {
+    _devices[best].credit -= total;
+  }
+  return best;
+}
+
+size_t BtHomeV2Multiplexer::nextAdvertisement(uint8_t buffer[MAX_EXTENDED_ADVERTISEMENT_SIZE], size_t &device)
+{
+  device = scheduleNext();
+  if (device == _size)
+  {
+    _lastStatus = BTHOME_ADVERTISEMENT_NO_MEASUREMENTS;
+    return 0;
+  }
+
+  VirtualDevice &virtualDevice = _devices[device];
+  _encoder.resetMeasurement();
+  _encoder.setIdentity(virtualDevice.shortName, virtualDevice.completeName, virtualDevice.triggerBased,
+                       nullptr, virtualDevice.macAddress, virtualDevice.counter,
+                       virtualDevice.encrypted ? &_ciphers[device] : nullptr);
+
+  // addEncoded kept every device within its packet space, so the encoder takes all of them
+  const Measurement *measurements = &_measurements[device * _measurementsPerDevice];
+  for (uint8_t i = 0; i < virtualDevice.measurementCount; i++)
+  {
+    if (!_encoder.addEncoded(BtHomeState{measurements[i].id, measurements[i].byteCount}, measurements[i].value))
+    {
+      _lastStatus = BTHOME_ADVERTISEMENT_REJECTED;
+      return 0;
+    }
+  }
+
+  size_t size = _encoder.getAdvertisementData(buffer);
+  _lastStatus = _encoder.getLastStatus();
+  if (!size)
+  {
+    return 0;
+  }
+  if (virtualDevice.encrypted)
+  {
+    virtualDevice.counter = _encoder.getCounter();
+  }
+  virtualDevice.fresh = false;
+  return size;
+}
@@ -0,0 +1,135 @@
+#ifndef BT_HOME_V2_MULTIPLEXER_H
+#define BT_HOME_V2_MULTIPLEXER_H
+
+#include <Arduino.h>
+#include "BaseDevice.h"
+
+static const size_t DEFAULT_MULTIPLEXER_MEASUREMENTS = 4;
+// a virtual device with new measurements counts this many times its weight when scheduling
+static const int32_t FRESHNESS_BOOST = 4;
+
+enum BtHomeSchedule
+{
+  BTHOME_SCHEDULE_ROUND_ROBIN,
+  BTHOME_SCHEDULE_FRESHNESS
+};
+
+/// @brief Several virtual BTHome devices sharing one radio, e.g. the sensors of a hub board.
+/// @details Each virtual device has its own MAC address, names, key and counter, stored in one table with
+/// room for a few encoded measurements. Packets are built by one shared encoder, so a virtual device costs
+/// bytesPerDevice() instead of a BtHomeV2Device. The key of an encrypted device is expanded once in addDevice,
+/// switching devices per slot does not run the key schedule or allocate. nextAdvertisement picks the device for the next advertising
+/// slot; set the radio's (random static) address to its MAC before sending the packet.
+///
+/// BTHOME_SCHEDULE_ROUND_ROBIN advertises the devices in turn. BTHOME_SCHEDULE_FRESHNESS is a smooth weighted
+/// round robin: every slot each device gains its weight, FRESHNESS_BOOST times that while it has measurements
+/// it has not advertised yet, and the device with the most credit is sent. Every device keeps getting slots.
+class BtHomeV2Multiplexer
+{
+public:
+  /// @param maxDevices - Table size, allocated once here.
+  /// @param measurementsPerDevice - Measurements each device can hold, numeric values up to 4 bytes.
+  BtHomeV2Multiplexer(size_t maxDevices, size_t measurementsPerDevice = DEFAULT_MULTIPLEXER_MEASUREMENTS,
+                      BtHomeSchedule schedule = BTHOME_SCHEDULE_ROUND_ROBIN, size_t maxAdvertisementSize = MAX_ADVERTISEMENT_SIZE);
+  ~BtHomeV2Multiplexer();
+
+  /// @param shortName, completeName - Kept by pointer, must outlive the multiplexer.
+  /// @param key - nullptr for an unencrypted device. Expanded here, with mbedtls that allocates; not kept.
+  /// @param weight - Share of the advertising slots with BTHOME_SCHEDULE_FRESHNESS, 1 - 255.
+  /// @return Index of the new device, or -1 if the table is full.
+  int addDevice(const char *shortName, const char *completeName, bool isTriggerBased,
+                const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], const uint8_t *key = nullptr, uint32_t counter = 1,
+                uint8_t weight = 1);
+
+  bool clearMeasurements(size_t device);
+  /// @brief Add an already scaled value, as pushed into the packet.
+  /// @return false if the device does not exist, has no measurement left or the value does not fit in its packet.
+  bool addEncoded(size_t device, BtHomeState sensor, uint32_t rawValue);
+  template <typename Sensor, typename T>
+  bool add(size_t device, T value);
+  template <typename Sensor>
+  bool addScaled(size_t device, int32_t milliUnits);
+
+  /// @brief Build the packet for the next advertising slot.
+  /// @param buffer - Must hold the maxAdvertisementSize given to the constructor.
+  /// @param device - Receives the index of the device the packet belongs to.
+  /// @return Number of bytes written, 0 if no device has measurements or the packet could not be built (see getLastStatus).
+  size_t nextAdvertisement(uint8_t buffer[MAX_EXTENDED_ADVERTISEMENT_SIZE], size_t &device);
+  /// @brief Why the last nextAdvertisement returned 0: BTHOME_ADVERTISEMENT_NO_MEASUREMENTS, or the encoder's status.
+  BtHomeAdvertisementStatus getLastStatus() const { return _lastStatus; }
+
+  const uint8_t *getMacAddress(size_t device) const { return _devices[device].macAddress; }
+  uint32_t getCounter(size_t device) const { return _devices[device].counter; }
+  size_t size() const { return _size; }
+
+  /// @brief Table memory per virtual device, names not included. With mbedtls an encrypted device also has the
+  /// AES context mbedtls allocates for its key.
+  static size_t bytesPerDevice(size_t measurementsPerDevice = DEFAULT_MULTIPLEXER_MEASUREMENTS);
+
+private:
+  BtHomeV2Multiplexer(const BtHomeV2Multiplexer &) = delete;
+  BtHomeV2Multiplexer &operator=(const BtHomeV2Multiplexer &) = delete;
+
+  struct Measurement
+  {
+    uint32_t value;
+    uint8_t id;
+    uint8_t byteCount;
+  };
+
+  struct VirtualDevice
+  {
+    const char *shortName;
+    const char *completeName;
+    uint32_t counter;
+    int32_t credit;
+    uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH];
+    uint8_t weight;
+    uint8_t measurementCount;
+    // object ids and values, checked against measurementSpace
+    uint8_t measurementBytes;
+    bool encrypted;
+    bool triggerBased;
+    bool fresh;
+  };
+
+  size_t scheduleNext();
+  int measurementSpace(const VirtualDevice &device) const;
+
+  BaseDevice _encoder;
+  VirtualDevice *_devices;
+  BtHomeV2Ccm *_ciphers;
+  Measurement *_measurements;
+  size_t _capacity;
+  size_t _measurementsPerDevice;
+  size_t _size = 0;
+  size_t _nextDevice = 0;
+  BtHomeAdvertisementStatus _lastStatus = BTHOME_ADVERTISEMENT_OK;
+  BtHomeSchedule _schedule;
+};
+
+template <typename Sensor, typename T>
+bool BtHomeV2Multiplexer::add(size_t device, T value)
+{
+  uint64_t scaledValue = BtHomeSensorScaler<Sensor, std::is_integral<T>::value>::scale(value);
+  return addEncoded(device, BtHomeState{Sensor::id, Sensor::byteCount}, static_cast<uint32_t>(scaledValue));
+}
+
+/// @brief Fixed-point add<>, see BaseDevice::addScaled<Sensor>.
+template <typename Sensor>
+bool BtHomeV2Multiplexer::addScaled(size_t device, int32_t milliUnits)
+{
+  typedef BtHomeMilliScale<Sensor> Scale;
+  int64_t raw;
+  if (Scale::numerator == 1)
+  {
+    raw = milliUnits / static_cast<int32_t>(Scale::denominator);
+  }
+  else
+  {
+    raw = static_cast<int64_t>(milliUnits) * Scale::numerator / Scale::denominator;
+  }
+  return addEncoded(device, BtHomeState{Sensor::id, Sensor::byteCount}, static_cast<uint32_t>(raw));
+}
+
+#endif // BT_HOME_V2_MULTIPLEXER_H
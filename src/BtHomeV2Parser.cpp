@@ -0,0 +1,222 @@
+#include "BtHomeV2Parser.h"
+#include "BtHomeV2Ccm.h"
+
+// AD structure: length, type, data. The length covers the type and data.
+static const size_t AD_LENGTH_SIZE = 1;
+static const size_t AD_TYPE_SIZE = 1;
+static const size_t UUID_SIZE = 2;
+static const size_t DEVICE_INFO_SIZE = 1;
+static const size_t OBJECT_ID_SIZE = 1;
+static const size_t LENGTH_PREFIX_SIZE = 1;
+static const uint8_t VERSION_MASK = 0xE0;
+
+#define BTHOME_SENSOR_CASE(name, objectId, byteCount, signedValue, scaleNumerator, scaleDenominator) \
+  case objectId:                                                                                     \
+    info = {objectId, byteCount, signedValue, scaleNumerator, scaleDenominator, BTHOME_OBJECT_SENSOR}; \
+    return true;
+
+#define BTHOME_STATE_CASE(name, objectId, byteCount)                  \
+  case objectId:                                                      \
+    info = {objectId, byteCount, false, 1, 1, BTHOME_OBJECT_STATE};   \
+    return true;
+
+#define BTHOME_EVENT_CASE(name, objectId, byteCount)                  \
+  case objectId:                                                      \
+    info = {objectId, byteCount, false, 1, 1, BTHOME_OBJECT_EVENT};   \
+    return true;
+
+bool lookupBtHomeObject(uint8_t id, BtHomeObjectInfo &info)
+{
+  switch (id)
+  {
+    BTHOME_SENSOR_TYPES(BTHOME_SENSOR_CASE)
+    BTHOME_STATE_TYPES(BTHOME_STATE_CASE)
+    BTHOME_EVENT_TYPES(BTHOME_EVENT_CASE)
+  case OBJECT_ID_TEXT:
+    info = {OBJECT_ID_TEXT, 0, false, 1, 1, BTHOME_OBJECT_TEXT};
+    return true;
+  case OBJECT_ID_RAW:
+    info = {OBJECT_ID_RAW, 0, false, 1, 1, BTHOME_OBJECT_RAW};
+    return true;
+  default:
+    return false;
+  }
+}
+
+BtHomeV2Parser::BtHomeV2Parser()
+{
+}
+
+BtHomeV2Parser::BtHomeV2Parser(const uint8_t *serviceData, size_t length)
+{
+  setServiceData(serviceData, length);
+}
+
+BtHomeV2Parser BtHomeV2Parser::fromAdvertisement(const uint8_t *advertisement, size_t length)
+{
+  BtHomeV2Parser parser;
+  const uint8_t *serviceData;
+  size_t serviceDataLength;
+  if (findServiceData(advertisement, length, &serviceData, &serviceDataLength))
+  {
+    parser.setServiceData(serviceData, serviceDataLength);
+  }
+  return parser;
+}
+
+BtHomeV2Parser BtHomeV2Parser::fromMeasurements(uint8_t deviceInfo, const uint8_t *measurements, size_t length)
+{
+  BtHomeV2Parser parser;
+  parser._deviceInfo = deviceInfo & ~FLAG_ENCRYPT;
+  parser._payload = measurements;
+  parser._payloadLength = length;
+  parser._initialStatus = BTHOME_PARSE_OK;
+  parser._status = BTHOME_PARSE_OK;
+  return parser;
+}
+
+bool BtHomeV2Parser::findServiceData(const uint8_t *advertisement, size_t length, const uint8_t **serviceData, size_t *serviceDataLength)
+{
+  size_t index = 0;
+  while (index < length)
+  {
+    size_t structureLength = advertisement[index];
+    if (structureLength == 0 || index + AD_LENGTH_SIZE + structureLength > length)
+    {
+      // zero length marks the end of the significant part; anything else is truncated
+      return false;
+    }
+
+    const uint8_t *structure = &advertisement[index + AD_LENGTH_SIZE];
+    if (structureLength >= AD_TYPE_SIZE + UUID_SIZE + DEVICE_INFO_SIZE &&
+        structure[0] == SERVICE_DATA && structure[1] == UUID1 && structure[2] == UUID2)
+    {
+      *serviceData = &structure[AD_TYPE_SIZE + UUID_SIZE];
+      *serviceDataLength = structureLength - AD_TYPE_SIZE - UUID_SIZE;
+      return true;
+    }
+    index += AD_LENGTH_SIZE + structureLength;
+  }
+  return false;
+}
+
+void BtHomeV2Parser::setServiceData(const uint8_t *serviceData, size_t length)
+{
+  if (length < DEVICE_INFO_SIZE)
+  {
+    _initialStatus = BTHOME_PARSE_NOT_BTHOME;
+  }
+  else
+  {
+    _deviceInfo = serviceData[0];
+    _payload = &serviceData[DEVICE_INFO_SIZE];
+    _payloadLength = length - DEVICE_INFO_SIZE;
+
+    if ((_deviceInfo & VERSION_MASK) != FLAG_VERSION)
+    {
+      _initialStatus = BTHOME_PARSE_UNSUPPORTED_VERSION;
+    }
+    else if (_deviceInfo & FLAG_ENCRYPT)
+    {
+      _initialStatus = BTHOME_PARSE_ENCRYPTED;
+    }
+    else
+    {
+      _initialStatus = BTHOME_PARSE_OK;
+    }
+  }
+  rewind();
+}
+
+void BtHomeV2Parser::rewind()
+{
+  _position = 0;
+  _status = _initialStatus;
+}
+
+bool BtHomeV2Parser::packetId(uint8_t &packetId) const
+{
+  if (_status != BTHOME_PARSE_OK || isEncrypted() || _payloadLength < OBJECT_ID_SIZE + packet_id.byteCount ||
+      _payload[0] != packet_id.id)
+  {
+    return false;
+  }
+
+  packetId = _payload[OBJECT_ID_SIZE];
+  return true;
+}
+
+bool BtHomeV2Parser::encryptionCounter(uint32_t &counter) const
+{
+  // ciphertext, counter, MIC
+  if (_status != BTHOME_PARSE_ENCRYPTED || _payloadLength < COUNTER_LEN + MIC_LEN)
+  {
+    return false;
+  }
+
+  const uint8_t *counterBytes = &_payload[_payloadLength - COUNTER_LEN - MIC_LEN];
+  counter = counterBytes[0] | (counterBytes[1] << 8) | (counterBytes[2] << 16) | (static_cast<uint32_t>(counterBytes[3]) << 24);
+  return true;
+}
+
+bool BtHomeV2Parser::next(BtHomeMeasurement &measurement)
+{
+  if (_status != BTHOME_PARSE_OK || _position >= _payloadLength)
+  {
+    return false;
+  }
+
+  const uint8_t *object = &_payload[_position];
+  size_t remaining = _payloadLength - _position;
+
+  if (!lookupBtHomeObject(object[0], measurement.info))
+  {
+    _status = BTHOME_PARSE_UNKNOWN_OBJECT;
+    return false;
+  }
+
+  size_t headerLength = OBJECT_ID_SIZE;
+  size_t valueLength = measurement.info.byteCount;
+  if (measurement.info.kind == BTHOME_OBJECT_TEXT || measurement.info.kind == BTHOME_OBJECT_RAW)
+  {
+    if (remaining < OBJECT_ID_SIZE + LENGTH_PREFIX_SIZE)
+    {
+      _status = BTHOME_PARSE_TRUNCATED;
+      return false;
+    }
+    headerLength += LENGTH_PREFIX_SIZE;
+    valueLength = object[OBJECT_ID_SIZE];
+  }
+
+  if (remaining < headerLength + valueLength)
+  {
+    _status = BTHOME_PARSE_TRUNCATED;
+    return false;
+  }
+
+  measurement.data = &object[headerLength];
+  measurement.length = static_cast<uint8_t>(valueLength);
+  measurement.rawValue = 0;
+
+  if (measurement.info.byteCount > 0)
+  {
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < measurement.info.byteCount; i++)
+    {
+      value |= static_cast<uint64_t>(measurement.data[i]) << (8 * i);
+    }
+
+    uint8_t unusedBits = 64 - 8 * measurement.info.byteCount;
+    if (measurement.info.signed_value)
+    {
+      measurement.rawValue = static_cast<int64_t>(value << unusedBits) >> unusedBits;
+    }
+    else
+    {
+      measurement.rawValue = static_cast<int64_t>(value);
+    }
+  }
+
+  _position += headerLength + valueLength;
+  return true;
+}
@@ -0,0 +1,137 @@
+#ifndef BT_HOME_V2_PARSER_H
+#define BT_HOME_V2_PARSER_H
+
+#include <Arduino.h>
+#include "definitions.h"
+#include "data_types.h"
+
+/// @brief What kind of object an id refers to.
+enum BtHomeObjectKind
+{
+  BTHOME_OBJECT_SENSOR,
+  BTHOME_OBJECT_STATE,
+  BTHOME_OBJECT_EVENT,
+  BTHOME_OBJECT_TEXT,
+  BTHOME_OBJECT_RAW
+};
+
+/// @brief Decoder view of an object id. Generated from the same tables as the encoder descriptors.
+/// @details For text and raw objects byteCount is 0, the length is carried in the packet.
+struct BtHomeObjectInfo
+{
+  uint8_t id;
+  uint8_t byteCount;
+  bool signed_value;
+  uint32_t scaleNumerator;
+  uint32_t scaleDenominator;
+  BtHomeObjectKind kind;
+};
+
+/// @brief Look up the descriptor of an object id.
+/// @return false if the id is unknown, in which case the rest of the packet cannot be parsed.
+bool lookupBtHomeObject(uint8_t id, BtHomeObjectInfo &info);
+
+/// @brief A single decoded measurement. The data pointer refers into the parsed buffer, nothing is copied.
+struct BtHomeMeasurement
+{
+  BtHomeObjectInfo info;
+  const uint8_t *data; // value bytes, after the object id (and length byte for text/raw)
+  uint8_t length;      // number of value bytes
+  int64_t rawValue;    // little endian value, sign extended for signed types. 0 for text/raw
+
+  /// @brief The value in its unit, i.e. rawValue * scale.
+  double value() const
+  {
+    return static_cast<double>(rawValue) * info.scaleNumerator / info.scaleDenominator;
+  }
+};
+
+enum BtHomeParseStatus
+{
+  BTHOME_PARSE_OK,
+  BTHOME_PARSE_NOT_BTHOME,
+  BTHOME_PARSE_UNSUPPORTED_VERSION,
+  BTHOME_PARSE_ENCRYPTED,
+  BTHOME_PARSE_UNKNOWN_OBJECT,
+  BTHOME_PARSE_TRUNCATED
+};
+
+/// @brief Walks a BTHome v2 payload in place, without copying or allocating.
+/// @details
+///   BtHomeV2Parser parser = BtHomeV2Parser::fromAdvertisement(data, length);
+///   BtHomeMeasurement measurement;
+///   while (parser.next(measurement)) { ... }
+///   if (parser.status() != BTHOME_PARSE_OK) { ... }
+class BtHomeV2Parser
+{
+public:
+  /// @brief Parse BTHome service data.
+  /// @param serviceData - Service data for UUID 0xFCD2, starting at the device information byte (after the UUID).
+  /// @param length
+  BtHomeV2Parser(const uint8_t *serviceData, size_t length);
+
+  /// @brief Parse a complete advertisement (list of AD structures) as built by BaseDevice::getAdvertisementData.
+  static BtHomeV2Parser fromAdvertisement(const uint8_t *advertisement, size_t length);
+
+  /// @brief Parse plaintext measurement bytes, e.g. an encrypted payload after decryption.
+  static BtHomeV2Parser fromMeasurements(uint8_t deviceInfo, const uint8_t *measurements, size_t length);
+
+  /// @brief Find the BTHome service data AD structure in an advertisement.
+  /// @param serviceData - Set to the device information byte (after the UUID).
+  /// @param serviceDataLength - Set to the number of bytes from the device information byte onwards.
+  /// @return false if the advertisement has no BTHome service data.
+  static bool findServiceData(const uint8_t *advertisement, size_t length, const uint8_t **serviceData, size_t *serviceDataLength);
+
+  BtHomeParseStatus status() const { return _status; }
+  uint8_t deviceInfo() const { return _deviceInfo; }
+  bool isEncrypted() const { return _deviceInfo & FLAG_ENCRYPT; }
+  bool isTriggerBased() const { return _deviceInfo & FLAG_TRIGGER; }
+
+  /// @brief Bytes after the device information byte. For encrypted packets: ciphertext, counter and MIC.
+  const uint8_t *payload() const { return _payload; }
+  size_t payloadLength() const { return _payloadLength; }
+
+  /// @brief The packet id (object 0x00), which an encoder with enablePacketId puts first.
+  /// @details Compare it with the last id seen from the device to drop retransmitted copies before decoding anything.
+  /// @return false if the packet has no packet id, or is still encrypted.
+  bool packetId(uint8_t &packetId) const;
+
+  /// @brief The encryption counter of an encrypted packet, readable before decrypting.
+  /// @details Check it with BtHomeV2ReplayFilter to skip copies and replays before verifying the MIC.
+  /// @return false if the packet is not encrypted or too short.
+  bool encryptionCounter(uint32_t &counter) const;
+
+  /// @brief Decode the next measurement.
+  /// @return false at the end of the payload or on an error, see status().
+  bool next(BtHomeMeasurement &measurement);
+
+  /// @brief Start iterating from the first measurement again.
+  void rewind();
+
+  /// @brief Call callback(const BtHomeMeasurement &) for every measurement.
+  /// @return Number of measurements decoded.
+  template <typename Callback>
+  size_t forEach(Callback callback)
+  {
+    size_t count = 0;
+    BtHomeMeasurement measurement;
+    while (next(measurement))
+    {
+      callback(measurement);
+      count++;
+    }
+    return count;
+  }
+
+private:
+  BtHomeV2Parser();
+  void setServiceData(const uint8_t *serviceData, size_t length);
+  const uint8_t *_payload = nullptr;
+  size_t _payloadLength = 0;
+  size_t _position = 0;
+  uint8_t _deviceInfo = 0;
+  BtHomeParseStatus _status = BTHOME_PARSE_NOT_BTHOME;
+  BtHomeParseStatus _initialStatus = BTHOME_PARSE_NOT_BTHOME;
+};
+
+#endif // BT_HOME_V2_PARSER_H
@@ -0,0 +1,116 @@
+#include "BtHomeV2PriorityPacker.h"
+
+// sensor indexes are stored as single bytes
+static const size_t MAX_PACKER_CAPACITY = 255;
+static const uint16_t MAX_PACKER_AGE = 0xFFFF;
+
+BtHomeV2PriorityPacker::BtHomeV2PriorityPacker(size_t capacity)
+    : _capacity(std::min(capacity, MAX_PACKER_CAPACITY))
+{
+  _sensors = new Sensor[_capacity];
+  _order = new uint8_t[_capacity];
+}
+
+BtHomeV2PriorityPacker::~BtHomeV2PriorityPacker()
+{
+  delete[] _sensors;
+  delete[] _order;
+}
+
+int BtHomeV2PriorityPacker::addSensor(BtHomeState sensor, uint8_t priority)
+{
+  if (_size >= _capacity || sensor.byteCount > sizeof(uint32_t))
+  {
+    return -1;
+  }
+
+  Sensor &entry = _sensors[_size];
+  entry.value = 0;
+  entry.age = 0;
+  entry.id = sensor.id;
+  entry.byteCount = sensor.byteCount;
+  entry.priority = priority ? priority : 1;
+  entry.hasValue = false;
+  return static_cast<int>(_size++);
+}
+
+bool BtHomeV2PriorityPacker::setPriority(size_t sensor, uint8_t priority)
+{
+  if (sensor >= _size)
+  {
+    return false;
+  }
+
+  _sensors[sensor].priority = priority ? priority : 1;
+  return true;
+}
+
+bool BtHomeV2PriorityPacker::setEncoded(size_t sensor, uint32_t rawValue)
+{
+  if (sensor >= _size)
+  {
+    return false;
+  }
+
+  _sensors[sensor].value = rawValue;
+  _sensors[sensor].hasValue = true;
+  return true;
+}
+
+bool BtHomeV2PriorityPacker::clearValue(size_t sensor)
+{
+  if (sensor >= _size)
+  {
+    return false;
+  }
+
+  _sensors[sensor].hasValue = false;
+  return true;
+}
+
+/// @details An insertion sort of the sensors with a value, a few dozen at most, then one pass adding them.
+/// Equal scores keep the registration order. A value that does not fit is skipped, a smaller one after it
+/// may still fill the gap. The space is probed first, so a deferred value is not counted as a rejected measurement.
+size_t BtHomeV2PriorityPacker::fill(BaseDevice &device)
+{
+  size_t ranked = 0;
+  for (size_t i = 0; i < _size; i++)
+  {
+    const Sensor &sensor = _sensors[i];
+    if (!sensor.hasValue)
+    {
+      continue;
+    }
+
+    uint32_t score = static_cast<uint32_t>(sensor.priority) * (sensor.age + 1u);
+    size_t position = ranked++;
+    while (position > 0)
+    {
+      const Sensor &previous = _sensors[_order[position - 1]];
+      if (static_cast<uint32_t>(previous.priority) * (previous.age + 1u) >= score)
+      {
+        break;
+      }
+      _order[position] = _order[position - 1];
+      position--;
+    }
+    _order[position] = static_cast<uint8_t>(i);
+  }
+
+  size_t added = 0;
+  for (size_t i = 0; i < ranked; i++)
+  {
+    Sensor &sensor = _sensors[_order[i]];
+    BtHomeState state{sensor.id, sensor.byteCount};
+    if (device.hasRoomFor(state) && device.addEncoded(state, sensor.value))
+    {
+      sensor.age = 0;
+      added++;
+    }
+    else if (sensor.age < MAX_PACKER_AGE)
+    {
+      sensor.age++;
+    }
+  }
+  return added;
+}
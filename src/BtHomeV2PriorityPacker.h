@@ -0,0 +1,106 @@
+#ifndef BT_HOME_V2_PRIORITY_PACKER_H
+#define BT_HOME_V2_PRIORITY_PACKER_H
+
+#include <Arduino.h>
+#include "BaseDevice.h"
+
+static const size_t DEFAULT_PACKER_CAPACITY = 16;
+static const uint8_t DEFAULT_PACKER_PRIORITY = 1;
+
+/// @brief Chooses which measurements go into each packet when more are offered than fit.
+/// @details Each sensor is registered once with a priority and keeps its latest value. fill picks the sensors
+/// by score = priority * (age + 1), age being the packets built since the sensor was last sent, and adds them
+/// to the device in that order as long as they fit. A deferred sensor gains its priority with every packet, so
+/// low priority values rotate into later advertisements instead of being lost, roughly every
+/// (highest priority / own priority) packets under full load.
+///
+///   int temperature = packer.addSensor<BtHomeSensors::temperature_int16_scale_0_01>(8);
+///   int battery = packer.addSensor<BtHomeSensors::battery_percentage>(1);
+///   ...
+///   packer.set<BtHomeSensors::temperature_int16_scale_0_01>(temperature, 21.5f);
+///   btHome.clearMeasurementData();
+///   btHome.packPrioritized(packer);
+class BtHomeV2PriorityPacker
+{
+public:
+  /// @param capacity - Sensors that can be registered, allocated once here.
+  explicit BtHomeV2PriorityPacker(size_t capacity = DEFAULT_PACKER_CAPACITY);
+  ~BtHomeV2PriorityPacker();
+
+  /// @param priority - Relative importance, 1 - 255.
+  /// @return Index of the sensor, or -1 if the table is full or the value is wider than 4 bytes.
+  int addSensor(BtHomeState sensor, uint8_t priority = DEFAULT_PACKER_PRIORITY);
+  template <typename Sensor>
+  int addSensor(uint8_t priority = DEFAULT_PACKER_PRIORITY);
+  bool setPriority(size_t sensor, uint8_t priority);
+
+  /// @brief Set the latest value of a sensor, already scaled as pushed into the packet. Sensors without a value are not sent.
+  bool setEncoded(size_t sensor, uint32_t rawValue);
+  template <typename Sensor, typename T>
+  bool set(size_t sensor, T value);
+  template <typename Sensor>
+  bool setScaled(size_t sensor, int32_t milliUnits);
+  /// @brief Stop sending the sensor until it gets a new value.
+  bool clearValue(size_t sensor);
+
+  /// @brief Add the highest scoring values that fit to the device, after whatever it already holds.
+  /// @details Does not clear the device. Counts as one packet for the ages of the sensors left out.
+  /// @return Number of measurements added.
+  size_t fill(BaseDevice &device);
+
+  /// @brief Packets since the sensor was last sent.
+  uint16_t getAge(size_t sensor) const { return _sensors[sensor].age; }
+  size_t size() const { return _size; }
+
+private:
+  BtHomeV2PriorityPacker(const BtHomeV2PriorityPacker &) = delete;
+  BtHomeV2PriorityPacker &operator=(const BtHomeV2PriorityPacker &) = delete;
+
+  struct Sensor
+  {
+    uint32_t value;
+    uint16_t age;
+    uint8_t id;
+    uint8_t byteCount;
+    uint8_t priority;
+    bool hasValue;
+  };
+
+  Sensor *_sensors;
+  // sensor indexes ranked by score, reused by every fill
+  uint8_t *_order;
+  size_t _capacity;
+  size_t _size = 0;
+};
+
+template <typename Sensor>
+int BtHomeV2PriorityPacker::addSensor(uint8_t priority)
+{
+  return addSensor(BtHomeState{Sensor::id, Sensor::byteCount}, priority);
+}
+
+template <typename Sensor, typename T>
+bool BtHomeV2PriorityPacker::set(size_t sensor, T value)
+{
+  uint64_t scaledValue = BtHomeSensorScaler<Sensor, std::is_integral<T>::value>::scale(value);
+  return setEncoded(sensor, static_cast<uint32_t>(scaledValue));
+}
+
+/// @brief Fixed-point set<>, see BaseDevice::addScaled<Sensor>.
+template <typename Sensor>
+bool BtHomeV2PriorityPacker::setScaled(size_t sensor, int32_t milliUnits)
+{
+  typedef BtHomeMilliScale<Sensor> Scale;
+  int64_t raw;
+  if (Scale::numerator == 1)
+  {
+    raw = milliUnits / static_cast<int32_t>(Scale::denominator);
+  }
+  else
+  {
+    raw = static_cast<int64_t>(milliUnits) * Scale::numerator / Scale::denominator;
+  }
+  return setEncoded(sensor, static_cast<uint32_t>(raw));
+}
+
+#endif // BT_HOME_V2_PRIORITY_PACKER_H
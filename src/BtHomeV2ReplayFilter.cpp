@@ -0,0 +1,137 @@
+#include "BtHomeV2ReplayFilter.h"
+
+BtHomeV2ReplayFilter::BtHomeV2ReplayFilter(size_t capacity)
+    : _capacity(capacity)
+{
+  // keep the table at most half full so probe sequences stay short
+  size_t slotCount = 2;
+  while (slotCount < capacity * 2)
+  {
+    slotCount <<= 1;
+  }
+  _slotMask = slotCount - 1;
+  _slots = new Slot[slotCount];
+  clear();
+}
+
+BtHomeV2ReplayFilter::~BtHomeV2ReplayFilter()
+{
+  delete[] _slots;
+}
+
+void BtHomeV2ReplayFilter::clear()
+{
+  memset(_slots, 0, (_slotMask + 1) * sizeof(Slot));
+  _size = 0;
+}
+
+uint64_t BtHomeV2ReplayFilter::keyOf(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH])
+{
+  uint64_t value = 0;
+  for (size_t i = 0; i < BLE_MAC_ADDRESS_LENGTH; i++)
+  {
+    value = (value << 8) | macAddress[i];
+  }
+  return (value << 8) | OCCUPIED;
+}
+
+/// @brief Home slot of a key (Fibonacci hashing, as in BtHomeV2KeyStore).
+size_t BtHomeV2ReplayFilter::homeSlot(uint64_t key) const
+{
+  return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & _slotMask;
+}
+
+/// @brief Slot holding the key, or the empty slot where it would be inserted.
+size_t BtHomeV2ReplayFilter::findSlot(uint64_t key) const
+{
+  size_t slot = homeSlot(key);
+  while (_slots[slot].key != 0 && _slots[slot].key != key)
+  {
+    slot = (slot + 1) & _slotMask;
+  }
+  return slot;
+}
+
+BtHomeReplayStatus BtHomeV2ReplayFilter::classify(const Slot &slot, uint32_t counter)
+{
+  if (counter > slot.highest)
+  {
+    return BTHOME_REPLAY_NEW;
+  }
+
+  uint32_t age = slot.highest - counter;
+  if (age >= REPLAY_WINDOW_SIZE)
+  {
+    return BTHOME_REPLAY_TOO_OLD;
+  }
+  return (slot.window >> age) & 1 ? BTHOME_REPLAY_DUPLICATE : BTHOME_REPLAY_NEW;
+}
+
+BtHomeReplayStatus BtHomeV2ReplayFilter::check(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter) const
+{
+  const Slot &slot = _slots[findSlot(keyOf(macAddress))];
+  return slot.key == 0 ? BTHOME_REPLAY_NEW : classify(slot, counter);
+}
+
+BtHomeReplayStatus BtHomeV2ReplayFilter::accept(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter)
+{
+  uint64_t key = keyOf(macAddress);
+  Slot &slot = _slots[findSlot(key)];
+  if (slot.key == 0)
+  {
+    if (_size >= _capacity)
+    {
+      return BTHOME_REPLAY_TABLE_FULL;
+    }
+    slot.key = key;
+    slot.highest = counter;
+    slot.window = 1;
+    _size++;
+    return BTHOME_REPLAY_NEW;
+  }
+
+  BtHomeReplayStatus status = classify(slot, counter);
+  if (status != BTHOME_REPLAY_NEW)
+  {
+    return status;
+  }
+
+  if (counter > slot.highest)
+  {
+    uint32_t shift = counter - slot.highest;
+    slot.window = shift < REPLAY_WINDOW_SIZE ? (slot.window << shift) | 1 : 1;
+    slot.highest = counter;
+  }
+  else
+  {
+    slot.window |= 1u << (slot.highest - counter);
+  }
+  return BTHOME_REPLAY_NEW;
+}
+
+bool BtHomeV2ReplayFilter::remove(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH])
+{
+  size_t slot = findSlot(keyOf(macAddress));
+  if (_slots[slot].key == 0)
+  {
+    return false;
+  }
+  _size--;
+
+  // backward shift deletion, so no tombstones are needed
+  size_t hole = slot;
+  size_t next = (hole + 1) & _slotMask;
+  while (_slots[next].key != 0)
+  {
+    size_t home = homeSlot(_slots[next].key);
+    // move the entry into the hole if its home slot is not between the hole and its current slot
+    if (((next - home) & _slotMask) >= ((next - hole) & _slotMask))
+    {
+      _slots[hole] = _slots[next];
+      hole = next;
+    }
+    next = (next + 1) & _slotMask;
+  }
+  _slots[hole].key = 0;
+  return true;
+}
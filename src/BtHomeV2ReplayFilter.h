@@ -0,0 +1,82 @@
+#ifndef BT_HOME_V2_REPLAY_FILTER_H
+#define BT_HOME_V2_REPLAY_FILTER_H
+
+#include <Arduino.h>
+#include "BtHomeV2Ccm.h"
+
+enum BtHomeReplayStatus
+{
+  BTHOME_REPLAY_NEW,       // counter not seen yet, worth decrypting
+  BTHOME_REPLAY_DUPLICATE, // counter seen: a copy from another proxy, a retransmission or a replay
+  BTHOME_REPLAY_TOO_OLD,   // REPLAY_WINDOW_SIZE or more below the highest counter of the device
+  BTHOME_REPLAY_TABLE_FULL // unknown device and no room left to track it
+};
+
+/// @brief Per device encryption counters seen by a decoder, to drop duplicated and replayed packets before
+/// spending time on the MIC.
+/// @details Like the IPsec anti-replay window: for every MAC address the highest counter accepted and a bitmap
+/// of the REPLAY_WINDOW_SIZE counters below it, so packets arriving slightly out of order (several proxies) still
+/// pass once. Each device is one 16 byte slot in an open addressing table, a lookup touches one cache line in
+/// the common case. All memory is allocated in the constructor.
+///
+/// The counter is only authenticated by the MIC, so check before decrypting and accept after:
+///   uint32_t counter;
+///   if (parser.encryptionCounter(counter) && filter.check(mac, counter) == BTHOME_REPLAY_NEW &&
+///       keys.decrypt(mac, serviceData, length, plaintext, &plaintextLength) == BTHOME_DECRYPT_OK) {
+///     filter.accept(mac, counter);
+///     ...
+///   }
+/// Forged packets then cannot move the window. A device that starts counting again (no counter store) is
+/// rejected as too old until remove() is called for it.
+class BtHomeV2ReplayFilter
+{
+public:
+  /// @param capacity - Maximum number of devices tracked.
+  explicit BtHomeV2ReplayFilter(size_t capacity);
+  ~BtHomeV2ReplayFilter();
+
+  /// @brief Classify a counter without changing anything.
+  /// @return BTHOME_REPLAY_NEW, BTHOME_REPLAY_DUPLICATE or BTHOME_REPLAY_TOO_OLD. Unknown devices are new.
+  BtHomeReplayStatus check(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter) const;
+
+  /// @brief Record an authenticated counter.
+  /// @return As check; the counter is only recorded for BTHOME_REPLAY_NEW. BTHOME_REPLAY_TABLE_FULL
+  /// for a new device when capacity() devices are tracked.
+  BtHomeReplayStatus accept(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH], uint32_t counter);
+
+  /// @brief Forget a device, e.g. after it was reset or its key changed.
+  bool remove(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH]);
+  void clear();
+
+  size_t size() const { return _size; }
+  size_t capacity() const { return _capacity; }
+  /// @brief Table memory, for sizing a gateway.
+  size_t memoryBytes() const { return (_slotMask + 1) * sizeof(Slot); }
+
+  static const uint32_t REPLAY_WINDOW_SIZE = 32;
+
+private:
+  BtHomeV2ReplayFilter(const BtHomeV2ReplayFilter &) = delete;
+  BtHomeV2ReplayFilter &operator=(const BtHomeV2ReplayFilter &) = delete;
+
+  struct Slot
+  {
+    uint64_t key;     // MAC address << 8 | OCCUPIED, 0 when empty
+    uint32_t highest; // highest accepted counter
+    uint32_t window;  // bit i set: counter highest - i was accepted
+  };
+
+  static const uint64_t OCCUPIED = 1;
+
+  static uint64_t keyOf(const uint8_t macAddress[BLE_MAC_ADDRESS_LENGTH]);
+  size_t homeSlot(uint64_t key) const;
+  size_t findSlot(uint64_t key) const;
+  static BtHomeReplayStatus classify(const Slot &slot, uint32_t counter);
+
+  Slot *_slots; // linear probing, kept at most half full
+  size_t _slotMask;
+  size_t _capacity;
+  size_t _size = 0;
+};
+
+#endif // BT_HOME_V2_REPLAY_FILTER_H
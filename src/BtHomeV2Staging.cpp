@@ -0,0 +1,97 @@
+#include "BtHomeV2Staging.h"
+
+// Every operation on _active and writers is sequentially consistent: a producer increments writers and
+// then re-reads _active, the consumer swaps _active and then reads writers. Either the producer sees the
+// swap and backs off, or the consumer sees the producer's increment and waits for its slot.
+
+BtHomeV2Staging::BtHomeV2Staging(size_t capacity)
+    : _active(0), _capacity(static_cast<uint32_t>(capacity))
+{
+  for (size_t i = 0; i < 2; i++)
+  {
+    _buffers[i].slots = new Slot[capacity];
+    _buffers[i].reserved.store(0);
+    _buffers[i].writers.store(0);
+  }
+}
+
+BtHomeV2Staging::~BtHomeV2Staging()
+{
+  delete[] _buffers[0].slots;
+  delete[] _buffers[1].slots;
+}
+
+/// @details Wait-free for the producer: a retry only happens when collect swapped the buffers in between,
+/// which the consumer does at most once per packet.
+bool BtHomeV2Staging::stage(BtHomeState sensor, uint32_t rawValue)
+{
+  if (sensor.byteCount > sizeof(rawValue))
+  {
+    return false;
+  }
+
+  Buffer *buffer;
+  for (;;)
+  {
+    uint32_t active = _active.load();
+    buffer = &_buffers[active];
+    buffer->writers.fetch_add(1);
+    if (_active.load() == active)
+    {
+      break;
+    }
+    // swapped in between, the consumer may already be reading this buffer
+    buffer->writers.fetch_sub(1);
+  }
+
+  uint32_t index = buffer->reserved.fetch_add(1, std::memory_order_relaxed);
+  bool stored = index < _capacity;
+  if (stored)
+  {
+    Slot &slot = buffer->slots[index];
+    slot.value = rawValue;
+    slot.id = sensor.id;
+    slot.byteCount = sensor.byteCount;
+  }
+  // publishes the slot to the consumer
+  buffer->writers.fetch_sub(1, std::memory_order_release);
+  return stored;
+}
+
+bool BtHomeV2Staging::collect(BaseDevice &device)
+{
+  uint32_t retired;
+  if (_retiredPending)
+  {
+    retired = _active.load() ^ 1;
+  }
+  else
+  {
+    retired = _active.load();
+    _active.store(retired ^ 1);
+    _retiredPending = true;
+  }
+
+  Buffer &buffer = _buffers[retired];
+  if (buffer.writers.load() != 0)
+  {
+    return false;
+  }
+
+  uint32_t reserved = buffer.reserved.load(std::memory_order_relaxed);
+  uint32_t count = reserved < _capacity ? reserved : _capacity;
+  _dropped += reserved - count;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    const Slot &slot = buffer.slots[i];
+    if (!device.addEncoded(BtHomeState{slot.id, slot.byteCount}, slot.value))
+    {
+      _dropped++;
+    }
+  }
+
+  // producers only see the reset after the next swap makes this buffer active again
+  buffer.reserved.store(0, std::memory_order_relaxed);
+  _retiredPending = false;
+  return true;
+}
@@ -0,0 +1,95 @@
+#ifndef BT_HOME_V2_STAGING_H
+#define BT_HOME_V2_STAGING_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "BaseDevice.h"
+
+static const size_t DEFAULT_STAGING_CAPACITY = 32;
+
+/// @brief Lock-free staging area for measurements produced by interrupts or other tasks.
+/// @details Two buffers of encoded measurements. Producers reserve a slot in the active buffer with an
+/// atomic increment and never wait. The advertising task swaps the buffers and copies the retired one
+/// into the device, so each packet holds exactly the measurements staged between two collects.
+///
+/// Any number of producers (ISRs included), one consumer calling collect. In an ISR stage integers
+/// (stage<Sensor>(int), stageScaled), the ESP32 does not save FPU registers for interrupts.
+/// On parts without atomic instructions (ESP32-C3) the toolchain masks interrupts for the few
+/// instructions of each atomic operation instead.
+class BtHomeV2Staging
+{
+public:
+  /// @param capacity - Measurements per buffer, allocated once here.
+  explicit BtHomeV2Staging(size_t capacity = DEFAULT_STAGING_CAPACITY);
+  ~BtHomeV2Staging();
+
+  /// @brief Stage an already scaled value, as pushed into the packet (at most 4 bytes).
+  /// @return false if the buffer is full until the next collect, the measurement is dropped.
+  bool stage(BtHomeState sensor, uint32_t rawValue);
+  template <typename Sensor, typename T>
+  bool stage(T value);
+  template <typename Sensor>
+  bool stageScaled(int32_t milliUnits);
+
+  /// @brief Swap the buffers and add the measurements staged since the previous collect to the device.
+  /// @details Does not clear the device. Never blocks: if a producer interrupted by this call is still
+  /// writing into the retired buffer, nothing is added and false is returned. Call again later, the
+  /// retired buffer is kept and new measurements keep going to the other one.
+  /// @return true if the staged measurements were added.
+  bool collect(BaseDevice &device);
+
+  /// @brief Measurements lost because a buffer or the device was full, since construction.
+  uint32_t getDropped() const { return _dropped; }
+
+private:
+  BtHomeV2Staging(const BtHomeV2Staging &) = delete;
+  BtHomeV2Staging &operator=(const BtHomeV2Staging &) = delete;
+
+  struct Slot
+  {
+    uint32_t value;
+    uint8_t id;
+    uint8_t byteCount;
+  };
+
+  struct Buffer
+  {
+    Slot *slots;
+    // may run past the capacity when full, the excess counts as dropped
+    std::atomic<uint32_t> reserved;
+    // producers between choosing this buffer and finishing their slot
+    std::atomic<uint32_t> writers;
+  };
+
+  Buffer _buffers[2];
+  std::atomic<uint32_t> _active;
+  uint32_t _capacity;
+  bool _retiredPending = false;
+  uint32_t _dropped = 0;
+};
+
+template <typename Sensor, typename T>
+bool BtHomeV2Staging::stage(T value)
+{
+  uint64_t scaledValue = BtHomeSensorScaler<Sensor, std::is_integral<T>::value>::scale(value);
+  return stage(BtHomeState{Sensor::id, Sensor::byteCount}, static_cast<uint32_t>(scaledValue));
+}
+
+/// @brief Fixed-point stage<>, see BaseDevice::addScaled<Sensor>.
+template <typename Sensor>
+bool BtHomeV2Staging::stageScaled(int32_t milliUnits)
+{
+  typedef BtHomeMilliScale<Sensor> Scale;
+  int64_t raw;
+  if (Scale::numerator == 1)
+  {
+    raw = milliUnits / static_cast<int32_t>(Scale::denominator);
+  }
+  else
+  {
+    raw = static_cast<int64_t>(milliUnits) * Scale::numerator / Scale::denominator;
+  }
+  return stage(BtHomeState{Sensor::id, Sensor::byteCount}, static_cast<uint32_t>(raw));
+}
+
+#endif // BT_HOME_V2_STAGING_H
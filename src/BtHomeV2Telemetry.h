@@ -0,0 +1,48 @@
+#ifndef BT_HOME_V2_TELEMETRY_H
+#define BT_HOME_V2_TELEMETRY_H
+
+#include <Arduino.h>
+
+// Encoder counters per device, compiled in only with -DBTHOME_TELEMETRY (build_flags / compiler.cpp.extra_flags).
+// Without it the counters take no memory, no instructions, and getTelemetry returns zeros.
+#if defined(BTHOME_TELEMETRY) && !defined(ESP32) && !defined(ESP8266) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+/// @brief Snapshot of what the encoder of one device did since construction or resetTelemetry.
+/// @details Small and plain, so a sketch can log it or advertise a few fields, e.g. as count_uint32.
+struct BtHomeTelemetry
+{
+  uint32_t packetsBuilt;
+  uint32_t bytesEmitted;
+  /// @brief Measurements not added because they did not fit (the add methods returned false). Values a
+  /// BtHomeV2PriorityPacker leaves for a later packet are deferred, not rejected, and not counted.
+  uint32_t measurementsRejected;
+  /// @brief Packets sent with the short name because the complete name did not fit.
+  uint32_t completeNamesDropped;
+  /// @brief Packets sent without any name.
+  uint32_t allNamesDropped;
+  uint32_t encryptions;
+  /// @brief Time spent in the AES-CCM backend: CPU cycles on ESP32 / ESP8266 and x86 hosts, microseconds elsewhere.
+  uint64_t encryptTicks;
+};
+
+#if defined(BTHOME_TELEMETRY)
+#define BTHOME_TELEMETRY_ADD(counter, amount) (_telemetry.counter += (amount))
+
+/// @brief Time stamp for encryptTicks.
+inline uint32_t btHomeTelemetryTicks()
+{
+#if defined(ESP32) || defined(ESP8266)
+  return ESP.getCycleCount();
+#elif defined(__x86_64__) || defined(__i386__)
+  return static_cast<uint32_t>(__rdtsc());
+#else
+  return micros();
+#endif
+}
+#else
+#define BTHOME_TELEMETRY_ADD(counter, amount) ((void)0)
+#endif
+
+#endif // BT_HOME_V2_TELEMETRY_H
@@ -18,114 +18,161 @@ struct BtHomeType : public BtHomeState
 {
     float scale;       // Multiplier to apply before serializing
     bool signed_value; // true if value is signed, false if unsigned
-
-    BtHomeType(uint8_t id, float scale, uint8_t byteCount, bool signed_value)
+    // exact resolution for the integer paths: value = raw * scaleNumerator / scaleDenominator, 0 if unknown
+    uint32_t scaleNumerator;
+    uint32_t scaleDenominator;
+
+    constexpr BtHomeType(uint8_t id, float scale, uint8_t byteCount, bool signed_value,
+                         uint32_t scaleNumerator = 0, uint32_t scaleDenominator = 0)
+        : BtHomeState{id, byteCount}, scale(scale), signed_value(signed_value),
+          scaleNumerator(scaleNumerator), scaleDenominator(scaleDenominator)
     {
-        this->id = id;
-        this->scale = scale;
-        this->byteCount = byteCount;
-        this->signed_value = signed_value;
     }
 };
 
 // Now BtHomeType has 'id' from BtHomeState, plus its own fields.
 
-const BtHomeType temperature_int8 = {0x57, 1.0f, 1, true};
-const BtHomeType temperature_int8_scale_0_35 = {0x58, 0.35f, 1, true};
-const BtHomeType temperature_int16_scale_0_1 = {0x45, 0.1f, 2, true};
-const BtHomeType temperature_int16_scale_0_01 = {0x02, 0.01f, 2, true};
-
-const BtHomeType count_uint8 = {0x09, 1.0f, 1, false};
-const BtHomeType count_uint16 = {0x3D, 1.0f, 2, false};
-const BtHomeType count_uint32 = {0x3E, 1.0f, 4, true};
-const BtHomeType count_int8 = {0x59, 1.0f, 1, true};
-const BtHomeType count_int16 = {0x5A, 1.0f, 2, true};
-const BtHomeType count_int32 = {0x5B, 1.0f, 4, true};
-
-const BtHomeType voltage_0_001 = {0x0C, 0.001f, 2, false};
-const BtHomeType voltage_0_1 = {0x4A, 0.1f, 2, false};
-
-const BtHomeType battery_percentage = {0x01, 1.0f, 1, false};
-
-const BtHomeType distance_millimetre = {0x40, 1.0f, 2, false};
-const BtHomeType distance_metre = {0x41, 0.1f, 2, false};
-
-const BtHomeType acceleration = {0x51, 0.001f, 2, false};
-const BtHomeType channel = {0x60, 1.0f, 1, false};
-const BtHomeType co2 = {0x12, 1.0f, 2, false};
-const BtHomeType conductivity = {0x56, 1.0f, 2, false};
-
-const BtHomeType current_uint16 = {0x43, 0.001f, 2, false};
-const BtHomeType current_int16 = {0x5D, 0.001f, 2, true};
-const BtHomeType dewpoint = {0x08, 0.01f, 2, true};
-const BtHomeType direction = {0x5E, 0.01f, 2, false};
-const BtHomeType duration_uint24 = {0x42, 0.001f, 3, false};
-const BtHomeType energy_uint32 = {0x4D, 0.001f, 4, true};
-const BtHomeType energy_uint24 = {0x0A, 0.001f, 3, false};
-const BtHomeType gas_uint24 = {0x4B, 0.001f, 3, false};
-const BtHomeType gas_uint32 = {0x4C, 0.001f, 4, true};
-const BtHomeType gyroscope = {0x52, 0.001f, 2, false};
-const BtHomeType humidity_uint16 = {0x03, 0.01f, 2, false};
-const BtHomeType humidity_uint8 = {0x2E, 1.0f, 1, false};
-const BtHomeType illuminance = {0x05, 0.01f, 3, false};
-const BtHomeType mass_kg = {0x06, 0.01f, 2, false};
-const BtHomeType mass_lb = {0x07, 0.01f, 2, false};
-const BtHomeType moisture_uint16 = {0x14, 0.01f, 2, false};
-const BtHomeType moisture_uint8 = {0x2F, 1.0f, 1, false};
-const BtHomeType pm2_5 = {0x0D, 1.0f, 2, false};
-const BtHomeType pm10 = {0x0E, 1.0f, 2, false};
-const BtHomeType power_uint24 = {0x0B, 0.01f, 3, false};
-const BtHomeType power_int32 = {0x5C, 0.01f, 4, true};
-;
-const BtHomeType precipitation = {0x5F, 0.1f, 2, false};
-const BtHomeType pressure = {0x04, 0.01f, 3, false};
-const BtHomeType rotation = {0x3F, 0.1f, 2, true};
-const BtHomeType speed = {0x44, 0.01f, 2, false};
-const BtHomeType timestamp = {0x50, 1.0f, 4, false};
-const BtHomeType tvoc = {0x13, 1.0f, 2, false};
-
-const BtHomeType volume_uint32 = {0x4E, 0.001f, 4, true};
-const BtHomeType volume_uint16_scale_0_1 = {0x47, 0.1f, 2, false};
-const BtHomeType volume_uint16_scale_1 = {0x48, 1.0f, 2, false};
-const BtHomeType volume_storage = {0x55, 0.001f, 4, true};
-const BtHomeType volume_flow_rate = {0x49, 0.001f, 2, false};
-const BtHomeType UV_index = {0x46, 0.1f, 1, false};
-const BtHomeType water_litre = {0x4F, 0.001f, 4, true};
-const BtHomeType time_type = {0x50, 1.0f, 4, false};
-
-// raw (0x54)  require custom serialization
-
-const BtHomeState battery_state = {0x15, 1}; // Battery state, 1 byte, 0 = normal, 1 = low
-const BtHomeState battery_charging = {0x16, 1};
-const BtHomeState carbon_monoxide = {0x17, 1};
-const BtHomeState cold = {0x18, 1};
-const BtHomeState connectivity = {0x19, 1};
-const BtHomeState door = {0x1A, 1};
-const BtHomeState garage_door = {0x1B, 1};
-const BtHomeState gas = {0x1C, 1};
-const BtHomeState generic_boolean = {0x0F, 1};
-const BtHomeState heat = {0x1D, 1};
-const BtHomeState light = {0x1E, 1};
-const BtHomeState lock = {0x1F, 1};
-const BtHomeState moisture = {0x20, 1};
-const BtHomeState motion = {0x21, 1};
-const BtHomeState moving = {0x22, 1};
-const BtHomeState occupancy = {0x23, 1};
-const BtHomeState opening = {0x11, 1};
-const BtHomeState plug = {0x24, 1};
-const BtHomeState power = {0x10, 1};
-const BtHomeState presence = {0x25, 1};
-const BtHomeState problem = {0x26, 1};
-const BtHomeState running = {0x27, 1};
-const BtHomeState safety = {0x28, 1};
-const BtHomeState smoke = {0x29, 1};
-const BtHomeState sound = {0x2A, 1};
-const BtHomeState tamper = {0x2B, 1};
-const BtHomeState vibration = {0x2C, 1};
-const BtHomeState window = {0x2D, 1};
-
-const BtHomeState button = {0x3A, 1};
-const BtHomeState dimmer = {0x3C, 2}; // Dimmer = state + steps
+/// @brief Compile-time sensor descriptor, used by BaseDevice::add<Sensor>().
+/// @details The resolution is an exact ratio: value = raw * ScaleNumerator / ScaleDenominator.
+/// The float `scale` is the same value the runtime BtHomeType carries, so both paths encode identically.
+template <uint8_t Id, uint8_t ByteCount, bool Signed, uint32_t ScaleNumerator, uint32_t ScaleDenominator>
+struct BtHomeSensor
+{
+    static constexpr uint8_t id = Id;
+    static constexpr uint8_t byteCount = ByteCount;
+    static constexpr bool signed_value = Signed;
+    static constexpr uint32_t scaleNumerator = ScaleNumerator;
+    static constexpr uint32_t scaleDenominator = ScaleDenominator;
+    static constexpr bool unscaled = ScaleNumerator == ScaleDenominator;
+    static constexpr float scale = static_cast<float>(ScaleNumerator) / static_cast<float>(ScaleDenominator);
+
+    static constexpr BtHomeType type()
+    {
+        return BtHomeType(Id, scale, ByteCount, Signed, ScaleNumerator, ScaleDenominator);
+    }
+};
+
+// Object tables. Each entry is expanded into the encoder descriptors below and into the
+// decoder lookup in BtHomeV2Parser, so the two can never drift apart.
+
+// name, object id, byte count, signed, scale numerator, scale denominator
+#define BTHOME_SENSOR_TYPES(X)                             \
+    X(temperature_int8, 0x57, 1, true, 1, 1)               \
+    X(temperature_int8_scale_0_35, 0x58, 1, true, 35, 100) \
+    X(temperature_int16_scale_0_1, 0x45, 2, true, 1, 10)   \
+    X(temperature_int16_scale_0_01, 0x02, 2, true, 1, 100) \
+    X(count_uint8, 0x09, 1, false, 1, 1)                   \
+    X(count_uint16, 0x3D, 2, false, 1, 1)                  \
+    X(count_uint32, 0x3E, 4, false, 1, 1)                  \
+    X(count_int8, 0x59, 1, true, 1, 1)                     \
+    X(count_int16, 0x5A, 2, true, 1, 1)                    \
+    X(count_int32, 0x5B, 4, true, 1, 1)                    \
+    X(voltage_0_001, 0x0C, 2, false, 1, 1000)              \
+    X(voltage_0_1, 0x4A, 2, false, 1, 10)                  \
+    X(battery_percentage, 0x01, 1, false, 1, 1)            \
+    X(distance_millimetre, 0x40, 2, false, 1, 1)           \
+    X(distance_metre, 0x41, 2, false, 1, 10)               \
+    X(acceleration, 0x51, 2, false, 1, 1000)               \
+    X(channel, 0x60, 1, false, 1, 1)                       \
+    X(co2, 0x12, 2, false, 1, 1)                           \
+    X(conductivity, 0x56, 2, false, 1, 1)                  \
+    X(current_uint16, 0x43, 2, false, 1, 1000)             \
+    X(current_int16, 0x5D, 2, true, 1, 1000)               \
+    X(dewpoint, 0x08, 2, true, 1, 100)                     \
+    X(direction, 0x5E, 2, false, 1, 100)                   \
+    X(duration_uint24, 0x42, 3, false, 1, 1000)            \
+    X(energy_uint32, 0x4D, 4, false, 1, 1000)              \
+    X(energy_uint24, 0x0A, 3, false, 1, 1000)              \
+    X(gas_uint24, 0x4B, 3, false, 1, 1000)                 \
+    X(gas_uint32, 0x4C, 4, false, 1, 1000)                 \
+    X(gyroscope, 0x52, 2, false, 1, 1000)                  \
+    X(humidity_uint16, 0x03, 2, false, 1, 100)             \
+    X(humidity_uint8, 0x2E, 1, false, 1, 1)                \
+    X(illuminance, 0x05, 3, false, 1, 100)                 \
+    X(mass_kg, 0x06, 2, false, 1, 100)                     \
+    X(mass_lb, 0x07, 2, false, 1, 100)                     \
+    X(moisture_uint16, 0x14, 2, false, 1, 100)             \
+    X(moisture_uint8, 0x2F, 1, false, 1, 1)                \
+    X(pm2_5, 0x0D, 2, false, 1, 1)                         \
+    X(pm10, 0x0E, 2, false, 1, 1)                          \
+    X(power_uint24, 0x0B, 3, false, 1, 100)                \
+    X(power_int32, 0x5C, 4, true, 1, 100)                  \
+    X(precipitation, 0x5F, 2, false, 1, 10)                \
+    X(pressure, 0x04, 3, false, 1, 100)                    \
+    X(rotation, 0x3F, 2, true, 1, 10)                      \
+    X(speed, 0x44, 2, false, 1, 100)                       \
+    X(timestamp, 0x50, 4, false, 1, 1)                     \
+    X(tvoc, 0x13, 2, false, 1, 1)                          \
+    X(volume_uint32, 0x4E, 4, false, 1, 1000)              \
+    X(volume_uint16_scale_0_1, 0x47, 2, false, 1, 10)      \
+    X(volume_uint16_scale_1, 0x48, 2, false, 1, 1)         \
+    X(volume_storage, 0x55, 4, false, 1, 1000)             \
+    X(volume_flow_rate, 0x49, 2, false, 1, 1000)           \
+    X(UV_index, 0x46, 1, false, 1, 10)                     \
+    X(water_litre, 0x4F, 4, false, 1, 1000)                \
+    X(packet_id, 0x00, 1, false, 1, 1)                     \
+    X(device_type_id, 0xF0, 2, false, 1, 1)                \
+    X(firmware_version_uint32, 0xF1, 4, false, 1, 1)       \
+    X(firmware_version_uint24, 0xF2, 3, false, 1, 1)
+
+// name, object id, byte count
+#define BTHOME_STATE_TYPES(X)    \
+    X(battery_state, 0x15, 1)    \
+    X(battery_charging, 0x16, 1) \
+    X(carbon_monoxide, 0x17, 1)  \
+    X(cold, 0x18, 1)             \
+    X(connectivity, 0x19, 1)     \
+    X(door, 0x1A, 1)             \
+    X(garage_door, 0x1B, 1)      \
+    X(gas, 0x1C, 1)              \
+    X(generic_boolean, 0x0F, 1)  \
+    X(heat, 0x1D, 1)             \
+    X(light, 0x1E, 1)            \
+    X(lock, 0x1F, 1)             \
+    X(moisture, 0x20, 1)         \
+    X(motion, 0x21, 1)           \
+    X(moving, 0x22, 1)           \
+    X(occupancy, 0x23, 1)        \
+    X(opening, 0x11, 1)          \
+    X(plug, 0x24, 1)             \
+    X(power, 0x10, 1)            \
+    X(presence, 0x25, 1)         \
+    X(problem, 0x26, 1)          \
+    X(running, 0x27, 1)          \
+    X(safety, 0x28, 1)           \
+    X(smoke, 0x29, 1)            \
+    X(sound, 0x2A, 1)            \
+    X(tamper, 0x2B, 1)           \
+    X(vibration, 0x2C, 1)        \
+    X(window, 0x2D, 1)
+
+// name, object id, byte count (dimmer = state + steps)
+#define BTHOME_EVENT_TYPES(X) \
+    X(button, 0x3A, 1)        \
+    X(dimmer, 0x3C, 2)
+
+// Declares the compile-time descriptor (BtHomeSensors::name) and the runtime BtHomeType (name).
+#define BTHOME_DECLARE_SENSOR(name, id, byteCount, signedValue, scaleNumerator, scaleDenominator) \
+    namespace BtHomeSensors                                                                     \
+    {                                                                                           \
+        typedef BtHomeSensor<id, byteCount, signedValue, scaleNumerator, scaleDenominator> name; \
+    }                                                                                           \
+    const BtHomeType name = BtHomeSensors::name::type();
+
+#define BTHOME_DECLARE_STATE(name, id, byteCount) const BtHomeState name = {id, byteCount};
+
+BTHOME_SENSOR_TYPES(BTHOME_DECLARE_SENSOR)
+BTHOME_STATE_TYPES(BTHOME_DECLARE_STATE)
+BTHOME_EVENT_TYPES(BTHOME_DECLARE_STATE)
+
+// time_type is an older name for timestamp (0x50)
+namespace BtHomeSensors
+{
+    typedef timestamp time_type;
+}
+const BtHomeType time_type = timestamp;
+
+// text (OBJECT_ID_TEXT) and raw (OBJECT_ID_RAW) are length prefixed and have no fixed descriptor
 
 enum Button_Event_Status
 {
@@ -22,4 +22,12 @@
 #define SHORT_NAME 0x08
 #define COMPLETE_NAME 0x09
 
+// AES-CCM backend (BtHomeV2Ccm.h). Uncomment to use the portable software AES instead of mbedtls,
+// e.g. on boards without mbedtls.
+// #define BTHOME_CCM_SOFTWARE
+
+// length prefixed objects
+#define OBJECT_ID_TEXT 0x53
+#define OBJECT_ID_RAW 0x54
+
 #endif
\ No newline at end of file